@@ -1,10 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "snscript_internal.h"
 
-sn_value_t sn_null = { .type = SN_VALUE_TYPE_NULL };
-sn_value_t sn_false = { .type = SN_VALUE_TYPE_BOOLEAN, .i = false };
-sn_value_t sn_true = { .type = SN_VALUE_TYPE_BOOLEAN, .i = true };
+sn_value_t sn_null = { SN_VALUE_BITS_NULL };
+sn_value_t sn_false = { SN_VALUE_BITS_FALSE };
+sn_value_t sn_true = { SN_VALUE_BITS_TRUE };
 
 sn_error_t sn_expr_set_rtype(sn_expr_t *expr);
 sn_error_t sn_expr_build(sn_expr_t *expr, sn_scope_t *scope);
@@ -261,6 +262,9 @@ sn_error_t sn_expr_set_rtype(sn_expr_t *expr)
             return sn_symbol_set_rtype(expr);
         case SN_EXPR_TYPE_LIST:
             return sn_list_set_rtype(expr);
+        case SN_EXPR_TYPE_UNPARSED:
+            // typed once it is parsed
+            return SN_SUCCESS;
     }
     return SN_ERROR_GENERIC;
 }
@@ -286,14 +290,14 @@ sn_error_t sn_expr_check_fn_call(sn_expr_t *fn_expr, sn_scope_t *scope)
     sn_value_t *val = sn_scope_get_const_value(&fn_expr->prog->globals, ref);
     assert(val != NULL);
 
-    if (val->type == SN_VALUE_TYPE_BUILTIN_FN) {
-        if (val->builtin_fn->is_pure) {
+    if (SN_VALUE_IS_BUILTIN_FN(*val)) {
+        if (SN_VALUE_BUILTIN_FN(*val)->is_pure) {
             return SN_SUCCESS;
         }
         return sn_expr_error(fn_expr, SN_ERROR_NOT_ALLOWED_IN_PURE_FN);
     }
-    else if (val->type == SN_VALUE_TYPE_USER_FN) {
-        if (val->user_fn->is_pure) {
+    else if (SN_VALUE_IS_USER_FN(*val)) {
+        if (SN_VALUE_USER_FN(*val)->is_pure) {
             return SN_SUCCESS;
         }
         return sn_expr_error(fn_expr, SN_ERROR_NOT_ALLOWED_IN_PURE_FN);
@@ -302,6 +306,130 @@ sn_error_t sn_expr_check_fn_call(sn_expr_t *fn_expr, sn_scope_t *scope)
     return SN_SUCCESS;
 }
 
+// a pure builtin that doesn't run script code, so that the values of its
+// arguments need not be seen by the collector
+bool sn_expr_is_shallow_builtin(sn_expr_t *fn_expr)
+{
+    sn_ref_t *ref = &fn_expr->ref;
+    if (fn_expr->rtype != SN_RTYPE_VAR || ref->type != SN_SCOPE_TYPE_GLOBAL || !ref->is_const) {
+        return false;
+    }
+
+    sn_value_t *val = sn_scope_get_const_value(&fn_expr->prog->globals, ref);
+    return val != NULL && SN_VALUE_IS_BUILTIN_FN(*val) && SN_VALUE_BUILTIN_FN(*val)->is_pure &&
+           !SN_VALUE_BUILTIN_FN(*val)->runs_code;
+}
+
+void sn_call_set_shallow_depth(sn_expr_t *expr)
+{
+    int depth = 0;
+
+    if (expr->child_count > SN_EVAL_SHALLOW_MAX_ARGS + 1 ||
+        !sn_expr_is_shallow_builtin(expr->child_head)) {
+        return;
+    }
+
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        if (child->shallow_depth == 0) {
+            return;
+        }
+        depth = SN_MAX(depth, child->shallow_depth);
+    }
+
+    if (depth < SN_EVAL_SHALLOW_MAX_DEPTH) {
+        expr->shallow_depth = depth + 1;
+    }
+}
+
+sn_func_t *sn_expr_const_user_fn(sn_expr_t *fn_expr)
+{
+    sn_ref_t *ref = &fn_expr->ref;
+    if (fn_expr->rtype != SN_RTYPE_VAR || ref->type != SN_SCOPE_TYPE_GLOBAL || !ref->is_const) {
+        return NULL;
+    }
+
+    sn_value_t *val = sn_scope_get_const_value(&fn_expr->prog->globals, ref);
+    return (val != NULL && SN_VALUE_IS_USER_FN(*val)) ? SN_VALUE_USER_FN(*val) : NULL;
+}
+
+// a cheap estimate of whether a call to func can take long: its body loops,
+// or calls func itself or a function that is heavy
+bool sn_expr_is_heavy(sn_expr_t *expr, sn_func_t *func)
+{
+    if (expr->rtype == SN_RTYPE_WHILE_EXPR) {
+        return true;
+    }
+
+    if (expr->rtype == SN_RTYPE_CALL) {
+        sn_func_t *callee = sn_expr_const_user_fn(expr->child_head);
+        if (callee != NULL && (callee == func || callee->is_heavy)) {
+            return true;
+        }
+    }
+
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        if (sn_expr_is_heavy(child, func)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// a call that can run on another thread: a heavy pure function whose
+// arguments are shallow, so they are evaluated before it is handed out
+bool sn_expr_is_forkable(sn_expr_t *expr)
+{
+    if (expr->rtype != SN_RTYPE_CALL) {
+        return false;
+    }
+
+    sn_func_t *callee = sn_expr_const_user_fn(expr->child_head);
+    if (callee == NULL || !callee->is_pure || !callee->is_heavy ||
+        callee->param_count != expr->child_count - 1) {
+        return false;
+    }
+
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        if (child->shallow_depth == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// marks the arguments of the calls in expr that are evaluated in parallel,
+// when a call has two or more forkable arguments and the others are shallow
+void sn_expr_set_fork_args(sn_expr_t *expr)
+{
+    expr->fork_args = 0;
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        sn_expr_set_fork_args(child);
+    }
+
+    if (expr->rtype != SN_RTYPE_CALL || expr->child_count > SN_FORK_MAX_CHILDREN) {
+        return;
+    }
+
+    uint32_t fork_args = 0;
+    int fork_count = 0;
+    int pos = 1;
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next, pos++) {
+        if (sn_expr_is_forkable(child)) {
+            fork_args |= 1u << pos;
+            fork_count++;
+        }
+        else if (child->shallow_depth == 0) {
+            return;
+        }
+    }
+
+    if (fork_count >= 2) {
+        expr->fork_args = fork_args;
+    }
+}
+
 sn_error_t sn_expr_build_children(sn_expr_t *expr, sn_scope_t *scope)
 {
     for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
@@ -312,48 +440,88 @@ sn_error_t sn_expr_build_children(sn_expr_t *expr, sn_scope_t *scope)
     }
 
     if (expr->rtype == SN_RTYPE_CALL) {
-        return sn_expr_check_fn_call(expr->child_head, scope);
+        sn_error_t status = sn_expr_check_fn_call(expr->child_head, scope);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
+
+        sn_call_set_shallow_depth(expr);
     }
 
     return SN_SUCCESS;
 }
 
-sn_error_t sn_expr_create_fn(sn_expr_t *expr, sn_scope_t *parent_scope)
+// the function a fn or pure form declared, once it was built
+sn_func_t *sn_form_func(sn_expr_t *form)
 {
-    sn_func_t *func = calloc(sizeof *func, 1);
-    assert(expr->child_head->rtype == SN_RTYPE_FN_KEYW ||
-           expr->child_head->rtype == SN_RTYPE_PURE_KEYW);
+    if (form->type != SN_EXPR_TYPE_LIST || !SN_VALUE_IS_USER_FN(form->literal)) {
+        return NULL;
+    }
 
-    func->is_pure = expr->child_head->rtype == SN_RTYPE_PURE_KEYW;
+    return SN_VALUE_USER_FN(form->literal);
+}
 
-    sn_expr_t *proto = expr->child_head->next;
-    assert(proto->rtype == SN_RTYPE_CALL);
-    sn_expr_t *name = proto->child_head;
+void sn_func_free(sn_func_t *func)
+{
+    if (func == NULL) {
+        return;
+    }
 
+    free(func->uses);
+    free(func);
+}
+
+// adds the name of the function to the scope, which makes it one of the
+// functions of the program
+sn_error_t sn_func_declare_name(sn_func_t *func, sn_scope_t *parent_scope)
+{
+    sn_program_t *prog = func->expr->prog;
+    if (prog->func_count == prog->func_cap) {
+        prog->func_cap = SN_MAX(prog->func_cap * 2, 64);
+        prog->funcs = realloc(prog->funcs, prog->func_cap * sizeof prog->funcs[0]);
+    }
+    prog->funcs[prog->func_count++] = func;
+
+    sn_expr_t *name = func->expr->child_head->next->child_head;
     sn_error_t status = sn_scope_add_var(parent_scope, name);
     if (status != SN_SUCCESS) {
         return sn_expr_error(name, status);
     }
 
     sn_value_t *val = sn_scope_create_const(parent_scope, &name->ref);
-    val->type = SN_VALUE_TYPE_USER_FN;
-    val->user_fn = func;
+    *val = sn_make_user_fn(func);
+    return SN_SUCCESS;
+}
 
+sn_error_t sn_func_declare_params(sn_func_t *func, sn_scope_t *parent_scope)
+{
+    sn_expr_t *proto = func->expr->child_head->next;
+    memset(&func->scope, '\0', sizeof func->scope);
     func->scope.parent = parent_scope;
     func->scope.is_pure = func->is_pure;
+    func->scope.fn_name = proto->child_head;
+    func->scope.func = func;
+    func->param_count = 0;
 
     // go through all of the parameters
     for (sn_expr_t *param = proto->child_head->next; param != NULL; param = param->next) {
-        status = sn_scope_add_var(&func->scope, param);
+        sn_error_t status = sn_scope_add_var(&func->scope, param);
         if (status != SN_SUCCESS) {
             return sn_expr_error(param, status);
         }
         func->param_count++;
     }
     assert(func->scope.cur_decl_count == func->param_count);
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_func_declare_body(sn_func_t *func)
+{
+    sn_program_t *prog = func->expr->prog;
+    sn_expr_t *proto = func->expr->child_head->next;
+    sn_expr_t *name = proto->child_head;
 
     // if this is the main function, do some extra stuff
-    sn_program_t *prog = expr->prog;
     if (name->sym == prog->sn_main && name->ref.type == SN_SCOPE_TYPE_GLOBAL) {
         prog->main_ref = name->ref;
         if (func->param_count > 1) {
@@ -362,15 +530,206 @@ sn_error_t sn_expr_create_fn(sn_expr_t *expr, sn_scope_t *parent_scope)
     }
 
     func->body = proto->next;
-    func->body_count = expr->child_count - 2;
+    func->body_count = func->expr->child_count - 2;
+    return SN_SUCCESS;
+}
+
+// adds the function to the scope, without building its body
+sn_error_t sn_expr_declare_fn(sn_expr_t *expr, sn_scope_t *parent_scope, sn_func_t **func_out)
+{
+    sn_func_t *func = calloc(sizeof *func, 1);
+    *func_out = func;
+
+    assert(expr->child_head->rtype == SN_RTYPE_FN_KEYW ||
+           expr->child_head->rtype == SN_RTYPE_PURE_KEYW);
+    assert(expr->child_head->next->rtype == SN_RTYPE_CALL);
+
+    func->expr = expr;
+    expr->literal = sn_make_user_fn(func);
+    func->is_pure = expr->child_head->rtype == SN_RTYPE_PURE_KEYW;
+    func->name = expr->child_head->next->child_head->sym;
+
+    sn_error_t status = sn_func_declare_name(func, parent_scope);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    status = sn_func_declare_params(func, parent_scope);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    return sn_func_declare_body(func);
+}
+
+// whether the globals the body of func refers to are declared by the same
+// forms as when it was built
+bool sn_func_uses_are_kept(sn_func_t *func)
+{
+    for (int i = 0; i < func->use_count; i++) {
+        sn_expr_t *decl = func->uses[i];
+        if (decl->sym->global != decl) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// declares a function an earlier build declared, and tells whether its body
+// has to be built again
+sn_error_t sn_func_redeclare(sn_func_t *func, sn_scope_t *parent_scope, bool was_built, bool *build_out)
+{
+    *build_out = false;
+    memset(&func->jit, '\0', sizeof func->jit);
+    memset(&func->lanes, '\0', sizeof func->lanes);
+
+    sn_error_t status = sn_func_declare_name(func, parent_scope);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    if (!was_built || func->build_state != SN_BUILD_STATE_DONE || !sn_func_uses_are_kept(func)) {
+        *build_out = true;
+        func->build_state = SN_BUILD_STATE_UNBUILT;
+        func->use_count = 0;
+        status = sn_func_declare_params(func, parent_scope);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
+    }
+
+    return sn_func_declare_body(func);
+}
+
+int sn_expr_ptr_compare(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(sn_expr_t *const *)a;
+    uintptr_t y = (uintptr_t)*(sn_expr_t *const *)b;
+    return (x > y) - (x < y);
+}
+
+// leaves each global the body refers to in the uses once
+void sn_func_sort_uses(sn_func_t *func)
+{
+    if (func->use_count == 0) {
+        return;
+    }
+
+    qsort(func->uses, func->use_count, sizeof func->uses[0], sn_expr_ptr_compare);
+
+    int count = 0;
+    for (int i = 0; i < func->use_count; i++) {
+        if (count == 0 || func->uses[count - 1] != func->uses[i]) {
+            func->uses[count++] = func->uses[i];
+        }
+    }
+    func->use_count = count;
+}
+
+// a body left unparsed is checked like the rest of its form was
+sn_error_t sn_func_parse_body(sn_func_t *func)
+{
+    sn_error_t status = sn_expr_parse_body(func->expr);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    func->body = func->expr->child_head->next->next;
+    func->body_count = func->expr->child_count - 2;
+    for (sn_expr_t *expr = func->body; expr != NULL; expr = expr->next) {
+        status = sn_expr_set_rtype(expr);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
+        if (expr->rtype == SN_RTYPE_FN_EXPR) {
+            return sn_expr_error(expr, SN_ERROR_NESTED_FN_EXPR);
+        }
+    }
+
+    return SN_SUCCESS;
+}
+
+// only reads the global scope, so bodies can be built on many threads
+sn_error_t sn_func_build_body(sn_func_t *func)
+{
+    if (func->body->type == SN_EXPR_TYPE_UNPARSED) {
+        sn_error_t status = sn_func_parse_body(func);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
+    }
 
     for (sn_expr_t *expr = func->body; expr != NULL; expr = expr->next) {
-        status = sn_expr_build(expr, &func->scope);
+        sn_error_t status = sn_expr_build(expr, &func->scope);
         if (status != SN_SUCCESS) {
             return status;
         }
     }
 
+    sn_func_sort_uses(func);
+    return SN_SUCCESS;
+}
+
+// functions are passed in order, so the functions called are done
+void sn_func_set_fork_args(sn_func_t *func)
+{
+    func->is_heavy = false;
+    for (sn_expr_t *expr = func->body; expr != NULL && !func->is_heavy; expr = expr->next) {
+        func->is_heavy = sn_expr_is_heavy(expr, func);
+    }
+    for (sn_expr_t *expr = func->body; expr != NULL; expr = expr->next) {
+        sn_expr_set_fork_args(expr);
+    }
+}
+
+// builds the body of a function of a lazily built program the first time it
+// is called; the error is kept, so every call of it fails the same way
+sn_error_t sn_func_ensure_built(sn_func_t *func)
+{
+    if (__atomic_load_n(&func->build_state, __ATOMIC_ACQUIRE) == SN_BUILD_STATE_DONE) {
+        return SN_SUCCESS;
+    }
+
+    sn_program_t *prog = func->scope.fn_name->prog;
+    pthread_mutex_lock(&prog->build_lock);
+    if (func->build_state == SN_BUILD_STATE_UNBUILT) {
+        sn_expr_error_redirect(&func->build_error);
+        func->build_status = sn_func_build_body(func);
+        sn_expr_error_redirect(NULL);
+
+        if (func->build_status != SN_SUCCESS) {
+            __atomic_store_n(&func->build_state, SN_BUILD_STATE_FAILED, __ATOMIC_RELEASE);
+        }
+        else {
+            if (prog->options.parallel_args) {
+                sn_func_set_fork_args(func);
+            }
+            __atomic_store_n(&func->build_state, SN_BUILD_STATE_DONE, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&prog->build_lock);
+
+    return func->build_status;
+}
+
+sn_error_t sn_expr_create_fn(sn_expr_t *expr, sn_scope_t *parent_scope)
+{
+    sn_func_t *func = NULL;
+    sn_error_t status = sn_expr_declare_fn(expr, parent_scope, &func);
+    if (status != SN_SUCCESS || expr->prog->options.lazy_build) {
+        return status;
+    }
+
+    status = sn_func_build_body(func);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    if (expr->prog->options.parallel_args) {
+        sn_func_set_fork_args(func);
+    }
+    func->build_state = SN_BUILD_STATE_DONE;
     return SN_SUCCESS;
 }
 
@@ -432,6 +791,17 @@ sn_error_t sn_expr_build_var(sn_expr_t *expr, sn_scope_t *scope)
         return sn_expr_error(expr, SN_ERROR_NOT_ALLOWED_IN_PURE_FN);
     }
 
+    // the builtins are never declared again
+    sn_func_t *func = scope->func;
+    if (func != NULL && expr->ref.type == SN_SCOPE_TYPE_GLOBAL && expr->ref.index >= expr->prog->builtin_count) {
+        if (func->use_count == func->use_cap) {
+            func->use_cap = SN_MAX(2 * func->use_cap, 8);
+            func->uses = realloc(func->uses, func->use_cap * sizeof func->uses[0]);
+        }
+        func->uses[func->use_count++] = expr->sym->global;
+    }
+
+    expr->shallow_depth = 1;
     return status;
 }
 
@@ -485,7 +855,14 @@ sn_error_t sn_expr_build(sn_expr_t *expr, sn_scope_t *scope)
         case SN_RTYPE_OR_KEYW:
         case SN_RTYPE_WHILE_KEYW:
         case SN_RTYPE_PURE_KEYW:
+            return SN_SUCCESS;
+
         case SN_RTYPE_LITERAL:
+            // a body that is built again keeps the box of a big literal
+            if (expr->literal.bits == 0) {
+                expr->literal = sn_value_literal(expr->vint);
+            }
+            expr->shallow_depth = 1;
             return SN_SUCCESS;
 
         case SN_RTYPE_LET_EXPR:
@@ -521,14 +898,162 @@ sn_error_t sn_expr_build(sn_expr_t *expr, sn_scope_t *scope)
     return SN_ERROR_GENERIC;
 }
 
-sn_error_t sn_program_build(sn_program_t *prog)
+sn_error_t sn_form_set_rtype(sn_expr_t *form)
+{
+    sn_error_t status = sn_expr_set_rtype(form);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    if (sn_rtype_only_in_fn(form->rtype)) {
+        return sn_expr_error(form, SN_ERROR_EXPR_OUTSIDE_OF_FN);
+    }
+
+    return SN_SUCCESS;
+}
+
+// builds one more top level form of a program that is built as it is parsed
+sn_error_t sn_program_build_form(sn_program_t *prog, sn_expr_t *expr)
 {
-    sn_error_t status = sn_expr_set_rtype(&prog->expr);
+    sn_error_t status = sn_form_set_rtype(expr);
     if (status != SN_SUCCESS) {
         return status;
     }
 
-    status = sn_expr_build(&prog->expr, &prog->globals);
+    return sn_expr_build(expr, &prog->globals);
+}
+
+typedef struct sn_body_st
+{
+    sn_func_t *func;
+    sn_error_t status;
+    sn_build_error_t error;
+    // whether an earlier build declared the function, and if it was heavy then
+    bool is_kept;
+    bool was_heavy;
+} sn_body_t;
+
+typedef struct sn_bodies_st
+{
+    sn_body_t *bodies;
+    size_t count;
+} sn_bodies_t;
+
+// a block is a chunk of bodies. All of them are built even after one fails,
+// so each keeps its own status.
+sn_error_t sn_build_bodies_chunk(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_bodies_t *b = data;
+    size_t first = (size_t)block * SN_BUILD_CHUNK_SIZE;
+    size_t last = SN_MIN(first + SN_BUILD_CHUNK_SIZE, b->count);
+    for (size_t i = first; i < last; i++) {
+        sn_body_t *body = &b->bodies[i];
+        sn_expr_error_redirect(&body->error);
+        body->status = sn_func_build_body(body->func);
+        sn_expr_error_redirect(NULL);
+    }
+
+    return SN_SUCCESS;
+}
+
+// builds the bodies on the pool, and records the error of the first one
+// that failed in the program
+sn_error_t sn_program_build_bodies(sn_program_t *prog, sn_body_t *bodies, size_t count)
+{
+    sn_bodies_t b = { .bodies = bodies, .count = count };
+    size_t chunk_count = (count + SN_BUILD_CHUNK_SIZE - 1) / SN_BUILD_CHUNK_SIZE;
+    sn_pool_run_plain(prog, sn_build_bodies_chunk, &b, chunk_count);
+
+    for (size_t i = 0; i < count; i++) {
+        if (bodies[i].status != SN_SUCCESS) {
+            prog->error_line = bodies[i].error.line;
+            prog->error_col = bodies[i].error.col;
+            prog->error_sym = bodies[i].error.sym;
+            return bodies[i].status;
+        }
+    }
+
+    return SN_SUCCESS;
+}
+
+// the top level forms are built in order, except for function bodies: those
+// are built once all of the globals are declared, and each only sees the
+// globals declared before it. The error is the one building in order finds,
+// so it is either in the body of a function or in the first form that failed
+// otherwise, whichever comes first. A lazily built program only declares its
+// functions.
+//
+// Once a build succeeded, building again keeps the bodies of the functions
+// whose forms are still there and whose globals are declared by the same forms.
+sn_error_t sn_program_build(sn_program_t *prog)
+{
+    bool was_built = prog->is_built;
+    prog->is_built = false;
+    sn_jit_release(prog);
+    sn_scope_clear_globals(&prog->globals, prog->builtin_count);
+    prog->main_ref.type = SN_SCOPE_TYPE_INVALID;
+    prog->func_count = 0;
+
+    sn_error_t status = SN_SUCCESS;
+    for (sn_expr_t *form = prog->expr.child_head; form != NULL; form = form->next) {
+        if (!was_built || form->rtype == SN_RTYPE_INVALID) {
+            status = sn_form_set_rtype(form);
+            if (status != SN_SUCCESS) {
+                return status;
+            }
+        }
+    }
+
+    sn_body_t *bodies = calloc(SN_MAX(prog->expr.child_count, 1), sizeof bodies[0]);
+    size_t count = 0;
+    for (sn_expr_t *form = prog->expr.child_head; form != NULL && status == SN_SUCCESS; form = form->next) {
+        if (form->rtype != SN_RTYPE_FN_EXPR && form->rtype != SN_RTYPE_PURE_EXPR) {
+            status = sn_expr_build(form, &prog->globals);
+            continue;
+        }
+
+        // a function that failed to be declared has no body to build
+        sn_body_t *body = &bodies[count];
+        bool build = true;
+        body->func = sn_form_func(form);
+        if (body->func == NULL) {
+            status = sn_expr_declare_fn(form, &prog->globals, &body->func);
+        }
+        else {
+            body->is_kept = true;
+            body->was_heavy = body->func->is_heavy;
+            status = sn_func_redeclare(body->func, &prog->globals, was_built, &build);
+        }
+        if (status == SN_SUCCESS && build && !prog->options.lazy_build) {
+            count++;
+        }
+    }
+
+    // the error of a body comes first, and is already recorded
+    sn_error_t body_status = sn_program_build_bodies(prog, bodies, count);
+    if (body_status != SN_SUCCESS) {
+        status = body_status;
+    }
+    else if (status == SN_SUCCESS) {
+        // the functions that call a kept function which turned heavy or light
+        // may fork other calls now
+        bool is_heavy_changed = false;
+        for (size_t i = 0; i < count; i++) {
+            if (prog->options.parallel_args) {
+                sn_func_set_fork_args(bodies[i].func);
+                is_heavy_changed |= bodies[i].is_kept && bodies[i].was_heavy != bodies[i].func->is_heavy;
+            }
+            bodies[i].func->build_state = SN_BUILD_STATE_DONE;
+        }
+
+        for (size_t i = 0; i < prog->func_count && is_heavy_changed; i++) {
+            if (prog->funcs[i]->build_state == SN_BUILD_STATE_DONE) {
+                sn_func_set_fork_args(prog->funcs[i]);
+            }
+        }
+    }
+    free(bodies);
+
     if (status != SN_SUCCESS) {
         return status;
     }
@@ -537,5 +1062,72 @@ sn_error_t sn_program_build(sn_program_t *prog)
         return SN_ERROR_MAIN_FN_MISSING;
     }
 
+    prog->is_built = true;
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_program_update(sn_program_t *prog, const char *source, size_t size)
+{
+    sn_expr_t **dropped = NULL;
+    size_t dropped_count = 0;
+    sn_error_t status = sn_program_reparse(prog, source, size, &dropped, &dropped_count);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    // the globals refer to the dropped forms until the program is built again
+    status = sn_program_build(prog);
+    if (status != SN_SUCCESS) {
+        prog->main_ref.type = SN_SCOPE_TYPE_INVALID;
+    }
+
+    for (size_t i = 0; i < dropped_count; i++) {
+        sn_func_free(sn_form_func(dropped[i]));
+        sn_form_free(dropped[i]);
+    }
+    free(dropped);
+    return status;
+}
+
+sn_error_t sn_program_build_all(sn_program_t *prog)
+{
+    pthread_mutex_lock(&prog->build_lock);
+    sn_body_t *bodies = calloc(SN_MAX(prog->func_count, 1), sizeof bodies[0]);
+    size_t count = 0;
+    for (size_t i = 0; i < prog->func_count; i++) {
+        if (prog->funcs[i]->build_state == SN_BUILD_STATE_UNBUILT) {
+            bodies[count++].func = prog->funcs[i];
+        }
+    }
+
+    sn_program_build_bodies(prog, bodies, count);
+    for (size_t i = 0; i < count; i++) {
+        sn_func_t *func = bodies[i].func;
+        func->build_status = bodies[i].status;
+        func->build_error = bodies[i].error;
+        if (func->build_status != SN_SUCCESS) {
+            __atomic_store_n(&func->build_state, SN_BUILD_STATE_FAILED, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (prog->options.parallel_args) {
+            sn_func_set_fork_args(func);
+        }
+        __atomic_store_n(&func->build_state, SN_BUILD_STATE_DONE, __ATOMIC_RELEASE);
+    }
+    free(bodies);
+    pthread_mutex_unlock(&prog->build_lock);
+
+    // also reports the functions that failed when they were called
+    for (size_t i = 0; i < prog->func_count; i++) {
+        sn_func_t *func = prog->funcs[i];
+        if (func->build_state == SN_BUILD_STATE_FAILED) {
+            prog->error_line = func->build_error.line;
+            prog->error_col = func->build_error.col;
+            prog->error_sym = func->build_error.sym;
+            return func->build_status;
+        }
+    }
+
     return SN_SUCCESS;
 }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "snscript_internal.h"
 
 sn_value_type_t sn_unified_type(sn_value_type_t type)
@@ -6,140 +7,138 @@ sn_value_type_t sn_unified_type(sn_value_type_t type)
     return type == SN_VALUE_TYPE_BUILTIN_FN ? SN_VALUE_TYPE_USER_FN : type;
 }
 
-sn_error_t sn_is_int(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_is_int(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
+    *ret = sn_false;
     if (arg_count != 1) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
-    ret->i = (args[0].type == SN_VALUE_TYPE_INTEGER);
+    *ret = sn_make_bool(SN_VALUE_IS_INT(args[0]));
 
     return SN_SUCCESS;
 }
 
-sn_error_t sn_is_fn(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_is_fn(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
+    *ret = sn_false;
     if (arg_count != 1) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
-    ret->i = (sn_unified_type(args[0].type) == SN_VALUE_TYPE_USER_FN);
+    *ret = sn_make_bool(SN_VALUE_IS_FN(args[0]));
 
     return SN_SUCCESS;
 }
 
-sn_error_t sn_is_null(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_is_null(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
+    *ret = sn_false;
     if (arg_count != 1) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
-    ret->i = (args[0].type == SN_VALUE_TYPE_NULL);
+    *ret = sn_make_bool(SN_VALUE_IS_NULL(args[0]));
 
     return SN_SUCCESS;
 }
 
-sn_error_t sn_equals(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_equals(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
+    *ret = sn_false;
 
     if (arg_count != 2) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
+    sn_value_type_t type = sn_value_type(args[0]);
+
     // consider user and builtin functions as the same type
-    if (sn_unified_type(args[0].type) != sn_unified_type(args[1].type)) {
+    if (sn_unified_type(type) != sn_unified_type(sn_value_type(args[1]))) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    // a builtin function will never equal a user function
-    if (args[0].type != args[0].type) {
-        ret->i = false;
-        return SN_SUCCESS;
-    }
-
-    switch (args[0].type) {
+    switch (type) {
         case SN_VALUE_TYPE_INVALID:
             abort();
             return SN_ERROR_GENERIC;
-        case SN_VALUE_TYPE_NULL:
-            ret->i = true;
-            break;
         case SN_VALUE_TYPE_INTEGER:
-        case SN_VALUE_TYPE_BOOLEAN:
-            ret->i = (args[0].i == args[1].i);
+            *ret = sn_make_bool(SN_VALUE_INT(args[0]) == SN_VALUE_INT(args[1]));
             break;
+        case SN_VALUE_TYPE_NULL:
+        case SN_VALUE_TYPE_BOOLEAN:
         case SN_VALUE_TYPE_USER_FN:
-            ret->i = (args[0].user_fn == args[1].user_fn);
-            break;
         case SN_VALUE_TYPE_BUILTIN_FN:
-            ret->i = (args[0].builtin_fn == args[1].builtin_fn);
+        case SN_VALUE_TYPE_VECTOR:
+            // a builtin function will never equal a user function, and
+            // vectors are only equal to themselves
+            *ret = sn_make_bool(args[0].bits == args[1].bits);
+            break;
+        case SN_VALUE_TYPE_FUTURE:
+            // a future may have a box in each arena it got to
+            *ret = sn_make_bool(SN_VALUE_FUTURE(args[0]) == SN_VALUE_FUTURE(args[1]));
             break;
     }
 
     return SN_SUCCESS;
 }
 
-sn_error_t sn_not_equals(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_not_equals(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    sn_error_t status = sn_equals(ret, arg_count, args);
+    sn_error_t status = sn_equals(vm, ret, arg_count, args);
     if (status != SN_SUCCESS) {
         return status;
     }
 
-    ret->i = !ret->i;
+    *ret = sn_make_bool(!SN_VALUE_BOOL(*ret));
     return SN_SUCCESS;
 }
 
-sn_error_t sn_not(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_not(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_BOOLEAN;
+    *ret = sn_false;
 
     if (arg_count != 1) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    if (args[0].type != SN_VALUE_TYPE_BOOLEAN) {
+    if (!SN_VALUE_IS_BOOL(args[0])) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    ret->i = !args[0].i;
+    *ret = sn_make_bool(!SN_VALUE_BOOL(args[0]));
     return SN_SUCCESS;
 }
 
-sn_error_t sn_add(sn_value_t *ret, int arg_count, const sn_value_t *args)
+// integer arithmetic wraps around, so it is done on unsigned values
+sn_error_t sn_add(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_INTEGER;
-    ret->i = 0;
+    uint64_t sum = 0;
+    *ret = sn_make_int(0);
     for (int i = 0; i < arg_count; i++) {
-        if (args[i].type != SN_VALUE_TYPE_INTEGER) {
+        if (!SN_VALUE_IS_INT(args[i])) {
             return SN_ERROR_INVALID_PARAMS_TO_FN;
         }
-        ret->i += args[i].i;
+        sum += (uint64_t)SN_VALUE_INT(args[i]);
     }
+    *ret = sn_make_int((int64_t)sum);
     return SN_SUCCESS;
 }
 
-sn_error_t sn_sub(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_sub(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_INTEGER;
+    *ret = sn_make_int(0);
     for (int i = 0; i < arg_count; i++) {
-        if (args[i].type != SN_VALUE_TYPE_INTEGER) {
+        if (!SN_VALUE_IS_INT(args[i])) {
             return SN_ERROR_INVALID_PARAMS_TO_FN;
         }
     }
 
     if (arg_count == 1) {
-        ret->i = -args[0].i;
+        *ret = sn_make_int((int64_t)(0 - (uint64_t)SN_VALUE_INT(args[0])));
     }
     else if (arg_count == 2) {
-        ret->i = args[0].i - args[1].i;
+        *ret = sn_make_int((int64_t)((uint64_t)SN_VALUE_INT(args[0]) - (uint64_t)SN_VALUE_INT(args[1])));
     }
     else {
         return SN_ERROR_INVALID_PARAMS_TO_FN;
@@ -148,76 +147,496 @@ sn_error_t sn_sub(sn_value_t *ret, int arg_count, const sn_value_t *args)
     return SN_SUCCESS;
 }
 
-sn_error_t sn_mul(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_mul(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_INTEGER;
-    ret->i = 1;
+    uint64_t product = 1;
+    *ret = sn_make_int(1);
     for (int i = 0; i < arg_count; i++) {
-        if (args[i].type != SN_VALUE_TYPE_INTEGER) {
+        if (!SN_VALUE_IS_INT(args[i])) {
             return SN_ERROR_WRONG_VALUE_TYPE;
         }
-        ret->i *= args[i].i;
+        product *= (uint64_t)SN_VALUE_INT(args[i]);
     }
+    *ret = sn_make_int((int64_t)product);
     return SN_SUCCESS;
 }
 
-sn_error_t sn_div(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_div(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_INTEGER;
+    *ret = sn_make_int(0);
     if (arg_count != 2) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    if (args[0].type != SN_VALUE_TYPE_INTEGER && args[1].type != SN_VALUE_TYPE_INTEGER) {
+    if (!SN_VALUE_IS_INT(args[0]) || !SN_VALUE_IS_INT(args[1])) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    ret->i = args[0].i / args[1].i;
+    *ret = sn_make_int(SN_VALUE_INT(args[0]) / SN_VALUE_INT(args[1]));
     return SN_SUCCESS;
 }
 
-sn_error_t sn_mod(sn_value_t *ret, int arg_count, const sn_value_t *args)
+sn_error_t sn_mod(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
 {
-    ret->type = SN_VALUE_TYPE_INTEGER;
+    *ret = sn_make_int(0);
     if (arg_count != 2) {
         return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
     }
 
-    if (args[0].type != SN_VALUE_TYPE_INTEGER && args[1].type != SN_VALUE_TYPE_INTEGER) {
+    if (!SN_VALUE_IS_INT(args[0]) || !SN_VALUE_IS_INT(args[1])) {
+        return SN_ERROR_WRONG_VALUE_TYPE;
+    }
+
+    *ret = sn_make_int(SN_VALUE_INT(args[0]) % SN_VALUE_INT(args[1]));
+    return SN_SUCCESS;
+}
+
+// ends the current slice of a resumed vm before its next step
+sn_error_t sn_yield(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count != 0) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    sn_stack_yield(&vm->stack);
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_len(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_make_int(0);
+    if (arg_count != 1) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    if (!SN_VALUE_IS_VECTOR(args[0])) {
+        return SN_ERROR_WRONG_VALUE_TYPE;
+    }
+
+    *ret = sn_make_int(SN_VALUE_VECTOR(args[0])->count);
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_at(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count != 2) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    if (!SN_VALUE_IS_VECTOR(args[0]) || !SN_VALUE_IS_INT(args[1])) {
+        return SN_ERROR_WRONG_VALUE_TYPE;
+    }
+
+    sn_vector_t *vector = SN_VALUE_VECTOR(args[0]);
+    int64_t index = SN_VALUE_INT(args[1]);
+    if (index < 0 || index >= vector->count) {
+        return SN_ERROR_INVALID_PARAMS_TO_FN;
+    }
+
+    *ret = vector->items[index];
+    return SN_SUCCESS;
+}
+
+// the state of a pmap or preduce shared by the threads running its blocks
+typedef struct sn_pmap_st
+{
+    sn_value_t fn;
+    sn_value_t combine;
+    int64_t lo;
+    int64_t hi;
+    // a result per item of pmap or per block of preduce; integers are moved
+    // to ints, since their boxes belong to the arena of the worker
+    sn_value_t *results;
+    int64_t *ints;
+} sn_pmap_t;
+
+bool sn_is_pure_fn(sn_value_t fn)
+{
+    if (SN_VALUE_IS_USER_FN(fn)) {
+        return SN_VALUE_USER_FN(fn)->is_pure;
+    }
+    return SN_VALUE_IS_BUILTIN_FN(fn) && SN_VALUE_BUILTIN_FN(fn)->is_pure;
+}
+
+sn_error_t sn_pmap_check_range(const sn_value_t *lo, const sn_value_t *hi, int64_t *count_out)
+{
+    if (!SN_VALUE_IS_INT(*lo) || !SN_VALUE_IS_INT(*hi)) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    ret->i = args[0].i % args[1].i;
+    int64_t count = (int64_t)((uint64_t)SN_VALUE_INT(*hi) - (uint64_t)SN_VALUE_INT(*lo));
+    if (SN_VALUE_INT(*hi) < SN_VALUE_INT(*lo) || count < 0 || count > INT32_MAX) {
+        return SN_ERROR_INVALID_PARAMS_TO_FN;
+    }
+
+    *count_out = count;
     return SN_SUCCESS;
 }
 
-sn_error_t sn_println(sn_value_t *ret, int arg_count, const sn_value_t *args)
+void sn_pmap_store(sn_pmap_t *p, int64_t idx, sn_value_t value)
+{
+    if (SN_VALUE_IS_INT(value) && !SN_VALUE_IS_SMALL_INT(value)) {
+        p->ints[idx] = SN_VALUE_INT(value);
+        value.bits = SN_VALUE_BITS_INVALID;
+    }
+    p->results[idx] = value;
+}
+
+// called on the thread of the vm once the blocks are done
+sn_value_t sn_pmap_load(sn_pmap_t *p, int64_t idx)
 {
-    ret->type = SN_VALUE_TYPE_NULL;
+    if (p->results[idx].bits == SN_VALUE_BITS_INVALID) {
+        return sn_make_int(p->ints[idx]);
+    }
+    return p->results[idx];
+}
+
+sn_error_t sn_pmap_block(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_pmap_t *p = data;
+    int64_t first = p->lo + block * SN_POOL_BLOCK_SIZE;
+    int64_t last = first + SN_MIN(SN_POOL_BLOCK_SIZE, p->hi - first);
+    int width = sn_lanes_width(stack->vm->prog, p->fn);
+    int push_count = stack->push_count;
+    sn_value_t *slots = &stack->values[sn_stack_alloc_values(stack, width)];
+    sn_error_t status = SN_SUCCESS;
+
+    for (int64_t i = first; i < last && status == SN_SUCCESS; i += width) {
+        int count = (int)SN_MIN(width, last - i);
+        status = sn_lanes_call_range(stack, p->fn, i, count, slots);
+        for (int k = 0; k < count && status == SN_SUCCESS; k++) {
+            sn_pmap_store(p, i + k - p->lo, slots[k]);
+        }
+    }
+
+    stack->push_count = push_count;
+    return status;
+}
+
+// folds the items of a block from the left, starting with the first item
+sn_error_t sn_preduce_block(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_pmap_t *p = data;
+    int64_t first = p->lo + block * SN_POOL_BLOCK_SIZE;
+    int64_t last = first + SN_MIN(SN_POOL_BLOCK_SIZE, p->hi - first);
+    int width = sn_lanes_width(stack->vm->prog, p->fn);
+    int push_count = stack->push_count;
+    sn_value_t *slots = &stack->values[sn_stack_alloc_values(stack, 3 + width)];
+    sn_error_t status = SN_SUCCESS;
+
+    // slots[0] is the accumulator, followed by the next item, the result of
+    // combine and the items of a lane group
+    for (int64_t i = first; i < last && status == SN_SUCCESS; i += width) {
+        int count = (int)SN_MIN(width, last - i);
+        status = sn_lanes_call_range(stack, p->fn, i, count, &slots[3]);
+        for (int k = 0; k < count && status == SN_SUCCESS; k++) {
+            if (i + k == first) {
+                slots[0] = slots[3];
+                continue;
+            }
+            slots[1] = slots[3 + k];
+            status = sn_stack_call(stack, p->combine, 2, &slots[0], &slots[2]);
+            slots[0] = slots[2];
+        }
+    }
+    sn_pmap_store(p, block, slots[0]);
+
+    stack->push_count = push_count;
+    return status;
+}
+
+// (pmap f lo hi) is the vector of (f i) for lo <= i < hi, computed in parallel
+sn_error_t sn_pmap(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count != 3) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    // C code emitted for a program has no interpreter to run f with
+    if (!sn_is_pure_fn(args[0]) || vm->prog == NULL) {
+        return SN_ERROR_INVALID_PARAMS_TO_FN;
+    }
+
+    int64_t count = 0;
+    sn_error_t status = sn_pmap_check_range(&args[1], &args[2], &count);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    sn_pmap_t p = {
+        .fn = args[0],
+        .lo = SN_VALUE_INT(args[1]),
+        .hi = SN_VALUE_INT(args[2]),
+        .results = malloc(count * sizeof p.results[0]),
+        .ints = malloc(count * sizeof p.ints[0]),
+    };
+
+    int64_t block_count = (count + SN_POOL_BLOCK_SIZE - 1) / SN_POOL_BLOCK_SIZE;
+    status = sn_pool_run(&vm->stack, sn_pmap_block, &p, block_count);
+    if (status == SN_SUCCESS) {
+        *ret = sn_value_vector(count);
+        sn_vector_t *vector = SN_VALUE_VECTOR(*ret);
+        for (int64_t i = 0; i < count; i++) {
+            vector->items[i] = sn_pmap_load(&p, i);
+        }
+    }
+
+    free(p.results);
+    free(p.ints);
+    return status;
+}
+
+// (preduce f combine init lo hi) folds (f i) for lo <= i < hi into init with
+// combine. The items are folded in fixed blocks in parallel and the blocks
+// are then folded in order, so combine should be associative.
+sn_error_t sn_preduce(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count != 5) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    if (!sn_is_pure_fn(args[0]) || !sn_is_pure_fn(args[1]) || vm->prog == NULL) {
+        return SN_ERROR_INVALID_PARAMS_TO_FN;
+    }
+
+    int64_t count = 0;
+    sn_error_t status = sn_pmap_check_range(&args[3], &args[4], &count);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    int64_t block_count = (count + SN_POOL_BLOCK_SIZE - 1) / SN_POOL_BLOCK_SIZE;
+    sn_pmap_t p = {
+        .fn = args[0],
+        .combine = args[1],
+        .lo = SN_VALUE_INT(args[3]),
+        .hi = SN_VALUE_INT(args[4]),
+        .results = malloc(block_count * sizeof p.results[0]),
+        .ints = malloc(block_count * sizeof p.ints[0]),
+    };
+
+    status = sn_pool_run(&vm->stack, sn_preduce_block, &p, block_count);
+
+    // the blocks are folded on the stack of the vm, whose slots keep the
+    // boxes alive
+    sn_stack_t *stack = &vm->stack;
+    int push_count = stack->push_count;
+    sn_value_t *slots = &stack->values[sn_stack_alloc_values(stack, 3)];
+    slots[0] = args[2];
+    for (int64_t block = 0; block < block_count && status == SN_SUCCESS; block++) {
+        slots[1] = sn_pmap_load(&p, block);
+        status = sn_stack_call(stack, p.combine, 2, &slots[0], &slots[2]);
+        slots[0] = slots[2];
+    }
+
+    if (status == SN_SUCCESS) {
+        *ret = slots[0];
+    }
+    stack->push_count = push_count;
+
+    free(p.results);
+    free(p.ints);
+    return status;
+}
+
+sn_error_t sn_future_block(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_future_t *future = data;
+    int push_count = stack->push_count;
+    sn_value_t *value = &stack->values[sn_stack_alloc_values(stack, 1)];
+
+    sn_error_t status = sn_stack_call(stack, future->fn, future->arg_count, future->args, value);
+
+    // boxes of the arena of the stack go away with it
+    if (SN_VALUE_IS_BOX(*value) && (SN_VALUE_BOX(*value)->flags & SN_BOX_FLAG_ARENA)) {
+        sn_box_export(&future->value_box, SN_VALUE_BOX(*value));
+        value->bits = (uintptr_t)&future->value_box + SN_VALUE_TAG_BOX;
+    }
+    future->value = *value;
+
+    stack->push_count = push_count;
+    return status;
+}
+
+// (spawn f a b ...) starts (f a b ...) on the pool and returns a future for
+// its value, which is read with await; f must be pure
+sn_error_t sn_spawn(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count < 1) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    // C code emitted for a program has no interpreter to run f with
+    if (!sn_is_pure_fn(args[0]) || vm->prog == NULL) {
+        return SN_ERROR_INVALID_PARAMS_TO_FN;
+    }
+
+    if (SN_VALUE_IS_USER_FN(args[0]) && SN_VALUE_USER_FN(args[0])->param_count != arg_count - 1) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    // the list of the stack holds the first reference
+    sn_future_t *future = calloc(1, sizeof *future + (arg_count - 1) * sizeof future->args[0]);
+    future->ref_count = 1;
+    future->fn = args[0];
+    future->arg_count = arg_count - 1;
+    future->value = sn_null;
+    for (int i = 0; i < future->arg_count; i++) {
+        sn_value_t arg = args[i + 1];
+        if (SN_VALUE_IS_BOX(arg)) {
+            sn_box_t *box = calloc(1, sizeof *box);
+            sn_box_export(box, SN_VALUE_BOX(arg));
+            arg.bits = (uintptr_t)box + SN_VALUE_TAG_BOX;
+        }
+        future->args[i] = arg;
+    }
+
+    sn_stack_t *stack = &vm->stack;
+    sn_pool_job_init(&future->job, sn_future_block, future);
+    sn_error_t status = sn_pool_start(stack, &future->job, 1);
+    if (status != SN_SUCCESS) {
+        sn_future_release(future);
+        return status;
+    }
+
+    future->spawn_depth = stack->lend_depth;
+    future->next_spawned = stack->futures;
+    stack->futures = future;
+
+    *ret = sn_value_future(future);
+    return SN_SUCCESS;
+}
+
+// (await fut) is the value of the call of a future, or its error. The thread
+// runs tasks of the pool until the call is done.
+sn_error_t sn_await(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
+    if (arg_count != 1) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    if (!SN_VALUE_IS_FUTURE(args[0])) {
+        return SN_ERROR_WRONG_VALUE_TYPE;
+    }
+
+    sn_future_t *future = SN_VALUE_FUTURE(args[0]);
+    sn_error_t status = sn_pool_wait(&vm->stack, &future->job, &vm->stack);
+    if (status == SN_SUCCESS) {
+        *ret = sn_value_import(future->value);
+    }
+    return status;
+}
+
+void sn_vm_output(sn_vm_t *vm, const char *str, size_t size)
+{
+    if (vm->out_size + size > vm->out_cap) {
+        vm->out_cap = SN_MAX(SN_OUTPUT_FLUSH_SIZE, 2 * (vm->out_size + size));
+        vm->out_buf = realloc(vm->out_buf, vm->out_cap);
+    }
+
+    memcpy(vm->out_buf + vm->out_size, str, size);
+    vm->out_size += size;
+}
+
+void sn_vm_output_str(sn_vm_t *vm, const char *str)
+{
+    sn_vm_output(vm, str, strlen(str));
+}
+
+void sn_vm_output_int(sn_vm_t *vm, int64_t i)
+{
+    char buf[24];
+    char *p = buf + sizeof buf;
+    uint64_t u = i < 0 ? 0 - (uint64_t)i : (uint64_t)i;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    if (i < 0) {
+        *--p = '-';
+    }
+    sn_vm_output(vm, p, buf + sizeof buf - p);
+}
+
+void sn_vm_flush_output(sn_vm_t *vm)
+{
+    if (vm->out_size == 0) {
+        return;
+    }
+
+    if (vm->write != NULL) {
+        vm->write(vm->write_ctx, vm->out_buf, vm->out_size);
+    }
+    else {
+        fwrite(vm->out_buf, 1, vm->out_size, stdout);
+    }
+    vm->out_size = 0;
+}
+
+void sn_print_value(sn_vm_t *vm, sn_value_t value)
+{
+    switch (sn_value_type(value)) {
+        case SN_VALUE_TYPE_INVALID:
+            break;
+        case SN_VALUE_TYPE_NULL:
+            sn_vm_output_str(vm, "null");
+            break;
+        case SN_VALUE_TYPE_INTEGER:
+            sn_vm_output_int(vm, SN_VALUE_INT(value));
+            break;
+        case SN_VALUE_TYPE_BOOLEAN:
+            sn_vm_output_str(vm, SN_VALUE_BOOL(value) ? "true" : "false");
+            break;
+        case SN_VALUE_TYPE_USER_FN:
+            sn_vm_output_str(vm, "<user fn>");
+            break;
+        case SN_VALUE_TYPE_BUILTIN_FN:
+            sn_vm_output_str(vm, "<builtin fn>");
+            break;
+        case SN_VALUE_TYPE_FUTURE:
+            sn_vm_output_str(vm, "<future>");
+            break;
+        case SN_VALUE_TYPE_VECTOR:
+            sn_vm_output_str(vm, "[");
+            for (int64_t i = 0; i < SN_VALUE_VECTOR(value)->count; i++) {
+                if (i != 0) {
+                    sn_vm_output_str(vm, " ");
+                }
+                sn_print_value(vm, SN_VALUE_VECTOR(value)->items[i]);
+            }
+            sn_vm_output_str(vm, "]");
+            break;
+    }
+}
+
+// output is buffered by the vm and written a block of whole lines at a time,
+// and when a run stops
+sn_error_t sn_println(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args)
+{
+    *ret = sn_null;
     for (int i = 0; i < arg_count; i++) {
-        if (i != 0) {
-            putchar(' ');
+        if (sn_value_type(args[i]) == SN_VALUE_TYPE_INVALID) {
+            return SN_ERROR_INVALID_PARAMS_TO_FN;
         }
-        switch (args[i].type) {
-            case SN_VALUE_TYPE_INVALID:
-                return SN_ERROR_INVALID_PARAMS_TO_FN;
-            case SN_VALUE_TYPE_NULL:
-                printf("null");
-                break;
-            case SN_VALUE_TYPE_INTEGER:
-                printf("%ld", args[i].i);
-                break;
-            case SN_VALUE_TYPE_BOOLEAN:
-                printf("%s", args[i].i ? "true" : "false");
-                break;
-            case SN_VALUE_TYPE_USER_FN:
-                printf("<user fn>");
-                break;
-            case SN_VALUE_TYPE_BUILTIN_FN:
-                printf("<builtin fn>");
-                break;
+    }
+
+    for (int i = 0; i < arg_count; i++) {
+        if (i != 0) {
+            sn_vm_output_str(vm, " ");
         }
+        sn_print_value(vm, args[i]);
+    }
+    sn_vm_output_str(vm, "\n");
+
+    if (vm->out_size >= SN_OUTPUT_FLUSH_SIZE) {
+        sn_vm_flush_output(vm);
     }
-    printf("\n");
     return SN_SUCCESS;
 }
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <string.h>
+#include "snscript_internal.h"
+
+// Cache of built programs, shared by the threads of a process.
+//
+// A program is found by the SHA-256 of its source and options, so a repeated
+// source costs one hash instead of a parse and a build. The cache holds a pin
+// on each of its programs and every caller gets one more, so a program that
+// is evicted lives on until the runs that got it unpin it. Programs that
+// failed to build are kept too, since the same source fails the same way.
+//
+// The first thread to miss builds the program without holding the lock, and
+// the threads that ask for the same one meanwhile wait for it instead of
+// building their own.
+
+#define SN_SHA256_SIZE 32
+
+typedef struct sn_sha256_st
+{
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t block_size;
+    uint64_t total;
+} sn_sha256_t;
+
+static const uint32_t sn_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SN_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sn_sha256_init(sn_sha256_t *h)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h->state, init, sizeof init);
+    h->block_size = 0;
+    h->total = 0;
+}
+
+void sn_sha256_compress(sn_sha256_t *h, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SN_ROTR(w[i - 15], 7) ^ SN_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SN_ROTR(w[i - 2], 17) ^ SN_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h->state[0], b = h->state[1], c = h->state[2], d = h->state[3];
+    uint32_t e = h->state[4], f = h->state[5], g = h->state[6], k = h->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SN_ROTR(e, 6) ^ SN_ROTR(e, 11) ^ SN_ROTR(e, 25);
+        uint32_t t1 = k + s1 + ((e & f) ^ (~e & g)) + sn_sha256_k[i] + w[i];
+        uint32_t s0 = SN_ROTR(a, 2) ^ SN_ROTR(a, 13) ^ SN_ROTR(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    h->state[0] += a;
+    h->state[1] += b;
+    h->state[2] += c;
+    h->state[3] += d;
+    h->state[4] += e;
+    h->state[5] += f;
+    h->state[6] += g;
+    h->state[7] += k;
+}
+
+void sn_sha256_update(sn_sha256_t *h, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    h->total += size;
+
+    if (h->block_size > 0) {
+        size_t n = SN_MIN(size, 64 - h->block_size);
+        memcpy(h->block + h->block_size, p, n);
+        h->block_size += n;
+        p += n;
+        size -= n;
+        if (h->block_size < 64) {
+            return;
+        }
+        sn_sha256_compress(h, h->block);
+        h->block_size = 0;
+    }
+
+    for (; size >= 64; p += 64, size -= 64) {
+        sn_sha256_compress(h, p);
+    }
+
+    memcpy(h->block, p, size);
+    h->block_size = size;
+}
+
+void sn_sha256_final(sn_sha256_t *h, uint8_t *digest)
+{
+    uint64_t bits = h->total * 8;
+    uint8_t pad[72] = {0x80};
+    size_t pad_size = (h->block_size < 56 ? 56 : 120) - h->block_size;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_size + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sn_sha256_update(h, pad, pad_size + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(h->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(h->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(h->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)h->state[i];
+    }
+}
+
+typedef struct sn_cache_entry_st sn_cache_entry_t;
+struct sn_cache_entry_st
+{
+    uint8_t key[SN_SHA256_SIZE];
+    sn_cache_entry_t *next_in_bucket;
+
+    // the most recently used first, once built
+    sn_cache_entry_t *prev;
+    sn_cache_entry_t *next;
+
+    bool is_building;
+    sn_program_t *prog;
+    sn_error_t status;
+    size_t bytes;
+};
+
+struct sn_program_cache_st
+{
+    pthread_mutex_t lock;
+    // signaled when a program is built
+    pthread_cond_t built;
+
+    sn_cache_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+
+    sn_cache_entry_t *head;
+    sn_cache_entry_t *tail;
+    size_t bytes;
+    size_t max_bytes;
+};
+
+// the options that change how a program is built or runs are part of the key
+void sn_cache_key(const char *source, size_t size, const sn_program_options_t *options, uint8_t *key)
+{
+    sn_program_options_t defaults;
+    if (options == NULL) {
+        sn_program_options_init(&defaults);
+        options = &defaults;
+    }
+
+    int64_t fields[] = {
+        options->jit_threshold,
+        options->thread_count,
+        options->parallel_args,
+        (int64_t)(uintptr_t)options->write,
+        (int64_t)(uintptr_t)options->write_ctx,
+        options->lazy_build,
+        options->lazy_parse,
+        (int64_t)size,
+    };
+
+    sn_sha256_t h;
+    sn_sha256_init(&h);
+    sn_sha256_update(&h, fields, sizeof fields);
+    sn_sha256_update(&h, source, size);
+    sn_sha256_final(&h, key);
+}
+
+sn_cache_entry_t **sn_cache_find(sn_program_cache_t *cache, const uint8_t *key)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, key, sizeof hash);
+    sn_cache_entry_t **link = &cache->buckets[hash & (cache->bucket_count - 1)];
+    while (*link != NULL && memcmp((*link)->key, key, SN_SHA256_SIZE) != 0) {
+        link = &(*link)->next_in_bucket;
+    }
+    return link;
+}
+
+void sn_cache_grow(sn_program_cache_t *cache)
+{
+    sn_cache_entry_t **old = cache->buckets;
+    size_t old_count = cache->bucket_count;
+    cache->bucket_count *= 2;
+    cache->buckets = calloc(cache->bucket_count, sizeof cache->buckets[0]);
+
+    for (size_t i = 0; i < old_count; i++) {
+        while (old[i] != NULL) {
+            sn_cache_entry_t *entry = old[i];
+            old[i] = entry->next_in_bucket;
+            sn_cache_entry_t **link = sn_cache_find(cache, entry->key);
+            entry->next_in_bucket = *link;
+            *link = entry;
+        }
+    }
+    free(old);
+}
+
+void sn_cache_unlink(sn_program_cache_t *cache, sn_cache_entry_t *entry)
+{
+    *(entry->prev != NULL ? &entry->prev->next : &cache->head) = entry->next;
+    *(entry->next != NULL ? &entry->next->prev : &cache->tail) = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+void sn_cache_push_front(sn_program_cache_t *cache, sn_cache_entry_t *entry)
+{
+    entry->next = cache->head;
+    *(cache->head != NULL ? &cache->head->prev : &cache->tail) = entry;
+    cache->head = entry;
+}
+
+// drops the least recently used programs until the rest fit, but always
+// keeps the one just used
+void sn_cache_evict(sn_program_cache_t *cache)
+{
+    while (cache->bytes > cache->max_bytes && cache->tail != cache->head) {
+        sn_cache_entry_t *entry = cache->tail;
+        sn_cache_unlink(cache, entry);
+        *sn_cache_find(cache, entry->key) = entry->next_in_bucket;
+        cache->count--;
+        cache->bytes -= entry->bytes;
+
+        sn_program_unpin(entry->prog);
+        free(entry);
+    }
+}
+
+sn_error_t sn_program_cache_create(sn_program_cache_t **cache_out, size_t max_bytes)
+{
+    sn_program_cache_t *cache = calloc(1, sizeof *cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->built, NULL);
+    cache->bucket_count = 64;
+    cache->buckets = calloc(cache->bucket_count, sizeof cache->buckets[0]);
+    cache->max_bytes = max_bytes;
+
+    *cache_out = cache;
+    return SN_SUCCESS;
+}
+
+void sn_program_cache_destroy(sn_program_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    while (cache->head != NULL) {
+        sn_cache_entry_t *entry = cache->head;
+        cache->head = entry->next;
+        sn_program_unpin(entry->prog);
+        free(entry);
+    }
+
+    pthread_cond_destroy(&cache->built);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+sn_program_t *sn_cache_build(const char *source, size_t size, const sn_program_options_t *options, sn_error_t *status_out)
+{
+    sn_program_t *prog = NULL;
+    sn_error_t status = sn_program_create_with_options(&prog, source, size, options);
+    if (status == SN_SUCCESS) {
+        status = sn_program_build(prog);
+    }
+
+    *status_out = status;
+    return prog;
+}
+
+sn_error_t sn_program_cache_get(sn_program_cache_t *cache,
+                                const char *source,
+                                size_t size,
+                                const sn_program_options_t *options,
+                                sn_program_t **program_out)
+{
+    uint8_t key[SN_SHA256_SIZE];
+    sn_cache_key(source, size, options, key);
+
+    // a program waited for may be evicted before the waiter runs again, so
+    // it is looked up again each time
+    pthread_mutex_lock(&cache->lock);
+    sn_cache_entry_t *entry = *sn_cache_find(cache, key);
+    while (entry != NULL && entry->is_building) {
+        pthread_cond_wait(&cache->built, &cache->lock);
+        entry = *sn_cache_find(cache, key);
+    }
+
+    if (entry == NULL) {
+        entry = calloc(1, sizeof *entry);
+        memcpy(entry->key, key, sizeof key);
+        entry->is_building = true;
+        *sn_cache_find(cache, key) = entry;
+        if (++cache->count > cache->bucket_count) {
+            sn_cache_grow(cache);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        sn_error_t status = SN_SUCCESS;
+        sn_program_t *prog = sn_cache_build(source, size, options, &status);
+        size_t bytes = sn_program_memory_size(prog);
+        prog->pin_count = 1;
+
+        pthread_mutex_lock(&cache->lock);
+        entry->prog = prog;
+        entry->status = status;
+        entry->bytes = bytes;
+        entry->is_building = false;
+        sn_cache_push_front(cache, entry);
+        cache->bytes += bytes;
+        pthread_cond_broadcast(&cache->built);
+    }
+    else {
+        sn_cache_unlink(cache, entry);
+        sn_cache_push_front(cache, entry);
+    }
+
+    __atomic_add_fetch(&entry->prog->pin_count, 1, __ATOMIC_RELAXED);
+    *program_out = entry->prog;
+    sn_error_t status = entry->status;
+    sn_cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
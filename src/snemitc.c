@@ -0,0 +1,902 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snscript_internal.h"
+
+// Ahead-of-time translation of a built program to C.
+//
+// Every user function becomes a C function over sn_value_t locals that calls
+// the builtins in snbuiltins.c directly, with inline paths for integer
+// arithmetic and comparisons. Pure functions the JIT can type are also
+// emitted as C functions over int64_t, which the sn_value_t version calls
+// first whenever all of its arguments are integers. Builtins and functions
+// are static initializers of the globals, while the rest of the top level is
+// evaluated in order at the start of sn_compiled_run_main like the
+// interpreter does.
+
+typedef struct sn_emit_st
+{
+    FILE *out;
+    sn_program_t *prog;
+    int indent;
+    int temp_count;
+    int max_temp_count;
+    int label_count;
+} sn_emit_t;
+
+void sn_emit_expr(sn_emit_t *e, sn_expr_t *expr, const char *dest);
+
+void sn_emit_line(sn_emit_t *e, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(e->out, "%*s", 4 * e->indent, "");
+    vfprintf(e->out, fmt, ap);
+    fputc('\n', e->out);
+    va_end(ap);
+}
+
+int sn_emit_alloc_temps(sn_emit_t *e, int count)
+{
+    int base = e->temp_count;
+    e->temp_count += count;
+    e->max_temp_count = SN_MAX(e->max_temp_count, e->temp_count);
+    return base;
+}
+
+void sn_emit_c_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (const char *c = str; *c != '\0'; c++) {
+        // escape '?' so that symbols can't form trigraphs
+        if (*c == '"' || *c == '\\' || *c == '?') {
+            fputc('\\', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+void sn_emit_int64(FILE *out, int64_t i)
+{
+    if (i == INT64_MIN) {
+        fprintf(out, "INT64_MIN");
+    }
+    else {
+        fprintf(out, "INT64_C(%lld)", (long long)i);
+    }
+}
+
+// writes the error position of expr as the trailing arguments of SN_C_FAIL
+void sn_emit_fail(sn_emit_t *e, const char *status, sn_expr_t *expr)
+{
+    fprintf(e->out, "%*sSN_C_FAIL(%s, %d, %d, ", 4 * e->indent, "", status, expr->line, expr->col);
+    if (expr->type == SN_EXPR_TYPE_SYMBOL) {
+        sn_emit_c_string(e->out, expr->sym->value);
+    }
+    else {
+        fprintf(e->out, "NULL");
+    }
+    fprintf(e->out, ");\n");
+}
+
+void sn_emit_check_boolean(sn_emit_t *e, const char *value, sn_expr_t *expr)
+{
+    sn_emit_line(e, "if (!SN_VALUE_IS_BOOL(%s)) {", value);
+    e->indent++;
+    sn_emit_fail(e, "SN_ERROR_WRONG_VALUE_TYPE", expr);
+    e->indent--;
+    sn_emit_line(e, "}");
+}
+
+void sn_emit_ref(char *buf, size_t size, sn_ref_t *ref)
+{
+    if (ref->type == SN_SCOPE_TYPE_GLOBAL) {
+        snprintf(buf, size, "sn_c_globals[%d]", ref->index);
+    }
+    else {
+        snprintf(buf, size, "l[%d]", ref->index);
+    }
+}
+
+sn_value_t *sn_emit_const_callee(sn_expr_t *expr)
+{
+    if (expr->rtype != SN_RTYPE_VAR || expr->ref.type != SN_SCOPE_TYPE_GLOBAL) {
+        return NULL;
+    }
+
+    return sn_scope_get_const_value(&expr->prog->globals, &expr->ref);
+}
+
+const char *sn_emit_builtin_op(sn_builtin_fn_t fn, bool *is_compare)
+{
+    *is_compare = fn == sn_equals || fn == sn_not_equals;
+
+    if (fn == sn_add) {
+        return "sn_c_add";
+    }
+    else if (fn == sn_sub) {
+        return "sn_c_sub";
+    }
+    else if (fn == sn_mul) {
+        return "sn_c_mul";
+    }
+    else if (fn == sn_equals) {
+        return "==";
+    }
+    else if (fn == sn_not_equals) {
+        return "!=";
+    }
+
+    return NULL;
+}
+
+void sn_emit_builtin_call(sn_emit_t *e,
+                          sn_expr_t *expr,
+                          sn_builtin_func_t *builtin,
+                          int args,
+                          const char *dest)
+{
+    int arg_count = expr->child_count - 1;
+    bool is_compare = false;
+    const char *op = sn_emit_builtin_op(builtin->fn, &is_compare);
+
+    if (op != NULL && arg_count == 2) {
+        sn_emit_line(e, "if (SN_VALUE_IS_SMALL_INT(t[%d]) && SN_VALUE_IS_SMALL_INT(t[%d])) {",
+                     args, args + 1);
+        e->indent++;
+        if (is_compare) {
+            sn_emit_line(e, "%s = sn_make_bool(t[%d].bits %s t[%d].bits);", dest, args, op, args + 1);
+        }
+        else {
+            sn_emit_line(e, "%s = sn_make_int(%s(SN_VALUE_INT(t[%d]), SN_VALUE_INT(t[%d])));",
+                         dest, op, args, args + 1);
+        }
+        e->indent--;
+        sn_emit_line(e, "}");
+        sn_emit_line(e, "else {");
+        e->indent++;
+    }
+
+    sn_emit_line(e, "status = %s(sn_c_vm, &%s, %d, &t[%d]);", builtin->c_name, dest, arg_count, args);
+    sn_emit_line(e, "if (status != SN_SUCCESS) {");
+    e->indent++;
+    sn_emit_fail(e, "status", expr);
+    e->indent--;
+    sn_emit_line(e, "}");
+
+    if (op != NULL && arg_count == 2) {
+        e->indent--;
+        sn_emit_line(e, "}");
+    }
+}
+
+void sn_emit_return_on_error(sn_emit_t *e)
+{
+    sn_emit_line(e, "if (status != SN_SUCCESS) {");
+    sn_emit_line(e, "    return status;");
+    sn_emit_line(e, "}");
+}
+
+void sn_emit_args(sn_emit_t *e, sn_expr_t *expr, int base)
+{
+    char buf[32];
+    int i = 0;
+
+    for (sn_expr_t *arg = expr->child_head->next; arg != NULL; arg = arg->next) {
+        snprintf(buf, sizeof buf, "t[%d]", base + i++);
+        sn_emit_expr(e, arg, buf);
+    }
+}
+
+// the callee is checked before the arguments are evaluated, in the same
+// order as sn_stack_eval_call
+void sn_emit_call(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    int arg_count = expr->child_count - 1;
+    sn_expr_t *fn_expr = expr->child_head;
+    sn_value_t *callee = sn_emit_const_callee(fn_expr);
+    int base = sn_emit_alloc_temps(e, expr->child_count);
+    char buf[32];
+
+    if (callee == NULL) {
+        snprintf(buf, sizeof buf, "t[%d]", base);
+        sn_emit_expr(e, fn_expr, buf);
+        fprintf(e->out, "%*sstatus = sn_c_check_call(&t[%d], %d, %d, %d, %d, %d, ",
+                4 * e->indent, "", base, arg_count,
+                expr->line, expr->col, fn_expr->line, fn_expr->col);
+        if (fn_expr->type == SN_EXPR_TYPE_SYMBOL) {
+            sn_emit_c_string(e->out, fn_expr->sym->value);
+        }
+        else {
+            fprintf(e->out, "NULL");
+        }
+        fprintf(e->out, ");\n");
+        sn_emit_return_on_error(e);
+        sn_emit_args(e, expr, base + 1);
+        sn_emit_line(e, "status = sn_c_call(&%s, &t[%d], %d, &t[%d], %d, %d);",
+                     dest, base, arg_count, base + 1, expr->line, expr->col);
+        sn_emit_return_on_error(e);
+    }
+    else if (SN_VALUE_IS_BUILTIN_FN(*callee)) {
+        sn_emit_args(e, expr, base + 1);
+        sn_emit_builtin_call(e, expr, SN_VALUE_BUILTIN_FN(*callee), base + 1, dest);
+    }
+    else if (!SN_VALUE_IS_USER_FN(*callee)) {
+        sn_emit_fail(e, "SN_ERROR_CALLEE_NOT_A_FN", fn_expr);
+    }
+    else if (arg_count != SN_VALUE_USER_FN(*callee)->param_count) {
+        sn_emit_fail(e, "SN_ERROR_WRONG_ARG_COUNT_IN_CALL", expr);
+    }
+    else {
+        sn_emit_args(e, expr, base + 1);
+        sn_emit_line(e, "status = sn_c_fn_%d(&%s, &t[%d]);", fn_expr->ref.index, dest, base + 1);
+        sn_emit_return_on_error(e);
+    }
+
+    e->temp_count = base;
+}
+
+void sn_emit_assign(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    sn_expr_t *dst = expr->child_head->next;
+    int temp = sn_emit_alloc_temps(e, 1);
+    char buf[32];
+    char ref[32];
+
+    snprintf(buf, sizeof buf, "t[%d]", temp);
+    sn_emit_expr(e, dst->next, buf);
+    sn_emit_ref(ref, sizeof ref, &dst->ref);
+    sn_emit_line(e, "%s = %s;", ref, buf);
+    sn_emit_line(e, "%s = sn_null;", dest);
+
+    e->temp_count = temp;
+}
+
+void sn_emit_if(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    sn_expr_t *cond_expr = expr->child_head->next;
+    sn_expr_t *true_arm = cond_expr->next;
+    sn_expr_t *false_arm = true_arm->next;
+    int temp = sn_emit_alloc_temps(e, 1);
+    char cond[32];
+
+    snprintf(cond, sizeof cond, "t[%d]", temp);
+    sn_emit_expr(e, cond_expr, cond);
+    sn_emit_check_boolean(e, cond, cond_expr);
+
+    sn_emit_line(e, "if (SN_VALUE_BOOL(%s)) {", cond);
+    e->indent++;
+    sn_emit_expr(e, true_arm, dest);
+    e->indent--;
+    sn_emit_line(e, "}");
+    sn_emit_line(e, "else {");
+    e->indent++;
+    if (false_arm != NULL) {
+        sn_emit_expr(e, false_arm, dest);
+    }
+    else {
+        sn_emit_line(e, "%s = sn_null;", dest);
+    }
+    e->indent--;
+    sn_emit_line(e, "}");
+
+    e->temp_count = temp;
+}
+
+void sn_emit_do(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        sn_emit_expr(e, child, dest);
+    }
+}
+
+void sn_emit_andor(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    bool is_and = expr->rtype == SN_RTYPE_AND_EXPR;
+    int label = e->label_count++;
+
+    sn_emit_line(e, "%s = %s;", dest, is_and ? "sn_true" : "sn_false");
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        sn_emit_expr(e, child, dest);
+        sn_emit_check_boolean(e, dest, child);
+        sn_emit_line(e, "if (%sSN_VALUE_BOOL(%s)) {", is_and ? "!" : "", dest);
+        sn_emit_line(e, "    goto sn_c_done_%d;", label);
+        sn_emit_line(e, "}");
+    }
+    fprintf(e->out, "sn_c_done_%d:;\n", label);
+}
+
+void sn_emit_while(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    sn_expr_t *cond_expr = expr->child_head->next;
+    sn_expr_t *body = cond_expr->next;
+    int temp = sn_emit_alloc_temps(e, 1);
+    char cond[32];
+
+    snprintf(cond, sizeof cond, "t[%d]", temp);
+    sn_emit_line(e, "%s = sn_null;", dest);
+    sn_emit_line(e, "for (;;) {");
+    e->indent++;
+    sn_emit_expr(e, cond_expr, cond);
+    sn_emit_check_boolean(e, cond, cond_expr);
+    sn_emit_line(e, "if (!SN_VALUE_BOOL(%s)) {", cond);
+    sn_emit_line(e, "    break;");
+    sn_emit_line(e, "}");
+    if (body != NULL) {
+        sn_emit_expr(e, body, dest);
+    }
+    e->indent--;
+    sn_emit_line(e, "}");
+
+    e->temp_count = temp;
+}
+
+void sn_emit_expr(sn_emit_t *e, sn_expr_t *expr, const char *dest)
+{
+    char ref[32];
+
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            fprintf(e->out, "%*s%s = sn_make_int(", 4 * e->indent, "", dest);
+            sn_emit_int64(e->out, expr->vint);
+            fprintf(e->out, ");\n");
+            return;
+
+        case SN_RTYPE_VAR:
+            sn_emit_ref(ref, sizeof ref, &expr->ref);
+            sn_emit_line(e, "%s = %s;", dest, ref);
+            return;
+
+        case SN_RTYPE_CALL:
+            sn_emit_call(e, expr, dest);
+            return;
+
+        case SN_RTYPE_LET_EXPR:
+        case SN_RTYPE_CONST_EXPR:
+        case SN_RTYPE_ASSIGN_EXPR:
+            sn_emit_assign(e, expr, dest);
+            return;
+
+        case SN_RTYPE_IF_EXPR:
+            sn_emit_if(e, expr, dest);
+            return;
+
+        case SN_RTYPE_DO_EXPR:
+            sn_emit_do(e, expr, dest);
+            return;
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            sn_emit_andor(e, expr, dest);
+            return;
+
+        case SN_RTYPE_WHILE_EXPR:
+            sn_emit_while(e, expr, dest);
+            return;
+
+        case SN_RTYPE_PURE_EXPR:
+        case SN_RTYPE_FN_EXPR:
+            sn_emit_line(e, "%s = sn_null;", dest);
+            return;
+
+        default:
+            break;
+    }
+
+    abort();
+}
+
+void sn_emit_typed_expr(sn_emit_t *e, sn_expr_t *expr);
+
+void sn_emit_typed_args(sn_emit_t *e, sn_expr_t *expr, const char *sep)
+{
+    for (sn_expr_t *arg = expr->child_head->next; arg != NULL; arg = arg->next) {
+        sn_emit_typed_expr(e, arg);
+        if (arg->next != NULL) {
+            fprintf(e->out, "%s", sep);
+        }
+    }
+}
+
+void sn_emit_typed_builtin_call(sn_emit_t *e, sn_expr_t *expr, sn_builtin_fn_t fn)
+{
+    int arg_count = expr->child_count - 1;
+    sn_expr_t *args = expr->child_head + 1;
+
+    if (fn == sn_add || fn == sn_mul) {
+        if (arg_count == 0) {
+            fprintf(e->out, "INT64_C(%d)", fn == sn_mul);
+            return;
+        }
+
+        // nest the calls so that they fold left like the builtins
+        for (int i = 1; i < arg_count; i++) {
+            fprintf(e->out, "%s(", fn == sn_add ? "sn_c_add" : "sn_c_mul");
+        }
+        sn_emit_typed_expr(e, &args[0]);
+        for (int i = 1; i < arg_count; i++) {
+            fprintf(e->out, ", ");
+            sn_emit_typed_expr(e, &args[i]);
+            fprintf(e->out, ")");
+        }
+        return;
+    }
+
+    if (fn == sn_sub) {
+        fprintf(e->out, arg_count == 1 ? "sn_c_neg(" : "sn_c_sub(");
+    }
+    else if (fn == sn_div) {
+        fprintf(e->out, "sn_c_div(bail, ");
+    }
+    else if (fn == sn_mod) {
+        fprintf(e->out, "sn_c_mod(bail, ");
+    }
+    else if (fn == sn_equals) {
+        fprintf(e->out, "(int64_t)(");
+        sn_emit_typed_args(e, expr, " == ");
+        fprintf(e->out, ")");
+        return;
+    }
+    else if (fn == sn_not_equals) {
+        fprintf(e->out, "(int64_t)(");
+        sn_emit_typed_args(e, expr, " != ");
+        fprintf(e->out, ")");
+        return;
+    }
+    else {
+        assert(fn == sn_not);
+        fprintf(e->out, "(int64_t)!(");
+    }
+
+    sn_emit_typed_args(e, expr, ", ");
+    fprintf(e->out, ")");
+}
+
+// the JIT typer has already checked that expr only uses typed constructs
+void sn_emit_typed_expr(sn_emit_t *e, sn_expr_t *expr)
+{
+    sn_value_t *val = NULL;
+
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            sn_emit_int64(e->out, expr->vint);
+            return;
+
+        case SN_RTYPE_VAR:
+            if (expr->ref.type == SN_SCOPE_TYPE_LOCAL) {
+                fprintf(e->out, "a%d", expr->ref.index);
+            }
+            else if ((val = sn_emit_const_callee(expr)) != NULL) {
+                assert(SN_VALUE_IS_BOOL(*val));
+                fprintf(e->out, "INT64_C(%d)", SN_VALUE_BOOL(*val));
+            }
+            else {
+                fprintf(e->out, "sn_c_global_int(bail, %d)", expr->ref.index);
+            }
+            return;
+
+        case SN_RTYPE_CALL:
+            val = sn_emit_const_callee(expr->child_head);
+            if (SN_VALUE_IS_USER_FN(*val)) {
+                fprintf(e->out, "sn_c_fn_%d_typed(bail", expr->child_head->ref.index);
+                if (expr->child_count > 1) {
+                    fprintf(e->out, ", ");
+                }
+                sn_emit_typed_args(e, expr, ", ");
+                fprintf(e->out, ")");
+            }
+            else {
+                sn_emit_typed_builtin_call(e, expr, SN_VALUE_BUILTIN_FN(*val)->fn);
+            }
+            return;
+
+        case SN_RTYPE_IF_EXPR:
+            fprintf(e->out, "(");
+            sn_emit_typed_expr(e, &expr->child_head[1]);
+            fprintf(e->out, " ? ");
+            sn_emit_typed_expr(e, &expr->child_head[2]);
+            fprintf(e->out, " : ");
+            sn_emit_typed_expr(e, &expr->child_head[3]);
+            fprintf(e->out, ")");
+            return;
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            fprintf(e->out, "(int64_t)(");
+            sn_emit_typed_args(e, expr, expr->rtype == SN_RTYPE_AND_EXPR ? " && " : " || ");
+            fprintf(e->out, ")");
+            return;
+
+        default:
+            break;
+    }
+
+    abort();
+}
+
+bool sn_emit_func_is_typed(sn_func_t *func)
+{
+    return func->jit.state == SN_JIT_STATE_TYPED || func->jit.state == SN_JIT_STATE_COMPILED;
+}
+
+void sn_emit_typed_params(sn_emit_t *e, sn_func_t *func)
+{
+    fprintf(e->out, "int *bail");
+    for (int i = 0; i < func->param_count; i++) {
+        fprintf(e->out, ", int64_t a%d", i);
+    }
+}
+
+void sn_emit_prototypes(sn_emit_t *e, sn_func_t *func, int idx)
+{
+    fprintf(e->out, "static sn_error_t sn_c_fn_%d(sn_value_t *ret, const sn_value_t *args);\n", idx);
+    if (sn_emit_func_is_typed(func)) {
+        fprintf(e->out, "static int64_t sn_c_fn_%d_typed(", idx);
+        sn_emit_typed_params(e, func);
+        fprintf(e->out, ");\n");
+    }
+}
+
+// emits the statements of a function body, which go through a buffer first
+// since the number of temporaries is only known once they have been emitted
+void sn_emit_body(sn_emit_t *e, sn_expr_t *body, int local_count, int param_count)
+{
+    FILE *out = e->out;
+    char *buf = NULL;
+    size_t size = 0;
+
+    e->out = open_memstream(&buf, &size);
+    e->indent = 1;
+    e->temp_count = 0;
+    e->max_temp_count = 0;
+
+    for (sn_expr_t *expr = body; expr != NULL; expr = expr->next) {
+        sn_emit_expr(e, expr, "*ret");
+    }
+
+    fclose(e->out);
+    e->out = out;
+
+    if (local_count > 0) {
+        fprintf(out, "    sn_value_t l[%d] = {0};\n", local_count);
+    }
+    fprintf(out, "    sn_value_t t[%d];\n", SN_MAX(e->max_temp_count, 1));
+    fprintf(out, "    sn_error_t status = SN_SUCCESS;\n");
+    fprintf(out, "    (void)t;\n");
+    fprintf(out, "    (void)status;\n");
+    for (int i = 0; i < param_count; i++) {
+        fprintf(out, "    l[%d] = args[%d];\n", i, i);
+    }
+    fprintf(out, "    *ret = sn_null;\n");
+    fwrite(buf, 1, size, out);
+    fprintf(out, "    return SN_SUCCESS;\n");
+    free(buf);
+}
+
+void sn_emit_func(sn_emit_t *e, sn_func_t *func, int idx)
+{
+    fprintf(e->out, "// %s\n", func->name->value);
+
+    if (sn_emit_func_is_typed(func)) {
+        fprintf(e->out, "static int64_t sn_c_fn_%d_typed(", idx);
+        sn_emit_typed_params(e, func);
+        fprintf(e->out, ")\n{\n");
+        fprintf(e->out, "    if (*bail) {\n");
+        fprintf(e->out, "        return 0;\n");
+        fprintf(e->out, "    }\n");
+        fprintf(e->out, "    return ");
+        sn_emit_typed_expr(e, func->body);
+        fprintf(e->out, ";\n}\n\n");
+    }
+
+    fprintf(e->out, "static sn_error_t sn_c_fn_%d_generic(sn_value_t *ret, const sn_value_t *args)\n{\n", idx);
+    sn_emit_body(e, func->body, func->scope.max_decl_count, func->param_count);
+    fprintf(e->out, "}\n\n");
+
+    fprintf(e->out, "static sn_error_t sn_c_fn_%d(sn_value_t *ret, const sn_value_t *args)\n{\n", idx);
+    if (sn_emit_func_is_typed(func)) {
+        fprintf(e->out, "    if (1");
+        for (int i = 0; i < func->param_count; i++) {
+            fprintf(e->out, " && SN_VALUE_IS_INT(args[%d])", i);
+        }
+        fprintf(e->out, ") {\n");
+        fprintf(e->out, "        int bail = 0;\n");
+        fprintf(e->out, "        int64_t result = sn_c_fn_%d_typed(&bail", idx);
+        for (int i = 0; i < func->param_count; i++) {
+            fprintf(e->out, ", SN_VALUE_INT(args[%d])", i);
+        }
+        fprintf(e->out, ");\n");
+        fprintf(e->out, "        if (!bail) {\n");
+        fprintf(e->out, "            *ret = %s(result);\n",
+                func->jit.ret_type == SN_VALUE_TYPE_INTEGER ? "sn_make_int" : "sn_make_bool");
+        fprintf(e->out, "            return SN_SUCCESS;\n");
+        fprintf(e->out, "        }\n");
+        fprintf(e->out, "    }\n");
+    }
+    fprintf(e->out, "    return sn_c_fn_%d_generic(ret, args);\n}\n\n", idx);
+}
+
+static const char *sn_emit_prelude =
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include \"snscript_internal.h\"\n"
+    "\n"
+    "#define SN_C_FAIL(status, line, col, sym) return sn_c_error(status, line, col, sym)\n"
+    "\n"
+    "static int sn_c_error_line;\n"
+    "static int sn_c_error_col;\n"
+    "static const char *sn_c_error_sym;\n"
+    "\n"
+    "// passed to the builtins, the C code never steps or suspends it\n"
+    "static sn_vm_t *sn_c_vm;\n"
+    "\n"
+    "static inline sn_error_t sn_c_error(sn_error_t status, int line, int col, const char *sym)\n"
+    "{\n"
+    "    sn_c_error_line = line;\n"
+    "    sn_c_error_col = col;\n"
+    "    sn_c_error_sym = sym;\n"
+    "    return status;\n"
+    "}\n"
+    "\n"
+
+    "// integer arithmetic wraps like the builtins\n"
+    "static inline int64_t sn_c_add(int64_t a, int64_t b)\n"
+    "{\n"
+    "    return (int64_t)((uint64_t)a + (uint64_t)b);\n"
+    "}\n"
+    "\n"
+    "static inline int64_t sn_c_sub(int64_t a, int64_t b)\n"
+    "{\n"
+    "    return (int64_t)((uint64_t)a - (uint64_t)b);\n"
+    "}\n"
+    "\n"
+    "static inline int64_t sn_c_mul(int64_t a, int64_t b)\n"
+    "{\n"
+    "    return (int64_t)((uint64_t)a * (uint64_t)b);\n"
+    "}\n"
+    "\n"
+    "static inline int64_t sn_c_neg(int64_t a)\n"
+    "{\n"
+    "    return (int64_t)(0 - (uint64_t)a);\n"
+    "}\n"
+    "\n"
+    "// divisions that trap are left to the generic code\n"
+    "static inline int64_t sn_c_div(int *bail, int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b == 0 || (a == INT64_MIN && b == -1)) {\n"
+    "        *bail = 1;\n"
+    "        return 0;\n"
+    "    }\n"
+    "    return a / b;\n"
+    "}\n"
+    "\n"
+    "static inline int64_t sn_c_mod(int *bail, int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b == 0 || (a == INT64_MIN && b == -1)) {\n"
+    "        *bail = 1;\n"
+    "        return 0;\n"
+    "    }\n"
+    "    return a % b;\n"
+    "}\n"
+    "\n";
+
+void sn_emit_const(sn_emit_t *e, sn_const_t *c)
+{
+    // functions are tagged pointers to the objects emitted for them, the
+    // other consts are immediates whose bits can be copied over
+    fprintf(e->out, "    [%d] = {", c->idx);
+    if (SN_VALUE_IS_USER_FN(c->value)) {
+        fprintf(e->out, "(uintptr_t)&sn_c_func_%d + SN_VALUE_TAG_USER_FN", c->idx);
+    }
+    else if (SN_VALUE_IS_BUILTIN_FN(c->value)) {
+        fprintf(e->out, "(uintptr_t)&sn_c_builtin_%d + SN_VALUE_TAG_BUILTIN_FN", c->idx);
+    }
+    else {
+        assert(!SN_VALUE_IS_BOX(c->value));
+        fprintf(e->out, "UINT64_C(%llu)", (unsigned long long)c->value.bits);
+    }
+    fprintf(e->out, "},\n");
+}
+
+void sn_emit_globals(sn_emit_t *e)
+{
+    sn_scope_t *globals = &e->prog->globals;
+
+    for (sn_const_t *c = globals->head_const; c != NULL; c = c->next) {
+        if (SN_VALUE_IS_BUILTIN_FN(c->value)) {
+            sn_builtin_func_t *builtin = SN_VALUE_BUILTIN_FN(c->value);
+            fprintf(e->out, "static sn_builtin_func_t sn_c_builtin_%d = {.fn = %s, .is_pure = %s};\n",
+                    c->idx, builtin->c_name, builtin->is_pure ? "true" : "false");
+        }
+        else if (SN_VALUE_IS_USER_FN(c->value)) {
+            // only used as the identity of the function value
+            sn_func_t *func = SN_VALUE_USER_FN(c->value);
+            fprintf(e->out, "static sn_func_t sn_c_func_%d = {.is_pure = %s, .param_count = %d};\n",
+                    c->idx, func->is_pure ? "true" : "false", func->param_count);
+        }
+    }
+
+    fprintf(e->out, "\nstatic const sn_value_t sn_c_globals_init[%d] = {\n", SN_MAX(globals->max_decl_count, 1));
+    for (sn_const_t *c = globals->head_const; c != NULL; c = c->next) {
+        sn_emit_const(e, c);
+    }
+    fprintf(e->out, "};\n\n");
+
+    fprintf(e->out, "static sn_value_t sn_c_globals[%d];\n\n", SN_MAX(globals->max_decl_count, 1));
+    fprintf(e->out,
+            "static inline int64_t sn_c_global_int(int *bail, int idx)\n"
+            "{\n"
+            "    if (!SN_VALUE_IS_INT(sn_c_globals[idx])) {\n"
+            "        *bail = 1;\n"
+            "        return 0;\n"
+            "    }\n"
+            "    return SN_VALUE_INT(sn_c_globals[idx]);\n"
+            "}\n\n");
+}
+
+void sn_emit_dispatch(sn_emit_t *e)
+{
+    fprintf(e->out,
+            "static inline sn_error_t sn_c_check_call(const sn_value_t *fn, int arg_count, int line, int col,\n"
+            "                                         int fn_line, int fn_col, const char *fn_sym)\n"
+            "{\n"
+            "    if (SN_VALUE_IS_USER_FN(*fn)) {\n"
+            "        if (arg_count != SN_VALUE_USER_FN(*fn)->param_count) {\n"
+            "            return sn_c_error(SN_ERROR_WRONG_ARG_COUNT_IN_CALL, line, col, NULL);\n"
+            "        }\n"
+            "    }\n"
+            "    else if (!SN_VALUE_IS_BUILTIN_FN(*fn)) {\n"
+            "        return sn_c_error(SN_ERROR_CALLEE_NOT_A_FN, fn_line, fn_col, fn_sym);\n"
+            "    }\n"
+            "    return SN_SUCCESS;\n"
+            "}\n\n");
+
+    fprintf(e->out,
+            "static inline sn_error_t sn_c_call(sn_value_t *ret, const sn_value_t *fn, int arg_count,\n"
+            "                                   const sn_value_t *args, int line, int col)\n"
+            "{\n"
+            "    if (SN_VALUE_IS_BUILTIN_FN(*fn)) {\n"
+            "        sn_error_t status = SN_VALUE_BUILTIN_FN(*fn)->fn(sn_c_vm, ret, arg_count, args);\n"
+            "        if (status != SN_SUCCESS) {\n"
+            "            return sn_c_error(status, line, col, NULL);\n"
+            "        }\n"
+            "        return SN_SUCCESS;\n"
+            "    }\n");
+    for (sn_const_t *c = e->prog->globals.head_const; c != NULL; c = c->next) {
+        if (SN_VALUE_IS_USER_FN(c->value)) {
+            fprintf(e->out, "    if (SN_VALUE_USER_FN(*fn) == &sn_c_func_%d) {\n", c->idx);
+            fprintf(e->out, "        return sn_c_fn_%d(ret, args);\n", c->idx);
+            fprintf(e->out, "    }\n");
+        }
+    }
+    fprintf(e->out,
+            "    abort();\n"
+            "}\n\n");
+}
+
+void sn_emit_entry_points(sn_emit_t *e, const char *source_name)
+{
+    sn_program_t *prog = e->prog;
+
+    fprintf(e->out, "static sn_error_t sn_c_top_level(sn_value_t *ret)\n{\n");
+    sn_emit_body(e, prog->expr.child_head, 0, 0);
+    fprintf(e->out, "}\n\n");
+
+    fprintf(e->out,
+            "// there is no collector for the C stack, so boxed integers are only\n"
+            "// freed when the run ends\n"
+            "sn_error_t sn_compiled_run_main(sn_value_t *arg, sn_value_t *value_out)\n"
+            "{\n"
+            "    sn_box_arena_t boxes;\n"
+            "    sn_box_arena_init(&boxes);\n"
+            "    sn_box_arena_t *prev_boxes = sn_box_arena_enter(&boxes);\n"
+            "    sn_vm_create(&sn_c_vm);\n"
+            "    sn_value_t main_arg = arg != NULL ? *arg : sn_null;\n"
+            "    sn_value_t result = sn_null;\n"
+            "    memcpy(sn_c_globals, sn_c_globals_init, sizeof sn_c_globals);\n"
+            "    sn_error_t status = sn_c_top_level(&result);\n"
+            "    if (status == SN_SUCCESS) {\n"
+            "        status = sn_c_fn_%d(&result, &main_arg);\n"
+            "    }\n"
+            "    sn_value_export(value_out, status == SN_SUCCESS ? result : sn_null);\n"
+            "    sn_vm_destroy(sn_c_vm);\n"
+            "    sn_box_arena_leave(prev_boxes);\n"
+            "    sn_box_arena_deinit(&boxes);\n"
+            "    return status;\n"
+            "}\n\n",
+            prog->main_ref.index);
+
+    fprintf(e->out,
+            "void sn_compiled_error_pos(int *line_out, int *col_out)\n"
+            "{\n"
+            "    *line_out = sn_c_error_line;\n"
+            "    *col_out = sn_c_error_col;\n"
+            "}\n\n"
+            "void sn_compiled_error_symbol(const char **symbol_out)\n"
+            "{\n"
+            "    *symbol_out = sn_c_error_sym;\n"
+            "}\n\n");
+
+    fprintf(e->out,
+            "#ifdef SN_COMPILED_MAIN\n"
+            "int main(int argc, char **argv)\n"
+            "{\n"
+            "    sn_value_t *arg = sn_value_create();\n"
+            "    sn_value_t *value = sn_value_create();\n"
+            "    sn_value_set_integer(arg, argc == 2 ? atoi(argv[1]) : 0);\n"
+            "    sn_error_t status = sn_compiled_run_main(arg, value);\n"
+            "    if (status != SN_SUCCESS) {\n"
+            "        fprintf(stderr, \"%%s:%%d:%%d %%s%%s%%s\\n\", ");
+    sn_emit_c_string(e->out, source_name);
+    fprintf(e->out,
+            ",\n"
+            "                sn_c_error_line, sn_c_error_col, sn_error_str(status),\n"
+            "                sn_c_error_sym == NULL ? \"\" : \": \",\n"
+            "                sn_c_error_sym == NULL ? \"\" : sn_c_error_sym);\n"
+            "        exit(-1);\n"
+            "    }\n"
+            "    sn_value_destroy(arg);\n"
+            "    sn_value_destroy(value);\n"
+            "    return 0;\n"
+            "}\n"
+            "#endif\n");
+}
+
+sn_error_t sn_program_emit_c(sn_program_t *prog, const char *source_name, FILE *out)
+{
+    if (prog->main_ref.type != SN_SCOPE_TYPE_GLOBAL) {
+        return SN_ERROR_MAIN_FN_MISSING;
+    }
+
+    // the bodies of a lazily built program are all emitted
+    sn_error_t status = sn_program_build_all(prog);
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+
+    sn_emit_t e = {0};
+    e.out = out;
+    e.prog = prog;
+
+    // the typing state of functions is shared with the jit of running vms
+    pthread_mutex_lock(&prog->jit_lock);
+    for (sn_const_t *c = prog->globals.head_const; c != NULL; c = c->next) {
+        if (SN_VALUE_IS_USER_FN(c->value)) {
+            sn_jit_type(SN_VALUE_USER_FN(c->value));
+        }
+    }
+
+    fprintf(out, "// generated from ");
+    sn_emit_c_string(out, source_name);
+    fprintf(out, " by snscript --emit-c, link with the snscript sources\n");
+    fputs(sn_emit_prelude, out);
+    sn_emit_globals(&e);
+
+    for (sn_const_t *c = prog->globals.head_const; c != NULL; c = c->next) {
+        if (SN_VALUE_IS_USER_FN(c->value)) {
+            sn_emit_prototypes(&e, SN_VALUE_USER_FN(c->value), c->idx);
+        }
+    }
+    fprintf(out,
+            "static inline sn_error_t sn_c_check_call(const sn_value_t *fn, int arg_count, int line, int col,\n"
+            "                                         int fn_line, int fn_col, const char *fn_sym);\n"
+            "static inline sn_error_t sn_c_call(sn_value_t *ret, const sn_value_t *fn, int arg_count,\n"
+            "                                   const sn_value_t *args, int line, int col);\n\n");
+
+    for (sn_const_t *c = prog->globals.head_const; c != NULL; c = c->next) {
+        if (SN_VALUE_IS_USER_FN(c->value)) {
+            sn_emit_func(&e, SN_VALUE_USER_FN(c->value), c->idx);
+        }
+    }
+
+    sn_emit_dispatch(&e);
+    sn_emit_entry_points(&e, source_name);
+    pthread_mutex_unlock(&prog->jit_lock);
+
+    return ferror(out) ? SN_ERROR_GENERIC : SN_SUCCESS;
+}
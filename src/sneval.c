@@ -1,11 +1,39 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "snscript_internal.h"
 
 #define SN_STACK_FRAME_COUNT 1024
 #define SN_STACK_VALUE_COUNT 65536
 
+// runtime errors are recorded in the vm, since the program is shared
+sn_error_t sn_stack_error(sn_stack_t *stack, sn_expr_t *expr, sn_error_t error)
+{
+    assert(error != SN_SUCCESS);
+
+    sn_vm_t *vm = stack->vm;
+    vm->error_line = expr->line;
+    vm->error_col = expr->col;
+    vm->error_sym = expr->type == SN_EXPR_TYPE_SYMBOL ? expr->sym : NULL;
+    return error;
+}
+
+// builds the body of a function of a lazily built program; its error is
+// recorded in the vm like a runtime one
+sn_error_t sn_stack_build_func(sn_stack_t *stack, sn_func_t *func)
+{
+    sn_error_t status = sn_func_ensure_built(func);
+    if (status != SN_SUCCESS) {
+        sn_vm_t *vm = stack->vm;
+        vm->error_line = func->build_error.line;
+        vm->error_col = func->build_error.col;
+        vm->error_sym = func->build_error.sym;
+    }
+
+    return status;
+}
+
 int sn_stack_alloc_values(sn_stack_t *stack, int count)
 {
     if (stack->push_count == SN_STACK_VALUE_COUNT) {
@@ -14,6 +42,7 @@ int sn_stack_alloc_values(sn_stack_t *stack, int count)
 
     int start = stack->push_count;
     stack->push_count += count;
+    stack->high_water = SN_MAX(stack->high_water, stack->push_count);
     return start;
 }
 
@@ -32,14 +61,65 @@ void sn_stack_init(sn_stack_t *stack, sn_scope_t *globals)
 
     stack->globals = &stack->values[sn_stack_alloc_values(stack, globals->max_decl_count)];
     sn_scope_init_consts(globals, stack->globals);
+
+    sn_box_arena_init(&stack->boxes);
+
+    stack->fuel = INT64_MAX;
+    stack->steps_left = 0;
+    stack->deadline_ns = 0;
+    stack->suspend_when_exhausted = false;
+    stack->yielded = false;
+    stack->suspended = false;
+    stack->nested_calls = 0;
+    stack->futures = NULL;
+    stack->lend_depth = 0;
+}
+
+// waits for the futures spawned on stack at depth or deeper, and lets go of
+// them; they read the globals of the stack they were spawned on
+void sn_stack_join_futures(sn_stack_t *stack, int depth, sn_stack_t *helper)
+{
+    while (stack->futures != NULL && stack->futures->spawn_depth >= depth) {
+        sn_future_t *future = stack->futures;
+        stack->futures = future->next_spawned;
+        sn_pool_wait(stack, &future->job, helper);
+        sn_future_release(future);
+    }
 }
 
 void sn_stack_deinit(sn_stack_t *stack)
 {
+    sn_stack_join_futures(stack, 0, NULL);
+    sn_box_arena_deinit(&stack->boxes);
     free(stack->values);
     free(stack->frames);
 }
 
+// every live value is in a slot below push_count, since temporaries and the
+// destinations of frames are allocated on the stack
+void sn_stack_collect_boxes(sn_stack_t *stack)
+{
+    for (int i = 0; i < stack->push_count; i++) {
+        sn_box_arena_mark(&stack->boxes, stack->values[i]);
+    }
+
+    sn_box_arena_sweep(&stack->boxes);
+
+    // and the futures that are done no longer need to be kept
+    sn_future_t **link = &stack->futures;
+    while (*link != NULL) {
+        sn_future_t *future = *link;
+        if (sn_pool_is_done(&future->job)) {
+            *link = future->next_spawned;
+            sn_pool_wait(stack, &future->job, NULL);
+            sn_future_release(future);
+        }
+        else {
+            link = &future->next_spawned;
+        }
+    }
+}
+
 int sn_stack_alloc_locals(sn_stack_t *stack, sn_scope_t *locals)
 {
     return sn_stack_alloc_values(stack, locals->max_decl_count);
@@ -65,20 +145,82 @@ sn_error_t
 sn_stack_init_top(sn_stack_t *stack, sn_expr_t *expr, int locals_idx, sn_value_t *val_out)
 {
     sn_frame_t *f = sn_stack_top(stack);
-    memset(f, '\0', sizeof *f);
     f->expr = expr;
     f->locals_idx = locals_idx;
     f->base_push_count = stack->push_count;
+    f->cont_pos = 0;
     f->val_out = val_out;
     *val_out = sn_null;
     return SN_SUCCESS;
 }
 
+sn_value_t *sn_stack_lookup_ref_at(sn_stack_t *stack, int locals_idx, sn_ref_t *ref)
+{
+    assert(ref->type == SN_SCOPE_TYPE_GLOBAL || ref->type == SN_SCOPE_TYPE_LOCAL);
+
+    if (ref->type == SN_SCOPE_TYPE_GLOBAL) {
+        return &stack->globals[ref->index];
+    }
+    return &stack->values[locals_idx + ref->index];
+}
+
+sn_value_t *sn_stack_lookup_ref(sn_stack_t *stack, sn_ref_t *ref)
+{
+    if (ref->type == SN_SCOPE_TYPE_GLOBAL) {
+        return &stack->globals[ref->index];
+    }
+    return sn_stack_lookup_ref_at(stack, sn_stack_top(stack)->locals_idx, ref);
+}
+
+// evaluates literals, variables and pure builtin calls without pushing frames;
+// the builder bounds the recursion depth through expr->shallow_depth
+sn_error_t
+sn_stack_eval_shallow(sn_stack_t *stack, sn_expr_t *expr, int locals_idx, sn_value_t *val_out)
+{
+    assert(expr->shallow_depth > 0);
+
+    if (expr->rtype == SN_RTYPE_LITERAL) {
+        *val_out = expr->literal;
+        return SN_SUCCESS;
+    }
+
+    if (expr->rtype == SN_RTYPE_VAR) {
+        *val_out = *sn_stack_lookup_ref_at(stack, locals_idx, &expr->ref);
+        return SN_SUCCESS;
+    }
+
+    assert(expr->rtype == SN_RTYPE_CALL);
+
+    sn_value_t call_values[SN_EVAL_SHALLOW_MAX_ARGS + 1];
+    sn_value_t *value = call_values;
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        sn_error_t status = sn_stack_eval_shallow(stack, child, locals_idx, value++);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
+    }
+
+    assert(SN_VALUE_IS_BUILTIN_FN(call_values[0]));
+    sn_error_t status = SN_VALUE_BUILTIN_FN(call_values[0])->fn(stack->vm,
+                                                                val_out,
+                                                                expr->child_count - 1,
+                                                                call_values + 1);
+    if (status != SN_SUCCESS) {
+        return sn_stack_error(stack, expr, status);
+    }
+
+    return SN_SUCCESS;
+}
+
 sn_error_t
 sn_stack_push(sn_stack_t *stack, sn_expr_t *expr, sn_value_t *val_out)
 {
+    if (expr->shallow_depth > 0) {
+        return sn_stack_eval_shallow(stack, expr, sn_stack_top(stack)->locals_idx, val_out);
+    }
+
     if (stack->frame_top == 0) {
-        return sn_expr_error(expr, SN_ERROR_GENERIC);
+        return sn_stack_error(stack, expr, SN_ERROR_GENERIC);
     }
 
     int locals_idx = sn_stack_top(stack)->locals_idx;
@@ -100,31 +242,26 @@ sn_error_t sn_stack_pop(sn_stack_t *stack)
     return SN_SUCCESS;
 }
 
-sn_value_t *sn_stack_lookup_ref(sn_stack_t *stack, sn_ref_t *ref)
-{
-    assert(ref->type == SN_SCOPE_TYPE_GLOBAL || ref->type == SN_SCOPE_TYPE_LOCAL);
-
-    if (ref->type == SN_SCOPE_TYPE_GLOBAL) {
-        return &stack->globals[ref->index];
-    }
-    return &stack->values[sn_stack_top(stack)->locals_idx + ref->index];
-}
-
 sn_error_t sn_frame_check_call(sn_stack_t *stack, sn_frame_t *f, sn_value_t *fn)
 {
     int arg_count = f->expr->child_count - 1;
 
-    if (fn->type == SN_VALUE_TYPE_USER_FN) {
-        sn_func_t *func = fn->user_fn;
+    if (SN_VALUE_IS_USER_FN(*fn)) {
+        sn_func_t *func = SN_VALUE_USER_FN(*fn);
         if (arg_count != func->param_count) {
-            return sn_expr_error(f->expr, SN_ERROR_WRONG_ARG_COUNT_IN_CALL);
+            return sn_stack_error(stack, f->expr, SN_ERROR_WRONG_ARG_COUNT_IN_CALL);
+        }
+
+        sn_error_t status = sn_stack_build_func(stack, func);
+        if (status != SN_SUCCESS) {
+            return status;
         }
 
         // TODO: check for overflow
-        stack->push_count += func->scope.max_decl_count - func->param_count;
+        sn_stack_alloc_values(stack, func->scope.max_decl_count - func->param_count);
     }
-    else if (fn->type != SN_VALUE_TYPE_BUILTIN_FN) {
-        return sn_expr_error(f->expr->child_head, SN_ERROR_CALLEE_NOT_A_FN);
+    else if (!SN_VALUE_IS_BUILTIN_FN(*fn)) {
+        return sn_stack_error(stack, f->expr->child_head, SN_ERROR_CALLEE_NOT_A_FN);
     }
 
     return SN_SUCCESS;
@@ -140,24 +277,132 @@ sn_stack_eval_call_body(sn_stack_t *stack,
     int body_idx = f->cont_pos++ - call_value_count;
     sn_value_t *fn = &call_values[0];
 
-    if (fn->type == SN_VALUE_TYPE_USER_FN) {
-        sn_func_t *func = fn->user_fn;
+    if (SN_VALUE_IS_USER_FN(*fn)) {
+        sn_func_t *func = SN_VALUE_USER_FN(*fn);
         if (body_idx < func->body_count) {
             return sn_stack_push(stack, &func->body[body_idx], f->val_out);
         }
     }
     else {
-        status = fn->builtin_fn->fn(f->val_out,
-                                    call_value_count - 1,
-                                    call_values + 1);
+        status = SN_VALUE_BUILTIN_FN(*fn)->fn(stack->vm,
+                                              f->val_out,
+                                              call_value_count - 1,
+                                              call_values + 1);
         if (status != SN_SUCCESS) {
-            return sn_expr_error(f->expr, status);
+            return sn_stack_error(stack, f->expr, status);
         }
     }
 
     return sn_stack_pop(stack);
 }
 
+// an argument of a call that is evaluated on its own, see sn_expr_set_fork_args()
+typedef struct sn_fork_arg_st
+{
+    sn_value_t fn;
+    int arg_count;
+    sn_value_t *args;
+
+    // boxed integers are moved to value_int, since their boxes belong to the
+    // arena of the worker
+    sn_value_t value;
+    int64_t value_int;
+    sn_error_t status;
+    int error_line;
+    int error_col;
+    sn_symbol_t *error_sym;
+} sn_fork_arg_t;
+
+void sn_fork_arg_fail(sn_fork_arg_t *arg, sn_vm_t *vm, sn_error_t status)
+{
+    arg->status = status;
+    arg->error_line = vm->error_line;
+    arg->error_col = vm->error_col;
+    arg->error_sym = vm->error_sym;
+}
+
+sn_error_t sn_fork_arg_block(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_fork_arg_t *arg = ((sn_fork_arg_t **)data)[block];
+    int push_count = stack->push_count;
+    sn_value_t *value = &stack->values[sn_stack_alloc_values(stack, 1)];
+
+    sn_error_t status = sn_stack_call(stack, arg->fn, arg->arg_count, arg->args, value);
+    if (status != SN_SUCCESS) {
+        sn_fork_arg_fail(arg, stack->vm, status);
+    }
+    else if (SN_VALUE_IS_INT(*value) && !SN_VALUE_IS_SMALL_INT(*value)) {
+        arg->value_int = SN_VALUE_INT(*value);
+        arg->value.bits = SN_VALUE_BITS_INVALID;
+    }
+    else {
+        arg->value = *value;
+    }
+
+    stack->push_count = push_count;
+    return status;
+}
+
+// evaluates all arguments of the call in f: the shallow ones here, then the
+// forked calls on the pool. The error reported is the one of the first
+// argument that fails, as if they were evaluated in order, and no call is
+// started after an argument that fails to evaluate here.
+sn_error_t sn_stack_fork_args(sn_stack_t *stack, sn_frame_t *f, sn_value_t *call_values)
+{
+    sn_fork_arg_t args[SN_FORK_MAX_CHILDREN] = {{{0}}};
+    sn_fork_arg_t *forks[SN_FORK_MAX_CHILDREN];
+    int fork_count = 0;
+    int push_count = stack->push_count;
+    int pos = 1;
+
+    for (sn_expr_t *child = f->expr->child_head->next; child != NULL; child = child->next, pos++) {
+        sn_fork_arg_t *arg = &args[pos];
+        if ((f->expr->fork_args & (1u << pos)) == 0) {
+            arg->status = sn_stack_eval_shallow(stack, child, f->locals_idx, &call_values[pos]);
+        }
+        else {
+            sn_value_t *inputs = &stack->values[sn_stack_alloc_values(stack, child->child_count)];
+            sn_value_t *input = inputs;
+            for (sn_expr_t *c = child->child_head; c != NULL && arg->status == SN_SUCCESS; c = c->next) {
+                arg->status = sn_stack_eval_shallow(stack, c, f->locals_idx, input++);
+            }
+            arg->fn = inputs[0];
+            arg->arg_count = child->child_count - 1;
+            arg->args = inputs + 1;
+            call_values[pos] = sn_null;
+        }
+
+        if (arg->status != SN_SUCCESS) {
+            sn_fork_arg_fail(arg, stack->vm, arg->status);
+            break;
+        }
+        if (f->expr->fork_args & (1u << pos)) {
+            forks[fork_count++] = arg;
+        }
+    }
+
+    sn_pool_run(stack, sn_fork_arg_block, forks, fork_count);
+    stack->push_count = push_count;
+
+    for (pos = 1; pos < f->expr->child_count; pos++) {
+        sn_fork_arg_t *arg = &args[pos];
+        if (arg->status != SN_SUCCESS) {
+            sn_vm_t *vm = stack->vm;
+            vm->error_line = arg->error_line;
+            vm->error_col = arg->error_col;
+            vm->error_sym = arg->error_sym;
+            return arg->status;
+        }
+
+        if (f->expr->fork_args & (1u << pos)) {
+            call_values[pos] = arg->value.bits == SN_VALUE_BITS_INVALID ? sn_make_int(arg->value_int)
+                                                                        : arg->value;
+        }
+    }
+
+    return SN_SUCCESS;
+}
+
 sn_error_t sn_stack_eval_call(sn_stack_t *stack)
 {
     sn_frame_t *f = sn_stack_top(stack);
@@ -168,7 +413,7 @@ sn_error_t sn_stack_eval_call(sn_stack_t *stack)
 
     if (f->cont_pos == 0) {
         // TODO: check for overflow
-        stack->push_count += call_value_count;
+        sn_stack_alloc_values(stack, call_value_count);
         f->cont_pos++;
         return sn_stack_push(stack, fn_expr, call_values);
     }
@@ -177,6 +422,14 @@ sn_error_t sn_stack_eval_call(sn_stack_t *stack)
         if (status != SN_SUCCESS) {
             return status;
         }
+
+        if (f->expr->fork_args != 0 && sn_pool_can_fork(f->expr->prog)) {
+            status = sn_stack_fork_args(stack, f, call_values);
+            if (status != SN_SUCCESS) {
+                return status;
+            }
+            f->cont_pos = call_value_count;
+        }
     }
 
     if (f->cont_pos > 0 && f->cont_pos < call_value_count) {
@@ -186,6 +439,16 @@ sn_error_t sn_stack_eval_call(sn_stack_t *stack)
         return sn_stack_push(stack, expr_value, arg_value);
     }
     else if (f->cont_pos == call_value_count) {
+        if (SN_VALUE_IS_USER_FN(call_values[0]) &&
+            sn_jit_call(f->expr->prog,
+                        stack,
+                        SN_VALUE_USER_FN(call_values[0]),
+                        call_value_count - 1,
+                        call_values + 1,
+                        f->val_out)) {
+            return sn_stack_pop(stack);
+        }
+
         f->locals_idx = f->base_push_count + 1;
     }
 
@@ -221,12 +484,12 @@ sn_error_t sn_stack_eval_if(sn_stack_t *stack)
         return sn_stack_push(stack, cond_expr, cond);
     }
     else if (f->cont_pos == 1) {
-        if (cond->type != SN_VALUE_TYPE_BOOLEAN) {
-            return sn_expr_error(cond_expr, SN_ERROR_WRONG_VALUE_TYPE);
+        if (!SN_VALUE_IS_BOOL(*cond)) {
+            return sn_stack_error(stack, cond_expr, SN_ERROR_WRONG_VALUE_TYPE);
         }
 
         f->cont_pos++;
-        if (cond->i) {
+        if (SN_VALUE_BOOL(*cond)) {
             return sn_stack_push(stack, true_arm, f->val_out);
         }
 
@@ -265,18 +528,17 @@ sn_error_t sn_stack_eval_andor(sn_stack_t *stack)
     sn_value_t *val = f->val_out;
 
     if (f->cont_pos == 0) {
-        val->type = SN_VALUE_TYPE_BOOLEAN;
-        val->i = sn_frame_andor_default_value(f);
+        *val = sn_make_bool(sn_frame_andor_default_value(f));
         f->cont_pos = 1;
     }
 
     sn_expr_t *child = &f->expr->child_head[f->cont_pos];
 
-    if (val->type != SN_VALUE_TYPE_BOOLEAN) {
-        return sn_expr_error(child - 1, SN_ERROR_WRONG_VALUE_TYPE);
+    if (!SN_VALUE_IS_BOOL(*val)) {
+        return sn_stack_error(stack, child - 1, SN_ERROR_WRONG_VALUE_TYPE);
     }
 
-    if (val->i != sn_frame_andor_default_value(f) || f->cont_pos == f->expr->child_count) {
+    if (SN_VALUE_BOOL(*val) != sn_frame_andor_default_value(f) || f->cont_pos == f->expr->child_count) {
         return sn_stack_pop(stack);
     }
 
@@ -300,11 +562,11 @@ sn_error_t sn_stack_eval_while(sn_stack_t *stack)
         return sn_stack_push(stack, cond_expr, cond);
     }
 
-    if (cond->type != SN_VALUE_TYPE_BOOLEAN) {
-        return sn_expr_error(cond_expr, SN_ERROR_WRONG_VALUE_TYPE);
+    if (!SN_VALUE_IS_BOOL(*cond)) {
+        return sn_stack_error(stack, cond_expr, SN_ERROR_WRONG_VALUE_TYPE);
     }
 
-    if (!cond->i) {
+    if (!SN_VALUE_BOOL(*cond)) {
         return sn_stack_pop(stack);
     }
 
@@ -321,8 +583,7 @@ sn_error_t sn_stack_dispatch(sn_stack_t *stack)
     sn_frame_t *f = sn_stack_top(stack);
     switch (f->expr->rtype) {
         case SN_RTYPE_LITERAL:
-            f->val_out->type = SN_VALUE_TYPE_INTEGER;
-            f->val_out->i = f->expr->vint;
+            *f->val_out = f->expr->literal;
             return sn_stack_pop(stack);
 
         case SN_RTYPE_VAR:
@@ -363,16 +624,96 @@ sn_error_t sn_stack_dispatch(sn_stack_t *stack)
     return SN_ERROR_GENERIC;
 }
 
+int64_t sn_clock_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sn_stack_set_limits(sn_stack_t *stack, const sn_run_limits_t *limits)
+{
+    stack->steps_left = limits->max_steps > 0 ? limits->max_steps : INT64_MAX;
+    stack->deadline_ns = limits->timeout_ns > 0 ? sn_clock_now_ns() + limits->timeout_ns : 0;
+    stack->fuel = 0;
+}
+
+// called when the fuel runs out, hands out the next slice of the budget or
+// suspends the run
+sn_error_t sn_stack_refuel(sn_stack_t *stack)
+{
+    bool exhausted = stack->steps_left == 0;
+    if (!exhausted && stack->deadline_ns != 0) {
+        exhausted = sn_clock_now_ns() >= stack->deadline_ns;
+    }
+
+    if (stack->suspend_when_exhausted && (exhausted || stack->yielded)) {
+        stack->yielded = false;
+        if (stack->nested_calls == 0) {
+            stack->suspended = true;
+            return SN_SUCCESS;
+        }
+
+        // a run can't be suspended in the middle of a builtin, so the calls
+        // made by builtins carry on past the end of the slice
+        stack->fuel = SN_CLOCK_CHECK_STEPS;
+        return SN_SUCCESS;
+    }
+
+    stack->yielded = false;
+    if (exhausted) {
+        return sn_stack_error(stack, sn_stack_top(stack)->expr, SN_ERROR_BUDGET_EXHAUSTED);
+    }
+
+    int64_t fuel = stack->steps_left;
+    if (stack->deadline_ns != 0) {
+        fuel = fuel < SN_CLOCK_CHECK_STEPS ? fuel : SN_CLOCK_CHECK_STEPS;
+    }
+
+    stack->steps_left -= fuel;
+    stack->fuel = fuel;
+    return SN_SUCCESS;
+}
+
+// gives the unused fuel back, so that the next step refuels
+void sn_stack_yield(sn_stack_t *stack)
+{
+    stack->steps_left += stack->fuel;
+    stack->fuel = 0;
+    stack->yielded = true;
+}
+
 sn_error_t
-sn_eval_expr_with_stack(sn_expr_t *expr,
-                        sn_stack_t *stack,
-                        int locals_idx,
-                        sn_value_t *val_out)
+sn_stack_start(sn_stack_t *stack, sn_expr_t *expr, int locals_idx, sn_value_t *val_out)
 {
+    if (expr->shallow_depth > 0) {
+        return sn_stack_eval_shallow(stack, expr, locals_idx, val_out);
+    }
+
     stack->frame_top--;
-    sn_stack_init_top(stack, expr, locals_idx, val_out);
+    return sn_stack_init_top(stack, expr, locals_idx, val_out);
+}
+
+// steps until the frames above frame_top have returned, or until the run is
+// suspended
+sn_error_t sn_stack_run_to(sn_stack_t *stack, int frame_top)
+{
+    while (stack->frame_top < frame_top) {
+        if (stack->boxes.alloc_count >= stack->boxes.gc_threshold) {
+            sn_stack_collect_boxes(stack);
+        }
+
+        if (stack->fuel == 0) {
+            sn_error_t status = sn_stack_refuel(stack);
+            if (status != SN_SUCCESS) {
+                return status;
+            }
+            if (stack->suspended) {
+                return SN_SUCCESS;
+            }
+        }
+        stack->fuel--;
 
-    while (!sn_stack_is_empty(stack)) {
         sn_error_t status = sn_stack_dispatch(stack);
         if (status != SN_SUCCESS) {
             return status;
@@ -382,56 +723,444 @@ sn_eval_expr_with_stack(sn_expr_t *expr,
     return SN_SUCCESS;
 }
 
+sn_error_t sn_stack_run(sn_stack_t *stack)
+{
+    return sn_stack_run_to(stack, SN_STACK_FRAME_COUNT);
+}
+
+// calls fn on top of whatever the stack is running, for builtins that call
+// back into the script; val_out should be a slot on the stack
 sn_error_t
-sn_eval_expr_list_with_stack(sn_expr_t *expr_head,
-                             sn_stack_t *stack,
-                             int locals_idx,
-                             sn_value_t *val_out)
+sn_stack_call(sn_stack_t *stack, sn_value_t fn, int arg_count, const sn_value_t *args, sn_value_t *val_out)
+{
+    if (SN_VALUE_IS_BUILTIN_FN(fn)) {
+        return SN_VALUE_BUILTIN_FN(fn)->fn(stack->vm, val_out, arg_count, args);
+    }
+
+    if (!SN_VALUE_IS_USER_FN(fn)) {
+        return SN_ERROR_CALLEE_NOT_A_FN;
+    }
+
+    sn_func_t *func = SN_VALUE_USER_FN(fn);
+    if (arg_count != func->param_count) {
+        return SN_ERROR_WRONG_ARG_COUNT_IN_CALL;
+    }
+
+    sn_error_t build_status = sn_stack_build_func(stack, func);
+    if (build_status != SN_SUCCESS) {
+        return build_status;
+    }
+
+    if (sn_jit_call(stack->vm->prog, stack, func, arg_count, args, val_out)) {
+        return SN_SUCCESS;
+    }
+
+    int push_count = stack->push_count;
+    int frame_top = stack->frame_top;
+    int locals_idx = sn_stack_alloc_locals(stack, &func->scope);
+    memcpy(&stack->values[locals_idx], args, arg_count * sizeof args[0]);
+
+    sn_error_t status = SN_SUCCESS;
+    stack->nested_calls++;
+    for (sn_expr_t *expr = func->body; expr != NULL && status == SN_SUCCESS; expr = expr->next) {
+        status = sn_stack_start(stack, expr, locals_idx, val_out);
+        if (status == SN_SUCCESS) {
+            status = sn_stack_run_to(stack, frame_top);
+        }
+    }
+    stack->nested_calls--;
+
+    stack->push_count = push_count;
+    stack->frame_top = frame_top;
+    return status;
+}
+
+// readies the stack of a pool worker for a task of a job started by another
+// vm, whose globals it reads
+void sn_stack_lend(sn_stack_t *stack, sn_value_t *globals, int64_t max_steps, int64_t deadline_ns)
+{
+    // slots left over from earlier jobs may refer to boxes that are gone,
+    // and a collection would mark them
+    int base = stack->push_count;
+    if (stack->high_water > base) {
+        memset(&stack->values[base], '\0', (stack->high_water - base) * sizeof stack->values[0]);
+        stack->high_water = base;
+    }
+
+    stack->globals = globals;
+    stack->steps_left = max_steps;
+    stack->deadline_ns = deadline_ns;
+    stack->fuel = 0;
+}
+
+sn_error_t sn_vm_create(sn_vm_t **vm_out)
 {
-    for (sn_expr_t *expr = expr_head; expr != NULL; expr = expr->next) {
-        sn_error_t status = sn_eval_expr_with_stack(expr, stack, locals_idx, val_out);
+    sn_vm_t *vm = calloc(1, sizeof *vm);
+    vm->state = SN_VM_DONE;
+    vm->status = SN_ERROR_GENERIC;
+    vm->arg = sn_value_create();
+    *vm_out = vm;
+    return SN_SUCCESS;
+}
+
+void sn_vm_destroy(sn_vm_t *vm)
+{
+    if (vm == NULL) {
+        return;
+    }
+
+    sn_vm_flush_output(vm);
+    if (vm->prog != NULL) {
+        sn_stack_deinit(&vm->stack);
+    }
+    sn_value_destroy(vm->arg);
+    free(vm->out_buf);
+    free(vm);
+}
+
+// a vm that only serves calls made with sn_stack_call()
+void sn_vm_init_worker(sn_vm_t *vm, sn_program_t *prog)
+{
+    sn_stack_init(&vm->stack, &prog->globals);
+    vm->stack.vm = vm;
+    vm->prog = prog;
+    vm->state = SN_VM_RUNNING;
+    vm->status = SN_SUCCESS;
+    vm->write = prog->options.write;
+    vm->write_ctx = prog->options.write_ctx;
+}
+
+sn_error_t sn_vm_start(sn_vm_t *vm, sn_program_t *prog, sn_value_t *arg)
+{
+    if (prog->main_ref.type != SN_SCOPE_TYPE_GLOBAL) {
+        return SN_ERROR_MAIN_FN_MISSING;
+    }
+
+    if (vm->prog != NULL) {
+        sn_stack_deinit(&vm->stack);
+    }
+
+    sn_stack_t *stack = &vm->stack;
+    sn_stack_init(stack, &prog->globals);
+    stack->vm = vm;
+
+    // output left from a run of another program goes where that one's did
+    sn_vm_flush_output(vm);
+    vm->write = prog->options.write;
+    vm->write_ctx = prog->options.write_ctx;
+
+    vm->prog = prog;
+    vm->state = SN_VM_RUNNING;
+    vm->status = SN_SUCCESS;
+    vm->cursor = prog->expr.child_head;
+    vm->in_main = false;
+    vm->locals_idx = -1;
+
+    // the result lives on the stack so that its box stays reachable
+    vm->result = &stack->values[sn_stack_alloc_values(stack, 1)];
+    *vm->result = sn_null;
+
+    // the argument is copied, so the caller's value may go away
+    sn_value_export(vm->arg, arg != NULL ? *arg : sn_null);
+    return SN_SUCCESS;
+}
+
+// starts the next top level form, or the next expression of main
+sn_error_t sn_vm_next(sn_vm_t *vm)
+{
+    sn_stack_t *stack = &vm->stack;
+
+    if (vm->cursor == NULL && !vm->in_main && vm->stop_at_main) {
+        vm->state = SN_VM_DONE;
+        return SN_SUCCESS;
+    }
+
+    if (vm->cursor == NULL && !vm->in_main) {
+        sn_value_t *main_val = sn_stack_lookup_ref(stack, &vm->prog->main_ref);
+        assert(SN_VALUE_IS_USER_FN(*main_val));
+        sn_func_t *func = SN_VALUE_USER_FN(*main_val);
+        sn_error_t status = sn_stack_build_func(stack, func);
         if (status != SN_SUCCESS) {
             return status;
         }
+
+        vm->locals_idx = sn_stack_alloc_locals(stack, &func->scope);
+        if (func->param_count == 1) {
+            stack->values[vm->locals_idx] = *vm->arg;
+        }
+
+        vm->cursor = func->body;
+        vm->in_main = true;
+    }
+
+    if (vm->cursor == NULL) {
+        vm->state = SN_VM_DONE;
+        return SN_SUCCESS;
+    }
+
+    sn_expr_t *expr = vm->cursor;
+    vm->cursor = expr->next;
+    return sn_stack_start(stack, expr, vm->locals_idx, vm->result);
+}
+
+sn_vm_state_t sn_vm_run(sn_vm_t *vm)
+{
+    sn_stack_t *stack = &vm->stack;
+    sn_box_arena_t *prev_boxes = sn_box_arena_enter(&stack->boxes);
+
+    while (vm->state == SN_VM_RUNNING) {
+        sn_error_t status = sn_stack_run(stack);
+
+        // a yield in the last step of a form takes effect before the next one
+        if (status == SN_SUCCESS && stack->yielded && stack->suspend_when_exhausted) {
+            status = sn_stack_refuel(stack);
+        }
+
+        if (status == SN_SUCCESS && stack->suspended) {
+            stack->suspended = false;
+            break;
+        }
+
+        if (status == SN_SUCCESS) {
+            status = sn_vm_next(vm);
+        }
+
+        if (status != SN_SUCCESS) {
+            vm->state = SN_VM_ERROR;
+            vm->status = status;
+        }
+    }
+
+    if (vm->state != SN_VM_RUNNING) {
+        sn_stack_join_futures(stack, 0, stack);
+    }
+
+    // a vm running a batch keeps its output until its buffer fills or it is
+    // destroyed, so that the records don't each take the lock of the writer
+    if (vm->batch_globals == NULL) {
+        sn_vm_flush_output(vm);
+    }
+
+    sn_box_arena_leave(prev_boxes);
+    return vm->state;
+}
+
+sn_vm_state_t sn_vm_resume(sn_vm_t *vm, int64_t max_steps)
+{
+    if (vm->state != SN_VM_RUNNING) {
+        return vm->state;
+    }
+
+    sn_stack_t *stack = &vm->stack;
+    stack->steps_left = max_steps > 0 ? max_steps : INT64_MAX;
+    stack->deadline_ns = 0;
+    stack->fuel = 0;
+    stack->suspend_when_exhausted = true;
+
+    return sn_vm_run(vm);
+}
+
+void sn_vm_error_pos(sn_vm_t *vm, int *line_out, int *col_out)
+{
+    *line_out = vm->error_line;
+    *col_out = vm->error_col;
+}
+
+void sn_vm_error_symbol(sn_vm_t *vm, const char **symbol_out)
+{
+    *symbol_out = (vm->error_sym == NULL) ? NULL : vm->error_sym->value;
+}
+
+sn_error_t sn_vm_result(sn_vm_t *vm, sn_value_t *value_out)
+{
+    if (vm->state != SN_VM_DONE || vm->prog == NULL) {
+        sn_value_export(value_out, sn_null);
+        return vm->state == SN_VM_ERROR ? vm->status : SN_ERROR_GENERIC;
     }
 
+    sn_value_export(value_out, *vm->result);
     return SN_SUCCESS;
 }
 
+void sn_run_limits_init(sn_run_limits_t *limits)
+{
+    memset(limits, '\0', sizeof *limits);
+}
+
 sn_error_t sn_program_run_main(sn_program_t *prog, sn_value_t *arg, sn_value_t *value_out)
 {
-    *value_out = sn_null;
-    sn_error_t status = SN_SUCCESS;
-    sn_stack_t stack = {0};
-    sn_stack_init(&stack, &prog->globals);
+    return sn_program_run_main_limited(prog, arg, value_out, NULL);
+}
 
-    status = sn_eval_expr_list_with_stack(prog->expr.child_head, &stack, -1, value_out);
+sn_error_t sn_program_run_main_limited(sn_program_t *prog,
+                                       sn_value_t *arg,
+                                       sn_value_t *value_out,
+                                       const sn_run_limits_t *limits)
+{
+    sn_vm_t *vm = NULL;
+    sn_vm_create(&vm);
+
+    sn_error_t status = sn_vm_start(vm, prog, arg);
     if (status != SN_SUCCESS) {
+        sn_vm_destroy(vm);
+        sn_value_export(value_out, sn_null);
         return status;
     }
 
-    assert(prog->main_ref.type == SN_SCOPE_TYPE_GLOBAL);
+    if (limits != NULL) {
+        sn_stack_set_limits(&vm->stack, limits);
+    }
 
-    sn_value_t *main_val = sn_stack_lookup_ref(&stack, &prog->main_ref);
-    assert(main_val->type == SN_VALUE_TYPE_USER_FN);
-    sn_func_t *func = main_val->user_fn;
+    if (sn_vm_run(vm) == SN_VM_ERROR) {
+        prog->error_line = vm->error_line;
+        prog->error_col = vm->error_col;
+        prog->error_sym = vm->error_sym;
+    }
 
-    int locals_idx = sn_stack_alloc_locals(&stack, &func->scope);
-    if (func->param_count == 1) {
-        sn_value_t *locals = &stack.values[locals_idx];
-        if (arg != NULL) {
-            locals[0] = *arg;
-        }
-        else {
-            locals[0] = sn_null;
-        }
+    status = sn_vm_result(vm, value_out);
+    sn_vm_destroy(vm);
+    return status;
+}
+
+void sn_stack_reset_limits(sn_stack_t *stack, const sn_run_limits_t *limits)
+{
+    if (limits != NULL) {
+        sn_stack_set_limits(stack, limits);
     }
+    else {
+        stack->fuel = INT64_MAX;
+        stack->steps_left = 0;
+        stack->deadline_ns = 0;
+    }
+}
 
-    status = sn_eval_expr_list_with_stack(func->body, &stack, locals_idx, value_out);
+// runs the top level forms, and keeps the globals they leave on the stack
+sn_error_t sn_vm_start_batch(sn_vm_t *vm, sn_program_t *prog, const sn_run_limits_t *limits)
+{
+    sn_error_t status = sn_vm_start(vm, prog, NULL);
     if (status != SN_SUCCESS) {
         return status;
     }
 
-    sn_stack_deinit(&stack);
+    sn_stack_t *stack = &vm->stack;
+    sn_stack_reset_limits(stack, limits);
+    vm->stop_at_main = true;
+    if (sn_vm_run(vm) == SN_VM_ERROR) {
+        return vm->status;
+    }
+
+    int count = prog->globals.max_decl_count;
+    vm->batch_globals = &stack->values[sn_stack_alloc_values(stack, count)];
+    memcpy(vm->batch_globals, stack->globals, count * sizeof stack->globals[0]);
+    vm->batch_push_count = stack->push_count;
     return SN_SUCCESS;
 }
+
+// runs main on a vm started with sn_vm_start_batch()
+sn_error_t
+sn_vm_run_record(sn_vm_t *vm, sn_value_t *arg, sn_value_t *value_out, const sn_run_limits_t *limits)
+{
+    sn_stack_t *stack = &vm->stack;
+    memcpy(stack->globals, vm->batch_globals, vm->prog->globals.max_decl_count * sizeof stack->globals[0]);
+
+    // a run that failed leaves its frames behind
+    stack->push_count = vm->batch_push_count;
+    stack->frame_top = SN_STACK_FRAME_COUNT;
+    stack->yielded = false;
+    stack->suspended = false;
+    sn_stack_reset_limits(stack, limits);
+
+    vm->state = SN_VM_RUNNING;
+    vm->status = SN_SUCCESS;
+    vm->cursor = NULL;
+    vm->in_main = false;
+    vm->stop_at_main = false;
+    *vm->result = sn_null;
+    sn_value_export(vm->arg, arg != NULL ? *arg : sn_null);
+
+    sn_vm_run(vm);
+    return sn_vm_result(vm, value_out);
+}
+
+typedef struct sn_batch_st
+{
+    sn_program_t *prog;
+    size_t count;
+    sn_value_t *const *args;
+    sn_value_t *const *values_out;
+    sn_error_t *errors_out;
+    const sn_run_limits_t *limits;
+
+    // the first record no thread has taken
+    size_t next;
+} sn_batch_t;
+
+// each thread starts a vm of its own and takes chunks of records until none
+// are left; when the top level forms fail, every record gets their error
+sn_error_t sn_batch_run(sn_batch_t *b, sn_vm_t *vm)
+{
+    sn_error_t start_status = sn_vm_start_batch(vm, b->prog, b->limits);
+
+    while (true) {
+        size_t first = __atomic_fetch_add(&b->next, SN_BATCH_CHUNK_SIZE, __ATOMIC_RELAXED);
+        if (first >= b->count) {
+            break;
+        }
+
+        size_t last = SN_MIN(first + SN_BATCH_CHUNK_SIZE, b->count);
+        for (size_t i = first; i < last; i++) {
+            sn_error_t status = start_status;
+            if (status == SN_SUCCESS) {
+                status = sn_vm_run_record(vm, b->args[i], b->values_out[i], b->limits);
+            }
+            else {
+                sn_value_export(b->values_out[i], sn_null);
+            }
+
+            if (b->errors_out != NULL) {
+                b->errors_out[i] = status;
+            }
+        }
+    }
+
+    return start_status;
+}
+
+// a block of a batch is one of the threads that run it, with a vm of its
+// own; every one fails the same way when the top level forms do
+sn_error_t sn_batch_block(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_batch_t *b = data;
+    sn_vm_t *vm = NULL;
+    sn_vm_create(&vm);
+    sn_error_t status = sn_batch_run(b, vm);
+    if (status != SN_SUCCESS && block == 0) {
+        b->prog->error_line = vm->error_line;
+        b->prog->error_col = vm->error_col;
+        b->prog->error_sym = vm->error_sym;
+    }
+    sn_vm_destroy(vm);
+    return status;
+}
+
+sn_error_t sn_program_run_batch(sn_program_t *prog,
+                                size_t count,
+                                sn_value_t *const *args,
+                                sn_value_t *const *values_out,
+                                sn_error_t *errors_out,
+                                const sn_run_limits_t *limits)
+{
+    sn_batch_t b = {
+        .prog = prog,
+        .count = count,
+        .args = args,
+        .values_out = values_out,
+        .errors_out = errors_out,
+        .limits = limits,
+        .next = 0,
+    };
+
+    size_t chunk_count = (count + SN_BATCH_CHUNK_SIZE - 1) / SN_BATCH_CHUNK_SIZE;
+    size_t thread_count = SN_MIN((size_t)sn_pool_thread_count(prog), SN_MAX(chunk_count, 1));
+    return sn_pool_run_plain(prog, sn_batch_block, &b, thread_count);
+}
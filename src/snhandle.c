@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <sched.h>
+#include "snscript_internal.h"
+
+// a pin loads the program and takes a reference to it in a few steps, while
+// a thread publishing another may drop the one the handle held. Pins count
+// themselves in the counter of the epoch they started in, and publishing
+// moves on to the next epoch and waits for the pins of the one before to
+// finish, so a program isn't destroyed between being loaded and being
+// referenced. The runs that follow never hold up publishing.
+struct sn_program_handle_st
+{
+    sn_program_t *prog;
+    unsigned epoch;
+    int pinning[2];
+    pthread_mutex_t publish_lock;
+};
+
+void sn_program_unpin(sn_program_t *prog)
+{
+    if (__atomic_sub_fetch(&prog->pin_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        sn_program_destroy(prog);
+    }
+}
+
+sn_error_t sn_program_handle_create(sn_program_handle_t **handle_out, sn_program_t *prog)
+{
+    sn_program_handle_t *handle = calloc(1, sizeof *handle);
+    pthread_mutex_init(&handle->publish_lock, NULL);
+    prog->pin_count = 1;
+    handle->prog = prog;
+
+    *handle_out = handle;
+    return SN_SUCCESS;
+}
+
+void sn_program_handle_destroy(sn_program_handle_t *handle)
+{
+    if (handle == NULL) {
+        return;
+    }
+
+    sn_program_unpin(handle->prog);
+    pthread_mutex_destroy(&handle->publish_lock);
+    free(handle);
+}
+
+sn_program_t *sn_program_handle_pin(sn_program_handle_t *handle)
+{
+    // a pin that counted itself once the epoch moved on isn't waited for, so
+    // it counts itself again
+    unsigned epoch = __atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST);
+    int *pinning = &handle->pinning[epoch & 1];
+    __atomic_add_fetch(pinning, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST) != epoch) {
+        __atomic_sub_fetch(pinning, 1, __ATOMIC_SEQ_CST);
+        epoch = __atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST);
+        pinning = &handle->pinning[epoch & 1];
+        __atomic_add_fetch(pinning, 1, __ATOMIC_SEQ_CST);
+    }
+
+    sn_program_t *prog = __atomic_load_n(&handle->prog, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&prog->pin_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(pinning, 1, __ATOMIC_RELEASE);
+    return prog;
+}
+
+void sn_program_handle_publish(sn_program_handle_t *handle, sn_program_t *prog)
+{
+    prog->pin_count = 1;
+
+    pthread_mutex_lock(&handle->publish_lock);
+    sn_program_t *old = __atomic_exchange_n(&handle->prog, prog, __ATOMIC_SEQ_CST);
+    unsigned epoch = __atomic_fetch_add(&handle->epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&handle->pinning[epoch & 1], __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&handle->publish_lock);
+
+    sn_program_unpin(old);
+}
@@ -0,0 +1,787 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snscript_internal.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define SN_JIT_SUPPORTED 1
+#endif
+
+// Baseline JIT for pure functions over integers and booleans.
+//
+// A function can be compiled if its body is a single expression built from
+// integer literals, parameters, const globals, if, &&, ||, the arithmetic and
+// equality builtins and calls to other compilable pure functions. Every
+// expression then has a static type, so the only runtime guards are on the
+// arguments passed in by the interpreter and on const globals, whose values
+// are only known once the top level has run. A failed guard bails out of the
+// native code entirely and the call is re-run by the interpreter, which is
+// safe because pure functions have no side effects.
+
+typedef struct sn_jit_typer_st
+{
+    int touched_count;
+    int touched_cap;
+    sn_func_t **touched;
+} sn_jit_typer_t;
+
+sn_value_type_t sn_jit_type_expr(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr);
+
+sn_value_t *sn_jit_const_value(sn_expr_t *expr)
+{
+    if (expr->rtype != SN_RTYPE_VAR || expr->ref.type != SN_SCOPE_TYPE_GLOBAL) {
+        return NULL;
+    }
+
+    return sn_scope_get_const_value(&expr->prog->globals, &expr->ref);
+}
+
+void sn_jit_typer_touch(sn_jit_typer_t *t, sn_func_t *func)
+{
+    if (t->touched_count == t->touched_cap) {
+        t->touched_cap = SN_MAX(8, 2 * t->touched_cap);
+        t->touched = realloc(t->touched, t->touched_cap * sizeof t->touched[0]);
+    }
+
+    t->touched[t->touched_count++] = func;
+}
+
+sn_value_type_t sn_jit_type_func(sn_jit_typer_t *t, sn_func_t *func)
+{
+    switch (func->jit.state) {
+        case SN_JIT_STATE_TYPED:
+        case SN_JIT_STATE_COMPILED:
+            return func->jit.ret_type;
+
+        case SN_JIT_STATE_FAILED:
+            return SN_VALUE_TYPE_INVALID;
+
+        case SN_JIT_STATE_IN_PROGRESS:
+            // recursive call, assume the function returns an integer and
+            // check the assumption once the body has been typed
+            func->jit.uses_assumed_type = true;
+            return func->jit.ret_type;
+
+        case SN_JIT_STATE_UNKNOWN:
+            break;
+    }
+
+    if (!func->is_pure || func->body_count != 1 || func->param_count > SN_JIT_MAX_PARAMS ||
+        sn_func_ensure_built(func) != SN_SUCCESS) {
+        func->jit.state = SN_JIT_STATE_FAILED;
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    sn_jit_typer_touch(t, func);
+    func->jit.state = SN_JIT_STATE_IN_PROGRESS;
+    func->jit.ret_type = SN_VALUE_TYPE_INTEGER;
+    func->jit.uses_assumed_type = false;
+
+    sn_value_type_t type = sn_jit_type_expr(t, func, func->body);
+    if (type == SN_VALUE_TYPE_INVALID ||
+        (func->jit.uses_assumed_type && type != func->jit.ret_type)) {
+        func->jit.state = SN_JIT_STATE_FAILED;
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    func->jit.state = SN_JIT_STATE_TYPED;
+    func->jit.ret_type = type;
+    return type;
+}
+
+sn_value_type_t sn_jit_type_var(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr)
+{
+    if (expr->ref.type == SN_SCOPE_TYPE_LOCAL) {
+        return expr->ref.index < func->param_count ? SN_VALUE_TYPE_INTEGER : SN_VALUE_TYPE_INVALID;
+    }
+
+    sn_value_t *val = sn_jit_const_value(expr);
+    if (val != NULL) {
+        return SN_VALUE_IS_BOOL(*val) ? SN_VALUE_TYPE_BOOLEAN : SN_VALUE_TYPE_INVALID;
+    }
+
+    // the value of a user const is guarded when it is loaded
+    return expr->ref.is_const ? SN_VALUE_TYPE_INTEGER : SN_VALUE_TYPE_INVALID;
+}
+
+bool sn_jit_all_args_are(sn_value_type_t *types, int count, sn_value_type_t type)
+{
+    for (int i = 0; i < count; i++) {
+        if (types[i] != type) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+sn_value_type_t sn_jit_type_call(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr)
+{
+    sn_value_t *callee = sn_jit_const_value(expr->child_head);
+    int arg_count = expr->child_count - 1;
+    sn_value_type_t types[SN_JIT_MAX_PARAMS];
+
+    if (callee == NULL || arg_count > SN_JIT_MAX_PARAMS) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    for (int i = 0; i < arg_count; i++) {
+        types[i] = sn_jit_type_expr(t, func, &expr->child_head[i + 1]);
+        if (types[i] == SN_VALUE_TYPE_INVALID) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+    }
+
+    if (SN_VALUE_IS_USER_FN(*callee)) {
+        sn_func_t *callee_func = SN_VALUE_USER_FN(*callee);
+        if (arg_count != callee_func->param_count ||
+            !sn_jit_all_args_are(types, arg_count, SN_VALUE_TYPE_INTEGER)) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+        return sn_jit_type_func(t, callee_func);
+    }
+
+    if (!SN_VALUE_IS_BUILTIN_FN(*callee)) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    return sn_jit_type_builtin(SN_VALUE_BUILTIN_FN(*callee)->fn, types, arg_count);
+}
+
+// the type of a call to one of the arithmetic and equality builtins
+sn_value_type_t sn_jit_type_builtin(sn_builtin_fn_t fn, sn_value_type_t *types, int arg_count)
+{
+    bool ints = sn_jit_all_args_are(types, arg_count, SN_VALUE_TYPE_INTEGER);
+
+    if ((fn == sn_add || fn == sn_mul) && ints) {
+        return SN_VALUE_TYPE_INTEGER;
+    }
+    else if (fn == sn_sub && ints && (arg_count == 1 || arg_count == 2)) {
+        return SN_VALUE_TYPE_INTEGER;
+    }
+    else if ((fn == sn_div || fn == sn_mod) && ints && arg_count == 2) {
+        return SN_VALUE_TYPE_INTEGER;
+    }
+    else if ((fn == sn_equals || fn == sn_not_equals) && arg_count == 2 && types[0] == types[1]) {
+        return SN_VALUE_TYPE_BOOLEAN;
+    }
+    else if (fn == sn_not && arg_count == 1 && types[0] == SN_VALUE_TYPE_BOOLEAN) {
+        return SN_VALUE_TYPE_BOOLEAN;
+    }
+
+    return SN_VALUE_TYPE_INVALID;
+}
+
+sn_value_type_t sn_jit_type_if(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr)
+{
+    // an if without a false arm can evaluate to null
+    if (expr->child_count != 4 ||
+        sn_jit_type_expr(t, func, &expr->child_head[1]) != SN_VALUE_TYPE_BOOLEAN) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    sn_value_type_t type = sn_jit_type_expr(t, func, &expr->child_head[2]);
+    if (type != sn_jit_type_expr(t, func, &expr->child_head[3])) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    return type;
+}
+
+sn_value_type_t sn_jit_type_andor(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr)
+{
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        if (sn_jit_type_expr(t, func, child) != SN_VALUE_TYPE_BOOLEAN) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+    }
+
+    return SN_VALUE_TYPE_BOOLEAN;
+}
+
+sn_value_type_t sn_jit_type_expr(sn_jit_typer_t *t, sn_func_t *func, sn_expr_t *expr)
+{
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            return SN_VALUE_TYPE_INTEGER;
+
+        case SN_RTYPE_VAR:
+            return sn_jit_type_var(t, func, expr);
+
+        case SN_RTYPE_CALL:
+            return sn_jit_type_call(t, func, expr);
+
+        case SN_RTYPE_IF_EXPR:
+            return sn_jit_type_if(t, func, expr);
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            return sn_jit_type_andor(t, func, expr);
+
+        default:
+            break;
+    }
+
+    return SN_VALUE_TYPE_INVALID;
+}
+
+#ifdef SN_JIT_SUPPORTED
+
+typedef struct sn_jit_buf_st
+{
+    uint8_t *bytes;
+    size_t size;
+    size_t cap;
+
+    // positions of rel32 operands that jump to the bail out path
+    size_t *bails;
+    int bail_count;
+    int bail_cap;
+} sn_jit_buf_t;
+
+#define SN_JIT_EMIT(buf, ...) \
+    sn_jit_emit_bytes(buf, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+void sn_jit_expr_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr);
+
+void sn_jit_emit_bytes(sn_jit_buf_t *b, const uint8_t *bytes, size_t size)
+{
+    if (b->size + size > b->cap) {
+        b->cap = SN_MAX(256, 2 * (b->size + size));
+        b->bytes = realloc(b->bytes, b->cap);
+    }
+
+    memcpy(b->bytes + b->size, bytes, size);
+    b->size += size;
+}
+
+void sn_jit_emit32(sn_jit_buf_t *b, int32_t v)
+{
+    sn_jit_emit_bytes(b, (const uint8_t *)&v, sizeof v);
+}
+
+void sn_jit_emit64(sn_jit_buf_t *b, int64_t v)
+{
+    sn_jit_emit_bytes(b, (const uint8_t *)&v, sizeof v);
+}
+
+// emits a jump opcode and returns the position of its rel32 operand
+size_t sn_jit_emit_jump(sn_jit_buf_t *b, const uint8_t *opcode, size_t size)
+{
+    sn_jit_emit_bytes(b, opcode, size);
+    size_t pos = b->size;
+    sn_jit_emit32(b, 0);
+    return pos;
+}
+
+size_t sn_jit_emit_jmp(sn_jit_buf_t *b)
+{
+    return sn_jit_emit_jump(b, (const uint8_t[]){ 0xE9 }, 1);
+}
+
+size_t sn_jit_emit_jz(sn_jit_buf_t *b)
+{
+    return sn_jit_emit_jump(b, (const uint8_t[]){ 0x0F, 0x84 }, 2);
+}
+
+size_t sn_jit_emit_jnz(sn_jit_buf_t *b)
+{
+    return sn_jit_emit_jump(b, (const uint8_t[]){ 0x0F, 0x85 }, 2);
+}
+
+void sn_jit_patch(sn_jit_buf_t *b, size_t pos, size_t target)
+{
+    int32_t rel = (int32_t)(target - (pos + 4));
+    memcpy(b->bytes + pos, &rel, sizeof rel);
+}
+
+void sn_jit_patch_here(sn_jit_buf_t *b, size_t pos)
+{
+    sn_jit_patch(b, pos, b->size);
+}
+
+void sn_jit_add_bail(sn_jit_buf_t *b, size_t pos)
+{
+    if (b->bail_count == b->bail_cap) {
+        b->bail_cap = SN_MAX(8, 2 * b->bail_cap);
+        b->bails = realloc(b->bails, b->bail_cap * sizeof b->bails[0]);
+    }
+
+    b->bails[b->bail_count++] = pos;
+}
+
+void sn_jit_emit_mov_rax_imm(sn_jit_buf_t *b, int64_t v)
+{
+    // mov rax, imm64
+    SN_JIT_EMIT(b, 0x48, 0xB8);
+    sn_jit_emit64(b, v);
+}
+
+// evaluates the expression into rax and pushes it
+void sn_jit_expr_emit_push(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    sn_jit_expr_emit(b, func, expr);
+    SN_JIT_EMIT(b, 0x50);                               // push rax
+}
+
+// evaluates the expression into rcx, keeping rax from the previous operand
+void sn_jit_expr_emit_rhs(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    SN_JIT_EMIT(b, 0x50);                               // push rax
+    sn_jit_expr_emit(b, func, expr);
+    SN_JIT_EMIT(b, 0x48, 0x89, 0xC1);                   // mov rcx, rax
+    SN_JIT_EMIT(b, 0x58);                               // pop rax
+}
+
+void sn_jit_var_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    if (expr->ref.type == SN_SCOPE_TYPE_LOCAL) {
+        // mov rax, [rbx + 8 * index]
+        SN_JIT_EMIT(b, 0x48, 0x8B, 0x83);
+        sn_jit_emit32(b, 8 * expr->ref.index);
+        return;
+    }
+
+    sn_value_t *val = sn_jit_const_value(expr);
+    if (val != NULL) {
+        assert(SN_VALUE_IS_BOOL(*val));
+        sn_jit_emit_mov_rax_imm(b, SN_VALUE_BOOL(*val));
+        return;
+    }
+
+    int32_t disp = expr->ref.index * sizeof(sn_value_t);
+
+    // mov rax, [r12 + offsetof(sn_jit_ctx_t, globals)]
+    SN_JIT_EMIT(b, 0x49, 0x8B, 0x84, 0x24);
+    sn_jit_emit32(b, offsetof(sn_jit_ctx_t, globals));
+
+    // mov rax, [rax + disp]
+    SN_JIT_EMIT(b, 0x48, 0x8B, 0x80);
+    sn_jit_emit32(b, disp);
+
+    // only small integers are loaded, boxed ones bail out
+    SN_JIT_EMIT(b, 0xA8, 0x01);                         // test al, 1
+    sn_jit_add_bail(b, sn_jit_emit_jz(b));
+    SN_JIT_EMIT(b, 0x48, 0xD1, 0xF8);                   // sar rax, 1
+}
+
+void sn_jit_user_call_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr, sn_func_t *callee)
+{
+    int arg_count = expr->child_count - 1;
+
+    // push the arguments so that the first one ends up at the lowest address
+    for (int i = arg_count; i > 0; i--) {
+        sn_jit_expr_emit_push(b, func, &expr->child_head[i]);
+    }
+
+    SN_JIT_EMIT(b, 0x48, 0x89, 0xE7);                   // mov rdi, rsp
+    SN_JIT_EMIT(b, 0x4C, 0x89, 0xE6);                   // mov rsi, r12
+
+    // the callee may not be compiled yet, so call through its code pointer
+    sn_jit_emit_mov_rax_imm(b, (int64_t)(intptr_t)&callee->jit.code);
+    SN_JIT_EMIT(b, 0xFF, 0x10);                         // call [rax]
+
+    if (arg_count > 0) {
+        // add rsp, 8 * arg_count
+        SN_JIT_EMIT(b, 0x48, 0x81, 0xC4);
+        sn_jit_emit32(b, 8 * arg_count);
+    }
+
+    SN_JIT_EMIT(b, 0x48, 0x85, 0xD2);                   // test rdx, rdx
+    sn_jit_add_bail(b, sn_jit_emit_jnz(b));
+}
+
+void sn_jit_builtin_call_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr, sn_builtin_fn_t fn)
+{
+    int arg_count = expr->child_count - 1;
+    sn_expr_t *args = expr->child_head + 1;
+
+    if (arg_count == 0) {
+        sn_jit_emit_mov_rax_imm(b, fn == sn_mul ? 1 : 0);
+        return;
+    }
+
+    sn_jit_expr_emit(b, func, &args[0]);
+
+    if (fn == sn_sub && arg_count == 1) {
+        SN_JIT_EMIT(b, 0x48, 0xF7, 0xD8);               // neg rax
+        return;
+    }
+    else if (fn == sn_not) {
+        SN_JIT_EMIT(b, 0x48, 0x83, 0xF0, 0x01);         // xor rax, 1
+        return;
+    }
+
+    for (int i = 1; i < arg_count; i++) {
+        sn_jit_expr_emit_rhs(b, func, &args[i]);
+
+        if (fn == sn_add) {
+            SN_JIT_EMIT(b, 0x48, 0x01, 0xC8);           // add rax, rcx
+        }
+        else if (fn == sn_sub) {
+            SN_JIT_EMIT(b, 0x48, 0x29, 0xC8);           // sub rax, rcx
+        }
+        else if (fn == sn_mul) {
+            SN_JIT_EMIT(b, 0x48, 0x0F, 0xAF, 0xC1);     // imul rax, rcx
+        }
+        else if (fn == sn_div || fn == sn_mod) {
+            SN_JIT_EMIT(b, 0x48, 0x99);                 // cqo
+            SN_JIT_EMIT(b, 0x48, 0xF7, 0xF9);           // idiv rcx
+            if (fn == sn_mod) {
+                SN_JIT_EMIT(b, 0x48, 0x89, 0xD0);       // mov rax, rdx
+            }
+        }
+        else {
+            assert(fn == sn_equals || fn == sn_not_equals);
+            SN_JIT_EMIT(b, 0x48, 0x39, 0xC8);           // cmp rax, rcx
+            if (fn == sn_equals) {
+                SN_JIT_EMIT(b, 0x0F, 0x94, 0xC0);       // sete al
+            }
+            else {
+                SN_JIT_EMIT(b, 0x0F, 0x95, 0xC0);       // setne al
+            }
+            SN_JIT_EMIT(b, 0x0F, 0xB6, 0xC0);           // movzx eax, al
+        }
+    }
+}
+
+void sn_jit_call_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    sn_value_t *callee = sn_jit_const_value(expr->child_head);
+
+    if (SN_VALUE_IS_USER_FN(*callee)) {
+        sn_jit_user_call_emit(b, func, expr, SN_VALUE_USER_FN(*callee));
+    }
+    else {
+        sn_jit_builtin_call_emit(b, func, expr, SN_VALUE_BUILTIN_FN(*callee)->fn);
+    }
+}
+
+void sn_jit_if_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    sn_jit_expr_emit(b, func, &expr->child_head[1]);
+    SN_JIT_EMIT(b, 0x48, 0x85, 0xC0);                   // test rax, rax
+    size_t to_false = sn_jit_emit_jz(b);
+
+    sn_jit_expr_emit(b, func, &expr->child_head[2]);
+    size_t to_end = sn_jit_emit_jmp(b);
+
+    sn_jit_patch_here(b, to_false);
+    sn_jit_expr_emit(b, func, &expr->child_head[3]);
+    sn_jit_patch_here(b, to_end);
+}
+
+void sn_jit_andor_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    size_t ends[expr->child_count];
+    int end_count = 0;
+
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        sn_jit_expr_emit(b, func, child);
+        SN_JIT_EMIT(b, 0x48, 0x85, 0xC0);               // test rax, rax
+        if (expr->rtype == SN_RTYPE_AND_EXPR) {
+            ends[end_count++] = sn_jit_emit_jz(b);
+        }
+        else {
+            ends[end_count++] = sn_jit_emit_jnz(b);
+        }
+    }
+
+    for (int i = 0; i < end_count; i++) {
+        sn_jit_patch_here(b, ends[i]);
+    }
+}
+
+void sn_jit_expr_emit(sn_jit_buf_t *b, sn_func_t *func, sn_expr_t *expr)
+{
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            sn_jit_emit_mov_rax_imm(b, expr->vint);
+            return;
+
+        case SN_RTYPE_VAR:
+            sn_jit_var_emit(b, func, expr);
+            return;
+
+        case SN_RTYPE_CALL:
+            sn_jit_call_emit(b, func, expr);
+            return;
+
+        case SN_RTYPE_IF_EXPR:
+            sn_jit_if_emit(b, func, expr);
+            return;
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            sn_jit_andor_emit(b, func, expr);
+            return;
+
+        default:
+            break;
+    }
+
+    abort();
+}
+
+// native functions are called as sn_jit_fn_t, with the arguments in rbx and
+// the context in r12 for the duration of the call
+void sn_jit_func_emit(sn_jit_buf_t *b, sn_func_t *func)
+{
+    SN_JIT_EMIT(b, 0x55);                               // push rbp
+    SN_JIT_EMIT(b, 0x48, 0x89, 0xE5);                   // mov rbp, rsp
+    SN_JIT_EMIT(b, 0x53);                               // push rbx
+    SN_JIT_EMIT(b, 0x41, 0x54);                         // push r12
+    SN_JIT_EMIT(b, 0x48, 0x89, 0xFB);                   // mov rbx, rdi
+    SN_JIT_EMIT(b, 0x49, 0x89, 0xF4);                   // mov r12, rsi
+
+    // dec qword [r12 + offsetof(sn_jit_ctx_t, depth_left)]
+    SN_JIT_EMIT(b, 0x49, 0xFF, 0x8C, 0x24);
+    sn_jit_emit32(b, offsetof(sn_jit_ctx_t, depth_left));
+    sn_jit_add_bail(b, sn_jit_emit_jump(b, (const uint8_t[]){ 0x0F, 0x88 }, 2)); // js
+
+    // every call takes a step from the budget of the run
+    // dec qword [r12 + offsetof(sn_jit_ctx_t, fuel)]
+    SN_JIT_EMIT(b, 0x49, 0xFF, 0x8C, 0x24);
+    sn_jit_emit32(b, offsetof(sn_jit_ctx_t, fuel));
+    sn_jit_add_bail(b, sn_jit_emit_jump(b, (const uint8_t[]){ 0x0F, 0x88 }, 2)); // js
+
+    sn_jit_expr_emit(b, func, func->body);
+
+    // inc qword [r12 + offsetof(sn_jit_ctx_t, depth_left)]
+    SN_JIT_EMIT(b, 0x49, 0xFF, 0x84, 0x24);
+    sn_jit_emit32(b, offsetof(sn_jit_ctx_t, depth_left));
+    SN_JIT_EMIT(b, 0x31, 0xD2);                         // xor edx, edx
+    SN_JIT_EMIT(b, 0x41, 0x5C);                         // pop r12
+    SN_JIT_EMIT(b, 0x5B);                               // pop rbx
+    SN_JIT_EMIT(b, 0x5D);                               // pop rbp
+    SN_JIT_EMIT(b, 0xC3);                               // ret
+
+    for (int i = 0; i < b->bail_count; i++) {
+        sn_jit_patch_here(b, b->bails[i]);
+    }
+
+    SN_JIT_EMIT(b, 0x48, 0x8D, 0x65, 0xF0);             // lea rsp, [rbp - 16]
+    SN_JIT_EMIT(b, 0xBA, 0x01, 0x00, 0x00, 0x00);       // mov edx, 1
+    SN_JIT_EMIT(b, 0x41, 0x5C);                         // pop r12
+    SN_JIT_EMIT(b, 0x5B);                               // pop rbx
+    SN_JIT_EMIT(b, 0x5D);                               // pop rbp
+    SN_JIT_EMIT(b, 0xC3);                               // ret
+}
+
+sn_jit_code_t *sn_jit_func_compile(sn_func_t *func)
+{
+    sn_jit_buf_t b = {0};
+    sn_jit_func_emit(&b, func);
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = (b.size + page_size - 1) / page_size * page_size;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(b.bytes);
+        free(b.bails);
+        return NULL;
+    }
+
+    memcpy(mem, b.bytes, b.size);
+    free(b.bytes);
+    free(b.bails);
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return NULL;
+    }
+
+    sn_jit_code_t *code = calloc(1, sizeof *code);
+    code->mem = mem;
+    code->size = size;
+    return code;
+}
+
+void sn_jit_code_free(sn_jit_code_t *code)
+{
+    munmap(code->mem, code->size);
+    free(code);
+}
+
+#endif
+
+// types func and the pure functions it calls, leaving them TYPED
+bool sn_jit_type(sn_func_t *func)
+{
+    sn_jit_typer_t t = {0};
+    bool ok = sn_jit_type_func(&t, func) != SN_VALUE_TYPE_INVALID;
+
+    if (!ok) {
+        // functions typed on the way may have relied on func, so type them
+        // again if they are called on their own
+        for (int i = 0; i < t.touched_count; i++) {
+            t.touched[i]->jit.state = SN_JIT_STATE_UNKNOWN;
+        }
+        func->jit.state = SN_JIT_STATE_FAILED;
+    }
+
+    free(t.touched);
+    return ok;
+}
+
+#ifdef SN_JIT_SUPPORTED
+
+void sn_jit_collect(sn_jit_typer_t *t, sn_func_t *func);
+
+void sn_jit_collect_expr(sn_jit_typer_t *t, sn_expr_t *expr)
+{
+    if (expr->rtype == SN_RTYPE_CALL) {
+        sn_value_t *callee = sn_jit_const_value(expr->child_head);
+        if (callee != NULL && SN_VALUE_IS_USER_FN(*callee)) {
+            sn_jit_collect(t, SN_VALUE_USER_FN(*callee));
+        }
+    }
+
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        sn_jit_collect_expr(t, child);
+    }
+}
+
+// finds the typed functions reachable from func that still need code
+void sn_jit_collect(sn_jit_typer_t *t, sn_func_t *func)
+{
+    if (func->jit.state != SN_JIT_STATE_TYPED) {
+        return;
+    }
+
+    for (int i = 0; i < t->touched_count; i++) {
+        if (t->touched[i] == func) {
+            return;
+        }
+    }
+
+    sn_jit_typer_touch(t, func);
+    sn_jit_collect_expr(t, func->body);
+}
+
+// compiles func and every typed function it calls; the code pointers are only
+// installed once all of them compiled, since they call each other through them
+bool sn_jit_compile(sn_program_t *prog, sn_func_t *func)
+{
+    if (!sn_jit_type(func)) {
+        return false;
+    }
+
+    sn_jit_typer_t t = {0};
+    sn_jit_collect(&t, func);
+
+    sn_jit_code_t *codes[t.touched_count + 1];
+    int code_count = 0;
+    bool ok = true;
+
+    for (int i = 0; ok && i < t.touched_count; i++) {
+        codes[code_count] = sn_jit_func_compile(t.touched[i]);
+        ok = codes[code_count] != NULL;
+        code_count += ok;
+    }
+
+    for (int i = 0; i < code_count; i++) {
+        if (ok) {
+            t.touched[i]->jit.code = (sn_jit_fn_t)codes[i]->mem;
+            t.touched[i]->jit.state = SN_JIT_STATE_COMPILED;
+            codes[i]->next = prog->jit_code_head;
+            prog->jit_code_head = codes[i];
+        }
+        else {
+            sn_jit_code_free(codes[i]);
+        }
+    }
+
+    // other threads may only enter the code once every pointer is installed
+    for (int i = 0; ok && i < code_count; i++) {
+        __atomic_store_n(&t.touched[i]->jit.ready, true, __ATOMIC_RELEASE);
+    }
+
+    if (!ok) {
+        func->jit.state = SN_JIT_STATE_FAILED;
+    }
+
+    free(t.touched);
+    return ok;
+}
+
+#else
+
+bool sn_jit_compile(sn_program_t *prog, sn_func_t *func)
+{
+    func->jit.state = SN_JIT_STATE_FAILED;
+    return false;
+}
+
+#endif
+
+bool sn_jit_call(sn_program_t *prog,
+                 sn_stack_t *stack,
+                 sn_func_t *func,
+                 int arg_count,
+                 const sn_value_t *args,
+                 sn_value_t *val_out)
+{
+    int threshold = prog->options.jit_threshold;
+    if (!func->is_pure || threshold < 0) {
+        return false;
+    }
+
+    if (!__atomic_load_n(&func->jit.ready, __ATOMIC_ACQUIRE)) {
+        // only the call that reaches the threshold tries to compile
+        if (__atomic_add_fetch(&func->jit.call_count, 1, __ATOMIC_RELAXED) != threshold + 1) {
+            return false;
+        }
+
+        pthread_mutex_lock(&prog->jit_lock);
+        bool ok = func->jit.state == SN_JIT_STATE_COMPILED || sn_jit_compile(prog, func);
+        pthread_mutex_unlock(&prog->jit_lock);
+        if (!ok) {
+            return false;
+        }
+    }
+
+    int64_t ints[SN_JIT_MAX_PARAMS];
+    for (int i = 0; i < arg_count; i++) {
+        if (!SN_VALUE_IS_INT(args[i])) {
+            return false;
+        }
+        ints[i] = SN_VALUE_INT(args[i]);
+    }
+
+    sn_jit_ctx_t ctx = {
+        .globals = stack->globals,
+        .depth_left = stack->frame_top,
+        .fuel = stack->fuel,
+    };
+
+    // a call that ran out of fuel is re-run by the interpreter, which checks
+    // the budget on its next step
+    sn_jit_result_t result = func->jit.code(ints, &ctx);
+    stack->fuel = SN_MAX(ctx.fuel, 0);
+    if (result.bail) {
+        return false;
+    }
+
+    if (func->jit.ret_type == SN_VALUE_TYPE_INTEGER) {
+        *val_out = sn_make_int(result.value);
+    }
+    else {
+        *val_out = sn_make_bool(result.value);
+    }
+    return true;
+}
+
+void sn_jit_release(sn_program_t *prog)
+{
+#ifdef SN_JIT_SUPPORTED
+    while (prog->jit_code_head != NULL) {
+        sn_jit_code_t *next = prog->jit_code_head->next;
+        sn_jit_code_free(prog->jit_code_head);
+        prog->jit_code_head = next;
+    }
+#endif
+}
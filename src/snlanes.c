@@ -0,0 +1,678 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snscript_internal.h"
+
+// Lane evaluator for pure functions over integers and booleans.
+//
+// pmap and preduce call the same function over a run of integers, so the
+// calls are made SN_LANE_COUNT at a time: each expression is evaluated once
+// for a whole group of calls, on vectors with a lane per call, which the
+// compiler maps to SIMD registers where the target has them. Booleans are 0
+// or 1 in a lane, and null is 0.
+//
+// The typed functions are those the JIT accepts, plus let, =, do and while
+// whose value is null. Lanes that take different arms of an if, or stay in a
+// while for longer, are masked off while the others run. A lane that can't go
+// on, because it would divide by zero, runs out of fuel or calls a function
+// that isn't typed, is bailed out of and its call is re-run on its own by the
+// interpreter, which is safe because pure functions have no side effects.
+
+typedef uint64_t sn_lanes_t __attribute__((vector_size(SN_LANE_COUNT * sizeof(uint64_t))));
+typedef int64_t sn_lanes_signed_t __attribute__((vector_size(SN_LANE_COUNT * sizeof(int64_t))));
+
+// lanes of 0 or 1 from a vector comparison, and a mask from lanes of 0 or 1;
+// vectors aren't passed by value, whose ABI depends on the target
+#define SN_LANES_BOOL(cmp) ((sn_lanes_t)(cmp) & 1)
+#define SN_LANES_MASK(bools) ((sn_lanes_t){0} - (bools))
+
+typedef struct sn_lanes_typer_st
+{
+    sn_func_t *func;
+    // the type of the value in each local slot so far
+    sn_value_type_t *locals;
+} sn_lanes_typer_t;
+
+typedef struct sn_lanes_ctx_st
+{
+    sn_stack_t *stack;
+    // all ones in the lanes that have been bailed out of
+    sn_lanes_t bailed;
+    int depth;
+} sn_lanes_ctx_t;
+
+sn_value_type_t sn_lanes_type_func(sn_func_t *func);
+sn_value_type_t sn_lanes_type_expr(sn_lanes_typer_t *t, sn_expr_t *expr);
+
+bool sn_lanes_is_value_type(sn_value_type_t type)
+{
+    return type == SN_VALUE_TYPE_INTEGER || type == SN_VALUE_TYPE_BOOLEAN;
+}
+
+sn_value_type_t sn_lanes_type_var(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    if (expr->ref.type == SN_SCOPE_TYPE_LOCAL) {
+        return t->locals[expr->ref.index];
+    }
+
+    sn_value_t *val = sn_jit_const_value(expr);
+    if (val != NULL) {
+        if (SN_VALUE_IS_BOOL(*val)) {
+            return SN_VALUE_TYPE_BOOLEAN;
+        }
+        return SN_VALUE_IS_NULL(*val) ? SN_VALUE_TYPE_NULL : SN_VALUE_TYPE_INVALID;
+    }
+
+    // the value of a user const is checked when it is loaded
+    return expr->ref.is_const ? SN_VALUE_TYPE_INTEGER : SN_VALUE_TYPE_INVALID;
+}
+
+sn_value_type_t sn_lanes_type_call(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    sn_value_t *callee = sn_jit_const_value(expr->child_head);
+    int arg_count = expr->child_count - 1;
+    sn_value_type_t types[SN_JIT_MAX_PARAMS];
+
+    if (callee == NULL || arg_count > SN_JIT_MAX_PARAMS) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    for (int i = 0; i < arg_count; i++) {
+        types[i] = sn_lanes_type_expr(t, &expr->child_head[i + 1]);
+        if (types[i] == SN_VALUE_TYPE_INVALID) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+    }
+
+    if (SN_VALUE_IS_USER_FN(*callee)) {
+        sn_func_t *callee_func = SN_VALUE_USER_FN(*callee);
+        if (arg_count != callee_func->param_count) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+        for (int i = 0; i < arg_count; i++) {
+            if (types[i] != SN_VALUE_TYPE_INTEGER) {
+                return SN_VALUE_TYPE_INVALID;
+            }
+        }
+        return sn_lanes_type_func(callee_func);
+    }
+
+    if (!SN_VALUE_IS_BUILTIN_FN(*callee)) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    return sn_jit_type_builtin(SN_VALUE_BUILTIN_FN(*callee)->fn, types, arg_count);
+}
+
+sn_value_type_t sn_lanes_type_if(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    if (sn_lanes_type_expr(t, &expr->child_head[1]) != SN_VALUE_TYPE_BOOLEAN) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    // an if without a false arm can only be used for its effects
+    sn_value_type_t type = sn_lanes_type_expr(t, &expr->child_head[2]);
+    if (expr->child_count == 3) {
+        return type == SN_VALUE_TYPE_NULL ? type : SN_VALUE_TYPE_INVALID;
+    }
+
+    return type == sn_lanes_type_expr(t, &expr->child_head[3]) ? type : SN_VALUE_TYPE_INVALID;
+}
+
+sn_value_type_t sn_lanes_type_andor(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        if (sn_lanes_type_expr(t, child) != SN_VALUE_TYPE_BOOLEAN) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+    }
+
+    return SN_VALUE_TYPE_BOOLEAN;
+}
+
+sn_value_type_t sn_lanes_type_do(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    sn_value_type_t type = SN_VALUE_TYPE_NULL;
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        type = sn_lanes_type_expr(t, child);
+        if (type == SN_VALUE_TYPE_INVALID) {
+            break;
+        }
+    }
+
+    return type;
+}
+
+// a local keeps the type it is declared with, since the slot of a lane
+// doesn't say what it holds
+sn_value_type_t sn_lanes_type_assign(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    sn_expr_t *dst = expr->child_head->next;
+    sn_value_type_t type = sn_lanes_type_expr(t, dst->next);
+
+    if (dst->ref.type != SN_SCOPE_TYPE_LOCAL || !sn_lanes_is_value_type(type)) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    if (expr->rtype == SN_RTYPE_ASSIGN_EXPR) {
+        if (t->locals[dst->ref.index] != type) {
+            return SN_VALUE_TYPE_INVALID;
+        }
+    }
+    else {
+        t->locals[dst->ref.index] = type;
+    }
+
+    return SN_VALUE_TYPE_NULL;
+}
+
+// the value of a while is that of the last run of its body, or null
+sn_value_type_t sn_lanes_type_while(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    sn_expr_t *cond_expr = expr->child_head->next;
+    if (sn_lanes_type_expr(t, cond_expr) != SN_VALUE_TYPE_BOOLEAN) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    if (cond_expr->next != NULL && sn_lanes_type_expr(t, cond_expr->next) != SN_VALUE_TYPE_NULL) {
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    return SN_VALUE_TYPE_NULL;
+}
+
+sn_value_type_t sn_lanes_type_expr(sn_lanes_typer_t *t, sn_expr_t *expr)
+{
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            return SN_VALUE_TYPE_INTEGER;
+
+        case SN_RTYPE_VAR:
+            return sn_lanes_type_var(t, expr);
+
+        case SN_RTYPE_CALL:
+            return sn_lanes_type_call(t, expr);
+
+        case SN_RTYPE_IF_EXPR:
+            return sn_lanes_type_if(t, expr);
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            return sn_lanes_type_andor(t, expr);
+
+        case SN_RTYPE_DO_EXPR:
+            return sn_lanes_type_do(t, expr);
+
+        case SN_RTYPE_LET_EXPR:
+        case SN_RTYPE_CONST_EXPR:
+        case SN_RTYPE_ASSIGN_EXPR:
+            return sn_lanes_type_assign(t, expr);
+
+        case SN_RTYPE_WHILE_EXPR:
+            return sn_lanes_type_while(t, expr);
+
+        default:
+            break;
+    }
+
+    return SN_VALUE_TYPE_INVALID;
+}
+
+sn_value_type_t sn_lanes_type_func(sn_func_t *func)
+{
+    switch (func->lanes.state) {
+        case SN_JIT_STATE_TYPED:
+        case SN_JIT_STATE_COMPILED:
+            return func->lanes.ret_type;
+
+        case SN_JIT_STATE_FAILED:
+            return SN_VALUE_TYPE_INVALID;
+
+        case SN_JIT_STATE_IN_PROGRESS:
+            // recursive call, assume the function returns an integer and
+            // check the assumption once the body has been typed
+            func->lanes.uses_assumed_type = true;
+            return func->lanes.ret_type;
+
+        case SN_JIT_STATE_UNKNOWN:
+            break;
+    }
+
+    if (!func->is_pure || func->param_count > SN_JIT_MAX_PARAMS ||
+        sn_func_ensure_built(func) != SN_SUCCESS) {
+        func->lanes.state = SN_JIT_STATE_FAILED;
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    func->lanes.state = SN_JIT_STATE_IN_PROGRESS;
+    func->lanes.ret_type = SN_VALUE_TYPE_INTEGER;
+    func->lanes.uses_assumed_type = false;
+
+    sn_value_type_t locals[SN_MAX(func->scope.max_decl_count, 1)];
+    for (int i = 0; i < func->scope.max_decl_count; i++) {
+        locals[i] = i < func->param_count ? SN_VALUE_TYPE_INTEGER : SN_VALUE_TYPE_INVALID;
+    }
+
+    sn_lanes_typer_t t = { .func = func, .locals = locals };
+    sn_value_type_t type = SN_VALUE_TYPE_NULL;
+    for (sn_expr_t *expr = func->body; expr != NULL && type != SN_VALUE_TYPE_INVALID; expr = expr->next) {
+        type = sn_lanes_type_expr(&t, expr);
+    }
+
+    if ((!sn_lanes_is_value_type(type) && type != SN_VALUE_TYPE_NULL) ||
+        (func->lanes.uses_assumed_type && type != func->lanes.ret_type)) {
+        func->lanes.state = SN_JIT_STATE_FAILED;
+        return SN_VALUE_TYPE_INVALID;
+    }
+
+    func->lanes.state = SN_JIT_STATE_TYPED;
+    func->lanes.ret_type = type;
+    return type;
+}
+
+bool sn_lanes_any(const sn_lanes_t *mask)
+{
+    for (int i = 0; i < SN_LANE_COUNT; i++) {
+        if ((*mask)[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int sn_lanes_count(const sn_lanes_t *mask)
+{
+    int count = 0;
+    for (int i = 0; i < SN_LANE_COUNT; i++) {
+        count += (*mask)[i] != 0;
+    }
+
+    return count;
+}
+
+// takes a step per running lane from the budget of the run, like the
+// interpreter takes one per call and loop
+bool sn_lanes_charge(sn_lanes_ctx_t *ctx, const sn_lanes_t *mask)
+{
+    int64_t steps = sn_lanes_count(mask);
+    if (ctx->stack->fuel < steps) {
+        ctx->bailed = ~(sn_lanes_t){0};
+        return false;
+    }
+
+    ctx->stack->fuel -= steps;
+    return true;
+}
+
+void sn_lanes_eval(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out);
+
+void sn_lanes_eval_var(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, sn_lanes_t *out)
+{
+    if (expr->ref.type == SN_SCOPE_TYPE_LOCAL) {
+        *out = locals[expr->ref.index];
+        return;
+    }
+
+    sn_value_t val = ctx->stack->globals[expr->ref.index];
+    if (SN_VALUE_IS_INT(val)) {
+        *out = (sn_lanes_t){0} + (uint64_t)SN_VALUE_INT(val);
+    }
+    else if (SN_VALUE_IS_BOOL(val)) {
+        *out = (sn_lanes_t){0} + (uint64_t)SN_VALUE_BOOL(val);
+    }
+    else if (SN_VALUE_IS_NULL(val)) {
+        *out = (sn_lanes_t){0};
+    }
+    else {
+        // a user const the typer took for an integer isn't one
+        ctx->bailed = ~(sn_lanes_t){0};
+    }
+}
+
+// lanes that would trap in C are bailed out of, and the interpreter then
+// divides them as it always does
+void sn_lanes_eval_div(sn_lanes_ctx_t *ctx,
+                       sn_builtin_fn_t fn,
+                       const sn_lanes_t *args,
+                       const sn_lanes_t *mask,
+                       sn_lanes_t *out)
+{
+    sn_lanes_signed_t lhs = (sn_lanes_signed_t)args[0];
+    sn_lanes_signed_t rhs = (sn_lanes_signed_t)args[1];
+    sn_lanes_t bad = (sn_lanes_t)((rhs == 0) | ((lhs == INT64_MIN) & (rhs == -1)));
+
+    bad &= *mask;
+    ctx->bailed |= bad;
+
+    sn_lanes_t ok = *mask & ~bad;
+    rhs = (sn_lanes_signed_t)(((sn_lanes_t)rhs & ok) | (~ok & 1));
+    lhs = (sn_lanes_signed_t)((sn_lanes_t)lhs & ok);
+    *out = (sn_lanes_t)(fn == sn_div ? lhs / rhs : lhs % rhs);
+}
+
+void sn_lanes_eval_builtin(sn_lanes_ctx_t *ctx,
+                           sn_builtin_fn_t fn,
+                           int arg_count,
+                           const sn_lanes_t *args,
+                           const sn_lanes_t *mask,
+                           sn_lanes_t *out)
+{
+    if (fn == sn_add || fn == sn_mul) {
+        *out = (sn_lanes_t){0} + (fn == sn_add ? 0 : 1);
+        for (int i = 0; i < arg_count; i++) {
+            *out = fn == sn_add ? *out + args[i] : *out * args[i];
+        }
+    }
+    else if (fn == sn_sub) {
+        *out = arg_count == 1 ? (sn_lanes_t){0} - args[0] : args[0] - args[1];
+    }
+    else if (fn == sn_div || fn == sn_mod) {
+        sn_lanes_eval_div(ctx, fn, args, mask, out);
+    }
+    else if (fn == sn_equals) {
+        *out = SN_LANES_BOOL(args[0] == args[1]);
+    }
+    else if (fn == sn_not_equals) {
+        *out = SN_LANES_BOOL(args[0] != args[1]);
+    }
+    else {
+        assert(fn == sn_not);
+        *out = args[0] ^ 1;
+    }
+}
+
+// calls the function once per lane, for a single lane or recursion that
+// went too deep for lane groups to pay off
+void sn_lanes_call_each(sn_lanes_ctx_t *ctx,
+                        sn_value_t fn,
+                        int arg_count,
+                        const sn_lanes_t *args,
+                        const sn_lanes_t *mask,
+                        sn_lanes_t *out)
+{
+    sn_stack_t *stack = ctx->stack;
+    int push_count = stack->push_count;
+    sn_value_t *slots = &stack->values[sn_stack_alloc_values(stack, arg_count + 1)];
+
+    for (int lane = 0; lane < SN_LANE_COUNT; lane++) {
+        if ((*mask)[lane] == 0) {
+            continue;
+        }
+
+        for (int i = 0; i < arg_count; i++) {
+            slots[i] = sn_make_int((int64_t)args[i][lane]);
+        }
+
+        sn_value_t *val = &slots[arg_count];
+        if (sn_stack_call(stack, fn, arg_count, slots, val) != SN_SUCCESS) {
+            ctx->bailed[lane] = ~(uint64_t)0;
+        }
+        else if (SN_VALUE_IS_INT(*val)) {
+            (*out)[lane] = (uint64_t)SN_VALUE_INT(*val);
+        }
+        else {
+            (*out)[lane] = SN_VALUE_IS_BOOL(*val) && SN_VALUE_BOOL(*val);
+        }
+    }
+
+    stack->push_count = push_count;
+}
+
+void sn_lanes_call(sn_lanes_ctx_t *ctx,
+                   sn_value_t fn,
+                   const sn_lanes_t *args,
+                   const sn_lanes_t *mask,
+                   sn_lanes_t *out)
+{
+    sn_func_t *func = SN_VALUE_USER_FN(fn);
+
+    // a function that failed to type may return something its callers
+    // weren't typed for
+    if (func->lanes.state != SN_JIT_STATE_TYPED) {
+        ctx->bailed |= *mask;
+        return;
+    }
+
+    // the interpreter takes the steps of the calls it makes itself
+    if (sn_lanes_count(mask) == 1 || ctx->depth == SN_LANES_MAX_DEPTH) {
+        sn_lanes_call_each(ctx, fn, func->param_count, args, mask, out);
+        return;
+    }
+
+    if (!sn_lanes_charge(ctx, mask)) {
+        return;
+    }
+
+    sn_lanes_t locals[SN_MAX(func->scope.max_decl_count, 1)];
+    memset(locals, '\0', sizeof locals);
+    memcpy(locals, args, func->param_count * sizeof args[0]);
+
+    ctx->depth++;
+    for (sn_expr_t *expr = func->body; expr != NULL; expr = expr->next) {
+        sn_lanes_eval(ctx, locals, expr, mask, out);
+    }
+    ctx->depth--;
+}
+
+void sn_lanes_eval_call(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    sn_value_t callee = *sn_jit_const_value(expr->child_head);
+    int arg_count = expr->child_count - 1;
+    sn_lanes_t args[SN_MAX(arg_count, 1)];
+
+    for (int i = 0; i < arg_count; i++) {
+        sn_lanes_eval(ctx, locals, &expr->child_head[i + 1], mask, &args[i]);
+    }
+
+    sn_lanes_t active = *mask & ~ctx->bailed;
+    if (SN_VALUE_IS_USER_FN(callee)) {
+        sn_lanes_call(ctx, callee, args, &active, out);
+    }
+    else {
+        sn_lanes_eval_builtin(ctx, SN_VALUE_BUILTIN_FN(callee)->fn, arg_count, args, &active, out);
+    }
+}
+
+void sn_lanes_eval_if(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    sn_lanes_t cond;
+    sn_lanes_eval(ctx, locals, &expr->child_head[1], mask, &cond);
+
+    sn_lanes_t taken = *mask & SN_LANES_MASK(cond);
+    sn_lanes_t not_taken = *mask & ~taken;
+    sn_lanes_t val = {0};
+
+    sn_lanes_eval(ctx, locals, &expr->child_head[2], &taken, out);
+    if (expr->child_count == 4) {
+        sn_lanes_eval(ctx, locals, &expr->child_head[3], &not_taken, &val);
+    }
+
+    *out = (*out & taken) | (val & ~taken);
+}
+
+void sn_lanes_eval_andor(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    bool is_and = expr->rtype == SN_RTYPE_AND_EXPR;
+
+    // the lanes still evaluating children, which have only seen the default
+    sn_lanes_t running = *mask;
+    for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+        sn_lanes_t val;
+        sn_lanes_eval(ctx, locals, child, &running, &val);
+        running &= is_and ? SN_LANES_MASK(val) : ~SN_LANES_MASK(val);
+    }
+
+    *out = (running & 1) ^ !is_and;
+}
+
+void sn_lanes_eval_assign(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    sn_expr_t *dst = expr->child_head->next;
+    sn_lanes_t val;
+    sn_lanes_eval(ctx, locals, dst->next, mask, &val);
+
+    sn_lanes_t *slot = &locals[dst->ref.index];
+    *slot = (val & *mask) | (*slot & ~*mask);
+    *out = (sn_lanes_t){0};
+}
+
+void sn_lanes_eval_while(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    sn_expr_t *cond_expr = expr->child_head->next;
+    sn_lanes_t running = *mask;
+
+    for (;;) {
+        sn_lanes_t cond;
+        sn_lanes_eval(ctx, locals, cond_expr, &running, &cond);
+        running &= SN_LANES_MASK(cond) & ~ctx->bailed;
+        if (!sn_lanes_any(&running) || !sn_lanes_charge(ctx, &running)) {
+            break;
+        }
+
+        if (cond_expr->next != NULL) {
+            sn_lanes_eval(ctx, locals, cond_expr->next, &running, out);
+        }
+    }
+
+    *out = (sn_lanes_t){0};
+}
+
+void sn_lanes_eval(sn_lanes_ctx_t *ctx, sn_lanes_t *locals, sn_expr_t *expr, const sn_lanes_t *mask, sn_lanes_t *out)
+{
+    sn_lanes_t active = *mask & ~ctx->bailed;
+    if (!sn_lanes_any(&active)) {
+        *out = (sn_lanes_t){0};
+        return;
+    }
+
+    switch (expr->rtype) {
+        case SN_RTYPE_LITERAL:
+            *out = (sn_lanes_t){0} + (uint64_t)SN_VALUE_INT(expr->literal);
+            return;
+
+        case SN_RTYPE_VAR:
+            sn_lanes_eval_var(ctx, locals, expr, out);
+            return;
+
+        case SN_RTYPE_CALL:
+            sn_lanes_eval_call(ctx, locals, expr, &active, out);
+            return;
+
+        case SN_RTYPE_IF_EXPR:
+            sn_lanes_eval_if(ctx, locals, expr, &active, out);
+            return;
+
+        case SN_RTYPE_AND_EXPR:
+        case SN_RTYPE_OR_EXPR:
+            sn_lanes_eval_andor(ctx, locals, expr, &active, out);
+            return;
+
+        case SN_RTYPE_DO_EXPR:
+            for (sn_expr_t *child = expr->child_head->next; child != NULL; child = child->next) {
+                sn_lanes_eval(ctx, locals, child, &active, out);
+            }
+            return;
+
+        case SN_RTYPE_LET_EXPR:
+        case SN_RTYPE_CONST_EXPR:
+        case SN_RTYPE_ASSIGN_EXPR:
+            sn_lanes_eval_assign(ctx, locals, expr, &active, out);
+            return;
+
+        case SN_RTYPE_WHILE_EXPR:
+            sn_lanes_eval_while(ctx, locals, expr, &active, out);
+            return;
+
+        default:
+            break;
+    }
+
+    abort();
+}
+
+// how many calls of fn sn_lanes_call_range() makes at once: a lane group for
+// a typed function of one integer, and one otherwise. Functions the JIT can
+// compile are left to it, since it runs each call about as fast as a lane
+// group runs a call per lane.
+int sn_lanes_width(sn_program_t *prog, sn_value_t fn)
+{
+    if (!SN_VALUE_IS_USER_FN(fn)) {
+        return 1;
+    }
+
+    sn_func_t *func = SN_VALUE_USER_FN(fn);
+    if (func->param_count != 1 || __atomic_load_n(&func->jit.ready, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&func->lanes.rejected, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+
+    if (!__atomic_load_n(&func->lanes.ready, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&prog->jit_lock);
+        bool ok = func->lanes.ready;
+        if (!ok && !func->lanes.rejected) {
+            ok = (prog->options.jit_threshold < 0 || !sn_jit_type(func)) &&
+                 sn_lanes_type_func(func) != SN_VALUE_TYPE_INVALID;
+            __atomic_store_n(ok ? &func->lanes.ready : &func->lanes.rejected, true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&prog->jit_lock);
+        if (!ok) {
+            return 1;
+        }
+    }
+
+    return SN_LANE_COUNT;
+}
+
+// calls fn with each of the integers from first on, count of them at most
+// sn_lanes_width(), into vals_out, which should be slots on the stack. The
+// error is that of the first call that fails.
+sn_error_t sn_lanes_call_range(sn_stack_t *stack, sn_value_t fn, int64_t first, int count, sn_value_t *vals_out)
+{
+    assert(count == 1 || (count <= SN_LANE_COUNT && SN_VALUE_USER_FN(fn)->lanes.ready));
+
+    sn_lanes_ctx_t ctx = { .stack = stack, .bailed = ~(sn_lanes_t){0} };
+    if (count > 1) {
+        sn_lanes_t arg = {0};
+        sn_lanes_t mask = {0};
+        for (int lane = 0; lane < count; lane++) {
+            arg[lane] = (uint64_t)(first + lane);
+            mask[lane] = ~(uint64_t)0;
+        }
+
+        sn_func_t *func = SN_VALUE_USER_FN(fn);
+        sn_lanes_t val;
+        ctx.bailed = ~mask;
+        sn_lanes_call(&ctx, fn, &arg, &mask, &val);
+
+        for (int lane = 0; lane < count; lane++) {
+            if (ctx.bailed[lane] != 0) {
+                continue;
+            }
+
+            if (func->lanes.ret_type == SN_VALUE_TYPE_INTEGER) {
+                vals_out[lane] = sn_make_int((int64_t)val[lane]);
+            }
+            else if (func->lanes.ret_type == SN_VALUE_TYPE_BOOLEAN) {
+                vals_out[lane] = sn_make_bool(val[lane]);
+            }
+            else {
+                vals_out[lane] = sn_null;
+            }
+        }
+    }
+
+    int push_count = stack->push_count;
+    sn_value_t *arg = &stack->values[sn_stack_alloc_values(stack, 1)];
+    sn_error_t status = SN_SUCCESS;
+
+    for (int lane = 0; lane < count && status == SN_SUCCESS; lane++) {
+        if (ctx.bailed[lane] != 0) {
+            *arg = sn_make_int(first + lane);
+            status = sn_stack_call(stack, fn, 1, arg, &vals_out[lane]);
+        }
+    }
+
+    stack->push_count = push_count;
+    return status;
+}
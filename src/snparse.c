@@ -4,65 +4,84 @@
 #include <assert.h>
 #include "snscript_internal.h"
 
-sn_error_t sn_cur_parse_expr(sn_program_t *prog, sn_expr_t **expr_out);
+sn_error_t sn_cur_parse_expr(sn_cursor_t *c, sn_expr_t **expr_out);
+void sn_expr_free_children(sn_expr_t *expr);
 
-sn_error_t sn_cur_error(sn_program_t *prog, sn_error_t status)
+sn_error_t sn_cur_error(sn_cursor_t *c, sn_error_t status)
 {
-    prog->error_line = prog->cur_line;
-    prog->error_col = prog->cur_col;
+    c->error_line = c->line;
+    c->error_col = c->col;
     return status;
 }
 
-bool sn_cur_more(sn_program_t *prog)
+void sn_cursor_init(sn_cursor_t *c, sn_program_t *prog, const char *source, size_t size)
 {
-    return prog->cur < prog->last;
+    memset(c, '\0', sizeof *c);
+    c->prog = prog;
+    c->cur = source;
+    c->last = source + size;
+    c->line = 1;
+    c->col = 1;
 }
 
-void sn_cur_next(sn_program_t *prog)
+// parse errors are found by a cursor and then recorded in the program
+sn_error_t sn_cursor_record_error(sn_cursor_t *c, sn_error_t status)
 {
-    assert(sn_cur_more(prog));
-    prog->cur_col++;
-    if (*prog->cur == '\n') {
-        prog->cur_line++;
-        prog->cur_col = 1;
+    c->prog->error_line = c->error_line;
+    c->prog->error_col = c->error_col;
+    return status;
+}
+
+bool sn_cur_more(sn_cursor_t *c)
+{
+    return c->cur < c->last;
+}
+
+void sn_cur_next(sn_cursor_t *c)
+{
+    assert(sn_cur_more(c));
+    c->col++;
+    if (*c->cur == '\n') {
+        c->line++;
+        c->col = 1;
     }
-    prog->cur++;
+    c->cur++;
 }
 
-bool sn_cur_two_more(sn_program_t *prog)
+bool sn_cur_two_more(sn_cursor_t *c)
 {
-    return prog->cur + 1 < prog->last;
+    return c->cur + 1 < c->last;
 }
 
-bool sn_cur_is_expr_end(sn_program_t *prog)
+bool sn_cur_is_expr_end(sn_cursor_t *c)
 {
-    return !sn_cur_more(prog) ||
-           *prog->cur == ')' ||
-           *prog->cur == '}';
+    return !sn_cur_more(c) ||
+           *c->cur == ')' ||
+           *c->cur == '}';
 }
 
-bool sn_cur_is_whitespace(sn_program_t *prog)
+bool sn_cur_is_whitespace(sn_cursor_t *c)
 {
-    return sn_cur_more(prog) && isspace(*prog->cur);
+    return sn_cur_more(c) && isspace(*c->cur);
 }
 
-bool sn_cur_is_comment_start(sn_program_t *prog)
+bool sn_cur_is_comment_start(sn_cursor_t *c)
 {
-    return sn_cur_two_more(prog) && prog->cur[0] == ';' && prog->cur[1] == ';';
+    return sn_cur_two_more(c) && c->cur[0] == ';' && c->cur[1] == ';';
 }
 
-bool sn_cur_is_end_of_token(sn_program_t *prog)
+bool sn_cur_is_end_of_token(sn_cursor_t *c)
 {
-    return sn_cur_is_expr_end(prog) ||
-           sn_cur_is_comment_start(prog) ||
-           sn_cur_is_whitespace(prog);
+    return sn_cur_is_expr_end(c) ||
+           sn_cur_is_comment_start(c) ||
+           sn_cur_is_whitespace(c);
 }
 
-bool sn_cur_did_skip_comment(sn_program_t *prog)
+bool sn_cur_did_skip_comment(sn_cursor_t *c)
 {
-    if (sn_cur_is_comment_start(prog)) {
-        while (sn_cur_more(prog) && *prog->cur != '\n') {
-            sn_cur_next(prog);
+    if (sn_cur_is_comment_start(c)) {
+        while (sn_cur_more(c) && *c->cur != '\n') {
+            sn_cur_next(c);
         }
         return true;
     }
@@ -70,46 +89,46 @@ bool sn_cur_did_skip_comment(sn_program_t *prog)
     return false;
 }
 
-bool sn_cur_did_skip_whitespace(sn_program_t *prog)
+bool sn_cur_did_skip_whitespace(sn_cursor_t *c)
 {
     bool did_skip = false;
-    while (sn_cur_is_whitespace(prog)) {
-        sn_cur_next(prog);
+    while (sn_cur_is_whitespace(c)) {
+        sn_cur_next(c);
         did_skip = true;
     }
 
     return did_skip;
 }
 
-void sn_cur_skip_whitespace(sn_program_t *prog)
+void sn_cur_skip_whitespace(sn_cursor_t *c)
 {
-    while (sn_cur_did_skip_whitespace(prog) || sn_cur_did_skip_comment(prog));
+    while (sn_cur_did_skip_whitespace(c) || sn_cur_did_skip_comment(c));
 }
 
-bool sn_cur_is_symbol(sn_program_t *prog)
+bool sn_cur_is_symbol(sn_cursor_t *c)
 {
     const char *ok = "!@$%^&*-_=+:<>./?|";
-    return sn_cur_more(prog) &&
-           (isalnum(*prog->cur) || strchr(ok, *prog->cur) != NULL);
+    return sn_cur_more(c) &&
+           (isalnum(*c->cur) || strchr(ok, *c->cur) != NULL);
 }
 
-sn_error_t sn_cur_parse_integer(sn_program_t *prog, sn_expr_t *expr)
+sn_error_t sn_cur_parse_integer(sn_cursor_t *c, sn_expr_t *expr)
 {
     int64_t sign = 1;
     int64_t value = 0;
 
-    if (*prog->cur == '-') {
+    if (*c->cur == '-') {
         sign = -1;
-        sn_cur_next(prog);
+        sn_cur_next(c);
     }
 
-    while (sn_cur_more(prog) && isdigit(*prog->cur)) {
-        value = 10 * value + *prog->cur - '0';
-        sn_cur_next(prog);
+    while (sn_cur_more(c) && isdigit(*c->cur)) {
+        value = 10 * value + *c->cur - '0';
+        sn_cur_next(c);
     }
 
-    if (!sn_cur_is_end_of_token(prog)) {
-        return sn_cur_error(prog, SN_ERROR_INVALID_INTEGER_LITERAL);
+    if (!sn_cur_is_end_of_token(c)) {
+        return sn_cur_error(c, SN_ERROR_INVALID_INTEGER_LITERAL);
     }
 
     expr->type = SN_EXPR_TYPE_INTEGER;
@@ -117,95 +136,768 @@ sn_error_t sn_cur_parse_integer(sn_program_t *prog, sn_expr_t *expr)
     return SN_SUCCESS;
 }
 
-sn_error_t sn_cur_parse_symbol(sn_program_t *prog, sn_expr_t *expr)
+sn_error_t sn_cur_parse_symbol(sn_cursor_t *c, sn_expr_t *expr)
 {
-    const char *start = prog->cur;
-    while (sn_cur_is_symbol(prog)) {
-        sn_cur_next(prog);
+    const char *start = c->cur;
+    while (sn_cur_is_symbol(c)) {
+        sn_cur_next(c);
     }
 
-    if (!sn_cur_is_end_of_token(prog)) {
-        return sn_cur_error(prog, SN_ERROR_INVALID_SYMBOL_NAME);
+    if (!sn_cur_is_end_of_token(c)) {
+        return sn_cur_error(c, SN_ERROR_INVALID_SYMBOL_NAME);
     }
 
     expr->type = SN_EXPR_TYPE_SYMBOL;
-    expr->sym = sn_program_get_symbol(prog, start, prog->cur);
+    expr->sym = sn_program_get_symbol(c->prog, start, c->cur);
     return SN_SUCCESS;
 }
 
-bool sn_cur_is_integer(sn_program_t *prog)
+bool sn_cur_is_integer(sn_cursor_t *c)
 {
-    char c = *prog->cur;
-    return isdigit(c) || (c == '-' && sn_cur_two_more(prog) && isdigit(prog->cur[1]));
+    char ch = *c->cur;
+    return isdigit(ch) || (ch == '-' && sn_cur_two_more(c) && isdigit(c->cur[1]));
 }
 
-sn_error_t sn_cur_consume(sn_program_t *prog, char c)
+sn_error_t sn_cur_consume(sn_cursor_t *c, char ch)
 {
-    if (!sn_cur_more(prog)) {
-        return sn_cur_error(prog, SN_ERROR_UNEXPECTED_END_OF_INPUT);
+    if (!sn_cur_more(c)) {
+        return sn_cur_error(c, SN_ERROR_UNEXPECTED_END_OF_INPUT);
     }
-    if (*prog->cur != c) {
-        return sn_cur_error(prog, SN_ERROR_EXPECTED_EXPR_CLOSE);
+    if (*c->cur != ch) {
+        return sn_cur_error(c, SN_ERROR_EXPECTED_EXPR_CLOSE);
     }
 
-    sn_cur_next(prog);
+    sn_cur_next(c);
     return SN_SUCCESS;
 }
 
-sn_error_t sn_cur_parse_expr_list(sn_program_t *prog, sn_expr_t *expr)
+// moves the linked children of expr into one array
+void sn_expr_pack_children(sn_expr_t *expr)
+{
+    if (expr->child_count == 0) {
+        return;
+    }
+
+    sn_expr_t *expr_array = calloc(expr->child_count, sizeof expr[0]);
+    sn_expr_t *child = expr->child_head;
+
+    for (int i = 0; i < expr->child_count; i++) {
+        sn_expr_t *next_child = child->next;
+        expr_array[i] = *child;
+        if (i > 0) {
+            expr_array[i - 1].next = &expr_array[i];
+        }
+        free(child);
+        child = next_child;
+    }
+
+    expr->child_head = expr_array;
+}
+
+sn_error_t sn_cur_parse_expr_list(sn_cursor_t *c, sn_expr_t *expr)
 {
     sn_error_t status = SN_SUCCESS;
     expr->type = SN_EXPR_TYPE_LIST;
     sn_expr_t **child_tail = &expr->child_head;
     sn_expr_t *child = NULL;
 
-    while ((status = sn_cur_parse_expr(prog, &child)) == SN_SUCCESS && child != NULL) {
+    while ((status = sn_cur_parse_expr(c, &child)) == SN_SUCCESS && child != NULL) {
         *child_tail = child;
         child_tail = &child->next;
         expr->child_count++;
     }
 
-    if (expr->child_count == 0 || status != SN_SUCCESS) {
+    if (status != SN_SUCCESS) {
+        while (expr->child_head != NULL) {
+            child = expr->child_head;
+            expr->child_head = child->next;
+            sn_form_free(child);
+        }
+        expr->child_count = 0;
         return status;
     }
 
-    sn_expr_t *expr_array = calloc(expr->child_count, sizeof expr[0]);
-    child = expr->child_head;
+    sn_expr_pack_children(expr);
+    return SN_SUCCESS;
+}
 
-    for (int i = 0; i < expr->child_count; i++) {
-        sn_expr_t *next_child = child->next;
-        expr_array[i] = *child;
-        if (i > 0) {
-            expr_array[i - 1].next = &expr_array[i];
+// moves the cursor past the expressions up to the bracket that closes the
+// list it is in, and tells whether there were any
+bool sn_cur_skip_to_close(sn_cursor_t *c)
+{
+    bool is_empty = true;
+    int depth = 0;
+    while (sn_cur_more(c) && (depth > 0 || (*c->cur != ')' && *c->cur != '}'))) {
+        if (sn_cur_did_skip_comment(c) || sn_cur_did_skip_whitespace(c)) {
+            continue;
         }
-        free(child);
-        child = next_child;
+
+        if (*c->cur == '(' || *c->cur == '{') {
+            depth++;
+        }
+        else if (*c->cur == ')' || *c->cur == '}') {
+            depth--;
+        }
+        is_empty = false;
+        sn_cur_next(c);
+    }
+
+    return !is_empty;
+}
+
+// moves the cursor past one expression, or past a bracket that closes
+// nothing, without parsing it
+void sn_cur_skip_expr(sn_cursor_t *c)
+{
+    if (*c->cur == '(' || *c->cur == '{') {
+        sn_cur_next(c);
+        sn_cur_skip_to_close(c);
+    }
+
+    if (sn_cur_more(c) && (*c->cur == ')' || *c->cur == '}')) {
+        sn_cur_next(c);
+        return;
+    }
+
+    while (!sn_cur_is_end_of_token(c)) {
+        sn_cur_next(c);
+    }
+}
+
+// parses the keyword and prototype of a fn or pure form, and scans the body
+// for where it ends. Anything else, and a function without a body, is left
+// for sn_cur_parse_expr().
+sn_error_t sn_cur_parse_lazy_fn(sn_cursor_t *c, sn_expr_t **expr_out)
+{
+    sn_program_t *prog = c->prog;
+    if (!sn_cur_more(c) || *c->cur != '(') {
+        return SN_SUCCESS;
+    }
+
+    sn_cursor_t start = *c;
+    sn_expr_t *expr = calloc(1, sizeof *expr);
+    expr->prog = prog;
+    expr->type = SN_EXPR_TYPE_LIST;
+    expr->line = c->line;
+    expr->col = c->col;
+    sn_cur_next(c);
+
+    sn_expr_t *keyw = NULL;
+    sn_expr_t *proto = NULL;
+    sn_error_t status = sn_cur_parse_expr(c, &keyw);
+    if (status == SN_SUCCESS && keyw != NULL && keyw->type == SN_EXPR_TYPE_SYMBOL &&
+        (keyw->sym == prog->sn_fn || keyw->sym == prog->sn_pure)) {
+        status = sn_cur_parse_expr(c, &proto);
+    }
+
+    // the text of the body is in that of the form, once it is kept
+    sn_expr_t *body = NULL;
+    if (status == SN_SUCCESS && proto != NULL) {
+        body = calloc(1, sizeof *body);
+        body->prog = prog;
+        body->type = SN_EXPR_TYPE_UNPARSED;
+        body->line = c->line;
+        body->col = c->col;
+
+        const char *text = c->cur;
+        if (sn_cur_skip_to_close(c)) {
+            body->vint = c->cur - text;
+            status = sn_cur_consume(c, ')');
+        }
+        else {
+            free(body);
+            body = NULL;
+        }
+    }
+
+    if (status != SN_SUCCESS || body == NULL) {
+        sn_form_free(keyw);
+        sn_form_free(proto);
+        free(expr);
+        free(body);
+        if (status == SN_SUCCESS) {
+            *c = start;
+        }
+        return status;
+    }
+
+    expr->child_head = keyw;
+    keyw->next = proto;
+    proto->next = body;
+    expr->child_count = 3;
+    sn_expr_pack_children(expr);
+    *expr_out = expr;
+    return SN_SUCCESS;
+}
+
+// a top level form keeps its text, so that an update can tell whether it
+// changed. With the lazy_parse option, function bodies are left unparsed.
+sn_error_t sn_cur_parse_form(sn_cursor_t *c, sn_expr_t **expr_out)
+{
+    *expr_out = NULL;
+    sn_cur_skip_whitespace(c);
+    const char *start = c->cur;
+
+    sn_error_t status = SN_SUCCESS;
+    if (c->prog->options.lazy_parse) {
+        status = sn_cur_parse_lazy_fn(c, expr_out);
+    }
+    if (status == SN_SUCCESS && *expr_out == NULL) {
+        status = sn_cur_parse_expr(c, expr_out);
+    }
+
+    sn_expr_t *expr = *expr_out;
+    if (status != SN_SUCCESS || expr == NULL || expr->type != SN_EXPR_TYPE_LIST) {
+        return status;
+    }
+
+    expr->vint = c->cur - start;
+    expr->text = malloc(expr->vint);
+    memcpy(expr->text, start, expr->vint);
+
+    // an unparsed body ends right before the bracket that closes the form
+    sn_expr_t *body = expr->child_count > 0 ? &expr->child_head[expr->child_count - 1] : NULL;
+    if (body != NULL && body->type == SN_EXPR_TYPE_UNPARSED) {
+        body->text = expr->text + expr->vint - 1 - body->vint;
+    }
+    return SN_SUCCESS;
+}
+
+// parses the body of a function that was only scanned, in place of the
+// unparsed expression that ends its form
+sn_error_t sn_expr_parse_body(sn_expr_t *form)
+{
+    sn_expr_t *body = &form->child_head[form->child_count - 1];
+    assert(body->type == SN_EXPR_TYPE_UNPARSED);
+
+    sn_cursor_t c;
+    sn_cursor_init(&c, form->prog, body->text, body->vint);
+    c.line = body->line;
+    c.col = body->col;
+
+    sn_expr_t list = {0};
+    sn_error_t status = sn_cur_parse_expr_list(&c, &list);
+    if (status == SN_SUCCESS && c.cur != c.last) {
+        status = sn_cur_error(&c, SN_ERROR_EXPECTED_EXPR_CLOSE);
+    }
+    if (status != SN_SUCCESS) {
+        return sn_pos_error(form->prog, c.error_line, c.error_col, status);
+    }
+
+    size_t kept_count = form->child_count - 1;
+    size_t count = kept_count + list.child_count;
+    sn_expr_t *children = calloc(count, sizeof children[0]);
+    memcpy(children, form->child_head, kept_count * sizeof children[0]);
+    memcpy(children + kept_count, list.child_head, list.child_count * sizeof children[0]);
+    for (size_t i = 0; i + 1 < count; i++) {
+        children[i].next = &children[i + 1];
+    }
+
+    free(form->child_head);
+    free(list.child_head);
+    form->child_head = children;
+    form->child_count = count;
+    return SN_SUCCESS;
+}
+
+// frees what parsing allocated for the children of expr
+void sn_expr_free_children(sn_expr_t *expr)
+{
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        sn_expr_free_children(child);
+        if (child->type == SN_EXPR_TYPE_INTEGER && SN_VALUE_IS_BOX(child->literal)) {
+            free(SN_VALUE_BOX(child->literal));
+        }
+    }
+    free(expr->child_head);
+}
+
+void sn_form_free(sn_expr_t *form)
+{
+    if (form == NULL) {
+        return;
+    }
+
+    sn_expr_free_children(form);
+    if (form->type == SN_EXPR_TYPE_LIST) {
+        free(form->text);
+    }
+    free(form);
+}
+
+// parses the top level forms from c into list, which are all of them when the
+// cursor is at the end of the source. Each form is allocated on its own, so
+// that an update can free it; tail_out is where the next one is linked.
+sn_error_t sn_cur_parse_forms(sn_cursor_t *c, sn_expr_t *list, sn_expr_t ***tail_out)
+{
+    sn_error_t status = SN_SUCCESS;
+    list->type = SN_EXPR_TYPE_LIST;
+    sn_expr_t **form_tail = &list->child_head;
+    sn_expr_t *form = NULL;
+
+    while ((status = sn_cur_parse_form(c, &form)) == SN_SUCCESS && form != NULL) {
+        *form_tail = form;
+        form_tail = &form->next;
+        list->child_count++;
+    }
+
+    *tail_out = form_tail;
+    if (status != SN_SUCCESS) {
+        return status;
+    }
+    if (c->cur != c->last) {
+        return sn_cur_error(c, SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT);
+    }
+
+    return SN_SUCCESS;
+}
+
+// whether a form ends with ch, which is the next byte of the source. Brackets
+// and whitespace in comments don't count, and a form that isn't a list ends
+// at the whitespace after it.
+bool sn_scan_byte(sn_scan_t *scan, char ch)
+{
+    if (scan->in_comment) {
+        if (ch != '\n') {
+            return false;
+        }
+        scan->in_comment = false;
+    }
+
+    bool is_space = isspace((unsigned char)ch);
+    bool form_done = is_space && scan->in_form && scan->depth == 0;
+    if (ch == '(' || ch == '{') {
+        scan->depth++;
+    }
+    else if ((ch == ')' || ch == '}') && scan->depth > 0) {
+        scan->depth--;
+        form_done = scan->depth == 0;
+    }
+
+    scan->in_comment = ch == ';' && scan->after_semicolon;
+    scan->after_semicolon = ch == ';' && !scan->in_comment;
+    scan->in_form = !form_done && (scan->in_form || !is_space);
+    return form_done;
+}
+
+typedef struct sn_segment_st
+{
+    sn_cursor_t cursor;
+    sn_expr_t forms;
+    sn_expr_t **tail;
+    sn_error_t status;
+} sn_segment_t;
+
+// segments after one that failed are left unparsed
+sn_error_t sn_parse_segment(void *data, sn_stack_t *stack, int64_t block)
+{
+    sn_segment_t *segment = &((sn_segment_t *)data)[block];
+    segment->status = sn_cur_parse_forms(&segment->cursor, &segment->forms, &segment->tail);
+    return segment->status;
+}
+
+// splits the source into segments of about SN_PARSE_SEGMENT_SIZE bytes that
+// end where top level forms do, each with the position it starts at
+size_t sn_parse_split(sn_program_t *prog, const char *source, size_t size, sn_segment_t **segments_out)
+{
+    size_t cap = size / SN_PARSE_SEGMENT_SIZE + 1;
+    sn_segment_t *segments = calloc(cap, sizeof segments[0]);
+    size_t count = 0;
+
+    sn_scan_t scan = {0};
+    size_t start = 0;
+    int line = 1;
+    int col = 1;
+    int start_line = 1;
+    int start_col = 1;
+    for (size_t i = 0; i < size; i++) {
+        bool form_done = sn_scan_byte(&scan, source[i]);
+        col++;
+        if (source[i] == '\n') {
+            line++;
+            col = 1;
+        }
+
+        if (form_done && i + 1 - start >= SN_PARSE_SEGMENT_SIZE && count + 1 < cap) {
+            sn_cursor_init(&segments[count].cursor, prog, source + start, i + 1 - start);
+            segments[count].cursor.line = start_line;
+            segments[count].cursor.col = start_col;
+            count++;
+            start = i + 1;
+            start_line = line;
+            start_col = col;
+        }
+    }
+
+    sn_cursor_init(&segments[count].cursor, prog, source + start, size - start);
+    segments[count].cursor.line = start_line;
+    segments[count].cursor.col = start_col;
+    count++;
+
+    *segments_out = segments;
+    return count;
+}
+
+// a long source is split where top level forms end, and the segments are
+// parsed on the pool. Forms are linked in the order of the source, and the
+// error is the one of the first segment that failed, which is the one parsing
+// it in one go finds.
+sn_error_t sn_program_parse_parallel(sn_program_t *prog, const char *source, size_t size)
+{
+    sn_segment_t *segments = NULL;
+    size_t count = sn_parse_split(prog, source, size, &segments);
+    sn_pool_run_plain(prog, sn_parse_segment, segments, count);
+
+    // the forms from the first segment that failed on aren't linked, and
+    // are freed here
+    sn_error_t status = SN_SUCCESS;
+    sn_expr_t **form_tail = &prog->expr.child_head;
+    for (size_t i = 0; i < count; i++) {
+        sn_segment_t *segment = &segments[i];
+        if (status == SN_SUCCESS && segment->status != SN_SUCCESS) {
+            status = sn_cursor_record_error(&segment->cursor, segment->status);
+        }
+
+        if (status != SN_SUCCESS) {
+            for (sn_expr_t *form = segment->forms.child_head; form != NULL;) {
+                sn_expr_t *next = form->next;
+                sn_form_free(form);
+                form = next;
+            }
+        }
+        else if (segment->forms.child_count > 0) {
+            *form_tail = segment->forms.child_head;
+            form_tail = segment->tail;
+            prog->expr.child_count += segment->forms.child_count;
+        }
+    }
+
+    free(segments);
+    return status;
+}
+
+sn_error_t sn_program_parse(sn_program_t *prog, const char *source, size_t size)
+{
+    prog->expr.type = SN_EXPR_TYPE_LIST;
+    prog->expr.prog = prog;
+    prog->expr.rtype = SN_RTYPE_PROGRAM;
+
+    if (sn_pool_thread_count(prog) > 1 && size >= 2 * SN_PARSE_SEGMENT_SIZE) {
+        return sn_program_parse_parallel(prog, source, size);
+    }
+
+    sn_cursor_t c;
+    sn_expr_t **tail = NULL;
+    sn_cursor_init(&c, prog, source, size);
+    sn_error_t status = sn_cur_parse_forms(&c, &prog->expr, &tail);
+    if (status != SN_SUCCESS) {
+        return sn_cursor_record_error(&c, status);
     }
 
-    expr->child_head = expr_array;
     return SN_SUCCESS;
 }
 
-sn_error_t sn_program_parse(sn_program_t *prog)
+// a top level form of the source an update is given
+typedef struct sn_new_form_st
 {
-    prog->cur_line = 1;
-    prog->cur_col = 1;
+    const char *text;
+    size_t size;
+    int line;
+    int col;
+    sn_expr_t *expr;
+    bool is_parsed;
+} sn_new_form_t;
+
+// the top level lists of a program by their text
+typedef struct sn_form_table_st
+{
+    sn_expr_t **slots;
+    size_t mask;
+} sn_form_table_t;
+
+// left in the slot of a form that was taken, so that finding goes on past it
+static sn_expr_t sn_form_taken;
+
+void sn_form_table_init(sn_form_table_t *table, sn_expr_t *forms, size_t count)
+{
+    size_t cap = 16;
+    while (cap < 2 * count) {
+        cap *= 2;
+    }
+    table->slots = calloc(cap, sizeof table->slots[0]);
+    table->mask = cap - 1;
+
+    for (sn_expr_t *form = forms; form != NULL; form = form->next) {
+        if (form->type != SN_EXPR_TYPE_LIST) {
+            continue;
+        }
+
+        size_t i = sn_symbol_hash(form->text, form->vint) & table->mask;
+        while (table->slots[i] != NULL) {
+            i = (i + 1) & table->mask;
+        }
+        table->slots[i] = form;
+    }
+}
+
+sn_expr_t *sn_form_table_take(sn_form_table_t *table, const char *text, size_t size)
+{
+    size_t i = sn_symbol_hash(text, size) & table->mask;
+    for (; table->slots[i] != NULL; i = (i + 1) & table->mask) {
+        sn_expr_t *form = table->slots[i];
+        if (form != &sn_form_taken && (size_t)form->vint == size && memcmp(form->text, text, size) == 0) {
+            table->slots[i] = &sn_form_taken;
+            return form;
+        }
+    }
+
+    return NULL;
+}
+
+// moves the positions in a kept form to where its text starts now
+void sn_expr_move(sn_expr_t *expr, int first_line, int line_delta, int col_delta)
+{
+    if (expr->line == first_line) {
+        expr->col += col_delta;
+    }
+    expr->line += line_delta;
+
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        sn_expr_move(child, first_line, line_delta, col_delta);
+    }
+}
+
+// parses a form that changed on its own, at its place in the source
+sn_error_t sn_new_form_parse(sn_program_t *prog, sn_new_form_t *form)
+{
+    sn_cursor_t c;
+    sn_cursor_init(&c, prog, form->text, form->size);
+    c.line = form->line;
+    c.col = form->col;
+
+    form->is_parsed = true;
+    sn_error_t status = sn_cur_parse_form(&c, &form->expr);
+    if (status == SN_SUCCESS && (form->expr == NULL || c.cur != c.last)) {
+        status = sn_cur_error(&c, SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT);
+    }
+    if (status != SN_SUCCESS) {
+        return sn_cursor_record_error(&c, status);
+    }
+
+    return SN_SUCCESS;
+}
+
+// splits source into top level forms, keeps the forms of the program with the
+// same text and parses the others. Only once they all parsed do they replace
+// the forms of the program; the forms that weren't kept are then returned to
+// be freed, as functions may still refer to them until it is built again.
+sn_error_t sn_program_reparse(sn_program_t *prog,
+                              const char *source,
+                              size_t size,
+                              sn_expr_t ***dropped_out,
+                              size_t *dropped_count_out)
+{
+    sn_form_table_t table;
+    sn_form_table_init(&table, prog->expr.child_head, prog->expr.child_count);
+
+    sn_new_form_t *forms = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    sn_cursor_t c;
+    sn_cursor_init(&c, prog, source, size);
+    for (sn_cur_skip_whitespace(&c); sn_cur_more(&c); sn_cur_skip_whitespace(&c)) {
+        if (count == cap) {
+            cap = SN_MAX(64, 2 * cap);
+            forms = realloc(forms, cap * sizeof forms[0]);
+        }
+
+        sn_new_form_t *form = &forms[count++];
+        memset(form, '\0', sizeof *form);
+        form->text = c.cur;
+        form->line = c.line;
+        form->col = c.col;
+        sn_cur_skip_expr(&c);
+        form->size = c.cur - form->text;
+        form->expr = sn_form_table_take(&table, form->text, form->size);
+    }
+
+    sn_error_t status = SN_SUCCESS;
+    for (size_t i = 0; i < count && status == SN_SUCCESS; i++) {
+        if (forms[i].expr == NULL) {
+            status = sn_new_form_parse(prog, &forms[i]);
+        }
+    }
+
+    if (status != SN_SUCCESS) {
+        for (size_t i = 0; i < count; i++) {
+            if (forms[i].is_parsed) {
+                sn_form_free(forms[i].expr);
+            }
+        }
+        free(forms);
+        free(table.slots);
+        return status;
+    }
+
+    // what is left in the table, and forms that aren't lists, are dropped
+    sn_expr_t **dropped = calloc(SN_MAX(prog->expr.child_count, 1), sizeof dropped[0]);
+    size_t dropped_count = 0;
+    for (sn_expr_t *form = prog->expr.child_head; form != NULL; form = form->next) {
+        if (form->type != SN_EXPR_TYPE_LIST) {
+            dropped[dropped_count++] = form;
+        }
+    }
+    for (size_t i = 0; i <= table.mask; i++) {
+        if (table.slots[i] != NULL && table.slots[i] != &sn_form_taken) {
+            dropped[dropped_count++] = table.slots[i];
+        }
+    }
+
+    sn_expr_t **form_tail = &prog->expr.child_head;
+    for (size_t i = 0; i < count; i++) {
+        sn_expr_t *expr = forms[i].expr;
+        if (!forms[i].is_parsed && (expr->line != forms[i].line || expr->col != forms[i].col)) {
+            sn_expr_move(expr, expr->line, forms[i].line - expr->line, forms[i].col - expr->col);
+        }
+        *form_tail = expr;
+        form_tail = &expr->next;
+    }
+    *form_tail = NULL;
+    prog->expr.child_count = count;
 
+    free(forms);
+    free(table.slots);
+    *dropped_out = dropped;
+    *dropped_count_out = dropped_count;
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_parser_create(sn_parser_t **parser_out,
+                            sn_program_t **program_out,
+                            const sn_program_options_t *options)
+{
+    sn_program_t *prog = sn_program_create_empty(options);
+    prog->expr.type = SN_EXPR_TYPE_LIST;
     prog->expr.prog = prog;
     prog->expr.rtype = SN_RTYPE_PROGRAM;
 
-    sn_error_t status = sn_cur_parse_expr_list(prog, &prog->expr);
-    if (status == SN_SUCCESS && prog->cur != prog->last) {
-        return sn_cur_error(prog, SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT);
+    sn_parser_t *parser = calloc(1, sizeof *parser);
+    parser->prog = prog;
+    parser->form_tail = &prog->expr.child_head;
+    sn_cursor_init(&parser->cursor, prog, NULL, 0);
+
+    *parser_out = parser;
+    *program_out = prog;
+    return SN_SUCCESS;
+}
+
+// parses and builds the top level forms in text, which starts where the
+// previous text ended
+sn_error_t sn_parser_parse_text(sn_parser_t *parser, const char *text, size_t size)
+{
+    sn_program_t *prog = parser->prog;
+    sn_cursor_t *c = &parser->cursor;
+    c->cur = text;
+    c->last = text + size;
+
+    sn_error_t status = SN_SUCCESS;
+    sn_expr_t *form = NULL;
+    while ((status = sn_cur_parse_form(c, &form)) == SN_SUCCESS && form != NULL) {
+        *parser->form_tail = form;
+        parser->form_tail = &form->next;
+        prog->expr.child_count++;
+
+        status = sn_program_build_form(prog, form);
+        if (status != SN_SUCCESS) {
+            return status;
+        }
     }
 
+    if (status == SN_SUCCESS && c->cur != c->last) {
+        status = sn_cur_error(c, SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT);
+    }
+    if (status != SN_SUCCESS) {
+        return sn_cursor_record_error(c, status);
+    }
+
+    return SN_SUCCESS;
+}
+
+void sn_parser_keep_text(sn_parser_t *parser, const char *text, size_t size)
+{
+    if (parser->text_size + size > parser->text_cap) {
+        parser->text_cap = SN_MAX(4096, 2 * (parser->text_size + size));
+        parser->text = realloc(parser->text, parser->text_cap);
+    }
+
+    memcpy(parser->text + parser->text_size, text, size);
+    parser->text_size += size;
+}
+
+// the form ends with text, so it can be parsed now
+sn_error_t sn_parser_end_form(sn_parser_t *parser, const char *text, size_t size)
+{
+    if (parser->text_size == 0) {
+        return sn_parser_parse_text(parser, text, size);
+    }
+
+    sn_parser_keep_text(parser, text, size);
+    size_t text_size = parser->text_size;
+    parser->text_size = 0;
+    return sn_parser_parse_text(parser, parser->text, text_size);
+}
+
+sn_error_t sn_parser_feed(sn_parser_t *parser, const char *chunk, size_t size)
+{
+    if (parser->status != SN_SUCCESS) {
+        return parser->status;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (sn_scan_byte(&parser->scan, chunk[i])) {
+            parser->status = sn_parser_end_form(parser, chunk + start, i + 1 - start);
+            if (parser->status != SN_SUCCESS) {
+                return parser->status;
+            }
+            start = i + 1;
+        }
+    }
+
+    // whitespace between forms only moves the position on
+    if (!parser->scan.in_form && parser->text_size == 0) {
+        parser->status = sn_parser_parse_text(parser, chunk + start, size - start);
+        return parser->status;
+    }
+
+    sn_parser_keep_text(parser, chunk + start, size - start);
+    return SN_SUCCESS;
+}
+
+sn_error_t sn_parser_finish(sn_parser_t *parser)
+{
+    sn_program_t *prog = parser->prog;
+    sn_error_t status = parser->status;
+    if (status == SN_SUCCESS) {
+        status = sn_parser_parse_text(parser, parser->text, parser->text_size);
+    }
+
+    if (status == SN_SUCCESS && prog->main_ref.type == SN_SCOPE_TYPE_INVALID) {
+        status = SN_ERROR_MAIN_FN_MISSING;
+    }
+    prog->is_built = status == SN_SUCCESS;
+
+    free(parser->text);
+    free(parser);
     return status;
 }
 
-sn_error_t sn_program_reorder_infix_expr(sn_program_t *prog, sn_expr_t *expr)
+sn_error_t sn_cur_reorder_infix_expr(sn_cursor_t *c, sn_expr_t *expr)
 {
     if (expr->child_count != 3) {
-        return sn_expr_error(expr, SN_ERROR_INFIX_EXPR_NOT_3_ELEMENTS);
+        c->error_line = expr->line;
+        c->error_col = expr->col;
+        return SN_ERROR_INFIX_EXPR_NOT_3_ELEMENTS;
     }
 
     sn_expr_t *exprs = expr->child_head;
@@ -219,61 +911,61 @@ sn_error_t sn_program_reorder_infix_expr(sn_program_t *prog, sn_expr_t *expr)
     return SN_SUCCESS;
 }
 
-sn_error_t sn_cur_parse_expr(sn_program_t *prog, sn_expr_t **expr_out)
+sn_error_t sn_cur_parse_expr(sn_cursor_t *c, sn_expr_t **expr_out)
 {
     sn_error_t status = SN_SUCCESS;
     *expr_out = NULL;
 
-    sn_cur_skip_whitespace(prog);
-    if (sn_cur_is_expr_end(prog)) {
+    sn_cur_skip_whitespace(c);
+    if (sn_cur_is_expr_end(c)) {
         return SN_SUCCESS;
     }
 
     sn_expr_t *expr = calloc(1, sizeof *expr);
-    expr->prog = prog;
-    expr->line = prog->cur_line;
-    expr->col = prog->cur_col;
+    expr->prog = c->prog;
+    expr->line = c->line;
+    expr->col = c->col;
 
-    if (sn_cur_is_integer(prog)) {
-        status = sn_cur_parse_integer(prog, expr);
+    if (sn_cur_is_integer(c)) {
+        status = sn_cur_parse_integer(c, expr);
         if (status != SN_SUCCESS) {
             goto Done;
         }
     }
-    else if (*prog->cur == '(') {
-        status = sn_cur_consume(prog, '(');
+    else if (*c->cur == '(') {
+        status = sn_cur_consume(c, '(');
         if (status != SN_SUCCESS) {
             goto Done;
         }
-        status = sn_cur_parse_expr_list(prog, expr);
+        status = sn_cur_parse_expr_list(c, expr);
         if (status != SN_SUCCESS) {
             goto Done;
         }
-        status = sn_cur_consume(prog, ')');
+        status = sn_cur_consume(c, ')');
         if (status != SN_SUCCESS) {
             goto Done;
         }
     }
-    else if (*prog->cur == '{') {
-        status = sn_cur_consume(prog, '{');
+    else if (*c->cur == '{') {
+        status = sn_cur_consume(c, '{');
         if (status != SN_SUCCESS) {
             goto Done;
         }
-        status = sn_cur_parse_expr_list(prog, expr);
+        status = sn_cur_parse_expr_list(c, expr);
         if (status != SN_SUCCESS) {
             goto Done;
         }
-        status = sn_cur_consume(prog, '}');
+        status = sn_cur_consume(c, '}');
         if (status != SN_SUCCESS) {
             goto Done;
         }
-        status = sn_program_reorder_infix_expr(prog, expr);
+        status = sn_cur_reorder_infix_expr(c, expr);
         if (status != SN_SUCCESS) {
             goto Done;
         }
     }
     else {
-        status = sn_cur_parse_symbol(prog, expr);
+        status = sn_cur_parse_symbol(c, expr);
         if (status != SN_SUCCESS) {
             goto Done;
         }
@@ -284,6 +976,7 @@ Done:
         *expr_out = expr;
     }
     else {
+        sn_expr_free_children(expr);
         free(expr);
     }
     return status;
@@ -0,0 +1,531 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "snscript_internal.h"
+
+// Work-stealing thread pool for pmap and preduce, which also parses and
+// builds long programs and runs batches.
+//
+// A job is a range of blocks. Each worker has a deque of tasks, which are
+// ranges of blocks of some job: a worker splits the range it takes in halves,
+// pushing the second half to the bottom of its deque and going on with the
+// first, and idle workers steal from the top, where the largest ranges are.
+// Every worker has its own vm whose stack runs the calls, reading the
+// globals of the vm that started the job. The blocks only depend on the job,
+// so results don't depend on the number of threads or on which thread ran
+// which block.
+//
+// A worker can start a job itself, when a call it runs forks its arguments.
+// Instead of sleeping until the job is done it runs tasks, its own first, on
+// the stack it is already using, above the slots of the call that waits.
+
+typedef struct sn_pool_task_st
+{
+    sn_pool_job_t *job;
+    int64_t first;
+    int64_t last;
+} sn_pool_task_t;
+
+typedef struct sn_pool_worker_st
+{
+    sn_pool_t *pool;
+    pthread_t thread;
+    sn_vm_t *vm;
+
+    pthread_mutex_t lock;
+    sn_pool_task_t *tasks;
+    int top;
+    int bottom;
+    int cap;
+} sn_pool_worker_t;
+
+struct sn_pool_st
+{
+    int worker_count;
+    int started_count;
+    sn_pool_worker_t *workers;
+
+    // tasks in all the deques, idle workers sleep until there are some
+    int64_t task_count;
+    int idle_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+    unsigned next_worker;
+};
+
+// the worker running on this thread, if it is one
+static __thread sn_pool_worker_t *sn_pool_self;
+
+void sn_pool_push(sn_pool_worker_t *worker, sn_pool_task_t task)
+{
+    pthread_mutex_lock(&worker->lock);
+    if (worker->bottom == worker->cap) {
+        // compact before growing, the top moves down as tasks are stolen
+        int count = worker->bottom - worker->top;
+        if (worker->top > 0) {
+            memmove(worker->tasks, &worker->tasks[worker->top], count * sizeof worker->tasks[0]);
+            worker->top = 0;
+            worker->bottom = count;
+        }
+        if (count == worker->cap) {
+            worker->cap = SN_MAX(16, 2 * worker->cap);
+            worker->tasks = realloc(worker->tasks, worker->cap * sizeof worker->tasks[0]);
+        }
+    }
+    worker->tasks[worker->bottom++] = task;
+    pthread_mutex_unlock(&worker->lock);
+
+    sn_pool_t *pool = worker->pool;
+    __atomic_add_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool sn_pool_pop(sn_pool_worker_t *worker, bool steal, sn_pool_task_t *task_out)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->top < worker->bottom) {
+        *task_out = steal ? worker->tasks[worker->top++] : worker->tasks[--worker->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if (found) {
+        __atomic_sub_fetch(&worker->pool->task_count, 1, __ATOMIC_SEQ_CST);
+    }
+    return found;
+}
+
+bool sn_pool_take(sn_pool_worker_t *worker, sn_pool_task_t *task_out)
+{
+    if (sn_pool_pop(worker, false, task_out)) {
+        return true;
+    }
+
+    sn_pool_t *pool = worker->pool;
+    int self = worker - pool->workers;
+    for (int i = 1; i < pool->worker_count; i++) {
+        if (sn_pool_pop(&pool->workers[(self + i) % pool->worker_count], true, task_out)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void sn_pool_finish_blocks(sn_pool_job_t *job, int64_t count)
+{
+    pthread_mutex_lock(&job->lock);
+    job->blocks_left -= count;
+    if (job->blocks_left == 0) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+void sn_pool_run_block(sn_pool_job_t *job, sn_stack_t *stack, int64_t block)
+{
+    if (block > __atomic_load_n(&job->error_block, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    sn_error_t status = job->fn(job->data, stack, block);
+    if (status != SN_SUCCESS) {
+        pthread_mutex_lock(&job->lock);
+        if (block < job->error_block) {
+            __atomic_store_n(&job->error_block, block, __ATOMIC_RELAXED);
+            job->error = status;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+// hands a task to the workers in turn
+void sn_pool_push_any(sn_pool_t *pool, sn_pool_task_t task)
+{
+    unsigned idx = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+    sn_pool_push(&pool->workers[idx % pool->worker_count], task);
+}
+
+// runs a task on stack, which may be in the middle of a task of another job.
+// A worker splits the task and leaves the rest in its deque. A thread that
+// isn't a worker runs all of its blocks, except for a plain job on the pool,
+// whose rest it hands to the workers.
+void sn_pool_run_task(sn_pool_worker_t *worker, sn_stack_t *stack, sn_pool_task_t task)
+{
+    sn_pool_job_t *job = task.job;
+
+    while ((worker != NULL || (job->is_plain && job->pool != NULL)) && task.last - task.first > 1) {
+        int64_t mid = task.first + (task.last - task.first) / 2;
+        sn_pool_task_t rest = { job, mid, task.last };
+        if (worker != NULL) {
+            sn_pool_push(worker, rest);
+        }
+        else {
+            sn_pool_push_any(job->pool, rest);
+        }
+        task.last = mid;
+    }
+
+    if (job->is_plain) {
+        for (int64_t block = task.first; block < task.last; block++) {
+            sn_pool_run_block(job, NULL, block);
+        }
+        sn_pool_finish_blocks(job, task.last - task.first);
+        return;
+    }
+
+    sn_stack_t saved = *stack;
+    sn_stack_lend(stack, job->globals, job->max_steps, job->deadline_ns);
+    stack->lend_depth++;
+    for (int64_t block = task.first; block < task.last; block++) {
+        sn_pool_run_block(job, stack, block);
+    }
+
+    // futures spawned by the task read the globals of the job
+    sn_stack_join_futures(stack, stack->lend_depth, stack);
+    stack->lend_depth--;
+
+    int64_t steps_left = stack->steps_left + stack->fuel;
+    __atomic_add_fetch(&job->steps_used, job->max_steps - steps_left, __ATOMIC_RELAXED);
+
+    stack->globals = saved.globals;
+    stack->steps_left = saved.steps_left;
+    stack->deadline_ns = saved.deadline_ns;
+    stack->fuel = saved.fuel;
+    sn_pool_finish_blocks(job, task.last - task.first);
+}
+
+void *sn_pool_worker_main(void *data)
+{
+    sn_pool_worker_t *worker = data;
+    sn_pool_t *pool = worker->pool;
+    sn_box_arena_t *prev_boxes = sn_box_arena_enter(&worker->vm->stack.boxes);
+    sn_pool_self = worker;
+
+    while (true) {
+        sn_pool_task_t task;
+        if (sn_pool_take(worker, &task)) {
+            sn_pool_run_task(worker, &worker->vm->stack, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&pool->task_count, __ATOMIC_SEQ_CST) == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+        bool stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    sn_pool_self = NULL;
+    sn_box_arena_leave(prev_boxes);
+    return NULL;
+}
+
+int sn_pool_thread_count(sn_program_t *prog)
+{
+    int thread_count = prog->options.thread_count;
+    if (thread_count <= 0) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return SN_MAX(thread_count, 1);
+}
+
+// whether forking is likely to help: only when some worker has nothing to do,
+// or none have started yet
+bool sn_pool_can_fork(sn_program_t *prog)
+{
+    if (sn_pool_thread_count(prog) == 1) {
+        return false;
+    }
+
+    sn_pool_t *pool = __atomic_load_n(&prog->pool, __ATOMIC_ACQUIRE);
+    return pool == NULL || __atomic_load_n(&pool->idle_count, __ATOMIC_RELAXED) > 0;
+}
+
+sn_error_t sn_pool_create(sn_pool_t **pool_out, sn_program_t *prog, int thread_count)
+{
+    sn_pool_t *pool = calloc(1, sizeof *pool);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pool->workers = calloc(thread_count, sizeof pool->workers[0]);
+    for (int i = 0; i < thread_count; i++) {
+        sn_pool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        pthread_mutex_init(&worker->lock, NULL);
+        sn_vm_create(&worker->vm);
+        sn_vm_init_worker(worker->vm, prog);
+    }
+
+    // workers steal from each other, so they all exist before any starts
+    pool->worker_count = thread_count;
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, sn_pool_worker_main, &pool->workers[i]) != 0) {
+            sn_pool_destroy(pool);
+            return SN_ERROR_GENERIC;
+        }
+        pool->started_count++;
+    }
+
+    *pool_out = pool;
+    return SN_SUCCESS;
+}
+
+void sn_pool_destroy(sn_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->started_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        sn_pool_worker_t *worker = &pool->workers[i];
+        sn_vm_destroy(worker->vm);
+        free(worker->tasks);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+void sn_pool_job_init(sn_pool_job_t *job, sn_pool_block_fn_t fn, void *data)
+{
+    memset(job, '\0', sizeof *job);
+    job->fn = fn;
+    job->data = data;
+    job->error_block = INT64_MAX;
+    job->error = SN_SUCCESS;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+}
+
+void sn_pool_job_deinit(sn_pool_job_t *job)
+{
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->lock);
+}
+
+// the pool of prog, which the first job starts; NULL if it couldn't be
+sn_pool_t *sn_pool_get(sn_program_t *prog)
+{
+    pthread_mutex_lock(&prog->pool_lock);
+    sn_pool_t *pool = prog->pool;
+    if (pool == NULL) {
+        sn_pool_create(&pool, prog, sn_pool_thread_count(prog));
+        __atomic_store_n(&prog->pool, pool, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&prog->pool_lock);
+    return pool;
+}
+
+// starts fn over the blocks [0, block_count) for the vm running on stack,
+// without waiting for them. The steps of the workers are taken from the
+// budget of the vm by sn_pool_wait(); a vm that is stepped can't be
+// suspended during the job, so its workers aren't limited.
+sn_error_t sn_pool_start(sn_stack_t *stack, sn_pool_job_t *job, int64_t block_count)
+{
+    sn_program_t *prog = stack->vm->prog;
+    sn_pool_t *pool = NULL;
+
+    job->blocks_left = block_count;
+    if (block_count == 0) {
+        return SN_SUCCESS;
+    }
+
+    if (sn_pool_thread_count(prog) == 1) {
+        for (int64_t block = 0; block < block_count && job->error == SN_SUCCESS; block++) {
+            job->error = job->fn(job->data, stack, block);
+        }
+        job->blocks_left = 0;
+        return SN_SUCCESS;
+    }
+
+    pool = sn_pool_get(prog);
+    if (pool == NULL) {
+        job->blocks_left = 0;
+        return SN_ERROR_GENERIC;
+    }
+
+    job->pool = pool;
+    job->globals = stack->globals;
+    job->max_steps = stack->suspend_when_exhausted ? INT64_MAX : stack->steps_left + stack->fuel;
+    job->deadline_ns = stack->deadline_ns;
+
+    sn_pool_task_t task = { job, 0, block_count };
+    sn_pool_worker_t *self = sn_pool_self;
+    if (self != NULL && self->pool == pool) {
+        sn_pool_push(self, task);
+    }
+    else {
+        sn_pool_push_any(pool, task);
+    }
+
+    return SN_SUCCESS;
+}
+
+bool sn_pool_steal(sn_pool_t *pool, sn_pool_task_t *task_out)
+{
+    for (int i = 0; i < pool->worker_count; i++) {
+        if (sn_pool_pop(&pool->workers[i], true, task_out)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// takes a task of job from the top of a deque, leaving those of other jobs
+bool sn_pool_steal_job(sn_pool_t *pool, sn_pool_job_t *job, sn_pool_task_t *task_out)
+{
+    for (int i = 0; i < pool->worker_count; i++) {
+        sn_pool_worker_t *worker = &pool->workers[i];
+        bool found = false;
+
+        pthread_mutex_lock(&worker->lock);
+        if (worker->top < worker->bottom && worker->tasks[worker->top].job == job) {
+            *task_out = worker->tasks[worker->top++];
+            found = true;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        if (found) {
+            __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sn_pool_is_done(sn_pool_job_t *job)
+{
+    pthread_mutex_lock(&job->lock);
+    bool done = job->blocks_left == 0;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+// waits for a job that was started on stack, and returns the error of the
+// first block that failed. Until the job is done, the thread runs tasks on
+// helper: a worker takes its own first, another thread steals them. With no
+// helper, or one that is stepped and can't lend its budget, it just sleeps.
+sn_error_t sn_pool_wait(sn_stack_t *stack, sn_pool_job_t *job, sn_stack_t *helper)
+{
+    sn_pool_t *pool = job->pool;
+    sn_pool_worker_t *self = sn_pool_self;
+    if (pool == NULL || self == NULL || self->pool != pool) {
+        self = NULL;
+    }
+    if (helper != NULL && self == NULL && helper->suspend_when_exhausted) {
+        helper = NULL;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (job->blocks_left > 0) {
+        if (helper != NULL) {
+            sn_pool_task_t next;
+            pthread_mutex_unlock(&job->lock);
+            bool found = self != NULL ? sn_pool_take(self, &next) : sn_pool_steal(pool, &next);
+            if (found) {
+                sn_pool_run_task(self, helper, next);
+            }
+            pthread_mutex_lock(&job->lock);
+            if (found) {
+                continue;
+            }
+        }
+        if (job->blocks_left > 0) {
+            pthread_cond_wait(&job->done, &job->lock);
+        }
+    }
+
+    // a future can be waited for more than once, its steps count once
+    int64_t steps_used = job->steps_used;
+    job->steps_used = 0;
+    pthread_mutex_unlock(&job->lock);
+
+    if (steps_used < stack->fuel) {
+        stack->fuel -= steps_used;
+    }
+    else {
+        stack->steps_left = SN_MAX(stack->steps_left - (steps_used - stack->fuel), 0);
+        stack->fuel = 0;
+    }
+
+    return job->error;
+}
+
+// runs fn over the blocks [0, block_count) for the vm running on stack, and
+// returns the error of the first block that failed
+sn_error_t sn_pool_run(sn_stack_t *stack, sn_pool_block_fn_t fn, void *data, int64_t block_count)
+{
+    sn_pool_job_t job;
+    sn_pool_job_init(&job, fn, data);
+
+    sn_error_t status = sn_pool_start(stack, &job, block_count);
+    if (status == SN_SUCCESS) {
+        status = sn_pool_wait(stack, &job, stack);
+    }
+
+    sn_pool_job_deinit(&job);
+    return status;
+}
+
+// runs fn over the blocks [0, block_count) on the pool of prog, for work
+// that isn't part of a run, and returns the error of the first block that
+// failed. The calling thread, which mustn't be a worker, runs blocks too;
+// with one thread, or one block, it runs all of them.
+sn_error_t sn_pool_run_plain(sn_program_t *prog, sn_pool_block_fn_t fn, void *data, int64_t block_count)
+{
+    sn_pool_job_t job;
+    sn_pool_job_init(&job, fn, data);
+    job.is_plain = true;
+    job.blocks_left = block_count;
+    if (block_count > 1 && sn_pool_thread_count(prog) > 1) {
+        job.pool = sn_pool_get(prog);
+    }
+
+    sn_pool_task_t task = { &job, 0, block_count };
+    sn_pool_run_task(NULL, NULL, task);
+
+    pthread_mutex_lock(&job.lock);
+    while (job.blocks_left > 0) {
+        sn_pool_task_t next;
+        pthread_mutex_unlock(&job.lock);
+        bool found = sn_pool_steal_job(job.pool, &job, &next);
+        if (found) {
+            sn_pool_run_task(NULL, NULL, next);
+        }
+        pthread_mutex_lock(&job.lock);
+        if (!found && job.blocks_left > 0) {
+            pthread_cond_wait(&job.done, &job.lock);
+        }
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    sn_error_t status = job.error;
+    sn_pool_job_deinit(&job);
+    return status;
+}
@@ -6,6 +6,7 @@
 
 #include "snscript_internal.h"
 #define SN_ERROR_CASE(x) case SN_ERROR_ ## x: return "SN_ERROR_" #x
+#define SN_ADD_BUILTIN_FN(prog, str, fn, is_pure) sn_program_add_builtin_fn(prog, str, fn, #fn, is_pure)
 
 const char *sn_error_str(sn_error_t status)
 {
@@ -38,6 +39,7 @@ const char *sn_error_str(sn_error_t status)
         SN_ERROR_CASE(INVALID_PARAMS_TO_FN);
         SN_ERROR_CASE(WRONG_VALUE_TYPE);
         SN_ERROR_CASE(WRONG_ARG_COUNT_IN_CALL);
+        SN_ERROR_CASE(BUDGET_EXHAUSTED);
         SN_ERROR_CASE(LAZY_EXPR_TOO_SHORT);
         SN_ERROR_CASE(NOT_ALLOWED_IN_PURE_FN);
         SN_ERROR_CASE(GENERIC);
@@ -45,10 +47,27 @@ const char *sn_error_str(sn_error_t status)
     return NULL;
 }
 
+// set on threads that build function bodies in parallel, which keep the
+// error of each body apart from the program
+static __thread sn_build_error_t *sn_expr_error_out;
+
+void sn_expr_error_redirect(sn_build_error_t *error)
+{
+    sn_expr_error_out = error;
+}
+
 sn_error_t sn_expr_error(sn_expr_t *expr, sn_error_t error)
 {
     assert(error != SN_SUCCESS);
 
+    sn_build_error_t *out = sn_expr_error_out;
+    if (out != NULL) {
+        out->line = expr->line;
+        out->col = expr->col;
+        out->sym = expr->type == SN_EXPR_TYPE_SYMBOL ? expr->sym : NULL;
+        return error;
+    }
+
     sn_program_t *prog = expr->prog;
     prog->error_line = expr->line;
     prog->error_col = expr->col;
@@ -58,6 +77,25 @@ sn_error_t sn_expr_error(sn_expr_t *expr, sn_error_t error)
     return error;
 }
 
+// for an error that is at a position of the source rather than an expression,
+// like one parsing a body left for later
+sn_error_t sn_pos_error(sn_program_t *prog, int line, int col, sn_error_t error)
+{
+    assert(error != SN_SUCCESS);
+
+    sn_build_error_t *out = sn_expr_error_out;
+    if (out != NULL) {
+        out->line = line;
+        out->col = col;
+        out->sym = NULL;
+        return error;
+    }
+
+    prog->error_line = line;
+    prog->error_col = col;
+    return error;
+}
+
 void sn_program_error_pos(sn_program_t *prog, int *line_out, int *col_out)
 {
     *line_out = prog->error_line;
@@ -69,33 +107,71 @@ void sn_program_error_symbol(sn_program_t *prog, const char **symbol_out)
     *symbol_out = (prog->error_sym == NULL) ? NULL : prog->error_sym->value;
 }
 
-sn_symbol_t *sn_program_add_symbol(sn_program_t *prog, const char *str, size_t size)
+uint64_t sn_symbol_hash(const char *str, size_t size)
 {
-    sn_symbol_t *sym = calloc(1, sizeof *sym + size + 1);
-    sym->length = size;
-    memcpy(sym->value, str, size);
-
-    *prog->symbol_tail = sym;
-    prog->symbol_tail = &sym->next;
-
-    return sym;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint8_t)str[i]) * 1099511628211ull;
+    }
+    return hash;
 }
 
-sn_symbol_t *sn_program_default_symbol(sn_program_t *prog, const char *str)
+void sn_symbol_shard_grow(sn_symbol_shard_t *shard)
 {
-    return sn_program_add_symbol(prog, str, strlen(str));
+    size_t bucket_count = SN_MAX(64, 2 * shard->bucket_count);
+    sn_symbol_t **buckets = calloc(bucket_count, sizeof buckets[0]);
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        sn_symbol_t *sym = shard->buckets[i];
+        while (sym != NULL) {
+            sn_symbol_t *next = sym->next;
+            sn_symbol_t **bucket = &buckets[sym->hash & (bucket_count - 1)];
+            sym->next = *bucket;
+            *bucket = sym;
+            sym = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
 }
 
+// the symbol with the name [start, end), which is added the first time
 sn_symbol_t *sn_program_get_symbol(sn_program_t *prog, const char *start, const char *end)
 {
     size_t size = end - start;
-    for (sn_symbol_t *sym = prog->symbol_head; sym != NULL; sym = sym->next) {
-        if (sym->length == size && memcmp(sym->value, start, size) == 0) {
-            return sym;
-        }
+    uint64_t hash = sn_symbol_hash(start, size);
+    sn_symbol_shard_t *shard = &prog->symbols[(hash >> 32) & (SN_SYMBOL_SHARD_COUNT - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->count >= shard->bucket_count) {
+        sn_symbol_shard_grow(shard);
+    }
+
+    sn_symbol_t **bucket = &shard->buckets[hash & (shard->bucket_count - 1)];
+    sn_symbol_t *sym = *bucket;
+    while (sym != NULL && (sym->hash != hash || sym->length != size || memcmp(sym->value, start, size) != 0)) {
+        sym = sym->next;
+    }
+
+    if (sym == NULL) {
+        sym = calloc(1, sizeof *sym + size + 1);
+        sym->length = size;
+        sym->hash = hash;
+        sym->global_index = -1;
+        memcpy(sym->value, start, size);
+        sym->next = *bucket;
+        *bucket = sym;
+        shard->count++;
     }
+    pthread_mutex_unlock(&shard->lock);
 
-    return sn_program_add_symbol(prog, start, size);
+    return sym;
+}
+
+sn_symbol_t *sn_program_default_symbol(sn_program_t *prog, const char *str)
+{
+    return sn_program_get_symbol(prog, str, str + strlen(str));
 }
 
 sn_expr_t *sn_expr_create_builtin(sn_program_t *prog, sn_symbol_t *name)
@@ -118,16 +194,21 @@ sn_value_t *sn_program_add_builtin_value(sn_program_t *prog, const char *str)
     return sn_scope_create_const(&prog->globals, &decl->ref);
 }
 
-void
-sn_program_add_builtin_fn(sn_program_t *prog, const char *str, sn_builtin_fn_t fn, bool is_pure)
+sn_builtin_func_t *
+sn_program_add_builtin_fn(sn_program_t *prog,
+                          const char *str,
+                          sn_builtin_fn_t fn,
+                          const char *c_name,
+                          bool is_pure)
 {
     sn_builtin_func_t *func = calloc(1, sizeof *func);
     func->is_pure = is_pure;
     func->fn = fn;
+    func->c_name = c_name;
 
     sn_value_t *value = sn_program_add_builtin_value(prog, str);
-    value->type = SN_VALUE_TYPE_BUILTIN_FN;
-    value->builtin_fn = func;
+    *value = sn_make_builtin_fn(func);
+    return func;
 }
 
 void sn_program_add_default_symbols(sn_program_t *prog)
@@ -154,34 +235,69 @@ void sn_program_add_default_symbols(sn_program_t *prog)
     *sn_program_add_builtin_value(prog, "false") = sn_false;
 
     // add builtin functions
-    sn_program_add_builtin_fn(prog, "int?", sn_is_int, true);
-    sn_program_add_builtin_fn(prog, "fn?", sn_is_fn, true);
-    sn_program_add_builtin_fn(prog, "null?", sn_is_null, true);
-    sn_program_add_builtin_fn(prog, "==", sn_equals, true);
-    sn_program_add_builtin_fn(prog, "!=", sn_not_equals, true);
-    sn_program_add_builtin_fn(prog, "!", sn_not, true);
-    sn_program_add_builtin_fn(prog, "+", sn_add, true);
-    sn_program_add_builtin_fn(prog, "-", sn_sub, true);
-    sn_program_add_builtin_fn(prog, "*", sn_mul, true);
-    sn_program_add_builtin_fn(prog, "/", sn_div, true);
-    sn_program_add_builtin_fn(prog, "%", sn_mod, true);
-    sn_program_add_builtin_fn(prog, "println", sn_println, false);
+    SN_ADD_BUILTIN_FN(prog, "int?", sn_is_int, true);
+    SN_ADD_BUILTIN_FN(prog, "fn?", sn_is_fn, true);
+    SN_ADD_BUILTIN_FN(prog, "null?", sn_is_null, true);
+    SN_ADD_BUILTIN_FN(prog, "==", sn_equals, true);
+    SN_ADD_BUILTIN_FN(prog, "!=", sn_not_equals, true);
+    SN_ADD_BUILTIN_FN(prog, "!", sn_not, true);
+    SN_ADD_BUILTIN_FN(prog, "+", sn_add, true);
+    SN_ADD_BUILTIN_FN(prog, "-", sn_sub, true);
+    SN_ADD_BUILTIN_FN(prog, "*", sn_mul, true);
+    SN_ADD_BUILTIN_FN(prog, "/", sn_div, true);
+    SN_ADD_BUILTIN_FN(prog, "%", sn_mod, true);
+    SN_ADD_BUILTIN_FN(prog, "println", sn_println, false);
+    SN_ADD_BUILTIN_FN(prog, "yield", sn_yield, false);
+    SN_ADD_BUILTIN_FN(prog, "len", sn_len, true);
+    SN_ADD_BUILTIN_FN(prog, "at", sn_at, true);
+    SN_ADD_BUILTIN_FN(prog, "pmap", sn_pmap, false);
+    SN_ADD_BUILTIN_FN(prog, "preduce", sn_preduce, false);
+    // spawn runs the call itself with one thread, and await helps the pool
+    SN_ADD_BUILTIN_FN(prog, "spawn", sn_spawn, true)->runs_code = true;
+    SN_ADD_BUILTIN_FN(prog, "await", sn_await, true)->runs_code = true;
+}
+
+void sn_program_options_init(sn_program_options_t *options)
+{
+    memset(options, '\0', sizeof *options);
+    options->jit_threshold = SN_JIT_DEFAULT_THRESHOLD;
 }
 
 sn_error_t sn_program_create(sn_program_t **program_out, const char *source, size_t size)
+{
+    return sn_program_create_with_options(program_out, source, size, NULL);
+}
+
+// a program with the builtins and nothing parsed yet
+sn_program_t *sn_program_create_empty(const sn_program_options_t *options)
 {
     sn_program_t *prog = calloc(1, sizeof *prog);
-    prog->start = source;
-    prog->cur = source;
-    prog->last = source + size;
+    if (options != NULL) {
+        prog->options = *options;
+    }
+    else {
+        sn_program_options_init(&prog->options);
+    }
 
-    prog->symbol_tail = &prog->symbol_head;
-    sn_program_add_default_symbols(prog);
+    pthread_mutex_init(&prog->jit_lock, NULL);
+    pthread_mutex_init(&prog->build_lock, NULL);
+    pthread_mutex_init(&prog->pool_lock, NULL);
 
-    sn_error_t status = sn_program_parse(prog);
+    for (int i = 0; i < SN_SYMBOL_SHARD_COUNT; i++) {
+        pthread_mutex_init(&prog->symbols[i].lock, NULL);
+    }
+    sn_program_add_default_symbols(prog);
+    prog->builtin_count = prog->globals.cur_decl_count;
+    return prog;
+}
 
-    prog->cur = NULL;
-    prog->last = NULL;
+sn_error_t sn_program_create_with_options(sn_program_t **program_out,
+                                          const char *source,
+                                          size_t size,
+                                          const sn_program_options_t *options)
+{
+    sn_program_t *prog = sn_program_create_empty(options);
+    sn_error_t status = sn_program_parse(prog, source, size);
 
     *program_out = prog;
     return status;
@@ -193,9 +309,99 @@ void sn_program_destroy(sn_program_t *prog)
         return;
     }
 
+    sn_pool_destroy(prog->pool);
+    pthread_mutex_destroy(&prog->pool_lock);
+    sn_jit_release(prog);
+    pthread_mutex_destroy(&prog->jit_lock);
+    pthread_mutex_destroy(&prog->build_lock);
+
+    // the builtins are owned by the globals, and the rest by the forms, which
+    // also own the functions they declared
+    for (sn_expr_t *decl = prog->globals.decl_head; decl != NULL;) {
+        sn_expr_t *next = decl->next_decl;
+        if (decl->ref.index < prog->builtin_count) {
+            free(decl);
+        }
+        decl = next;
+    }
+    for (sn_const_t *c = prog->globals.head_const; c != NULL;) {
+        sn_const_t *next = c->next;
+        if (c->idx < prog->builtin_count && SN_VALUE_IS_BUILTIN_FN(c->value)) {
+            free(SN_VALUE_BUILTIN_FN(c->value));
+        }
+        free(c);
+        c = next;
+    }
+    free(prog->globals.consts);
+
+    sn_expr_t *form = prog->expr.child_head;
+    while (form != NULL) {
+        sn_expr_t *next = form->next;
+        sn_func_free(sn_form_func(form));
+        sn_form_free(form);
+        form = next;
+    }
+    free(prog->funcs);
+
+    for (int i = 0; i < SN_SYMBOL_SHARD_COUNT; i++) {
+        sn_symbol_shard_t *shard = &prog->symbols[i];
+        for (size_t j = 0; j < shard->bucket_count; j++) {
+            sn_symbol_t *sym = shard->buckets[j];
+            while (sym != NULL) {
+                sn_symbol_t *next = sym->next;
+                free(sym);
+                sym = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
     free(prog);
 }
 
+size_t sn_expr_memory_size(sn_expr_t *expr)
+{
+    size_t size = expr->child_count * sizeof(sn_expr_t);
+    for (sn_expr_t *child = expr->child_head; child != NULL; child = child->next) {
+        size += sn_expr_memory_size(child);
+    }
+    return size;
+}
+
+// roughly the bytes a program holds, for the cache to weigh it by; the
+// machine code of the JIT and the pool's threads aren't counted
+size_t sn_program_memory_size(sn_program_t *prog)
+{
+    size_t size = sizeof *prog;
+    for (sn_expr_t *form = prog->expr.child_head; form != NULL; form = form->next) {
+        size += sizeof *form + sn_expr_memory_size(form);
+        if (form->type == SN_EXPR_TYPE_LIST && form->text != NULL) {
+            size += (size_t)form->vint;
+        }
+    }
+
+    size += prog->func_cap * sizeof prog->funcs[0];
+    for (size_t i = 0; i < prog->func_count; i++) {
+        size += sizeof(sn_func_t) + prog->funcs[i]->use_cap * sizeof(sn_expr_t *);
+    }
+
+    for (int i = 0; i < SN_SYMBOL_SHARD_COUNT; i++) {
+        sn_symbol_shard_t *shard = &prog->symbols[i];
+        size += shard->bucket_count * sizeof shard->buckets[0];
+        for (size_t j = 0; j < shard->bucket_count; j++) {
+            for (sn_symbol_t *sym = shard->buckets[j]; sym != NULL; sym = sym->next) {
+                size += sizeof *sym + sym->length + 1;
+            }
+        }
+    }
+
+    size += prog->globals.const_cap * sizeof prog->globals.consts[0];
+    for (sn_const_t *c = prog->globals.head_const; c != NULL; c = c->next) {
+        size += sizeof *c;
+    }
+    return size;
+}
+
 bool sn_symbol_equals_string(sn_symbol_t *sym, const char *str)
 {
     size_t len = strlen(str);
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "snscript_internal.h"
 
@@ -16,6 +17,14 @@ sn_value_t *sn_scope_create_const(sn_scope_t *scope, sn_ref_t *ref)
     c->next = scope->head_const;
     scope->head_const = c;
 
+    if (c->idx >= scope->const_cap) {
+        int cap = SN_MAX(64, 2 * c->idx);
+        scope->consts = realloc(scope->consts, cap * sizeof scope->consts[0]);
+        memset(scope->consts + scope->const_cap, '\0', (cap - scope->const_cap) * sizeof scope->consts[0]);
+        scope->const_cap = cap;
+    }
+    scope->consts[c->idx] = c;
+
     ref->is_const = true;
 
     return &c->value;
@@ -23,13 +32,11 @@ sn_value_t *sn_scope_create_const(sn_scope_t *scope, sn_ref_t *ref)
 
 sn_value_t *sn_scope_get_const_value(sn_scope_t *scope, sn_ref_t *ref)
 {
-    for (sn_const_t *c = scope->head_const; c != NULL; c = c->next) {
-        if (c->idx == ref->index) {
-            return &c->value;
-        }
+    if (ref->index >= scope->const_cap || scope->consts[ref->index] == NULL) {
+        return NULL;
     }
 
-    return NULL;
+    return &scope->consts[ref->index]->value;
 }
 
 void sn_scope_init_consts(sn_scope_t *scope, sn_value_t *values)
@@ -41,6 +48,10 @@ void sn_scope_init_consts(sn_scope_t *scope, sn_value_t *values)
 
 sn_ref_t *sn_scope_find_var_current_scope(sn_scope_t *scope, sn_symbol_t *name)
 {
+    if (sn_scope_type(scope) == SN_SCOPE_TYPE_GLOBAL) {
+        return name->global != NULL ? &name->global->ref : NULL;
+    }
+
     for (sn_expr_t *decl = scope->decl_head; decl != NULL; decl = decl->next_decl) {
         if (name == decl->sym) {
             return &decl->ref;
@@ -61,6 +72,9 @@ void sn_block_leave(sn_block_t *block)
 {
     sn_scope_t *scope = block->scope;
     while (scope->decl_head != block->parent) {
+        if (sn_scope_type(scope) == SN_SCOPE_TYPE_GLOBAL) {
+            scope->decl_head->sym->global = NULL;
+        }
         scope->decl_head = scope->decl_head->next_decl;
         scope->cur_decl_count--;
     }
@@ -79,15 +93,56 @@ sn_error_t sn_scope_add_var(sn_scope_t *scope, sn_expr_t *expr)
 
     expr->next_decl = scope->decl_head;
     scope->decl_head = expr;
+    if (sn_scope_type(scope) == SN_SCOPE_TYPE_GLOBAL) {
+        // a global keeps its index when an update declares it again, so the
+        // bodies that refer to it don't have to be built again
+        if (expr->sym->global_index < 0) {
+            expr->sym->global_index = scope->max_decl_count;
+        }
+        expr->ref.index = expr->sym->global_index;
+        expr->sym->global = expr;
+    }
     scope->cur_decl_count++;
-    scope->max_decl_count = SN_MAX(scope->cur_decl_count, scope->max_decl_count);
+    scope->max_decl_count = SN_MAX(SN_MAX(scope->cur_decl_count, expr->ref.index + 1), scope->max_decl_count);
     return SN_SUCCESS;
 }
 
+// drops the globals the program declared, and keeps the builtins
+void sn_scope_clear_globals(sn_scope_t *scope, int builtin_count)
+{
+    while (scope->decl_head != NULL && scope->decl_head->ref.index >= builtin_count) {
+        scope->decl_head->sym->global = NULL;
+        scope->decl_head = scope->decl_head->next_decl;
+        scope->cur_decl_count--;
+    }
+
+    while (scope->head_const != NULL && scope->head_const->idx >= builtin_count) {
+        sn_const_t *c = scope->head_const;
+        scope->consts[c->idx] = NULL;
+        scope->head_const = c->next;
+        free(c);
+    }
+}
+
+// whether the global decl is in the source before the name of a function,
+// or is the name itself
+bool sn_scope_global_is_visible(sn_expr_t *decl, sn_expr_t *fn_name)
+{
+    return fn_name == NULL ||
+           decl->line < fn_name->line ||
+           (decl->line == fn_name->line && decl->col <= fn_name->col);
+}
+
 sn_error_t sn_scope_find_var(sn_scope_t *scope, sn_symbol_t *name, sn_ref_t *ref)
 {
+    sn_expr_t *fn_name = NULL;
     for (sn_scope_t *cur = scope; cur != NULL; cur = cur->parent) {
+        fn_name = cur->fn_name != NULL ? cur->fn_name : fn_name;
         sn_ref_t *found = sn_scope_find_var_current_scope(cur, name);
+        if (found != NULL && sn_scope_type(cur) == SN_SCOPE_TYPE_GLOBAL &&
+            !sn_scope_global_is_visible(name->global, fn_name)) {
+            found = NULL;
+        }
         if (found != NULL) {
             *ref = *found;
             return SN_SUCCESS;
@@ -1,9 +1,83 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include "snscript.h"
 
-void write_error(const char *file, sn_error_t status, sn_program_t *prog)
+// snscript --serve keeps a built program and runs main for integers sent over
+// a unix socket. Each request is an int64_t argument, and each reply a
+// serve_reply_t in the same order, both in host byte order since the two ends
+// share a machine. Output of println goes to the stdout of the server.
+// SIGHUP loads the file again; each request runs on the program that is
+// published when it starts, and a file that fails to build leaves the old one.
+// Each thread runs the top level forms of a program once, and main for each
+// request starts from the globals they left, as in a batch.
+typedef enum serve_kind_en
+{
+    SERVE_KIND_NULL,
+    SERVE_KIND_INTEGER,
+    SERVE_KIND_BOOLEAN,
+    // a value that doesn't fit a reply, such as a vector
+    SERVE_KIND_OTHER,
+} serve_kind_t;
+
+typedef struct serve_reply_st
+{
+    int32_t status;
+    int32_t kind;
+    // the position of the error, when status isn't SN_SUCCESS
+    int32_t line;
+    int32_t col;
+    int64_t value;
+} serve_reply_t;
+
+// requests read from a connection at a time, and sent by the client before it
+// waits for their replies
+#define SERVE_WINDOW 64
+
+typedef struct serve_conn_st
+{
+    int fd;
+    // with the start of a request that a read cut off
+    int64_t requests[SERVE_WINDOW];
+    size_t have;
+} serve_conn_t;
+
+typedef struct serve_conn_list_st
+{
+    serve_conn_t **conns;
+    int count;
+    int cap;
+} serve_conn_list_t;
+
+// the thread that accepts connections also polls the ones that are idle, and
+// queues one when it has requests; a thread answers a window of them and
+// hands the connection back, so a client that sends nothing holds no thread
+typedef struct server_st
+{
+    sn_program_handle_t *handle;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // connections with requests, not yet taken by a thread
+    serve_conn_list_t ready;
+    // connections that were answered, for the accept thread to poll again
+    serve_conn_list_t answered;
+} server_t;
+
+void write_error(FILE *out, const char *file, sn_error_t status, sn_program_t *prog)
 {
     int line = 0;
     int col = 0;
@@ -12,7 +86,7 @@ void write_error(const char *file, sn_error_t status, sn_program_t *prog)
     sn_program_error_pos(prog, &line, &col);
     sn_program_error_symbol(prog, &str);
 
-    fprintf(stderr,
+    fprintf(out,
             "%s:%d:%d %s%s%s\n",
             file,
             line,
@@ -22,14 +96,27 @@ void write_error(const char *file, sn_error_t status, sn_program_t *prog)
             str == NULL ? "" : str);
 }
 
-int main(int argc, char **argv)
+void usage(void)
 {
-    if (argc < 2) {
-        exit(-1);
-    }
+    fprintf(stderr,
+            "usage: snscript [--emit-c] file [arg]\n"
+            "       snscript -j n file...\n"
+            "       snscript --each-line file [-j n] < input\n"
+            "       snscript file --in column --out column [-j n]\n"
+            "       snscript --serve file --socket path [--threads n]\n"
+            "       snscript --client --socket path [arg...]\n"
+            "--emit-c writes the program as C to stdout; a compiled run frees boxed\n"
+            "integers only once it ends, and recursion too deep overflows the C stack\n");
+    exit(-1);
+}
 
-    FILE *f = fopen(argv[1], "rb");
-    assert(f);
+// NULL if the file can't be opened
+char *read_file(const char *path, size_t *size_out)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
 
     int ret = fseek(f, 0, SEEK_END);
     assert(ret == 0);
@@ -44,19 +131,1077 @@ int main(int argc, char **argv)
 
     fclose(f);
 
+    *size_out = size;
+    return bytes;
+}
+
+// writes the error and returns NULL if the program doesn't parse or build.
+// The file is parsed as it is read, so a script can be piped in as it is
+// generated.
+sn_program_t *try_load_program(const char *path, const sn_program_options_t *options)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    sn_parser_t *parser = NULL;
     sn_program_t *prog = NULL;
-    sn_error_t status = sn_program_create(&prog, bytes, size);
+    sn_error_t status = sn_parser_create(&parser, &prog, options);
+    assert(status == SN_SUCCESS);
+
+    char chunk[65536];
+    size_t size = 0;
+    while (status == SN_SUCCESS && (size = fread(chunk, 1, sizeof chunk, f)) > 0) {
+        status = sn_parser_feed(parser, chunk, size);
+    }
+
+    sn_error_t finish_status = sn_parser_finish(parser);
+    if (ferror(f)) {
+        perror(path);
+        fclose(f);
+        sn_program_destroy(prog);
+        return NULL;
+    }
+    fclose(f);
+
+    if (status == SN_SUCCESS) {
+        status = finish_status;
+    }
     if (status != SN_SUCCESS) {
-        write_error(argv[1], status, prog);
+        write_error(stderr, path, status, prog);
+        sn_program_destroy(prog);
+        return NULL;
+    }
+
+    return prog;
+}
+
+// exits if the program doesn't parse or build
+sn_program_t *load_program(const char *path, const sn_program_options_t *options)
+{
+    sn_program_t *prog = try_load_program(path, options);
+    if (prog == NULL) {
+        exit(-1);
+    }
+    return prog;
+}
+
+int socket_at(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof addr->sun_path) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        exit(-1);
+    }
+
+    memset(addr, '\0', sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    return fd;
+}
+
+// reads up to size bytes, at least one unless the peer is gone; returns the
+// count read, or 0 at the end
+size_t read_some(int fd, void *buf, size_t size)
+{
+    for (;;) {
+        ssize_t n = read(fd, buf, size);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+}
+
+bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        size_t n = read_some(fd, p, size);
+        if (n == 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// a vm of a thread, started on the program it keeps pinned. It moves to
+// another once that one is published, so an idle thread keeps the program
+// before alive until its next request.
+typedef struct serve_vm_st
+{
+    sn_vm_t *vm;
+    sn_program_t *prog;
+    // how the top level forms went, which every request gets if they failed
+    sn_error_t start_status;
+} serve_vm_t;
+
+void serve_run(serve_vm_t *sv,
+               sn_program_handle_t *handle,
+               int64_t i,
+               sn_value_t *arg,
+               sn_value_t *value,
+               serve_reply_t *reply)
+{
+    memset(reply, '\0', sizeof *reply);
+    sn_value_set_integer(arg, i);
+
+    sn_program_t *prog = sn_program_handle_pin(handle);
+    if (prog == sv->prog) {
+        sn_program_unpin(prog);
+    }
+    else {
+        // a vm that failed to start may still point at the program before,
+        // so it goes before that is unpinned
+        if (sv->prog != NULL) {
+            sn_vm_destroy(sv->vm);
+            sn_error_t status = sn_vm_create(&sv->vm);
+            assert(status == SN_SUCCESS);
+            sn_program_unpin(sv->prog);
+        }
+        sv->prog = prog;
+        sv->start_status = sn_vm_start_batch(sv->vm, prog, NULL);
+    }
+
+    sn_error_t status = sv->start_status;
+    if (status == SN_SUCCESS) {
+        status = sn_vm_run_record(sv->vm, arg, value, NULL);
+    }
+
+    reply->status = status;
+    if (status != SN_SUCCESS) {
+        sn_vm_error_pos(sv->vm, &reply->line, &reply->col);
+        return;
+    }
+
+    bool b = false;
+    if (sn_value_is_null(value)) {
+        reply->kind = SERVE_KIND_NULL;
+    }
+    else if (sn_value_as_integer(value, &reply->value) == SN_SUCCESS) {
+        reply->kind = SERVE_KIND_INTEGER;
+    }
+    else if (sn_value_as_boolean(value, &b) == SN_SUCCESS) {
+        reply->kind = SERVE_KIND_BOOLEAN;
+        reply->value = b;
+    }
+    else {
+        reply->kind = SERVE_KIND_OTHER;
+    }
+}
+
+volatile sig_atomic_t serve_reload_requested;
+// the write end of a pipe that wakes up the thread that accepts connections
+int serve_wake_fd = -1;
+
+void serve_conn_list_push(serve_conn_list_t *list, serve_conn_t *conn)
+{
+    if (list->count == list->cap) {
+        list->cap = list->cap == 0 ? 16 : 2 * list->cap;
+        list->conns = realloc(list->conns, list->cap * sizeof list->conns[0]);
+    }
+    list->conns[list->count++] = conn;
+}
+
+// answers the requests of a window that has come in on a connection; false
+// once the client has closed it
+bool serve_window(serve_vm_t *sv, sn_program_handle_t *handle, serve_conn_t *conn, sn_value_t *arg, sn_value_t *value)
+{
+    serve_reply_t replies[SERVE_WINDOW];
+
+    size_t n = read_some(conn->fd, (char *)conn->requests + conn->have, sizeof conn->requests - conn->have);
+    if (n == 0) {
+        return false;
+    }
+
+    conn->have += n;
+    size_t count = conn->have / sizeof conn->requests[0];
+    for (size_t i = 0; i < count; i++) {
+        serve_run(sv, handle, conn->requests[i], arg, value, &replies[i]);
+    }
+
+    if (!write_all(conn->fd, replies, count * sizeof replies[0])) {
+        return false;
+    }
+
+    conn->have -= count * sizeof conn->requests[0];
+    memmove(conn->requests, &conn->requests[count], conn->have);
+    return true;
+}
+
+void *serve_thread_main(void *data)
+{
+    server_t *server = data;
+    serve_vm_t sv = {0};
+    sn_error_t status = sn_vm_create(&sv.vm);
+    assert(status == SN_SUCCESS);
+    sn_value_t *arg = sn_value_create();
+    sn_value_t *value = sn_value_create();
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->ready.count == 0) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+        serve_conn_t *conn = server->ready.conns[0];
+        server->ready.count--;
+        memmove(&server->ready.conns[0], &server->ready.conns[1], server->ready.count * sizeof server->ready.conns[0]);
+        pthread_mutex_unlock(&server->lock);
+
+        if (!serve_window(&sv, server->handle, conn, arg, value)) {
+            close(conn->fd);
+            free(conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        serve_conn_list_push(&server->answered, conn);
+        pthread_mutex_unlock(&server->lock);
+        ssize_t ret = write(serve_wake_fd, "", 1);
+        (void)ret;
+    }
+
+    return NULL;
+}
+
+void serve_on_sighup(int sig)
+{
+    serve_reload_requested = 1;
+    ssize_t ret = write(serve_wake_fd, "", 1);
+    (void)ret;
+}
+
+int serve(const char *file, const char *socket_path, int thread_count)
+{
+    server_t server = {0};
+    sn_program_handle_create(&server.handle, load_program(file, NULL));
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+
+    struct sockaddr_un addr;
+    int listen_fd = socket_at(socket_path, &addr);
+
+    // a socket left behind by an earlier server is replaced, anything else
+    // at the path is not
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        perror(socket_path);
+        exit(-1);
+    }
+
+    if (thread_count <= 0) {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = thread_count > 0 ? thread_count : 1;
+    }
+
+    // the pipe is never full enough for the handler to block on it, since a
+    // byte in it already wakes the poll
+    int wake_fds[2];
+    if (pipe(wake_fds) != 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    serve_wake_fd = wake_fds[1];
+
+    // SIGHUP is left to the thread that accepts connections
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_thread_main, &server) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+        pthread_detach(thread);
+    }
+
+    struct sigaction action = { .sa_handler = serve_on_sighup, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+
+    // the connections this thread polls
+    serve_conn_list_t idle = {0};
+    struct pollfd *pfds = NULL;
+    int pfd_cap = 0;
+
+    // the flag is checked on every turn; a signal that comes after the check
+    // leaves a byte in the pipe, so the poll doesn't sleep through it
+    for (;;) {
+        if (serve_reload_requested) {
+            serve_reload_requested = 0;
+            sn_program_t *prog = try_load_program(file, NULL);
+            if (prog != NULL) {
+                sn_program_handle_publish(server.handle, prog);
+            }
+        }
+
+        pthread_mutex_lock(&server.lock);
+        for (int i = 0; i < server.answered.count; i++) {
+            serve_conn_list_push(&idle, server.answered.conns[i]);
+        }
+        server.answered.count = 0;
+        pthread_mutex_unlock(&server.lock);
+
+        if (pfd_cap < 2 + idle.count) {
+            pfd_cap = 2 + idle.cap;
+            pfds = realloc(pfds, pfd_cap * sizeof pfds[0]);
+        }
+        pfds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        pfds[1] = (struct pollfd){ .fd = wake_fds[0], .events = POLLIN };
+        for (int i = 0; i < idle.count; i++) {
+            pfds[2 + i] = (struct pollfd){ .fd = idle.conns[i]->fd, .events = POLLIN };
+        }
+
+        if (poll(pfds, 2 + idle.count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(-1);
+        }
+
+        if (pfds[1].revents != 0) {
+            char drain[64];
+            while (read(wake_fds[0], drain, sizeof drain) > 0) {
+            }
+        }
+
+        // a connection that was closed is readable too, and the thread that
+        // takes it finds the end
+        pthread_mutex_lock(&server.lock);
+        int kept = 0;
+        for (int i = 0; i < idle.count; i++) {
+            if (pfds[2 + i].revents != 0) {
+                serve_conn_list_push(&server.ready, idle.conns[i]);
+                pthread_cond_signal(&server.cond);
+            }
+            else {
+                idle.conns[kept++] = idle.conns[i];
+            }
+        }
+        idle.count = kept;
+        pthread_mutex_unlock(&server.lock);
+
+        if (pfds[0].revents == 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            exit(-1);
+        }
+
+        serve_conn_t *conn = malloc(sizeof *conn);
+        conn->fd = fd;
+        conn->have = 0;
+        serve_conn_list_push(&idle, conn);
+    }
+}
+
+// prints a line per reply; errors go to stderr
+bool print_reply(int64_t arg, const serve_reply_t *reply)
+{
+    if (reply->status != SN_SUCCESS) {
+        fprintf(stderr, "%lld:%d:%d %s\n", (long long)arg, reply->line, reply->col,
+                sn_error_str(reply->status));
+        return false;
+    }
+
+    switch (reply->kind) {
+        case SERVE_KIND_NULL:
+            printf("null\n");
+            break;
+        case SERVE_KIND_INTEGER:
+            printf("%lld\n", (long long)reply->value);
+            break;
+        case SERVE_KIND_BOOLEAN:
+            printf("%s\n", reply->value ? "true" : "false");
+            break;
+        default:
+            printf("<value>\n");
+            break;
+    }
+    return true;
+}
+
+// the next argument from the command line, or from a line of stdin when
+// there are none on the command line
+bool next_arg(int *argc, char ***argv, bool from_stdin, int64_t *arg_out)
+{
+    if (!from_stdin) {
+        if (*argc == 0) {
+            return false;
+        }
+        *arg_out = strtoll((*argv)[0], NULL, 10);
+        (*argc)--;
+        (*argv)++;
+        return true;
+    }
+
+    char line[64];
+    if (fgets(line, sizeof line, stdin) == NULL) {
+        return false;
+    }
+    *arg_out = strtoll(line, NULL, 10);
+    return true;
+}
+
+// sends the arguments a window at a time and prints the replies in order;
+// fails if any run failed
+int client(const char *socket_path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    int fd = socket_at(socket_path, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        perror(socket_path);
         exit(-1);
     }
 
-    status = sn_program_build(prog);
+    bool from_stdin = argc == 0;
+    bool ok = true;
+    int64_t requests[SERVE_WINDOW];
+    serve_reply_t replies[SERVE_WINDOW];
+
+    for (;;) {
+        size_t count = 0;
+        while (count < SERVE_WINDOW && next_arg(&argc, &argv, from_stdin, &requests[count])) {
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        if (!write_all(fd, requests, count * sizeof requests[0]) ||
+            !read_all(fd, replies, count * sizeof replies[0])) {
+            fprintf(stderr, "%s: connection lost\n", socket_path);
+            exit(-1);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            ok &= print_reply(requests[i], &replies[i]);
+        }
+    }
+
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// a script run by snscript -j, whose output is kept until the scripts before
+// it have been written
+typedef struct job_st
+{
+    const char *file;
+    char *out;
+    size_t out_size;
+    char *err;
+    size_t err_size;
+    bool ok;
+    double ms;
+    bool done;
+} job_t;
+
+typedef struct jobs_st
+{
+    job_t *jobs;
+    int count;
+    // the next job to take, taken atomically
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} jobs_t;
+
+double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void write_to_file(void *ctx, const char *buf, size_t size)
+{
+    fwrite(buf, 1, size, ctx);
+}
+
+// parses, builds and runs main of a script with 0, like snscript file does
+bool run_job_file(const char *file, FILE *out, FILE *err)
+{
+    size_t size = 0;
+    char *bytes = read_file(file, &size);
+    if (bytes == NULL) {
+        fprintf(err, "%s: %s\n", file, strerror(errno));
+        return false;
+    }
+
+    // the scripts themselves are what runs in parallel, so each one keeps
+    // its pmap and preduce on its own thread
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = 1;
+    options.write = write_to_file;
+    options.write_ctx = out;
+
+    sn_program_t *prog = NULL;
+    sn_error_t status = sn_program_create_with_options(&prog, bytes, size, &options);
+    if (status == SN_SUCCESS) {
+        status = sn_program_build(prog);
+    }
+
+    if (status == SN_SUCCESS) {
+        sn_value_t *arg = sn_value_create();
+        sn_value_t *value = sn_value_create();
+        sn_value_set_integer(arg, 0);
+        status = sn_program_run_main(prog, arg, value);
+        sn_value_destroy(value);
+        sn_value_destroy(arg);
+    }
+
     if (status != SN_SUCCESS) {
-        write_error(argv[1], status, prog);
+        write_error(err, file, status, prog);
+    }
+
+    sn_program_destroy(prog);
+    free(bytes);
+    return status == SN_SUCCESS;
+}
+
+void *jobs_thread_main(void *data)
+{
+    jobs_t *jobs = data;
+
+    for (;;) {
+        int idx = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+        if (idx >= jobs->count) {
+            return NULL;
+        }
+
+        job_t *job = &jobs->jobs[idx];
+        FILE *out = open_memstream(&job->out, &job->out_size);
+        FILE *err = open_memstream(&job->err, &job->err_size);
+        assert(out != NULL && err != NULL);
+
+        double start = now_ms();
+        bool ok = run_job_file(job->file, out, err);
+        double ms = now_ms() - start;
+        fclose(out);
+        fclose(err);
+
+        pthread_mutex_lock(&jobs->lock);
+        job->ok = ok;
+        job->ms = ms;
+        job->done = true;
+        pthread_cond_broadcast(&jobs->cond);
+        pthread_mutex_unlock(&jobs->lock);
+    }
+}
+
+// runs the scripts on thread_count threads, and writes the output, errors,
+// status and time of each in the order given as soon as it and the scripts
+// before it are done; fails if any script failed
+int run_jobs(int thread_count, int file_count, char **files)
+{
+    jobs_t jobs = {
+        .jobs = calloc(file_count, sizeof jobs.jobs[0]),
+        .count = file_count,
+    };
+    pthread_mutex_init(&jobs.lock, NULL);
+    pthread_cond_init(&jobs.cond, NULL);
+    for (int i = 0; i < file_count; i++) {
+        jobs.jobs[i].file = files[i];
+    }
+
+    if (thread_count <= 0) {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    thread_count = thread_count < file_count ? thread_count : file_count;
+    thread_count = thread_count > 0 ? thread_count : 1;
+
+    pthread_t threads[thread_count];
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, jobs_thread_main, &jobs) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < file_count; i++) {
+        job_t *job = &jobs.jobs[i];
+        pthread_mutex_lock(&jobs.lock);
+        while (!job->done) {
+            pthread_cond_wait(&jobs.cond, &jobs.lock);
+        }
+        pthread_mutex_unlock(&jobs.lock);
+
+        fwrite(job->out, 1, job->out_size, stdout);
+        fflush(stdout);
+        fwrite(job->err, 1, job->err_size, stderr);
+        fprintf(stderr, "%s: %s %.3f ms\n", job->file, job->ok ? "ok" : "failed", job->ms);
+        ok &= job->ok;
+
+        free(job->out);
+        free(job->err);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&jobs.cond);
+    pthread_mutex_destroy(&jobs.lock);
+    free(jobs.jobs);
+    return ok ? 0 : -1;
+}
+
+// lines of stdin run as one batch by snscript --each-line
+#define EACH_LINE_BATCH 16384
+
+// reads stdin a block at a time and hands out its lines
+typedef struct line_reader_st
+{
+    FILE *in;
+    char *buf;
+    size_t pos;
+    size_t size;
+    size_t cap;
+    bool eof;
+} line_reader_t;
+
+// the next line, without its newline, or NULL at the end of the input
+const char *read_line(line_reader_t *r, size_t *length_out)
+{
+    for (;;) {
+        char *nl = memchr(r->buf + r->pos, '\n', r->size - r->pos);
+        if (nl != NULL || (r->eof && r->pos < r->size)) {
+            const char *line = r->buf + r->pos;
+            size_t end = nl != NULL ? (size_t)(nl - r->buf) : r->size;
+            *length_out = end - r->pos;
+            r->pos = nl != NULL ? end + 1 : end;
+            return line;
+        }
+
+        if (r->eof) {
+            return NULL;
+        }
+
+        // keeps the start of the line that was cut off by the end of the block
+        memmove(r->buf, r->buf + r->pos, r->size - r->pos);
+        r->size -= r->pos;
+        r->pos = 0;
+        if (r->size == r->cap) {
+            r->cap = r->cap == 0 ? 1 << 16 : 2 * r->cap;
+            r->buf = realloc(r->buf, r->cap);
+        }
+
+        size_t n = fread(r->buf + r->size, 1, r->cap - r->size, r->in);
+        r->size += n;
+        r->eof = n == 0;
+    }
+}
+
+// a decimal integer with an optional sign and surrounding blanks
+bool parse_int(const char *str, size_t length, int64_t *i_out)
+{
+    const char *p = str;
+    const char *end = str + length;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+
+    bool neg = p < end && *p == '-';
+    p += p < end && (*p == '-' || *p == '+');
+    if (p == end) {
+        return false;
+    }
+
+    uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t u = 0;
+    for (; p < end; p++) {
+        unsigned digit = (unsigned)(*p - '0');
+        if (digit > 9 || u > (limit - digit) / 10) {
+            return false;
+        }
+        u = u * 10 + digit;
+    }
+
+    *i_out = neg ? (int64_t)(0 - u) : (int64_t)u;
+    return true;
+}
+
+void write_int(FILE *out, int64_t i)
+{
+    char buf[24];
+    char *p = buf + sizeof buf;
+    uint64_t u = i < 0 ? 0 - (uint64_t)i : (uint64_t)i;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (i < 0) {
+        *--p = '-';
+    }
+    fwrite(p, 1, buf + sizeof buf - p, out);
+}
+
+// writes a value the way println does, as far as the public API can tell
+void write_value(FILE *out, sn_value_t *value)
+{
+    int64_t i = 0;
+    bool b = false;
+    if (sn_value_is_null(value)) {
+        fputs("null", out);
+    }
+    else if (sn_value_as_integer(value, &i) == SN_SUCCESS) {
+        write_int(out, i);
+    }
+    else if (sn_value_as_boolean(value, &b) == SN_SUCCESS) {
+        fputs(b ? "true" : "false", out);
+    }
+    else if (sn_value_as_vector(value, &i) == SN_SUCCESS) {
+        fputc('[', out);
+        for (int64_t k = 0; k < i; k++) {
+            if (k != 0) {
+                fputc(' ', out);
+            }
+            write_value(out, sn_value_vector_item(value, k));
+        }
+        fputc(']', out);
+    }
+    else {
+        fputs("<value>", out);
+    }
+}
+
+// calls main once per line of stdin and writes a line per result to stdout,
+// in the order of the input. The lines are run in batches, on thread_count
+// threads at once. A line that isn't an integer or whose run fails gets an
+// empty line and the error goes to stderr; fails if any line did.
+int each_line(const char *file, int thread_count)
+{
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = thread_count;
+    sn_program_t *prog = load_program(file, &options);
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+    sn_value_t **args = calloc(EACH_LINE_BATCH, sizeof args[0]);
+    sn_value_t **values = calloc(EACH_LINE_BATCH, sizeof values[0]);
+    sn_error_t *errors = calloc(EACH_LINE_BATCH, sizeof errors[0]);
+    // the run of each line, or -1 for lines that aren't integers
+    int *runs = calloc(EACH_LINE_BATCH, sizeof runs[0]);
+    for (int i = 0; i < EACH_LINE_BATCH; i++) {
+        args[i] = sn_value_create();
+        values[i] = sn_value_create();
+    }
+
+    line_reader_t reader = { .in = stdin };
+    size_t line_no = 0;
+    bool ok = true;
+    bool more = true;
+
+    while (more) {
+        int line_count = 0;
+        int run_count = 0;
+        while (line_count < EACH_LINE_BATCH) {
+            size_t length = 0;
+            const char *line = read_line(&reader, &length);
+            if (line == NULL) {
+                more = false;
+                break;
+            }
+
+            int64_t i = 0;
+            runs[line_count++] = parse_int(line, length, &i) ? run_count : -1;
+            if (runs[line_count - 1] >= 0) {
+                sn_value_set_integer(args[run_count++], i);
+            }
+        }
+
+        sn_error_t status = sn_program_run_batch(prog, run_count, args, values, errors, NULL);
+        if (status != SN_SUCCESS) {
+            write_error(stderr, file, status, prog);
+            exit(-1);
+        }
+
+        for (int k = 0; k < line_count; k++) {
+            line_no++;
+            int run = runs[k];
+            if (run < 0) {
+                fprintf(stderr, "%s: line %zu: not an integer\n", file, line_no);
+            }
+            else if (errors[run] != SN_SUCCESS) {
+                fprintf(stderr, "%s: line %zu: %s\n", file, line_no, sn_error_str(errors[run]));
+            }
+            else {
+                write_value(stdout, values[run]);
+            }
+            ok &= run >= 0 && errors[run] == SN_SUCCESS;
+            fputc('\n', stdout);
+        }
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < EACH_LINE_BATCH; i++) {
+        sn_value_destroy(args[i]);
+        sn_value_destroy(values[i]);
+    }
+    free(args);
+    free(values);
+    free(errors);
+    free(runs);
+    free(reader.buf);
+    sn_program_destroy(prog);
+    return ok ? 0 : -1;
+}
+
+// maps a file of size bytes, creating it when writable; exits if it can't
+void *map_file(const char *path, bool writable, size_t *size_out)
+{
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (writable && ftruncate(fd, *size_out) != 0)) {
+        perror(path);
         exit(-1);
     }
 
+    size_t size = writable ? *size_out : (size_t)st.st_size;
+    void *mem = NULL;
+    if (size > 0) {
+        mem = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            perror(path);
+            exit(-1);
+        }
+    }
+
+    close(fd);
+    *size_out = size;
+    return mem;
+}
+
+// runs main for each int64 of the little endian column in_path, and writes
+// the integer results to the column out_path. Results that are null, not
+// integers or errors are written as 0, with their bit set in out_path.nulls,
+// a bit per result from the low bit of the first byte; errors also go to
+// stderr and fail the whole run. The records are run in batches, on
+// thread_count threads at once.
+int run_columns(const char *file, const char *in_path, const char *out_path, int thread_count)
+{
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = thread_count;
+    sn_program_t *prog = load_program(file, &options);
+
+    size_t in_size = 0;
+    const int64_t *in = map_file(in_path, false, &in_size);
+    if (in_size % sizeof in[0] != 0) {
+        fprintf(stderr, "%s: not a column of int64\n", in_path);
+        exit(-1);
+    }
+
+    size_t count = in_size / sizeof in[0];
+    size_t out_size = count * sizeof in[0];
+    int64_t *out = map_file(out_path, true, &out_size);
+
+    char nulls_path[strlen(out_path) + sizeof ".nulls"];
+    sprintf(nulls_path, "%s.nulls", out_path);
+    size_t nulls_size = (count + 7) / 8;
+    uint8_t *nulls = map_file(nulls_path, true, &nulls_size);
+
+    sn_value_t **args = calloc(EACH_LINE_BATCH, sizeof args[0]);
+    sn_value_t **values = calloc(EACH_LINE_BATCH, sizeof values[0]);
+    sn_error_t *errors = calloc(EACH_LINE_BATCH, sizeof errors[0]);
+    for (int i = 0; i < EACH_LINE_BATCH; i++) {
+        args[i] = sn_value_create();
+        values[i] = sn_value_create();
+    }
+
+    bool ok = true;
+    for (size_t first = 0; first < count; first += EACH_LINE_BATCH) {
+        size_t batch_count = count - first < EACH_LINE_BATCH ? count - first : EACH_LINE_BATCH;
+        for (size_t k = 0; k < batch_count; k++) {
+            sn_value_set_integer(args[k], (int64_t)le64toh((uint64_t)in[first + k]));
+        }
+
+        sn_error_t status = sn_program_run_batch(prog, batch_count, args, values, errors, NULL);
+        if (status != SN_SUCCESS) {
+            write_error(stderr, file, status, prog);
+            exit(-1);
+        }
+
+        for (size_t k = 0; k < batch_count; k++) {
+            size_t idx = first + k;
+            int64_t i = 0;
+            if (errors[k] != SN_SUCCESS) {
+                fprintf(stderr, "%s: record %zu: %s\n", file, idx, sn_error_str(errors[k]));
+                ok = false;
+            }
+
+            if (errors[k] != SN_SUCCESS || sn_value_as_integer(values[k], &i) != SN_SUCCESS) {
+                nulls[idx / 8] |= (uint8_t)(1 << (idx % 8));
+                i = 0;
+            }
+            out[idx] = (int64_t)htole64((uint64_t)i);
+        }
+    }
+
+    for (int i = 0; i < EACH_LINE_BATCH; i++) {
+        sn_value_destroy(args[i]);
+        sn_value_destroy(values[i]);
+    }
+    free(args);
+    free(values);
+    free(errors);
+
+    if (in_size > 0) {
+        munmap((void *)in, in_size);
+        munmap(out, out_size);
+        munmap(nulls, nulls_size);
+    }
+    sn_program_destroy(prog);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+    }
+
+    // snscript --serve file --socket path [--threads n]
+    // snscript --client --socket path [arg...]
+    bool is_serve = strcmp(argv[1], "--serve") == 0;
+    if (is_serve || strcmp(argv[1], "--client") == 0) {
+        const char *file = NULL;
+        const char *socket_path = NULL;
+        int thread_count = 0;
+        int i = 2;
+        if (is_serve) {
+            if (i == argc) {
+                usage();
+            }
+            file = argv[i++];
+        }
+
+        while (i + 1 < argc && strncmp(argv[i], "--", 2) == 0) {
+            if (strcmp(argv[i], "--socket") == 0) {
+                socket_path = argv[i + 1];
+            }
+            else if (is_serve && strcmp(argv[i], "--threads") == 0) {
+                thread_count = atoi(argv[i + 1]);
+            }
+            else {
+                usage();
+            }
+            i += 2;
+        }
+
+        if (socket_path == NULL || (is_serve && i != argc)) {
+            usage();
+        }
+        return is_serve ? serve(file, socket_path, thread_count) : client(socket_path, argc - i, &argv[i]);
+    }
+
+    // snscript -j n file... runs main of each file on n threads, 0 for one
+    // per online core
+    if (strcmp(argv[1], "-j") == 0) {
+        if (argc < 4) {
+            usage();
+        }
+        return run_jobs(atoi(argv[2]), argc - 3, &argv[3]);
+    }
+
+    // snscript --each-line file [-j n] < input
+    if (strcmp(argv[1], "--each-line") == 0) {
+        int thread_count = 1;
+        if (argc == 5 && strcmp(argv[3], "-j") == 0) {
+            thread_count = atoi(argv[4]);
+        }
+        else if (argc != 3) {
+            usage();
+        }
+        return each_line(argv[2], thread_count);
+    }
+
+    // snscript file --in column --out column [-j n]
+    if (argc >= 6 && strcmp(argv[2], "--in") == 0 && strcmp(argv[4], "--out") == 0) {
+        int thread_count = 1;
+        if (argc == 8 && strcmp(argv[6], "-j") == 0) {
+            thread_count = atoi(argv[7]);
+        }
+        else if (argc != 6) {
+            usage();
+        }
+        return run_columns(argv[1], argv[3], argv[5], thread_count);
+    }
+
+    // snscript --emit-c file writes the program as C to stdout
+    bool emit_c = strcmp(argv[1], "--emit-c") == 0;
+    if (emit_c) {
+        argc--;
+        argv++;
+        if (argc < 2) {
+            exit(-1);
+        }
+    }
+
+    sn_program_t *prog = load_program(argv[1], NULL);
+    sn_error_t status = SN_SUCCESS;
+
+    if (emit_c) {
+        status = sn_program_emit_c(prog, argv[1], stdout);
+        if (status != SN_SUCCESS) {
+            write_error(stderr, argv[1], status, prog);
+            exit(-1);
+        }
+        sn_program_destroy(prog);
+        return 0;
+    }
+
     sn_value_t *arg = sn_value_create();
     if (argc == 3) {
         sn_value_set_integer(arg, atoi(argv[2]));
@@ -68,10 +1213,11 @@ int main(int argc, char **argv)
     sn_value_t *value = sn_value_create();
     status = sn_program_run_main(prog, arg, value);
     if (status != SN_SUCCESS) {
-        write_error(argv[1], status, prog);
+        write_error(stderr, argv[1], status, prog);
         exit(-1);
     }
     sn_value_destroy(value);
+    sn_value_destroy(arg);
     sn_program_destroy(prog);
     return 0;
 }
@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef enum sn_error_en
 {
@@ -40,20 +41,163 @@ typedef enum sn_error_en
     SN_ERROR_INVALID_PARAMS_TO_FN,
     SN_ERROR_WRONG_VALUE_TYPE,
     SN_ERROR_WRONG_ARG_COUNT_IN_CALL,
+    SN_ERROR_BUDGET_EXHAUSTED,
     SN_ERROR_GENERIC = 0x7FFFFFFF
 } sn_error_t;
 
 typedef struct sn_program_st sn_program_t;
 typedef struct sn_value_st sn_value_t;
+typedef struct sn_vm_st sn_vm_t;
+typedef struct sn_parser_st sn_parser_t;
+typedef struct sn_program_handle_st sn_program_handle_t;
+typedef struct sn_program_cache_st sn_program_cache_t;
+
+typedef void (*sn_write_fn_t)(void *ctx, const char *buf, size_t size);
+
+typedef enum sn_vm_state_en
+{
+    SN_VM_RUNNING,
+    SN_VM_DONE,
+    SN_VM_ERROR,
+} sn_vm_state_t;
+
+typedef struct sn_program_options_st
+{
+    // calls to a pure integer function before it is compiled to native code;
+    // 0 compiles it on the first call and a negative value disables the JIT
+    int jit_threshold;
+    // threads of the pool that runs pmap, preduce, forked calls and batches,
+    // and parses long sources and builds function bodies, started on first
+    // use; 0 for one per online core, and 1 runs all of it on the calling
+    // thread. The thread that starts a batch, parse or build helps the pool
+    // with it.
+    int thread_count;
+    // evaluate the arguments of a call on those threads when two or more of
+    // them call pure functions that loop or recurse, and the rest are simple
+    bool parallel_args;
+    // receives what println writes, in blocks of whole lines that each vm
+    // buffers; NULL writes to stdout
+    sn_write_fn_t write;
+    void *write_ctx;
+    // build the body of a function when it is first called instead of with
+    // the program; an error in it is then an error of the call
+    bool lazy_build;
+    // only find where the bodies of top level functions end when parsing,
+    // and parse each when it is built; its syntax errors are then build errors
+    bool lazy_parse;
+} sn_program_options_t;
+
+typedef struct sn_run_limits_st
+{
+    // evaluation steps before the run fails with SN_ERROR_BUDGET_EXHAUSTED,
+    // 0 for no limit; calls to native code count as one step each
+    int64_t max_steps;
+    // wall clock budget for the run in nanoseconds, 0 for no limit; the clock
+    // is only read every SN_CLOCK_CHECK_STEPS steps
+    int64_t timeout_ns;
+} sn_run_limits_t;
 
 const char *sn_error_str(sn_error_t status);
 void sn_program_error_pos(sn_program_t *prog, int *line_out, int *col_out);
 void sn_program_error_symbol(sn_program_t *prog, const char **symbol_out);
 
+void sn_program_options_init(sn_program_options_t *options);
 sn_error_t sn_program_create(sn_program_t **program_out, const char *source, size_t size);
+sn_error_t sn_program_create_with_options(sn_program_t **program_out,
+                                          const char *source,
+                                          size_t size,
+                                          const sn_program_options_t *options);
 void sn_program_destroy(sn_program_t *prog);
+// parses source handed over in chunks of any size, and builds each top level
+// form as soon as it closes, so only the text of the form being read is kept.
+// The program is created along with the parser and is built once
+// sn_parser_finish() succeeds, so it must not be passed to
+// sn_program_build(). Errors are recorded in it as usual.
+sn_error_t sn_parser_create(sn_parser_t **parser_out,
+                            sn_program_t **program_out,
+                            const sn_program_options_t *options);
+sn_error_t sn_parser_feed(sn_parser_t *parser, const char *chunk, size_t size);
+// parses what is left of the source and destroys the parser
+sn_error_t sn_parser_finish(sn_parser_t *parser);
 sn_error_t sn_program_build(sn_program_t *prog);
+// builds the bodies of a lazily built program that haven't been yet, and
+// returns the first error in them
+sn_error_t sn_program_build_all(sn_program_t *prog);
+// replaces the source of a program. Top level forms with the same text as
+// before are kept as they were parsed, and a function body is only built again
+// when its form or a global it refers to changed. No vm may run the program
+// meanwhile. A parse error leaves the program as it was; after a build error
+// it can't run until an update succeeds.
+sn_error_t sn_program_update(sn_program_t *prog, const char *source, size_t size);
 sn_error_t sn_program_run_main(sn_program_t *prog, sn_value_t *arg, sn_value_t *value_out);
+void sn_run_limits_init(sn_run_limits_t *limits);
+sn_error_t sn_program_run_main_limited(sn_program_t *prog,
+                                       sn_value_t *arg,
+                                       sn_value_t *value_out,
+                                       const sn_run_limits_t *limits);
+// runs main once for each of args into values_out, with the limits for each
+// run. The top level forms are run once, and every run starts from the
+// globals they left. The error of each run goes to errors_out, if given; the
+// batch fails as a whole only when the top level forms do.
+sn_error_t sn_program_run_batch(sn_program_t *prog,
+                                size_t count,
+                                sn_value_t *const *args,
+                                sn_value_t *const *values_out,
+                                sn_error_t *errors_out,
+                                const sn_run_limits_t *limits);
+
+// a vm runs main of a program in slices of steps; a script can also give up
+// the rest of its slice by calling (yield). A built program can be run by
+// vms on any number of threads at once, each vm used by one thread at a time.
+// sn_program_run_main() also records errors in the program, so threads that
+// share a program should use vms and the errors they record instead.
+sn_error_t sn_vm_create(sn_vm_t **vm_out);
+void sn_vm_destroy(sn_vm_t *vm);
+sn_error_t sn_vm_start(sn_vm_t *vm, sn_program_t *prog, sn_value_t *arg);
+// starts a vm for many runs of main, as a batch does: the top level forms run
+// here once, and each run of sn_vm_run_record() starts from the globals they
+// left, with an argument of its own
+sn_error_t sn_vm_start_batch(sn_vm_t *vm, sn_program_t *prog, const sn_run_limits_t *limits);
+sn_error_t
+sn_vm_run_record(sn_vm_t *vm, sn_value_t *arg, sn_value_t *value_out, const sn_run_limits_t *limits);
+// runs for at most max_steps steps, or until done when max_steps is 0
+sn_vm_state_t sn_vm_resume(sn_vm_t *vm, int64_t max_steps);
+// the value returned by main once done, or the error the run stopped with
+sn_error_t sn_vm_result(sn_vm_t *vm, sn_value_t *value_out);
+void sn_vm_error_pos(sn_vm_t *vm, int *line_out, int *col_out);
+void sn_vm_error_symbol(sn_vm_t *vm, const char **symbol_out);
+
+// a handle holds the built program that is published, which each thread pins
+// for as long as it runs it, per request. Publishing another is one atomic
+// swap that waits only for the pins in progress, not for the runs; the program
+// before is destroyed once the last of its runs unpins it, so a vm that ran it
+// must have finished by then. The handle owns the programs it is given, and is
+// destroyed once no thread pins any more.
+sn_error_t sn_program_handle_create(sn_program_handle_t **handle_out, sn_program_t *prog);
+void sn_program_handle_destroy(sn_program_handle_t *handle);
+sn_program_t *sn_program_handle_pin(sn_program_handle_t *handle);
+void sn_program_unpin(sn_program_t *prog);
+void sn_program_handle_publish(sn_program_handle_t *handle, sn_program_t *prog);
+
+// a cache of built programs that threads share, found by a hash of their
+// source and options. A program is built once however many threads ask for it
+// at the same time, and the least recently used are dropped once they take
+// more than max_bytes. Get returns the program pinned, with the status of its
+// build, and it is unpinned once done with; it can't be given to a handle.
+sn_error_t sn_program_cache_create(sn_program_cache_t **cache_out, size_t max_bytes);
+void sn_program_cache_destroy(sn_program_cache_t *cache);
+sn_error_t sn_program_cache_get(sn_program_cache_t *cache,
+                                const char *source,
+                                size_t size,
+                                const sn_program_options_t *options,
+                                sn_program_t **program_out);
+
+// writes a C translation of a built program that defines
+// sn_compiled_run_main(), and main() when compiled with SN_COMPILED_MAIN.
+// Unlike a vm, a compiled run frees the integers it boxes only once it ends,
+// so a long loop that boxes grows without bound, and its calls nest on the C
+// stack with no frame limit, so recursion too deep crashes instead of failing.
+sn_error_t sn_program_emit_c(sn_program_t *prog, const char *source_name, FILE *out);
 
 sn_value_t *sn_value_create(void);
 void sn_value_destroy(sn_value_t *value);
@@ -61,3 +205,6 @@ void sn_value_set_integer(sn_value_t *value, int64_t i);
 sn_error_t sn_value_as_integer(sn_value_t *value, int64_t *i_out);
 sn_error_t sn_value_as_boolean(sn_value_t *value, bool *b_out);
 bool sn_value_is_null(sn_value_t *value);
+// the items of a vector are owned by it and may only be read
+sn_error_t sn_value_as_vector(sn_value_t *value, int64_t *count_out);
+sn_value_t *sn_value_vector_item(sn_value_t *value, int64_t index);
@@ -1,10 +1,45 @@
 #pragma once
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "snscript.h"
 
 #define SN_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define SN_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// expressions up to this height made only of literals, variables and calls to
+// pure builtins are evaluated recursively on the C stack instead of in frames
+#define SN_EVAL_SHALLOW_MAX_DEPTH 8
+#define SN_EVAL_SHALLOW_MAX_ARGS 8
+
+// a run with a timeout reads the clock after this many steps
+#define SN_CLOCK_CHECK_STEPS 1024
+
+// println output a vm buffers before it is written
+#define SN_OUTPUT_FLUSH_SIZE 65536
+
+// sources are parsed on many threads in segments of at least this many bytes
+#define SN_PARSE_SEGMENT_SIZE 65536
+// locks of the symbol table, a power of two
+#define SN_SYMBOL_SHARD_COUNT 16
+
+// pmap and preduce hand out their ranges to threads in blocks of this many
+#define SN_POOL_BLOCK_SIZE 256
+// a thread running a batch takes this many records at a time
+#define SN_BATCH_CHUNK_SIZE 64
+// a thread building function bodies takes this many at a time
+#define SN_BUILD_CHUNK_SIZE 16
+// calls with more children than this never have their arguments forked
+#define SN_FORK_MAX_CHILDREN 32
+
+// pure functions are compiled to native code after this many calls
+#define SN_JIT_DEFAULT_THRESHOLD 1000
+#define SN_JIT_MAX_PARAMS 16
+// calls of a pure integer function run at once by the lane evaluator, and
+// how deep its lane groups call other functions before going one at a time
+#define SN_LANE_COUNT 8
+#define SN_LANES_MAX_DEPTH 8
 
 typedef enum sn_expr_type_en
 {
@@ -12,6 +47,8 @@ typedef enum sn_expr_type_en
     SN_EXPR_TYPE_INTEGER,
     SN_EXPR_TYPE_SYMBOL,
     SN_EXPR_TYPE_LIST,
+    // the body of a function left for later by the lazy_parse option
+    SN_EXPR_TYPE_UNPARSED,
 } sn_expr_type_t;
 
 typedef enum sn_value_type_en
@@ -22,6 +59,8 @@ typedef enum sn_value_type_en
     SN_VALUE_TYPE_BOOLEAN,
     SN_VALUE_TYPE_USER_FN,
     SN_VALUE_TYPE_BUILTIN_FN,
+    SN_VALUE_TYPE_VECTOR,
+    SN_VALUE_TYPE_FUTURE,
 } sn_value_type_t;
 
 typedef enum sn_rtype_st
@@ -74,24 +113,236 @@ typedef struct sn_const_st sn_const_t;
 typedef struct sn_block_st sn_block_t;
 typedef struct sn_stack_st sn_stack_t;
 typedef struct sn_frame_st sn_frame_t;
-typedef sn_error_t (*sn_builtin_fn_t)(sn_value_t *ret, int arg_count, const sn_value_t *args);
+typedef struct sn_pool_st sn_pool_t;
+typedef struct sn_future_st sn_future_t;
+typedef sn_error_t (*sn_builtin_fn_t)(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+typedef sn_error_t (*sn_pool_block_fn_t)(void *data, sn_stack_t *stack, int64_t block);
+
+typedef enum sn_jit_state_en
+{
+    SN_JIT_STATE_UNKNOWN,
+    SN_JIT_STATE_IN_PROGRESS,
+    SN_JIT_STATE_TYPED,
+    SN_JIT_STATE_COMPILED,
+    SN_JIT_STATE_FAILED,
+} sn_jit_state_t;
+
+typedef struct sn_jit_ctx_st
+{
+    sn_value_t *globals;
+    int64_t depth_left;
+    int64_t fuel;
+} sn_jit_ctx_t;
+
+typedef struct sn_jit_result_st
+{
+    int64_t value;
+    int64_t bail;
+} sn_jit_result_t;
+
+typedef sn_jit_result_t (*sn_jit_fn_t)(const int64_t *args, sn_jit_ctx_t *ctx);
+
+typedef struct sn_jit_code_st sn_jit_code_t;
+struct sn_jit_code_st
+{
+    void *mem;
+    size_t size;
+    sn_jit_code_t *next;
+};
+
+typedef struct sn_jit_func_st
+{
+    // only changed with the jit lock of the program held
+    sn_jit_state_t state;
+    bool uses_assumed_type;
+    sn_value_type_t ret_type;
+    sn_jit_fn_t code;
+
+    // accessed atomically by running threads: the calls so far, and whether
+    // code can be called
+    int call_count;
+    bool ready;
+} sn_jit_func_t;
+
+typedef struct sn_lanes_func_st
+{
+    // only changed with the jit lock of the program held
+    sn_jit_state_t state;
+    bool uses_assumed_type;
+    sn_value_type_t ret_type;
+
+    // accessed atomically by running threads, set once the function and the
+    // functions it calls are typed
+    bool ready;
+    // likewise, set once the function is found not to run in lanes, so that
+    // each pmap and preduce doesn't try to type it again
+    bool rejected;
+} sn_lanes_func_t;
 
 struct sn_builtin_func_st
 {
     sn_builtin_fn_t fn;
     bool is_pure;
+    // runs script code, which may collect boxes, so its arguments can't be
+    // held where a shallow evaluation keeps them
+    bool runs_code;
+    const char *c_name;
 };
 
+// a value is a single tagged word:
+//   ...xx1  small integer, shifted left by one
+//   ...010  sn_func_t *
+//   ...100  sn_builtin_func_t *
+//   ...110  sn_box_t *, an integer outside of the small integer range
+//   ...000  invalid (0), null, false or true
 struct sn_value_st
 {
-    sn_value_type_t type;
+    uint64_t bits;
+};
+
+#define SN_VALUE_TAG_MASK 7
+#define SN_VALUE_TAG_USER_FN 2
+#define SN_VALUE_TAG_BUILTIN_FN 4
+#define SN_VALUE_TAG_BOX 6
+
+#define SN_VALUE_BITS_INVALID 0
+#define SN_VALUE_BITS_NULL 8
+#define SN_VALUE_BITS_FALSE 16
+#define SN_VALUE_BITS_TRUE 24
+
+#define SN_SMALL_INT_MIN (INT64_MIN >> 1)
+#define SN_SMALL_INT_MAX (INT64_MAX >> 1)
+
+// boxes allocated by an arena are owned by it, the others live as long as
+// the program or public value that holds them
+#define SN_BOX_FLAG_ARENA 1
+#define SN_BOX_FLAG_MARKED 2
+
+// boxes are allocated in chunks of this many by an arena, which collects
+// them once it has handed out this many since the last collection
+#define SN_BOX_CHUNK_SIZE 256
+#define SN_BOX_GC_MIN 4096
+
+typedef struct sn_vector_st
+{
+    int64_t count;
+    sn_value_t items[];
+} sn_vector_t;
+
+typedef struct sn_box_st sn_box_t;
+struct sn_box_st
+{
+    uint8_t type;
+    uint8_t flags;
+    // the arena that owns the box, so that a collection leaves the boxes of
+    // other arenas alone
+    uint32_t arena_id;
     union {
         int64_t i;
-        sn_func_t *user_fn;
-        sn_builtin_func_t *builtin_fn;
+        sn_vector_t *vector;
+        sn_future_t *future;
+        sn_box_t *next_free;
     };
 };
 
+typedef struct sn_box_chunk_st sn_box_chunk_t;
+struct sn_box_chunk_st
+{
+    sn_box_chunk_t *next;
+    sn_box_t boxes[SN_BOX_CHUNK_SIZE];
+};
+
+typedef struct sn_box_arena_st
+{
+    uint32_t id;
+    sn_box_chunk_t *chunk_head;
+    int chunk_used;
+    sn_box_t *free_head;
+    int64_t alloc_count;
+    int64_t gc_threshold;
+} sn_box_arena_t;
+
+#define SN_VALUE_IS_SMALL_INT(v) (((v).bits & 1) != 0)
+#define SN_VALUE_IS_BOX(v) (((v).bits & SN_VALUE_TAG_MASK) == SN_VALUE_TAG_BOX)
+#define SN_VALUE_IS_INT(v) \
+    (SN_VALUE_IS_SMALL_INT(v) || (SN_VALUE_IS_BOX(v) && SN_VALUE_BOX(v)->type == SN_VALUE_TYPE_INTEGER))
+#define SN_VALUE_IS_BOOL(v) (((v).bits | 8) == SN_VALUE_BITS_TRUE)
+#define SN_VALUE_IS_NULL(v) ((v).bits == SN_VALUE_BITS_NULL)
+#define SN_VALUE_IS_USER_FN(v) (((v).bits & SN_VALUE_TAG_MASK) == SN_VALUE_TAG_USER_FN)
+#define SN_VALUE_IS_BUILTIN_FN(v) (((v).bits & SN_VALUE_TAG_MASK) == SN_VALUE_TAG_BUILTIN_FN)
+#define SN_VALUE_IS_FN(v) (SN_VALUE_IS_USER_FN(v) || SN_VALUE_IS_BUILTIN_FN(v))
+
+#define SN_VALUE_BOX(v) ((sn_box_t *)(uintptr_t)((v).bits - SN_VALUE_TAG_BOX))
+#define SN_VALUE_INT(v) (SN_VALUE_IS_SMALL_INT(v) ? (int64_t)(v).bits >> 1 : SN_VALUE_BOX(v)->i)
+#define SN_VALUE_BOOL(v) ((v).bits == SN_VALUE_BITS_TRUE)
+#define SN_VALUE_USER_FN(v) ((sn_func_t *)(uintptr_t)((v).bits - SN_VALUE_TAG_USER_FN))
+#define SN_VALUE_BUILTIN_FN(v) ((sn_builtin_func_t *)(uintptr_t)((v).bits - SN_VALUE_TAG_BUILTIN_FN))
+#define SN_VALUE_IS_VECTOR(v) (SN_VALUE_IS_BOX(v) && SN_VALUE_BOX(v)->type == SN_VALUE_TYPE_VECTOR)
+#define SN_VALUE_VECTOR(v) (SN_VALUE_BOX(v)->vector)
+#define SN_VALUE_IS_FUTURE(v) (SN_VALUE_IS_BOX(v) && SN_VALUE_BOX(v)->type == SN_VALUE_TYPE_FUTURE)
+#define SN_VALUE_FUTURE(v) (SN_VALUE_BOX(v)->future)
+
+sn_value_t sn_value_box_int(int64_t i);
+sn_value_t sn_value_vector(int64_t count);
+sn_value_t sn_value_future(sn_future_t *future);
+sn_value_t sn_value_import(sn_value_t value);
+void sn_box_export(sn_box_t *dst, sn_box_t *src);
+void sn_box_release(sn_box_t *box);
+
+static inline sn_value_t sn_make_int(int64_t i)
+{
+    if (i < SN_SMALL_INT_MIN || i > SN_SMALL_INT_MAX) {
+        return sn_value_box_int(i);
+    }
+
+    sn_value_t v = { ((uint64_t)i << 1) | 1 };
+    return v;
+}
+
+static inline sn_value_t sn_make_bool(bool b)
+{
+    sn_value_t v = { b ? SN_VALUE_BITS_TRUE : SN_VALUE_BITS_FALSE };
+    return v;
+}
+
+static inline sn_value_t sn_make_user_fn(sn_func_t *func)
+{
+    sn_value_t v = { (uintptr_t)func + SN_VALUE_TAG_USER_FN };
+    return v;
+}
+
+static inline sn_value_t sn_make_builtin_fn(sn_builtin_func_t *func)
+{
+    sn_value_t v = { (uintptr_t)func + SN_VALUE_TAG_BUILTIN_FN };
+    return v;
+}
+
+static inline sn_value_type_t sn_value_type(sn_value_t v)
+{
+    if (SN_VALUE_IS_SMALL_INT(v)) {
+        return SN_VALUE_TYPE_INTEGER;
+    }
+
+    switch (v.bits & SN_VALUE_TAG_MASK) {
+        case SN_VALUE_TAG_USER_FN:
+            return SN_VALUE_TYPE_USER_FN;
+        case SN_VALUE_TAG_BUILTIN_FN:
+            return SN_VALUE_TYPE_BUILTIN_FN;
+        case SN_VALUE_TAG_BOX:
+            return SN_VALUE_BOX(v)->type;
+    }
+
+    switch (v.bits) {
+        case SN_VALUE_BITS_NULL:
+            return SN_VALUE_TYPE_NULL;
+        case SN_VALUE_BITS_FALSE:
+        case SN_VALUE_BITS_TRUE:
+            return SN_VALUE_TYPE_BOOLEAN;
+    }
+
+    return SN_VALUE_TYPE_INVALID;
+}
+
 struct sn_frame_st
 {
     sn_expr_t *expr;
@@ -101,23 +352,135 @@ struct sn_frame_st
     int cont_pos;
 };
 
+// blocks run on the pool for a vm, see snpool.c
+typedef struct sn_pool_job_st
+{
+    sn_pool_block_fn_t fn;
+    void *data;
+    sn_pool_t *pool;
+    // run outside of any vm, for sn_pool_run_plain(); the blocks get no stack
+    bool is_plain;
+    sn_value_t *globals;
+    int64_t max_steps;
+    int64_t deadline_ns;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int64_t blocks_left;
+    int64_t steps_used;
+    // the first block that failed, later blocks are skipped
+    int64_t error_block;
+    sn_error_t error;
+} sn_pool_job_t;
+
+// a call to a pure function made by spawn, shared by the boxes that refer to
+// it. It owns copies of its arguments and of a boxed result, so that it
+// doesn't depend on the arenas of the threads involved.
+struct sn_future_st
+{
+    int ref_count;
+    // in the list of the stack that spawned it, while it is kept there
+    sn_future_t *next_spawned;
+    int spawn_depth;
+    sn_pool_job_t job;
+
+    sn_value_t fn;
+    int arg_count;
+    // read once the job is done; a boxed integer is stored in value_box
+    sn_value_t value;
+    sn_box_t value_box;
+    sn_value_t args[];
+};
+
 struct sn_stack_st
 {
     int push_count;
+    // the most slots that were in use at once
+    int high_water;
     sn_value_t *values;
     sn_value_t *globals;
 
     int frame_top;
     sn_frame_t *frames;
+
+    sn_box_arena_t boxes;
+
+    // steps until the budget is checked again, out of steps_left
+    int64_t fuel;
+    int64_t steps_left;
+    int64_t deadline_ns;
+
+    // whether running out of budget suspends the run instead of failing it
+    bool suspend_when_exhausted;
+    bool yielded;
+    bool suspended;
+    // calls made by builtins through sn_stack_call() that are running
+    int nested_calls;
+    // futures spawned here that may still be running, newest first, and the
+    // tasks of pool jobs running on the stack, nested in each other
+    sn_future_t *futures;
+    int lend_depth;
+
+    sn_vm_t *vm;
+};
+
+struct sn_vm_st
+{
+    sn_stack_t stack;
+    sn_program_t *prog;
+    sn_vm_state_t state;
+    sn_error_t status;
+
+    // the next top level form, or expression of main once in_main is set
+    sn_expr_t *cursor;
+    bool in_main;
+    int locals_idx;
+
+    // a vm that runs a batch stops before main, and keeps the globals the top
+    // level forms left for each record
+    bool stop_at_main;
+    sn_value_t *batch_globals;
+    int batch_push_count;
+
+    sn_value_t *result;
+    sn_value_t *arg;
+
+    // println output not written yet, and where it goes
+    char *out_buf;
+    size_t out_size;
+    size_t out_cap;
+    sn_write_fn_t write;
+    void *write_ctx;
+
+    int error_line;
+    int error_col;
+    sn_symbol_t *error_sym;
 };
 
 struct sn_symbol_st
 {
     size_t length;
+    uint64_t hash;
     sn_symbol_t *next;
+    // the declaration of the global with this name, if there is one
+    sn_expr_t *global;
+    // the index of the global with this name, which it keeps when an update
+    // declares it again; -1 until it is first declared
+    int global_index;
     char value[];
 };
 
+// symbols are interned in a hash table split in shards that each have a
+// lock, so that segments of a program can be parsed on many threads and
+// still compare symbols by pointer
+typedef struct sn_symbol_shard_st
+{
+    pthread_mutex_t lock;
+    sn_symbol_t **buckets;
+    size_t bucket_count;
+    size_t count;
+} sn_symbol_shard_t;
+
 typedef struct sn_ref_st
 {
     sn_scope_type_t type;
@@ -135,11 +498,19 @@ struct sn_const_st
 struct sn_scope_st
 {
     sn_const_t *head_const;
+    // the consts of the global scope by index
+    sn_const_t **consts;
+    int const_cap;
     sn_scope_t *parent;
     sn_expr_t *decl_head;
     int cur_decl_count;
     int max_decl_count;
     bool is_pure;
+    // the name of the function of the scope; only globals declared up to it
+    // are seen, even when the body is built after later ones
+    sn_expr_t *fn_name;
+    // the function whose parameters and locals these are
+    sn_func_t *func;
 };
 
 struct sn_block_st
@@ -149,14 +520,43 @@ struct sn_block_st
     sn_const_t *parent_const;
 };
 
+typedef struct sn_build_error_st
+{
+    int line;
+    int col;
+    sn_symbol_t *sym;
+} sn_build_error_t;
+
+typedef enum sn_build_state_en
+{
+    SN_BUILD_STATE_UNBUILT,
+    SN_BUILD_STATE_DONE,
+    SN_BUILD_STATE_FAILED,
+} sn_build_state_t;
+
 struct sn_func_st
 {
+    // read without the build lock once done
+    sn_build_state_t build_state;
+    sn_error_t build_status;
+    sn_build_error_t build_error;
     bool is_pure;
+    // loops or recurses, set with the parallel_args option
+    bool is_heavy;
     int param_count;
     sn_scope_t scope;
     sn_symbol_t *name;
+    // the fn or pure form
+    sn_expr_t *expr;
+    // the declarations of the globals the body refers to, so that an update
+    // can tell whether it has to be built again
+    sn_expr_t **uses;
+    int use_count;
+    int use_cap;
     int body_count;
     sn_expr_t *body;
+    sn_jit_func_t jit;
+    sn_lanes_func_t lanes;
 };
 
 struct sn_expr_st
@@ -164,18 +564,64 @@ struct sn_expr_st
     sn_expr_type_t type;
     sn_rtype_t rtype;
     int64_t vint;
-    sn_symbol_t *sym;
+    union {
+        sn_symbol_t *sym;
+        // the source of a top level list, which an update compares, or of
+        // an unparsed body in it; vint bytes long
+        char *text;
+    };
     size_t child_count;
     sn_expr_t *child_head;
     sn_expr_t *next;
 
     sn_ref_t ref;
     sn_expr_t *next_decl;
+    int shallow_depth;
+    // argument positions of a call that are evaluated on the pool
+    uint32_t fork_args;
+    // the value of a literal, or the function a fn or pure form declared
+    sn_value_t literal;
     sn_program_t *prog;
     int line;
     int col;
 };
 
+// where parsing is in the source, and where it failed
+typedef struct sn_cursor_st
+{
+    sn_program_t *prog;
+    const char *cur;
+    const char *last;
+    int line;
+    int col;
+    int error_line;
+    int error_col;
+} sn_cursor_t;
+
+// finds where top level forms end in source that is read a byte at a time
+typedef struct sn_scan_st
+{
+    int depth;
+    bool in_form;
+    bool in_comment;
+    bool after_semicolon;
+} sn_scan_t;
+
+// a top level form is parsed once the bracket that opened it closes, or
+// once whitespace follows it when it isn't a list; its text is kept until then
+struct sn_parser_st
+{
+    sn_program_t *prog;
+    sn_expr_t **form_tail;
+    sn_error_t status;
+    sn_cursor_t cursor;
+    sn_scan_t scan;
+
+    char *text;
+    size_t text_size;
+    size_t text_cap;
+};
+
 struct sn_program_st
 {
     int error_line;
@@ -184,14 +630,7 @@ struct sn_program_st
 
     sn_expr_t expr;
 
-    sn_symbol_t *symbol_head;
-    sn_symbol_t **symbol_tail;
-
-    const char *start;
-    const char *cur;
-    const char *last;
-    int cur_line;
-    int cur_col;
+    sn_symbol_shard_t symbols[SN_SYMBOL_SHARD_COUNT];
 
     // special forms
     sn_symbol_t *sn_let;
@@ -211,17 +650,62 @@ struct sn_program_st
     sn_func_t *main_func;
 
     sn_scope_t globals;
+    // the globals before these are the builtins
+    int builtin_count;
+    // set once a build or an update succeeds
+    bool is_built;
+    // the handle or cache that holds the program and the threads that pinned it
+    int pin_count;
+
+    sn_program_options_t options;
+    pthread_mutex_t jit_lock;
+    // held while bodies of a lazily built program are built
+    pthread_mutex_t build_lock;
+    // all of the functions, in the order they are declared
+    sn_func_t **funcs;
+    size_t func_count;
+    size_t func_cap;
+    sn_jit_code_t *jit_code_head;
+
+    // started by the first pmap, preduce or forked call
+    pthread_mutex_t pool_lock;
+    sn_pool_t *pool;
 };
 
+void sn_box_arena_init(sn_box_arena_t *arena);
+sn_box_arena_t *sn_box_arena_enter(sn_box_arena_t *arena);
+void sn_box_arena_leave(sn_box_arena_t *prev);
+void sn_box_arena_deinit(sn_box_arena_t *arena);
+void sn_box_arena_mark(sn_box_arena_t *arena, sn_value_t value);
+void sn_box_arena_sweep(sn_box_arena_t *arena);
+sn_value_t sn_value_literal(int64_t i);
+void sn_value_export(sn_value_t *value_out, sn_value_t value);
+
 extern sn_value_t sn_null;
 extern sn_value_t sn_true;
 extern sn_value_t sn_false;
 
 sn_error_t sn_expr_error(sn_expr_t *expr, sn_error_t error);
+sn_error_t sn_pos_error(sn_program_t *prog, int line, int col, sn_error_t error);
+void sn_expr_error_redirect(sn_build_error_t *error);
 bool sn_symbol_equals_string(sn_symbol_t *sym, const char *str);
 sn_expr_t *sn_program_test_get_first_expr(sn_program_t *prog);
 sn_symbol_t *sn_program_get_symbol(sn_program_t *prog, const char *start, const char *end);
-sn_error_t sn_program_parse(sn_program_t *prog);
+uint64_t sn_symbol_hash(const char *str, size_t size);
+sn_error_t sn_program_parse(sn_program_t *prog, const char *source, size_t size);
+sn_program_t *sn_program_create_empty(const sn_program_options_t *options);
+sn_error_t sn_program_build_form(sn_program_t *prog, sn_expr_t *expr);
+sn_error_t sn_expr_parse_body(sn_expr_t *form);
+sn_error_t sn_func_ensure_built(sn_func_t *func);
+sn_func_t *sn_form_func(sn_expr_t *form);
+void sn_func_free(sn_func_t *func);
+sn_error_t sn_program_reparse(sn_program_t *prog,
+                              const char *source,
+                              size_t size,
+                              sn_expr_t ***dropped_out,
+                              size_t *dropped_count_out);
+void sn_form_free(sn_expr_t *form);
+size_t sn_program_memory_size(sn_program_t *prog);
 
 sn_error_t sn_scope_add_var(sn_scope_t *scope, sn_expr_t *expr);
 sn_error_t sn_scope_find_var(sn_scope_t *scope, sn_symbol_t *name, sn_ref_t *ref);
@@ -229,20 +713,64 @@ sn_value_t *sn_scope_create_const(sn_scope_t *scope, sn_ref_t *ref);
 void sn_scope_init_consts(sn_scope_t *scope, sn_value_t *values);
 sn_value_t *sn_scope_get_const_value(sn_scope_t *scope, sn_ref_t *ref);
 sn_scope_type_t sn_scope_type(sn_scope_t *scope);
+void sn_scope_clear_globals(sn_scope_t *scope, int builtin_count);
+
+int sn_stack_alloc_values(sn_stack_t *stack, int count);
+void sn_stack_yield(sn_stack_t *stack);
+sn_error_t
+sn_stack_call(sn_stack_t *stack, sn_value_t fn, int arg_count, const sn_value_t *args, sn_value_t *val_out);
+void sn_stack_lend(sn_stack_t *stack, sn_value_t *globals, int64_t max_steps, int64_t deadline_ns);
+void sn_vm_init_worker(sn_vm_t *vm, sn_program_t *prog);
+void sn_stack_join_futures(sn_stack_t *stack, int depth, sn_stack_t *helper);
+void sn_future_release(sn_future_t *future);
+
+sn_error_t sn_pool_create(sn_pool_t **pool_out, sn_program_t *prog, int thread_count);
+void sn_pool_destroy(sn_pool_t *pool);
+int sn_pool_thread_count(sn_program_t *prog);
+bool sn_pool_can_fork(sn_program_t *prog);
+void sn_pool_job_init(sn_pool_job_t *job, sn_pool_block_fn_t fn, void *data);
+void sn_pool_job_deinit(sn_pool_job_t *job);
+sn_error_t sn_pool_start(sn_stack_t *stack, sn_pool_job_t *job, int64_t block_count);
+bool sn_pool_is_done(sn_pool_job_t *job);
+sn_error_t sn_pool_wait(sn_stack_t *stack, sn_pool_job_t *job, sn_stack_t *helper);
+sn_error_t sn_pool_run(sn_stack_t *stack, sn_pool_block_fn_t fn, void *data, int64_t block_count);
+sn_error_t sn_pool_run_plain(sn_program_t *prog, sn_pool_block_fn_t fn, void *data, int64_t block_count);
+
+bool sn_jit_type(sn_func_t *func);
+sn_value_t *sn_jit_const_value(sn_expr_t *expr);
+sn_value_type_t sn_jit_type_builtin(sn_builtin_fn_t fn, sn_value_type_t *types, int arg_count);
+bool sn_jit_call(sn_program_t *prog,
+                 sn_stack_t *stack,
+                 sn_func_t *func,
+                 int arg_count,
+                 const sn_value_t *args,
+                 sn_value_t *val_out);
+void sn_jit_release(sn_program_t *prog);
+
+int sn_lanes_width(sn_program_t *prog, sn_value_t fn);
+sn_error_t sn_lanes_call_range(sn_stack_t *stack, sn_value_t fn, int64_t first, int count, sn_value_t *vals_out);
 
 void sn_block_enter(sn_block_t *block, sn_scope_t *scope);
 void sn_block_leave(sn_block_t *block);
 
-sn_error_t sn_is_int(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_is_fn(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_is_null(sn_value_t *ret, int arg_count, const sn_value_t *args);
-
-sn_error_t sn_not_equals(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_not(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_equals(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_add(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_sub(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_mul(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_div(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_mod(sn_value_t *ret, int arg_count, const sn_value_t *args);
-sn_error_t sn_println(sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_is_int(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_is_fn(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_is_null(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+
+sn_error_t sn_not_equals(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_not(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_equals(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_add(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_sub(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_mul(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_div(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_mod(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_yield(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_len(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_at(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_pmap(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_preduce(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_spawn(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_await(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+sn_error_t sn_println(sn_vm_t *vm, sn_value_t *ret, int arg_count, const sn_value_t *args);
+void sn_vm_flush_output(sn_vm_t *vm);
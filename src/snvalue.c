@@ -1,11 +1,334 @@
+#include <assert.h>
 #include <stdlib.h>
 #include "snscript_internal.h"
 
+// public values carry their own box, so that they don't depend on the arena
+// of the run that produced them
+typedef struct sn_public_value_st
+{
+    sn_value_t value;
+    sn_box_t box;
+} sn_public_value_t;
+
+// integers outside of the small range are boxed in the arena of the running
+// evaluator on this thread
+static __thread sn_box_arena_t *sn_box_arena_current;
+static uint32_t sn_box_arena_last_id;
+
+void sn_box_arena_init(sn_box_arena_t *arena)
+{
+    // 0 is left for boxes without an arena
+    do {
+        arena->id = __atomic_add_fetch(&sn_box_arena_last_id, 1, __ATOMIC_RELAXED);
+    } while (arena->id == 0);
+
+    arena->chunk_head = NULL;
+    arena->chunk_used = SN_BOX_CHUNK_SIZE;
+    arena->free_head = NULL;
+    arena->alloc_count = 0;
+    arena->gc_threshold = SN_BOX_GC_MIN;
+}
+
+sn_box_arena_t *sn_box_arena_enter(sn_box_arena_t *arena)
+{
+    sn_box_arena_t *prev = sn_box_arena_current;
+    sn_box_arena_current = arena;
+    return prev;
+}
+
+void sn_box_arena_leave(sn_box_arena_t *prev)
+{
+    sn_box_arena_current = prev;
+}
+
+void sn_box_free_contents(sn_box_t *box)
+{
+    if (box->type == SN_VALUE_TYPE_VECTOR) {
+        free(box->vector);
+    }
+    else if (box->type == SN_VALUE_TYPE_FUTURE) {
+        sn_future_release(box->future);
+    }
+}
+
+void sn_box_arena_deinit(sn_box_arena_t *arena)
+{
+    for (sn_box_chunk_t *chunk = arena->chunk_head; chunk != NULL; chunk = chunk->next) {
+        int used = chunk == arena->chunk_head ? arena->chunk_used : SN_BOX_CHUNK_SIZE;
+        for (int i = 0; i < used; i++) {
+            if (chunk->boxes[i].flags & SN_BOX_FLAG_ARENA) {
+                sn_box_free_contents(&chunk->boxes[i]);
+            }
+        }
+    }
+
+    while (arena->chunk_head != NULL) {
+        sn_box_chunk_t *next = arena->chunk_head->next;
+        free(arena->chunk_head);
+        arena->chunk_head = next;
+    }
+}
+
+sn_box_t *sn_box_arena_alloc(sn_box_arena_t *arena)
+{
+    arena->alloc_count++;
+
+    sn_box_t *box = arena->free_head;
+    if (box != NULL) {
+        arena->free_head = box->next_free;
+        return box;
+    }
+
+    if (arena->chunk_used == SN_BOX_CHUNK_SIZE) {
+        sn_box_chunk_t *chunk = malloc(sizeof *chunk);
+        chunk->next = arena->chunk_head;
+        arena->chunk_head = chunk;
+        arena->chunk_used = 0;
+    }
+
+    return &arena->chunk_head->boxes[arena->chunk_used++];
+}
+
+void sn_box_arena_mark(sn_box_arena_t *arena, sn_value_t value)
+{
+    if (!SN_VALUE_IS_BOX(value)) {
+        return;
+    }
+
+    sn_box_t *box = SN_VALUE_BOX(value);
+    if (box->arena_id != arena->id || (box->flags & SN_BOX_FLAG_MARKED)) {
+        return;
+    }
+
+    box->flags |= SN_BOX_FLAG_MARKED;
+    if (box->type == SN_VALUE_TYPE_VECTOR) {
+        for (int64_t i = 0; i < box->vector->count; i++) {
+            sn_box_arena_mark(arena, box->vector->items[i]);
+        }
+    }
+}
+
+// frees the boxes that weren't marked since the last sweep
+void sn_box_arena_sweep(sn_box_arena_t *arena)
+{
+    int64_t live_count = 0;
+    arena->free_head = NULL;
+
+    for (sn_box_chunk_t *chunk = arena->chunk_head; chunk != NULL; chunk = chunk->next) {
+        int used = chunk == arena->chunk_head ? arena->chunk_used : SN_BOX_CHUNK_SIZE;
+        for (int i = 0; i < used; i++) {
+            sn_box_t *box = &chunk->boxes[i];
+            if (box->flags & SN_BOX_FLAG_MARKED) {
+                box->flags &= ~SN_BOX_FLAG_MARKED;
+                live_count++;
+            }
+            else {
+                if (box->flags & SN_BOX_FLAG_ARENA) {
+                    sn_box_free_contents(box);
+                }
+                box->type = SN_VALUE_TYPE_INVALID;
+                box->flags = 0;
+                box->next_free = arena->free_head;
+                arena->free_head = box;
+            }
+        }
+    }
+
+    arena->alloc_count = 0;
+    arena->gc_threshold = SN_MAX(SN_BOX_GC_MIN, live_count);
+}
+
+sn_value_t sn_value_box_int(int64_t i)
+{
+    assert(sn_box_arena_current != NULL);
+
+    sn_box_t *box = sn_box_arena_alloc(sn_box_arena_current);
+    box->type = SN_VALUE_TYPE_INTEGER;
+    box->flags = SN_BOX_FLAG_ARENA;
+    box->arena_id = sn_box_arena_current->id;
+    box->i = i;
+
+    sn_value_t v = { (uintptr_t)box + SN_VALUE_TAG_BOX };
+    return v;
+}
+
+// a vector of count nulls, owned by the arena like boxed integers
+sn_value_t sn_value_vector(int64_t count)
+{
+    assert(sn_box_arena_current != NULL);
+
+    sn_vector_t *vector = malloc(sizeof *vector + count * sizeof vector->items[0]);
+    vector->count = count;
+    for (int64_t i = 0; i < count; i++) {
+        vector->items[i] = sn_null;
+    }
+
+    sn_box_t *box = sn_box_arena_alloc(sn_box_arena_current);
+    box->type = SN_VALUE_TYPE_VECTOR;
+    box->flags = SN_BOX_FLAG_ARENA;
+    box->arena_id = sn_box_arena_current->id;
+    box->vector = vector;
+
+    sn_value_t v = { (uintptr_t)box + SN_VALUE_TAG_BOX };
+    return v;
+}
+
+// a new reference to future, owned by the arena
+sn_value_t sn_value_future(sn_future_t *future)
+{
+    assert(sn_box_arena_current != NULL);
+
+    __atomic_add_fetch(&future->ref_count, 1, __ATOMIC_RELAXED);
+
+    sn_box_t *box = sn_box_arena_alloc(sn_box_arena_current);
+    box->type = SN_VALUE_TYPE_FUTURE;
+    box->flags = SN_BOX_FLAG_ARENA;
+    box->arena_id = sn_box_arena_current->id;
+    box->future = future;
+
+    sn_value_t v = { (uintptr_t)box + SN_VALUE_TAG_BOX };
+    return v;
+}
+
+// copies a value that something else owns into the current arena
+sn_value_t sn_value_import(sn_value_t value)
+{
+    if (!SN_VALUE_IS_BOX(value)) {
+        return value;
+    }
+
+    sn_box_t *box = SN_VALUE_BOX(value);
+    if (box->type == SN_VALUE_TYPE_FUTURE) {
+        return sn_value_future(box->future);
+    }
+    else if (box->type == SN_VALUE_TYPE_VECTOR) {
+        sn_value_t copy = sn_value_vector(box->vector->count);
+        for (int64_t i = 0; i < box->vector->count; i++) {
+            SN_VALUE_VECTOR(copy)->items[i] = sn_value_import(box->vector->items[i]);
+        }
+        return copy;
+    }
+
+    return sn_value_box_int(box->i);
+}
+
+// the value of an integer literal, boxed for as long as the program lives
+sn_value_t sn_value_literal(int64_t i)
+{
+    if (i >= SN_SMALL_INT_MIN && i <= SN_SMALL_INT_MAX) {
+        return sn_make_int(i);
+    }
+
+    sn_box_t *box = calloc(1, sizeof *box);
+    box->type = SN_VALUE_TYPE_INTEGER;
+    box->i = i;
+
+    sn_value_t v = { (uintptr_t)box + SN_VALUE_TAG_BOX };
+    return v;
+}
+
+// copies a vector and the boxes in it out of their arena, into memory that
+// is freed with sn_box_release()
+sn_vector_t *sn_vector_export(sn_vector_t *vector)
+{
+    sn_vector_t *copy = malloc(sizeof *copy + vector->count * sizeof copy->items[0]);
+    copy->count = vector->count;
+
+    for (int64_t i = 0; i < vector->count; i++) {
+        sn_value_t item = vector->items[i];
+        if (SN_VALUE_IS_BOX(item)) {
+            sn_box_t *box = calloc(1, sizeof *box);
+            sn_box_export(box, SN_VALUE_BOX(item));
+            item.bits = (uintptr_t)box + SN_VALUE_TAG_BOX;
+        }
+        copy->items[i] = item;
+    }
+
+    return copy;
+}
+
+void sn_box_export(sn_box_t *dst, sn_box_t *src)
+{
+    dst->type = src->type;
+    dst->flags = 0;
+    dst->arena_id = 0;
+    if (src->type == SN_VALUE_TYPE_VECTOR) {
+        dst->vector = sn_vector_export(src->vector);
+    }
+    else if (src->type == SN_VALUE_TYPE_FUTURE) {
+        dst->future = src->future;
+        __atomic_add_fetch(&dst->future->ref_count, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        dst->i = src->i;
+    }
+}
+
+void sn_box_release(sn_box_t *box)
+{
+    if (box->type == SN_VALUE_TYPE_FUTURE) {
+        sn_future_release(box->future);
+        box->type = SN_VALUE_TYPE_INVALID;
+    }
+
+    if (box->type != SN_VALUE_TYPE_VECTOR) {
+        return;
+    }
+
+    for (int64_t i = 0; i < box->vector->count; i++) {
+        if (SN_VALUE_IS_BOX(box->vector->items[i])) {
+            sn_box_t *item = SN_VALUE_BOX(box->vector->items[i]);
+            sn_box_release(item);
+            free(item);
+        }
+    }
+    free(box->vector);
+    box->type = SN_VALUE_TYPE_INVALID;
+}
+
+void sn_future_release(sn_future_t *future)
+{
+    if (__atomic_sub_fetch(&future->ref_count, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < future->arg_count; i++) {
+        if (SN_VALUE_IS_BOX(future->args[i])) {
+            sn_box_t *box = SN_VALUE_BOX(future->args[i]);
+            sn_box_release(box);
+            free(box);
+        }
+    }
+    sn_box_release(&future->value_box);
+    sn_pool_job_deinit(&future->job);
+    free(future);
+}
+
+// stores a value produced by a run into a public value
+void sn_value_export(sn_value_t *value_out, sn_value_t value)
+{
+    sn_public_value_t *pub = (sn_public_value_t *)value_out;
+
+    // the value may be a part of what the public value held
+    sn_box_t old = pub->box;
+
+    if (SN_VALUE_IS_BOX(value)) {
+        sn_box_export(&pub->box, SN_VALUE_BOX(value));
+        value.bits = (uintptr_t)&pub->box + SN_VALUE_TAG_BOX;
+    }
+    else {
+        pub->box.type = SN_VALUE_TYPE_INVALID;
+    }
+
+    pub->value = value;
+    sn_box_release(&old);
+}
+
 sn_value_t *sn_value_create(void)
 {
-    sn_value_t *out = calloc(1, sizeof *out);
-    out->type = SN_VALUE_TYPE_INVALID;
-    return out;
+    sn_public_value_t *out = calloc(1, sizeof *out);
+    out->value.bits = SN_VALUE_BITS_INVALID;
+    return &out->value;
 }
 
 void sn_value_destroy(sn_value_t *value)
@@ -14,36 +337,71 @@ void sn_value_destroy(sn_value_t *value)
         return;
     }
 
+    sn_box_release(&((sn_public_value_t *)value)->box);
     free(value);
 }
 
 sn_error_t sn_value_as_integer(sn_value_t *value, int64_t *i_out)
 {
-    if (value->type != SN_VALUE_TYPE_INTEGER) {
+    if (!SN_VALUE_IS_INT(*value)) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    *i_out = value->i;
+    *i_out = SN_VALUE_INT(*value);
     return SN_SUCCESS;
 }
 
 sn_error_t sn_value_as_boolean(sn_value_t *value, bool *b_out)
 {
-    if (value->type != SN_VALUE_TYPE_BOOLEAN) {
+    if (!SN_VALUE_IS_BOOL(*value)) {
         return SN_ERROR_WRONG_VALUE_TYPE;
     }
 
-    *b_out = value->i;
+    *b_out = SN_VALUE_BOOL(*value);
     return SN_SUCCESS;
 }
 
 bool sn_value_is_null(sn_value_t *value)
 {
-    return value->type == SN_VALUE_TYPE_NULL;
+    return SN_VALUE_IS_NULL(*value);
+}
+
+sn_error_t sn_value_as_vector(sn_value_t *value, int64_t *count_out)
+{
+    if (!SN_VALUE_IS_VECTOR(*value)) {
+        return SN_ERROR_WRONG_VALUE_TYPE;
+    }
+
+    *count_out = SN_VALUE_VECTOR(*value)->count;
+    return SN_SUCCESS;
+}
+
+sn_value_t *sn_value_vector_item(sn_value_t *value, int64_t index)
+{
+    if (!SN_VALUE_IS_VECTOR(*value)) {
+        return NULL;
+    }
+
+    sn_vector_t *vector = SN_VALUE_VECTOR(*value);
+    if (index < 0 || index >= vector->count) {
+        return NULL;
+    }
+    return &vector->items[index];
 }
 
 void sn_value_set_integer(sn_value_t *value, int64_t i)
 {
-    value->type = SN_VALUE_TYPE_INTEGER;
-    value->i = i;
+    sn_public_value_t *pub = (sn_public_value_t *)value;
+    sn_box_release(&pub->box);
+
+    if (i >= SN_SMALL_INT_MIN && i <= SN_SMALL_INT_MAX) {
+        pub->value = sn_make_int(i);
+        return;
+    }
+
+    pub->box.type = SN_VALUE_TYPE_INTEGER;
+    pub->box.flags = 0;
+    pub->box.arena_id = 0;
+    pub->box.i = i;
+    pub->value.bits = (uintptr_t)&pub->box + SN_VALUE_TAG_BOX;
 }
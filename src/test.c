@@ -2,6 +2,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "snscript_internal.h"
 
@@ -10,7 +11,7 @@
 #define ASSERT_NULL(x) ASSERT_EQ(x, NULL)
 #define ASSERT_OK(x) ASSERT_EQ(x, SN_SUCCESS)
 
-#define ASSERT_NULL_TYPE(x) ASSERT((x).type == SN_VALUE_TYPE_NULL)
+#define ASSERT_NULL_TYPE(x) ASSERT(SN_VALUE_IS_NULL(x))
 
 void test_prog_create_destroy(void)
 {
@@ -541,6 +542,153 @@ void test_println(void)
     sn_program_destroy(prog);
 }
 
+typedef struct output_st
+{
+    char buf[4096];
+    size_t size;
+    int writes;
+} output_t;
+
+void output_write(void *ctx, const char *buf, size_t size)
+{
+    output_t *output = ctx;
+    ASSERT(output->size + size < sizeof output->buf);
+    memcpy(output->buf + output->size, buf, size);
+    output->size += size;
+    output->buf[output->size] = '\0';
+    output->writes++;
+}
+
+void test_parse_parallel(void)
+{
+    // long enough to be parsed on threads in segments
+    size_t cap = 4 * SN_PARSE_SEGMENT_SIZE;
+    char *src = malloc(cap);
+    size_t size = 0;
+    int count = 0;
+    while (size < 3 * SN_PARSE_SEGMENT_SIZE) {
+        size += sprintf(src + size,
+                        ";; f%d returns (x + %d) {\n"
+                        "(pure (f%d x)\n"
+                        "  {x + %d}) (const c%d -%d)\n",
+                        count, count, count, count, count, count);
+        count++;
+    }
+    size += sprintf(src + size, "(fn (main) {(f%d 1) + c1})\n", count - 1);
+
+    int thread_counts[] = {1, 4};
+    int64_t values[2];
+    for (int t = 0; t < 2; t++) {
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+
+        sn_program_t *prog = NULL;
+        ASSERT_OK(sn_program_create_with_options(&prog, src, size, &options));
+        ASSERT_EQ(prog->expr.child_count, 2 * count + 1);
+        ASSERT_OK(sn_program_build(prog));
+        sn_value_t *val = sn_value_create();
+        ASSERT_OK(sn_program_run_main(prog, NULL, val));
+        values[t] = ival(val);
+        sn_value_destroy(val);
+        sn_program_destroy(prog);
+
+        // the first error is found, wherever the segments are split
+        char *bad = strstr(src + 2 * SN_PARSE_SEGMENT_SIZE, "(pure");
+        bad[1] = '}';
+        ASSERT_EQ(sn_program_create_with_options(&prog, src, size, &options), SN_ERROR_EXPECTED_EXPR_CLOSE);
+        int line = 0;
+        int col = 0;
+        sn_program_error_pos(prog, &line, &col);
+        int bad_line = 1;
+        for (char *c = src; c < bad; c++) {
+            bad_line += *c == '\n';
+        }
+        ASSERT_EQ(line, bad_line);
+        ASSERT_EQ(col, 2);
+        bad[1] = 'p';
+        sn_program_destroy(prog);
+
+        // the forms parsed after an error are freed along with the rest
+        bad = strstr(src + SN_PARSE_SEGMENT_SIZE / 2, "(pure");
+        bad[1] = '}';
+        ASSERT_EQ(sn_program_create_with_options(&prog, src, size, &options), SN_ERROR_EXPECTED_EXPR_CLOSE);
+        bad[1] = 'p';
+        sn_program_destroy(prog);
+    }
+    ASSERT_EQ(values[0], count - 1);
+    ASSERT_EQ(values[1], count - 1);
+
+    free(src);
+}
+
+void test_output(void)
+{
+    output_t output = {0};
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = 1;
+    options.write = output_write;
+    options.write_ctx = &output;
+
+    // a run writes what it printed once, when it stops
+    char *src = "(pure (double x) {x * 2})\n"
+                "(fn (main)\n"
+                "  (println 0 -7 {9223372036854775807 + 0} {{0 - 9223372036854775807} - 1})\n"
+                "  (println true false null)\n"
+                "  (println (pmap double 0 3))\n"
+                "  (println))\n";
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+    sn_value_t *val = sn_value_create();
+    ASSERT_OK(sn_program_run_main(prog, NULL, val));
+    ASSERT_EQ(output.writes, 1);
+    ASSERT(strcmp(output.buf,
+                  "0 -7 9223372036854775807 -9223372036854775808\n"
+                  "true false null\n"
+                  "[0 2 4]\n"
+                  "\n") == 0);
+
+    // output from a failed run is written too
+    output.size = 0;
+    output.writes = 0;
+    sn_program_destroy(prog);
+    src = "(fn (main) (println 1) {1 + true})\n";
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_EQ(sn_program_run_main(prog, NULL, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+    ASSERT_EQ(output.writes, 1);
+    ASSERT(strcmp(output.buf, "1\n") == 0);
+    sn_program_destroy(prog);
+
+    // a batch writes once its vms are done with
+    output.size = 0;
+    output.writes = 0;
+    enum { COUNT = 100 };
+    sn_value_t *args[COUNT];
+    sn_value_t *vals[COUNT];
+    sn_error_t errors[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        args[i] = sn_value_create();
+        vals[i] = sn_value_create();
+        sn_value_set_integer(args[i], i);
+    }
+    src = "(fn (main x) (if {{x % 40} == 0} (println x) null))\n";
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_OK(sn_program_run_batch(prog, COUNT, args, vals, errors, NULL));
+    ASSERT_EQ(output.writes, 1);
+    ASSERT(strcmp(output.buf, "0\n40\n80\n") == 0);
+    sn_program_destroy(prog);
+
+    for (int i = 0; i < COUNT; i++) {
+        sn_value_destroy(args[i]);
+        sn_value_destroy(vals[i]);
+    }
+    sn_value_destroy(val);
+}
+
 void error_check(sn_program_t *prog, int expect_line, int expect_col, const char *expect_str)
 {
     int actual_line;
@@ -594,6 +742,26 @@ void test_parse_error(void)
     sn_program_destroy(prog);
 }
 
+// parses and builds src handed to a parser chunk_size bytes at a time
+sn_error_t
+stream_program(sn_program_t **prog_out,
+               const char *src,
+               size_t chunk_size,
+               const sn_program_options_t *options)
+{
+    sn_parser_t *parser = NULL;
+    ASSERT_OK(sn_parser_create(&parser, prog_out, options));
+
+    sn_error_t status = SN_SUCCESS;
+    size_t size = strlen(src);
+    for (size_t i = 0; i < size && status == SN_SUCCESS; i += chunk_size) {
+        status = sn_parser_feed(parser, src + i, SN_MIN(chunk_size, size - i));
+    }
+
+    sn_error_t finish_status = sn_parser_finish(parser);
+    return status != SN_SUCCESS ? status : finish_status;
+}
+
 void
 error_build(sn_error_t err_code,
             int err_line,
@@ -612,9 +780,312 @@ error_build(sn_error_t err_code,
         error_check(prog, err_line, err_col, err_sym);
     }
     sn_program_destroy(prog);
+
+    // a program built as it is parsed fails the same way
+    size_t chunk_sizes[] = {1, 3, strlen(src)};
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(stream_program(&prog, src, chunk_sizes[i], NULL), err_code);
+        if (err_code != SN_SUCCESS) {
+            error_check(prog, err_line, err_col, err_sym);
+        }
+        sn_program_destroy(prog);
+    }
+
+    // and so does one that parses function bodies as they are built
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.lazy_parse = true;
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    status = sn_program_build(prog);
+    if (status != err_code) {
+        fprintf(stderr, "lazily parsed sn_program_build returned %s\n", sn_error_str(status));
+        abort();
+    }
+    if (err_code != SN_SUCCESS) {
+        error_check(prog, err_line, err_col, err_sym);
+    }
+    sn_program_destroy(prog);
 }
 
 
+void test_parser(void)
+{
+    struct {
+        const char *src;
+        sn_error_t status;
+        int line;
+        int col;
+    } errors[] = {
+        {"(\n", SN_ERROR_UNEXPECTED_END_OF_INPUT, 2, 1},
+        {")\n", SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT, 1, 1},
+        {"(fn (main) 1))", SN_ERROR_EXTRA_CHARS_AT_END_OF_INPUT, 1, 14},
+        {"(}\n", SN_ERROR_EXPECTED_EXPR_CLOSE, 1, 2},
+        {"(\n(x)\n({a b c d}))\n", SN_ERROR_INFIX_EXPR_NOT_3_ELEMENTS, 3, 2},
+        {"\n\n1234x", SN_ERROR_INVALID_INTEGER_LITERAL, 3, 5},
+        {"var'", SN_ERROR_INVALID_SYMBOL_NAME, 1, 4},
+        {"(fn (main) ;; (\n 1) ;", SN_ERROR_INVALID_SYMBOL_NAME, 2, 5},
+        {"(fn (main) 1)\n;; (fn (main) 2)", SN_SUCCESS, 0, 0},
+    };
+
+    for (int e = 0; e < sizeof errors / sizeof errors[0]; e++) {
+        for (size_t chunk_size = 1; chunk_size <= 4; chunk_size++) {
+            sn_program_t *prog = NULL;
+            ASSERT_EQ(stream_program(&prog, errors[e].src, chunk_size, NULL), errors[e].status);
+            if (errors[e].status != SN_SUCCESS) {
+                error_check(prog, errors[e].line, errors[e].col, NULL);
+            }
+            sn_program_destroy(prog);
+        }
+    }
+
+    // forms are split across chunks anywhere, atoms included
+    char *src = "(const a 40);; a comment (\n"
+                "(let b {a + 1})  (fn (f x)\n"
+                "  {x * -1})\n"
+                "(fn (main)\n"
+                "  (= b {b + (f -1)})\n"
+                "  {a + b})\n"
+                ";; a comment at the end";
+    sn_value_t *val = sn_value_create();
+    for (size_t chunk_size = 1; chunk_size <= strlen(src); chunk_size++) {
+        sn_program_t *prog = NULL;
+        ASSERT_OK(stream_program(&prog, src, chunk_size, NULL));
+        ASSERT_OK(sn_program_run_main(prog, NULL, val));
+        ASSERT_EQ(ival(val), 82);
+        sn_program_destroy(prog);
+    }
+    sn_value_destroy(val);
+}
+
+void test_build_parallel(void)
+{
+    enum { COUNT = 200 };
+    char *src = malloc(COUNT * 64 + 256);
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        options.parallel_args = true;
+
+        // each function calls the one before it
+        size_t size = sprintf(src, "(pure (f0 x) x)\n");
+        for (int i = 1; i < COUNT; i++) {
+            size += sprintf(src + size, "(pure (f%d x) (f%d {x + 1}))\n", i, i - 1);
+        }
+        sprintf(src + size, "(fn (main) (f%d 0))\n", COUNT - 1);
+
+        sn_program_t *prog = NULL;
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+        sn_value_t *val = sn_value_create();
+        ASSERT_OK(sn_program_run_main(prog, NULL, val));
+        ASSERT_EQ(ival(val), COUNT - 1);
+        sn_value_destroy(val);
+        sn_program_destroy(prog);
+
+        // a body only sees the globals declared before it, and the error is
+        // the first one in the source
+        sprintf(src + size,
+                "(fn (g) (h))\n"
+                "(fn (h) null)\n"
+                "(const k {1 + undeclared})\n"
+                "(fn (main) (f%d 0))\n", COUNT - 1);
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_EQ(sn_program_build(prog), SN_ERROR_UNDECLARED);
+        error_check(prog, COUNT + 1, 10, "h");
+        sn_program_destroy(prog);
+
+        sprintf(src + size,
+                "(const k {1 + undeclared})\n"
+                "(fn (g) (h))\n"
+                "(fn (main) (f%d 0))\n", COUNT - 1);
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_EQ(sn_program_build(prog), SN_ERROR_UNDECLARED);
+        error_check(prog, COUNT + 1, 15, "undeclared");
+        sn_program_destroy(prog);
+    }
+
+    free(src);
+}
+
+void test_lazy_build(void)
+{
+    char *src = "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}} n {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(pure (sq x) {x * x})\n"
+                "(pure (add a b) {a + b})\n"
+                "(fn (broken) (undeclared 1))\n"
+                "(pure (bad x) (nope x))\n"
+                "(fn (main x)\n"
+                "  (if {x == 0} {(fib 20) + (preduce sq add 0 0 10)}\n"
+                "    (if {x == 1} (broken) (pmap bad 0 3))))\n";
+
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        options.parallel_args = true;
+        options.lazy_build = true;
+
+        // the bodies that fail are never called
+        sn_program_t *prog = NULL;
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+        sn_value_t *arg = sn_value_create();
+        sn_value_t *val = sn_value_create();
+        sn_value_set_integer(arg, 0);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 6765 + 285);
+
+        // the error of a body is the error of every call of it
+        for (int i = 0; i < 2; i++) {
+            sn_value_set_integer(arg, 1);
+            ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_UNDECLARED);
+            error_check(prog, 5, 15, "undeclared");
+        }
+
+        // like other errors of its blocks, at the pmap
+        sn_value_set_integer(arg, 2);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_UNDECLARED);
+        error_check(prog, 9, 27, NULL);
+
+        // building the rest reports the first failed body in the source
+        ASSERT_EQ(sn_program_build_all(prog), SN_ERROR_UNDECLARED);
+        error_check(prog, 5, 15, "undeclared");
+        sn_value_destroy(val);
+        sn_value_destroy(arg);
+        sn_program_destroy(prog);
+
+        // nothing called, so all of it is built by build_all
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+        ASSERT_EQ(sn_program_build_all(prog), SN_ERROR_UNDECLARED);
+        error_check(prog, 5, 15, "undeclared");
+        sn_program_destroy(prog);
+    }
+}
+
+void test_lazy_parse(void)
+{
+    char *src = "(pure (sq x) ;; ( in a comment\n"
+                "  {x * x})\n"
+                "(pure (add a b) {a + b})\n"
+                "(fn (broken) (let a 12x) a)\n"
+                "(fn (main x)\n"
+                "  (if {x == 0} (preduce sq add 0 0 10) (broken)))\n";
+
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.lazy_parse = true;
+    options.lazy_build = true;
+
+    // parsed whole, and streamed in pieces
+    size_t chunk_sizes[] = {0, 1, 7};
+    for (int i = 0; i < 3; i++) {
+        sn_program_t *prog = NULL;
+        if (chunk_sizes[i] == 0) {
+            ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+            ASSERT_OK(sn_program_build(prog));
+        }
+        else {
+            ASSERT_OK(stream_program(&prog, src, chunk_sizes[i], &options));
+        }
+
+        sn_value_t *arg = sn_value_create();
+        sn_value_t *val = sn_value_create();
+        sn_value_set_integer(arg, 0);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 285);
+
+        // the syntax error of a body is found once it is called
+        sn_value_set_integer(arg, 1);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_INTEGER_LITERAL);
+        error_check(prog, 4, 23, NULL);
+        sn_value_destroy(val);
+        sn_value_destroy(arg);
+        sn_program_destroy(prog);
+    }
+
+    // where forms end is still checked when parsing
+    sn_program_t *prog = NULL;
+    src = "(fn (main) (f)";
+    ASSERT_EQ(sn_program_create_with_options(&prog, src, strlen(src), &options),
+              SN_ERROR_UNEXPECTED_END_OF_INPUT);
+    sn_program_destroy(prog);
+
+    src = "(fn (main) (f) 1}";
+    ASSERT_EQ(sn_program_create_with_options(&prog, src, strlen(src), &options),
+              SN_ERROR_EXPECTED_EXPR_CLOSE);
+    error_check(prog, 1, 17, NULL);
+    sn_program_destroy(prog);
+}
+
+int64_t run_update(sn_program_t *prog, const char *src)
+{
+    ASSERT_OK(sn_program_update(prog, src, strlen(src)));
+
+    sn_value_t *val = sn_value_create();
+    ASSERT_OK(sn_program_run_main(prog, NULL, val));
+    int64_t result = ival(val);
+    sn_value_destroy(val);
+    return result;
+}
+
+void test_update(void)
+{
+    char *src = "(pure (sq x) {x * x})\n"
+                "(let base 10)\n"
+                "(fn (main) {(sq 3) + base})\n";
+
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+    sn_expr_t *sq = sn_program_test_get_first_expr(prog);
+
+    // a form that didn't change is kept
+    ASSERT_EQ(run_update(prog, "(pure (sq x) {x * x})\n"
+                               "(let base 20)\n"
+                               "(fn (main) {(sq 3) + base})\n"), 29);
+    ASSERT_EQ(sn_program_test_get_first_expr(prog), sq);
+
+    ASSERT_EQ(run_update(prog, "(pure (sq x) {x * {x * x}})\n"
+                               "(let base 20)\n"
+                               "(fn (main) {(sq 3) + base})\n"), 47);
+
+    // a parse error leaves the program as it was
+    src = "(pure (sq x) {x * x})\n"
+          "(fn (main) (sq 2)\n";
+    ASSERT_EQ(sn_program_update(prog, src, strlen(src)), SN_ERROR_UNEXPECTED_END_OF_INPUT);
+    error_check(prog, 3, 1, NULL);
+    ASSERT_EQ(run_update(prog, "(pure (sq x) {x * {x * x}})\n"
+                               "(let base 20)\n"
+                               "(fn (main) {(sq 3) + base})\n"), 47);
+
+    // main is kept, but the function it calls is gone; the error is where
+    // main is now
+    sn_value_t *val = sn_value_create();
+    src = "(let base 20)\n"
+          "(fn (main) {(sq 3) + base})\n";
+    ASSERT_EQ(sn_program_update(prog, src, strlen(src)), SN_ERROR_UNDECLARED);
+    error_check(prog, 2, 14, "sq");
+    ASSERT_EQ(sn_program_run_main(prog, NULL, val), SN_ERROR_MAIN_FN_MISSING);
+
+    // only what is declared before a function is seen in it
+    src = "(let base 20)\n"
+          "(fn (main) {(sq 3) + base})\n"
+          "(pure (sq x) {x * x})\n";
+    ASSERT_EQ(sn_program_update(prog, src, strlen(src)), SN_ERROR_UNDECLARED);
+    error_check(prog, 2, 14, "sq");
+
+    ASSERT_EQ(run_update(prog, "  (pure (sq x) {x * x})\n"
+                               "(let base 20)\n"
+                               "(fn (main) {(sq 3) + base})\n"), 29);
+    sn_value_destroy(val);
+    sn_program_destroy(prog);
+}
+
 void test_build_error(void)
 {
     error_build(SN_ERROR_EXPR_NOT_3_ITEMS, 2, 3, NULL,
@@ -1379,6 +1850,1157 @@ void test_pure(void)
     sn_value_destroy(arg);
 }
 
+void test_shallow(void)
+{
+    char *src = "(fn (main x)\n"
+                "  (+ x (* 2 3) (- (+ (+ (+ (+ (+ (+ (+ (+ 1))))))))))\n"
+                "  (println x))\n";
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+
+    sn_expr_t *body = &sn_program_test_get_first_expr(prog)->child_head[2];
+    ASSERT_EQ(body->shallow_depth, 0);
+    ASSERT_EQ(body->child_head[0].shallow_depth, 1);
+    ASSERT_EQ(body->child_head[1].shallow_depth, 1);
+    ASSERT_EQ(body->child_head[2].shallow_depth, 2);
+    ASSERT_EQ(body->child_head[3].shallow_depth, 0);
+    ASSERT_EQ(body->child_head[3].child_head[1].shallow_depth, 0);
+    ASSERT_EQ(body->child_head[3].child_head[1].child_head[1].shallow_depth,
+              SN_EVAL_SHALLOW_MAX_DEPTH);
+
+    // println isn't pure
+    ASSERT_EQ(body->next->shallow_depth, 0);
+    sn_program_destroy(prog);
+
+    sn_value_t *arg = sn_value_create();
+    sn_value_set_integer(arg, 4);
+    sn_value_t *val = run_main(arg,
+                               "(fn (main x)\n"
+                               "  (+ x (* 2 3) (- (+ (+ (+ (+ (+ (+ (+ (+ 1)))))))))))\n");
+    ASSERT_EQ(ival(val), 9);
+
+    // a local that shadows a builtin is called through a frame
+    val = run_main(arg,
+                   "(fn (main x)\n"
+                   "  (let + -)\n"
+                   "  (+ x 1))\n");
+    ASSERT_EQ(ival(val), 3);
+
+    error_run_main(SN_ERROR_WRONG_VALUE_TYPE, 2, 8, NULL, arg,
+                   "(fn (main x)\n"
+                   "  (+ x (! x)))\n");
+
+    sn_value_destroy(arg);
+}
+
+sn_value_t *
+error_run_main_jit(sn_error_t err_code,
+                   sn_value_t *arg,
+                   const char *src,
+                   const char *fn_name,
+                   bool expect_compiled)
+{
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.jit_threshold = 0;
+
+    sn_value_t *value = sn_value_create();
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_EQ(sn_program_run_main(prog, arg, value), err_code);
+
+#if defined(__x86_64__)
+    sn_ref_t ref;
+    sn_symbol_t *sym = sn_program_get_symbol(prog, fn_name, fn_name + strlen(fn_name));
+    ASSERT_OK(sn_scope_find_var(&prog->globals, sym, &ref));
+    sn_func_t *func = SN_VALUE_USER_FN(*sn_scope_get_const_value(&prog->globals, &ref));
+    ASSERT_EQ(func->jit.code != NULL, expect_compiled);
+#endif
+
+    sn_program_destroy(prog);
+    return value;
+}
+
+void test_jit(void)
+{
+    sn_value_t *arg = sn_value_create();
+    sn_value_t *val = NULL;
+
+    sn_value_set_integer(arg, 20);
+    val = error_run_main_jit(SN_SUCCESS, arg,
+                             "(pure (fib n)\n"
+                             "  (if {{n == 0} || {n == 1}}\n"
+                             "    n\n"
+                             "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                             "(fn (main x) (fib x))\n", "fib", true);
+    ASSERT_EQ(ival(val), 6765);
+
+    sn_value_set_integer(arg, 10);
+    val = error_run_main_jit(SN_SUCCESS, arg,
+                             "(pure (fact n)\n"
+                             "  (if {n == 0} 1 {n * (fact {n - 1})}))\n"
+                             "(fn (main x) (fact x))\n", "fact", true);
+    ASSERT_EQ(ival(val), 3628800);
+
+    // booleans, const globals and calls between compiled functions
+    sn_value_set_integer(arg, 7);
+    val = error_run_main_jit(SN_SUCCESS, arg,
+                             "(pure (even? n)\n"
+                             "  (|| {n == 0} (! {{n % 2} != 0})))\n"
+                             "(pure (odd? n)\n"
+                             "  (&& {n != 0} (! (even? n))))\n"
+                             "(const k 3)\n"
+                             "(pure (f n) (if (odd? n) {(- n) % k} {n / k}))\n"
+                             "(fn (main x) {(f x) + (f {x + 1})})\n", "f", true);
+    ASSERT_EQ(ival(val), -1 + 2);
+
+    // an if without a false arm isn't compiled
+    val = error_run_main_jit(SN_SUCCESS, arg,
+                             "(pure (f n) (if {n == 7} 1))\n"
+                             "(fn (main x) (f x))\n", "f", false);
+    ASSERT_EQ(ival(val), 1);
+
+    // non-integer arguments are left to the interpreter
+    val = error_run_main_jit(SN_SUCCESS, arg,
+                             "(pure (same? a b) {a == b})\n"
+                             "(fn (main x) (same? true (same? x x)))\n", "same?", true);
+    ASSERT_EQ(bval(val), true);
+
+    // a const global that isn't an integer fails the guard
+    error_run_main_jit(SN_ERROR_WRONG_VALUE_TYPE, arg,
+                       "(const k true)\n"
+                       "(pure (f n) {n == k})\n"
+                       "(fn (main x) (f x))\n", "f", true);
+
+    sn_value_destroy(arg);
+}
+
+// runs the C a program was translated to, compiled with the library, and
+// reads what it wrote to stdout and stderr
+void emit_c_run(const char *exe_path, int arg, char *out, char *err, size_t size)
+{
+    char cmd[256];
+    snprintf(cmd, sizeof cmd, "%s %d 2>%s.err", exe_path, arg, exe_path);
+    FILE *p = popen(cmd, "r");
+    ASSERT(p != NULL);
+    out[fread(out, 1, size - 1, p)] = '\0';
+    pclose(p);
+
+    snprintf(cmd, sizeof cmd, "%s.err", exe_path);
+    FILE *f = fopen(cmd, "r");
+    ASSERT(f != NULL);
+    err[fread(err, 1, size - 1, f)] = '\0';
+    fclose(f);
+    remove(cmd);
+}
+
+void test_emit_c(void)
+{
+    char *src = "(const k 3)\n"
+                "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}}\n"
+                "    n\n"
+                "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(fn (count n)\n"
+                "  (let i 0)\n"
+                "  (while {i != n} (= i {i + k}))\n"
+                "  i)\n"
+                "(fn (main x)\n"
+                "  (let f count)\n"
+                "  (println (fib x) (f 9) {9223372036854775807 + x})\n"
+                "  (println (if {x == 3} (fib true) x)))\n";
+    output_t output = {0};
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = 1;
+    options.write = output_write;
+    options.write_ctx = &output;
+
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+
+    char c_path[] = "/tmp/sn_emit_c_XXXXXX.c";
+    int fd = mkstemps(c_path, 2);
+    ASSERT(fd >= 0);
+    FILE *out = fdopen(fd, "w");
+    ASSERT_OK(sn_program_emit_c(prog, "test.sn", out));
+    fclose(out);
+
+    // the library sources are the ones next to this file
+    char exe_path[sizeof c_path];
+    memcpy(exe_path, c_path, sizeof c_path);
+    exe_path[strlen(exe_path) - 2] = '\0';
+    char cmd[1024];
+    snprintf(cmd, sizeof cmd,
+             "cd \"$(dirname %s)\" && gcc -w -pthread -I. -DSN_COMPILED_MAIN %s "
+             "$(ls *.c | grep -v -e '^test.c$' -e '^snscript.c$') -o %s",
+             __FILE__, c_path, exe_path);
+    ASSERT_EQ(system(cmd), 0);
+
+    // fib is typed and runs natively, count is generic, and fib called with
+    // a boolean falls back to the generic code, which fails
+    int args[] = {0, 10, 3};
+    sn_value_t *arg = sn_value_create();
+    sn_value_t *val = sn_value_create();
+    for (int i = 0; i < 3; i++) {
+        output.size = 0;
+        output.buf[0] = '\0';
+        sn_value_set_integer(arg, args[i]);
+        sn_error_t status = sn_program_run_main(prog, arg, val);
+
+        char expected_err[256] = "";
+        if (status != SN_SUCCESS) {
+            int line = 0;
+            int col = 0;
+            const char *sym = NULL;
+            sn_program_error_pos(prog, &line, &col);
+            sn_program_error_symbol(prog, &sym);
+            snprintf(expected_err, sizeof expected_err, "test.sn:%d:%d %s%s%s\n", line, col,
+                     sn_error_str(status), sym == NULL ? "" : ": ", sym == NULL ? "" : sym);
+        }
+        ASSERT_EQ(status == SN_SUCCESS, args[i] != 3);
+
+        char run_out[4096];
+        char run_err[4096];
+        emit_c_run(exe_path, args[i], run_out, run_err, sizeof run_out);
+        ASSERT(strcmp(run_out, output.buf) == 0);
+        ASSERT(strcmp(run_err, expected_err) == 0);
+    }
+
+    remove(c_path);
+    remove(exe_path);
+    sn_value_destroy(val);
+    sn_value_destroy(arg);
+    sn_program_destroy(prog);
+}
+
+void test_value_repr(void)
+{
+    sn_value_t *arg = sn_value_create();
+    sn_value_t *val = NULL;
+
+    ASSERT_EQ(sizeof(sn_value_t), 8);
+
+    // integers outside of the small range are boxed
+    val = run_main(NULL, "(fn (main) {9223372036854775807 + 1})\n");
+    ASSERT_EQ(ival(val), INT64_MIN);
+
+    sn_value_set_integer(arg, INT64_MAX);
+    val = run_main(arg, "(fn (main x) (== x 9223372036854775807))\n");
+    ASSERT_EQ(bval(val), true);
+
+    sn_value_set_integer(arg, -4611686018427387904);
+    val = run_main(arg, "(fn (main x) {x - 1})\n");
+    ASSERT_EQ(ival(val), -4611686018427387905);
+
+    // boxes that are still reachable survive collections
+    val = run_main(NULL,
+                   "(let big 4611686018427387905)\n"
+                   "(fn (main)\n"
+                   "  (let i 0)\n"
+                   "  (let s 0)\n"
+                   "  (while {i != 100000}\n"
+                   "    (do (= s {s + big}) (= i {i + 1})))\n"
+                   "  s)\n");
+    ASSERT_EQ(ival(val), 100000);
+
+    sn_value_destroy(arg);
+}
+
+void test_budget(void)
+{
+    sn_run_limits_t limits;
+    sn_program_t *prog = NULL;
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(fn (main x)\n"
+                "  (let i 0)\n"
+                "  (while {i != x} (= i {i + 1}))\n"
+                "  i)\n";
+
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+
+    // a loop that finishes within its budget
+    sn_run_limits_init(&limits);
+    limits.max_steps = 10000;
+    sn_value_set_integer(arg, 100);
+    ASSERT_OK(sn_program_run_main_limited(prog, arg, val, &limits));
+    ASSERT_EQ(ival(val), 100);
+
+    // and one that doesn't
+    sn_value_set_integer(arg, -1);
+    ASSERT_EQ(sn_program_run_main_limited(prog, arg, val, &limits), SN_ERROR_BUDGET_EXHAUSTED);
+    ASSERT(sn_value_is_null(val));
+
+    sn_run_limits_init(&limits);
+    limits.timeout_ns = 10 * 1000 * 1000;
+    ASSERT_EQ(sn_program_run_main_limited(prog, arg, val, &limits), SN_ERROR_BUDGET_EXHAUSTED);
+    sn_program_destroy(prog);
+
+    // calls to native code take from the same budget
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.jit_threshold = 0;
+    src = "(pure (fib n)\n"
+          "  (if {{n == 0} || {n == 1}}\n"
+          "    n\n"
+          "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+          "(fn (main x) (fib x))\n";
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+
+    sn_run_limits_init(&limits);
+    limits.max_steps = 100000;
+    sn_value_set_integer(arg, 10);
+    ASSERT_OK(sn_program_run_main_limited(prog, arg, val, &limits));
+    ASSERT_EQ(ival(val), 55);
+
+    sn_value_set_integer(arg, 60);
+    ASSERT_EQ(sn_program_run_main_limited(prog, arg, val, &limits), SN_ERROR_BUDGET_EXHAUSTED);
+
+    sn_program_destroy(prog);
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+void test_vm(void)
+{
+    sn_vm_t *vm = NULL;
+    sn_program_t *prog = NULL;
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(let count 0)\n"
+                "(fn (main x)\n"
+                "  (let i 0)\n"
+                "  (while {i != x} (do (= i {i + 1}) (yield)))\n"
+                "  {i + 100000000000000000})\n";
+
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_OK(sn_vm_create(&vm));
+
+    // every iteration yields, so each resume runs one of them
+    sn_value_set_integer(arg, 5);
+    ASSERT_OK(sn_vm_start(vm, prog, arg));
+    sn_value_set_integer(arg, 0);
+    int resumes = 0;
+    while (sn_vm_resume(vm, 0) == SN_VM_RUNNING) {
+        ASSERT_EQ(sn_vm_result(vm, val), SN_ERROR_GENERIC);
+        resumes++;
+    }
+    ASSERT_EQ(resumes, 5);
+    ASSERT_OK(sn_vm_result(vm, val));
+    ASSERT_EQ(ival(val), 100000000000000005);
+    ASSERT_EQ(sn_vm_resume(vm, 0), SN_VM_DONE);
+
+    // a run gets the same result however its steps are sliced
+    sn_value_set_integer(arg, 50);
+    ASSERT_OK(sn_vm_start(vm, prog, arg));
+    resumes = 0;
+    while (sn_vm_resume(vm, 3) == SN_VM_RUNNING) {
+        resumes++;
+    }
+    ASSERT(resumes > 50);
+    ASSERT_OK(sn_vm_result(vm, val));
+    ASSERT_EQ(ival(val), 100000000000000050);
+
+    // yield doesn't stop runs that aren't stepped
+    ASSERT_OK(sn_program_run_main(prog, arg, val));
+    ASSERT_EQ(ival(val), 100000000000000050);
+    sn_program_destroy(prog);
+
+    src = "(fn (main x)\n"
+          "  (yield)\n"
+          "  {x + true})\n";
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_OK(sn_vm_start(vm, prog, arg));
+    ASSERT_EQ(sn_vm_resume(vm, 0), SN_VM_RUNNING);
+    ASSERT_EQ(sn_vm_resume(vm, 0), SN_VM_ERROR);
+    ASSERT_EQ(sn_vm_result(vm, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+    ASSERT(sn_value_is_null(val));
+
+    sn_vm_destroy(vm);
+    sn_program_destroy(prog);
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+typedef struct test_thread_st
+{
+    sn_program_t *prog;
+    int64_t arg;
+    int64_t result;
+    sn_error_t status;
+    int line;
+    int col;
+} test_thread_t;
+
+void *test_thread_run(void *data)
+{
+    test_thread_t *t = data;
+    sn_vm_t *vm = NULL;
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+
+    sn_vm_create(&vm);
+    sn_value_set_integer(arg, t->arg);
+    for (int i = 0; i < 20; i++) {
+        sn_vm_start(vm, t->prog, arg);
+        sn_vm_resume(vm, 0);
+        t->status = sn_vm_result(vm, val);
+        if (t->status == SN_SUCCESS) {
+            t->result = ival(val);
+        }
+        sn_vm_error_pos(vm, &t->line, &t->col);
+    }
+
+    sn_vm_destroy(vm);
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+    return NULL;
+}
+
+void test_threads(void)
+{
+    sn_program_t *prog = NULL;
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.jit_threshold = 3;
+    char *src = "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}}\n"
+                "    n\n"
+                "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(fn (main x)\n"
+                "  (if {x == -1}\n"
+                "    {x + true}\n"
+                "    (fib x)))\n";
+
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+
+    // one program, run by a vm on each thread; half of the runs fail
+    pthread_t threads[8];
+    test_thread_t runs[8];
+    for (int i = 0; i < 8; i++) {
+        runs[i] = (test_thread_t){.prog = prog, .arg = i % 2 == 0 ? 15 : -1};
+        ASSERT_EQ(pthread_create(&threads[i], NULL, test_thread_run, &runs[i]), 0);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+        if (i % 2 == 0) {
+            ASSERT_OK(runs[i].status);
+            ASSERT_EQ(runs[i].result, 610);
+        }
+        else {
+            ASSERT_EQ(runs[i].status, SN_ERROR_INVALID_PARAMS_TO_FN);
+            ASSERT_EQ(runs[i].line, 7);
+            ASSERT_EQ(runs[i].col, 5);
+        }
+    }
+
+    sn_program_destroy(prog);
+}
+
+typedef struct test_lazy_run_st
+{
+    test_thread_t run;
+    pthread_barrier_t *start;
+} test_lazy_run_t;
+
+// calls main once, at the same time as the other threads
+void *test_lazy_run(void *data)
+{
+    test_lazy_run_t *t = data;
+    sn_vm_t *vm = NULL;
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    sn_vm_create(&vm);
+    sn_value_set_integer(arg, t->run.arg);
+
+    pthread_barrier_wait(t->start);
+    ASSERT_OK(sn_vm_start(vm, t->run.prog, arg));
+    sn_vm_resume(vm, 0);
+    t->run.status = sn_vm_result(vm, val);
+    if (t->run.status == SN_SUCCESS) {
+        t->run.result = ival(val);
+    }
+    sn_vm_error_pos(vm, &t->run.line, &t->run.col);
+
+    sn_vm_destroy(vm);
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+    return NULL;
+}
+
+void test_lazy_build_threads(void)
+{
+    char *src = "(fn (broken) (undeclared 1))\n"
+                "(pure (sq x) {x * x})\n"
+                "(fn (main x) (if {x == 0} (sq 7) (broken)))\n";
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.lazy_build = true;
+
+    // bodies are built by whichever vm calls them first, and one that fails
+    // fails every call
+    for (int round = 0; round < 20; round++) {
+        sn_program_t *prog = NULL;
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, 8);
+        pthread_t threads[8];
+        test_lazy_run_t runs[8];
+        for (int i = 0; i < 8; i++) {
+            runs[i] = (test_lazy_run_t){.run = {.prog = prog, .arg = i % 2}, .start = &start};
+            ASSERT_EQ(pthread_create(&threads[i], NULL, test_lazy_run, &runs[i]), 0);
+        }
+
+        for (int i = 0; i < 8; i++) {
+            ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+            if (i % 2 == 0) {
+                ASSERT_OK(runs[i].run.status);
+                ASSERT_EQ(runs[i].run.result, 49);
+            }
+            else {
+                ASSERT_EQ(runs[i].run.status, SN_ERROR_UNDECLARED);
+                ASSERT_EQ(runs[i].run.line, 1);
+                ASSERT_EQ(runs[i].run.col, 15);
+            }
+        }
+
+        pthread_barrier_destroy(&start);
+        sn_program_destroy(prog);
+    }
+}
+
+typedef struct test_handle_run_st
+{
+    sn_program_handle_t *handle;
+    bool stop;
+    // the versions seen by the runs, which only go up
+    int64_t last;
+    bool in_order;
+} test_handle_run_t;
+
+void *test_handle_run(void *data)
+{
+    test_handle_run_t *t = data;
+    sn_value_t *val = sn_value_create();
+    sn_vm_t *vm = NULL;
+    ASSERT_OK(sn_vm_create(&vm));
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        sn_program_t *prog = sn_program_handle_pin(t->handle);
+        ASSERT_OK(sn_vm_start(vm, prog, NULL));
+        sn_vm_resume(vm, 0);
+        ASSERT_OK(sn_vm_result(vm, val));
+        sn_program_unpin(prog);
+
+        t->in_order = t->in_order && ival(val) >= t->last;
+        t->last = ival(val);
+    }
+
+    sn_vm_destroy(vm);
+    sn_value_destroy(val);
+    return NULL;
+}
+
+sn_program_t *handle_program(int version)
+{
+    char src[256];
+    snprintf(src, sizeof src,
+             "(pure (fib n) (if {{n == 0} || {n == 1}} n {(fib {n - 1}) + (fib {n - 2})}))\n"
+             "(fn (main) {{(fib 10) * 0} + %d})\n",
+             version);
+
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+    return prog;
+}
+
+void test_program_handle(void)
+{
+    sn_program_handle_t *handle = NULL;
+    ASSERT_OK(sn_program_handle_create(&handle, handle_program(1)));
+
+    // programs are published while threads keep running the one they pinned
+    pthread_t threads[4];
+    test_handle_run_t runs[4];
+    for (int i = 0; i < 4; i++) {
+        runs[i] = (test_handle_run_t){.handle = handle, .last = 1, .in_order = true};
+        ASSERT_EQ(pthread_create(&threads[i], NULL, test_handle_run, &runs[i]), 0);
+    }
+
+    for (int version = 2; version <= 50; version++) {
+        sn_program_handle_publish(handle, handle_program(version));
+    }
+
+    for (int i = 0; i < 4; i++) {
+        __atomic_store_n(&runs[i].stop, true, __ATOMIC_RELEASE);
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+        ASSERT(runs[i].in_order);
+    }
+
+    // a program pinned before another is published lives on until unpinned
+    sn_program_t *prog = sn_program_handle_pin(handle);
+    sn_program_handle_publish(handle, handle_program(51));
+    sn_value_t *val = sn_value_create();
+    ASSERT_OK(sn_program_run_main(prog, NULL, val));
+    ASSERT_EQ(ival(val), 50);
+    sn_program_unpin(prog);
+
+    prog = sn_program_handle_pin(handle);
+    ASSERT_OK(sn_program_run_main(prog, NULL, val));
+    ASSERT_EQ(ival(val), 51);
+    sn_program_unpin(prog);
+
+    sn_value_destroy(val);
+    sn_program_handle_destroy(handle);
+}
+
+typedef struct test_cache_get_st
+{
+    sn_program_cache_t *cache;
+    const char *source;
+    sn_program_t *prog;
+} test_cache_get_t;
+
+void *test_cache_get(void *data)
+{
+    test_cache_get_t *t = data;
+    ASSERT_OK(sn_program_cache_get(t->cache, t->source, strlen(t->source), NULL, &t->prog));
+    return NULL;
+}
+
+// gets the programs in turn from a cache that holds only one, so that most
+// gets evict the program others are waiting for
+void *test_cache_churn(void *data)
+{
+    sn_program_cache_t *cache = data;
+    sn_value_t *val = sn_value_create();
+    sn_vm_t *vm = NULL;
+    ASSERT_OK(sn_vm_create(&vm));
+    for (int i = 0; i < 1000; i++) {
+        char src[64];
+        snprintf(src, sizeof src, "(fn (main) %d)\n", i % 5);
+        sn_program_t *prog = NULL;
+        ASSERT_OK(sn_program_cache_get(cache, src, strlen(src), NULL, &prog));
+        ASSERT_OK(sn_vm_start(vm, prog, NULL));
+        sn_vm_resume(vm, 0);
+        ASSERT_OK(sn_vm_result(vm, val));
+        ASSERT_EQ(ival(val), i % 5);
+        sn_program_unpin(prog);
+    }
+
+    sn_vm_destroy(vm);
+    sn_value_destroy(val);
+    return NULL;
+}
+
+void test_program_cache(void)
+{
+    sn_program_cache_t *cache = NULL;
+    ASSERT_OK(sn_program_cache_create(&cache, 1 << 24));
+    const char *src = "(pure (sq x) {x * x})\n(fn (main) (sq 7))\n";
+    sn_value_t *val = sn_value_create();
+
+    // threads that miss at once all get the one program built
+    pthread_t threads[8];
+    test_cache_get_t gets[8];
+    for (int i = 0; i < 8; i++) {
+        gets[i] = (test_cache_get_t){.cache = cache, .source = src};
+        ASSERT_EQ(pthread_create(&threads[i], NULL, test_cache_get, &gets[i]), 0);
+    }
+    for (int i = 0; i < 8; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+        ASSERT(gets[i].prog == gets[0].prog);
+    }
+    ASSERT_OK(sn_program_run_main(gets[0].prog, NULL, val));
+    ASSERT_EQ(ival(val), 49);
+    for (int i = 0; i < 8; i++) {
+        sn_program_unpin(gets[i].prog);
+    }
+
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_cache_get(cache, src, strlen(src), NULL, &prog));
+    ASSERT(prog == gets[0].prog);
+    sn_program_unpin(prog);
+
+    // the options are part of the key
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.jit_threshold = -1;
+    ASSERT_OK(sn_program_cache_get(cache, src, strlen(src), &options, &prog));
+    ASSERT(prog != gets[0].prog);
+    sn_program_unpin(prog);
+
+    // a failed build is cached along with its error
+    const char *bad = "(fn (main)\n  (sq 7))\n";
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(sn_program_cache_get(cache, bad, strlen(bad), NULL, &prog), SN_ERROR_UNDECLARED);
+        int line = 0;
+        int col = 0;
+        sn_program_error_pos(prog, &line, &col);
+        ASSERT_EQ(line, 2);
+        ASSERT_EQ(col, 4);
+        sn_program_unpin(prog);
+    }
+    sn_program_cache_destroy(cache);
+
+    // with room for only one program, getting another evicts the first,
+    // which still runs for whoever holds it
+    ASSERT_OK(sn_program_cache_create(&cache, 1));
+    sn_program_t *first = NULL;
+    ASSERT_OK(sn_program_cache_get(cache, src, strlen(src), NULL, &first));
+    const char *other = "(fn (main) 8)\n";
+    ASSERT_OK(sn_program_cache_get(cache, other, strlen(other), NULL, &prog));
+    sn_program_unpin(prog);
+    ASSERT_OK(sn_program_cache_get(cache, src, strlen(src), NULL, &prog));
+    ASSERT(prog != first);
+    ASSERT_OK(sn_program_run_main(first, NULL, val));
+    ASSERT_EQ(ival(val), 49);
+    sn_program_unpin(first);
+    sn_program_unpin(prog);
+
+    for (int i = 0; i < 8; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, test_cache_churn, cache), 0);
+    }
+    for (int i = 0; i < 8; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    sn_program_cache_destroy(cache);
+
+    sn_value_destroy(val);
+}
+
+void test_pmap(void)
+{
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(pure (big x) {x * 4000000000000})\n"
+                "(pure (add a b) {a + b})\n"
+                "(pure (bad x) (if {x == 700} {x + true} x))\n"
+                "(fn (main x)\n"
+                "  (if {x == 0} (pmap big 0 1000)\n"
+                "    (if {x == 1} (preduce big add 5 -1000 1000)\n"
+                "      (if {x == 2} (preduce bad add 0 0 1000)\n"
+                "        (pmap println 0 10)))))\n";
+
+    // the same results on one thread and on several
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_t *prog = NULL;
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+
+        int64_t count = 0;
+        sn_value_set_integer(arg, 0);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_OK(sn_value_as_vector(val, &count));
+        ASSERT_EQ(count, 1000);
+        for (int64_t i = 0; i < count; i++) {
+            ASSERT_EQ(ival(sn_value_vector_item(val, i)), i * 4000000000000);
+        }
+        ASSERT(sn_value_vector_item(val, 1000) == NULL);
+
+        sn_value_set_integer(arg, 1);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 5 - 1000 * 4000000000000);
+
+        // the error of the first failing block, at the call
+        sn_value_set_integer(arg, 2);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+        int line = 0;
+        int col = 0;
+        sn_program_error_pos(prog, &line, &col);
+        ASSERT_EQ(line, 7);
+        ASSERT_EQ(col, 20);
+
+        // only pure functions
+        sn_value_set_integer(arg, 3);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+
+        sn_program_destroy(prog);
+    }
+
+    ASSERT_EQ(ival(run_main(0, "(fn (main x) (len (pmap - 3 10)))")), 7);
+    ASSERT_EQ(ival(run_main(0, "(fn (main x) (at (pmap - 3 10) 2))")), -5);
+
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+sn_func_t *find_user_fn(sn_program_t *prog, const char *name)
+{
+    sn_ref_t ref;
+    sn_symbol_t *sym = sn_program_get_symbol(prog, name, name + strlen(name));
+    ASSERT_OK(sn_scope_find_var(&prog->globals, sym, &ref));
+    return SN_VALUE_USER_FN(*sn_scope_get_const_value(&prog->globals, &ref));
+}
+
+int64_t collatz_steps(int64_t x)
+{
+    int64_t steps = 0;
+    for (; x != 1; steps++) {
+        x = x % 2 == 0 ? x / 2 : 3 * x + 1;
+    }
+    return steps;
+}
+
+int64_t fib(int64_t n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+void test_lanes(void)
+{
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(pure (steps n)\n"
+                "  (let x {n + 1})\n"
+                "  (let c 0)\n"
+                "  (while {x != 1}\n"
+                "    (do (if {{x % 2} == 0} (= x {x / 2}) (= x {{x * 3} + 1}))\n"
+                "        (= c {c + 1})))\n"
+                "  c)\n"
+                "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}}\n"
+                "    n\n"
+                "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(pure (pick n) (&& {n != 3} (|| {n == 1} {{n % 3} == 0})))\n"
+                "(pure (mixed n) (if (pick n) {{n / 3} * 1000000000000} {n % 7}))\n"
+                "(pure (spin n) (while {n == 500} null) n)\n"
+                "(pure (either n) (if {n == 0} true n))\n"
+                "(pure (add a b) {a + b})\n"
+                "(fn (main x)\n"
+                "  (if {x == 0} (pmap steps 0 1000)\n"
+                "    (if {x == 1} (pmap fib 0 20)\n"
+                "      (if {x == 2} (pmap pick -10 10)\n"
+                "        (if {x == 3} (preduce mixed add 0 -1000 1000)\n"
+                "          (if {x == 4} (pmap spin 0 1000)\n"
+                "            (pmap either 0 100)))))))\n";
+
+    sn_program_t *prog = NULL;
+    sn_program_options_t options;
+    sn_program_options_init(&options);
+    options.thread_count = 4;
+    options.jit_threshold = -1;
+    ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+    ASSERT_OK(sn_program_build(prog));
+
+    // loops that run for a different number of iterations in each lane
+    int64_t count = 0;
+    sn_value_set_integer(arg, 0);
+    ASSERT_OK(sn_program_run_main(prog, arg, val));
+    ASSERT_OK(sn_value_as_vector(val, &count));
+    ASSERT_EQ(count, 1000);
+    for (int64_t i = 0; i < count; i++) {
+        ASSERT_EQ(ival(sn_value_vector_item(val, i)), collatz_steps(i + 1));
+    }
+    ASSERT(find_user_fn(prog, "steps")->lanes.ready);
+
+    // recursion that goes on one lane at a time once it is deep enough
+    sn_value_set_integer(arg, 1);
+    ASSERT_OK(sn_program_run_main(prog, arg, val));
+    for (int64_t i = 0; i < 20; i++) {
+        ASSERT_EQ(ival(sn_value_vector_item(val, i)), fib(i));
+    }
+
+    // booleans, and integers that need boxes
+    sn_value_set_integer(arg, 2);
+    ASSERT_OK(sn_program_run_main(prog, arg, val));
+    for (int64_t i = -10; i < 10; i++) {
+        ASSERT_EQ(bval(sn_value_vector_item(val, i + 10)), i != 3 && (i == 1 || i % 3 == 0));
+    }
+
+    int64_t sum = 0;
+    for (int64_t i = -1000; i < 1000; i++) {
+        sum += i != 3 && (i == 1 || i % 3 == 0) ? i / 3 * 1000000000000 : i % 7;
+    }
+    sn_value_set_integer(arg, 3);
+    ASSERT_OK(sn_program_run_main(prog, arg, val));
+    ASSERT_EQ(ival(val), sum);
+
+    // a lane that runs out of budget fails the run like the interpreter does
+    sn_run_limits_t limits;
+    sn_run_limits_init(&limits);
+    limits.max_steps = 100000;
+    sn_value_set_integer(arg, 4);
+    ASSERT_EQ(sn_program_run_main_limited(prog, arg, val, &limits), SN_ERROR_BUDGET_EXHAUSTED);
+
+    // a function that returns values of two types runs a call at a time, and
+    // isn't typed again on the next pmap
+    sn_value_set_integer(arg, 5);
+    for (int run = 0; run < 2; run++) {
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT(bval(sn_value_vector_item(val, 0)));
+        for (int64_t i = 1; i < 100; i++) {
+            ASSERT_EQ(ival(sn_value_vector_item(val, i)), i);
+        }
+        ASSERT(find_user_fn(prog, "either")->lanes.rejected);
+        ASSERT(!find_user_fn(prog, "either")->lanes.ready);
+    }
+
+    sn_program_destroy(prog);
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+void test_parallel_args(void)
+{
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}}\n"
+                "    n\n"
+                "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(pure (big n) (let i 0) (while {i != n} (= i {i + 1})) {i * 4000000000000})\n"
+                "(pure (bad n) (if {n == 3} {n + true} (fib n)))\n"
+                "(fn (main x)\n"
+                "  (if {x == 0} {(fib 20) + (big 1000)}\n"
+                "    (if {x == 1} {(bad 8) + (bad 3)}\n"
+                "      {(fib 5) + (bad {x + true})})))\n";
+
+    // forked or not, the same results and errors
+    for (int parallel = 0; parallel < 2; parallel++) {
+        sn_program_t *prog = NULL;
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = 4;
+        options.parallel_args = parallel;
+        options.jit_threshold = -1;
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+
+        sn_value_t *main_fn = sn_scope_get_const_value(&prog->globals, &prog->main_ref);
+        sn_expr_t *if_expr = SN_VALUE_USER_FN(*main_fn)->body;
+        sn_expr_t *sum = if_expr->child_head->next->next;
+        ASSERT_EQ(sum->fork_args, parallel ? 0x6 : 0);
+
+        sn_value_set_integer(arg, 0);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 6765 + 1000 * 4000000000000);
+
+        int line = 0;
+        int col = 0;
+        sn_value_set_integer(arg, 1);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+        sn_program_error_pos(prog, &line, &col);
+        ASSERT_EQ(line, 6);
+        ASSERT_EQ(col, 28);
+
+        // an argument that fails before the call is made
+        sn_value_set_integer(arg, 2);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+        sn_program_error_pos(prog, &line, &col);
+        ASSERT_EQ(line, 10);
+        ASSERT_EQ(col, 23);
+
+        sn_program_destroy(prog);
+    }
+
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+void test_futures(void)
+{
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(pure (fib n)\n"
+                "  (if {{n == 0} || {n == 1}}\n"
+                "    n\n"
+                "    {(fib {n - 1}) + (fib {n - 2})}))\n"
+                "(pure (pfib n d)\n"
+                "  (if {d == 0}\n"
+                "    (fib n)\n"
+                "    (do\n"
+                "      (let a (spawn pfib {n - 1} {d - 1}))\n"
+                "      (let b (pfib {n - 2} {d - 1}))\n"
+                "      {(await a) + b})))\n"
+                "(pure (big x) {x * 4000000000000})\n"
+                "(pure (bad x) {x + true})\n"
+                "(pure (id x) x)\n"
+                "(fn (main x)\n"
+                "  (let v (pmap big 0 3))\n"
+                "  (if {x == 0} (pfib 20 5)\n"
+                "  (if {x == 1} (await (spawn big 3))\n"
+                "  (if {x == 2} (do (let f (spawn fib 15)) {(await f) + (await f)})\n"
+                "  (if {x == 3} (at (await (spawn id v)) 2)\n"
+                "  (if {x == 4} (do (spawn fib 20) (spawn bad 1) 7)\n"
+                "  (if {x == 5} (await (spawn bad 1))\n"
+                "  (if {x == 6} (spawn println 1)\n"
+                "    (await 1)))))))))\n";
+
+    // the same results on one thread and on several
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_t *prog = NULL;
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+
+        sn_value_set_integer(arg, 0);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 6765);
+
+        sn_value_set_integer(arg, 1);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 12000000000000);
+
+        // a future can be awaited more than once
+        sn_value_set_integer(arg, 2);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 1220);
+
+        // the future has its own copy of the vector
+        sn_value_set_integer(arg, 3);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 8000000000000);
+
+        // futures that are never awaited, or fail, don't fail the run
+        sn_value_set_integer(arg, 4);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), 7);
+
+        // the error of the call is reported at the await
+        sn_value_set_integer(arg, 5);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+        int line = 0;
+        int col = 0;
+        sn_program_error_pos(prog, &line, &col);
+        ASSERT_EQ(line, 22);
+        ASSERT_EQ(col, 16);
+
+        sn_value_set_integer(arg, 6);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_INVALID_PARAMS_TO_FN);
+        sn_value_set_integer(arg, 7);
+        ASSERT_EQ(sn_program_run_main(prog, arg, val), SN_ERROR_WRONG_VALUE_TYPE);
+
+        sn_program_destroy(prog);
+    }
+
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+void test_future_args(void)
+{
+    sn_value_t *val = sn_value_create();
+    sn_value_t *arg = sn_value_create();
+    char *src = "(pure (churn n)\n"
+                "  (let i 0)\n"
+                "  (let s 0)\n"
+                "  (while {i != n} (do (= s {s + 4611686018427387905}) (= i {i + 1})))\n"
+                "  s)\n"
+                "(fn (main x) (+ (* x 4611686018427387) (await (spawn churn 20000))))\n";
+
+    // the boxed product is kept while the call collects the boxes it makes
+    uint64_t churn = 20000 * UINT64_C(4611686018427387905);
+    int64_t expected = (int64_t)(1999 * UINT64_C(4611686018427387) + churn);
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_t *prog = NULL;
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+
+        sn_value_set_integer(arg, 1999);
+        ASSERT_OK(sn_program_run_main(prog, arg, val));
+        ASSERT_EQ(ival(val), expected);
+        sn_program_destroy(prog);
+    }
+
+    sn_value_destroy(arg);
+    sn_value_destroy(val);
+}
+
+void test_run_batch(void)
+{
+    enum { COUNT = 1000 };
+    sn_value_t *args[COUNT];
+    sn_value_t *vals[COUNT];
+    sn_error_t errors[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        args[i] = sn_value_create();
+        vals[i] = sn_value_create();
+        sn_value_set_integer(args[i], i);
+    }
+
+    // every run starts from the globals the top level forms left
+    char *src = "(let runs 0)\n"
+                "(const k (* 3 4000000000000))\n"
+                "(fn (main x)\n"
+                "  (= runs {runs + 1})\n"
+                "  (while {x == 501} null)\n"
+                "  (if {x == 500} {x + true} {{x * x} + {k * runs}}))\n";
+
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        sn_program_t *prog = NULL;
+        sn_program_options_t options;
+        sn_program_options_init(&options);
+        options.thread_count = thread_counts[t];
+        ASSERT_OK(sn_program_create_with_options(&prog, src, strlen(src), &options));
+        ASSERT_OK(sn_program_build(prog));
+
+        // with a budget for each run
+        sn_run_limits_t limits;
+        sn_run_limits_init(&limits);
+        limits.max_steps = 1000;
+        ASSERT_OK(sn_program_run_batch(prog, COUNT, args, vals, errors, &limits));
+        for (int i = 0; i < COUNT; i++) {
+            if (i == 501) {
+                ASSERT_EQ(errors[i], SN_ERROR_BUDGET_EXHAUSTED);
+            }
+            else if (i == 500) {
+                ASSERT_EQ(errors[i], SN_ERROR_INVALID_PARAMS_TO_FN);
+                ASSERT(sn_value_is_null(vals[i]));
+            }
+            else {
+                ASSERT_OK(errors[i]);
+                ASSERT_EQ(ival(vals[i]), i * i + 12000000000000);
+            }
+        }
+
+        sn_program_destroy(prog);
+    }
+
+    // a top level form that fails fails every run
+    src = "(const k {1 + true})\n(fn (main x) x)\n";
+    sn_program_t *prog = NULL;
+    ASSERT_OK(sn_program_create(&prog, src, strlen(src)));
+    ASSERT_OK(sn_program_build(prog));
+    ASSERT_EQ(sn_program_run_batch(prog, COUNT, args, vals, errors, NULL), SN_ERROR_INVALID_PARAMS_TO_FN);
+    ASSERT_EQ(errors[0], SN_ERROR_INVALID_PARAMS_TO_FN);
+    ASSERT_EQ(errors[COUNT - 1], SN_ERROR_INVALID_PARAMS_TO_FN);
+    int line = 0;
+    int col = 0;
+    sn_program_error_pos(prog, &line, &col);
+    ASSERT_EQ(line, 1);
+    ASSERT_EQ(col, 10);
+    sn_program_destroy(prog);
+
+    for (int i = 0; i < COUNT; i++) {
+        sn_value_destroy(args[i]);
+        sn_value_destroy(vals[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     test_prog_create_destroy();
@@ -1425,6 +3047,29 @@ int main(int argc, char **argv)
     test_while();
     test_main();
     test_pure();
+    test_shallow();
+    test_jit();
+    test_emit_c();
+    test_value_repr();
+    test_budget();
+    test_vm();
+    test_threads();
+    test_lazy_build_threads();
+    test_program_handle();
+    test_program_cache();
+    test_pmap();
+    test_lanes();
+    test_parallel_args();
+    test_futures();
+    test_future_args();
+    test_run_batch();
+    test_output();
+    test_parser();
+    test_parse_parallel();
+    test_build_parallel();
+    test_lazy_build();
+    test_lazy_parse();
+    test_update();
     printf("PASSED\n");
     return 0;
 }